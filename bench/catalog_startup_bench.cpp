@@ -0,0 +1,166 @@
+// Measures how long the server takes to list a large library at startup:
+// a cold scan with one thread (the original startup path) and with a pool
+// of threads, a warm boot from the persisted catalog file, and the
+// background reconcile that follows it, with and without changed files.
+//
+// Usage: catalog_startup_bench [files] [directories] [threads]
+
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "logger.h"
+#include "song_catalog.h"
+
+namespace fs = std::filesystem;
+
+// Write a short PCM WAV file: 8 kHz mono 8-bit, one second of silence
+void WriteWav(const fs::path& path) {
+  constexpr uint32_t kDataSize = 8000;
+  static const std::vector<char> wav = [] {
+    std::vector<char> wav(44 + kDataSize, static_cast<char>(0x80));
+    auto put = [&wav](size_t offset, uint32_t value, int bytes) {
+      for (int i = 0; i < bytes; i++) {
+        wav[offset + i] = static_cast<char>(value >> (8 * i));
+      }
+    };
+    std::memcpy(wav.data(), "RIFF", 4);
+    put(4, 36 + kDataSize, 4);
+    std::memcpy(wav.data() + 8, "WAVEfmt ", 8);
+    put(16, 16, 4);
+    put(20, 1, 2);
+    put(22, 1, 2);
+    put(24, 8000, 4);
+    put(28, 8000, 4);
+    put(32, 1, 2);
+    put(34, 8, 2);
+    std::memcpy(wav.data() + 36, "data", 4);
+    put(40, kDataSize, 4);
+    return wav;
+  }();
+  std::ofstream file(path, std::ios::binary);
+  file.write(wav.data(), wav.size());
+}
+
+// Evict the library from the page cache if we are allowed to, so the scans
+// hit storage instead of memory
+bool DropCaches() {
+  sync();
+  std::ofstream file("/proc/sys/vm/drop_caches");
+  file << "3" << std::endl;
+  return static_cast<bool>(file);
+}
+
+template <typename Fn>
+double TimeMs(Fn fn) {
+  auto start = std::chrono::steady_clock::now();
+  fn();
+  return std::chrono::duration<double, std::milli>(
+             std::chrono::steady_clock::now() - start)
+      .count();
+}
+
+void Report(const std::string& step, double ms, size_t songs) {
+  std::cout << std::left << std::setw(34) << step << std::right
+            << std::setw(12) << std::fixed << std::setprecision(1) << ms
+            << std::setw(12) << songs << std::endl;
+}
+
+int main(int argc, char* argv[]) {
+  Logger::init("catalog_startup_bench");
+  Logger::setLevel(spdlog::level::warn);
+
+  size_t files = argc > 1 ? std::stoul(argv[1]) : 100000;
+  size_t directories = argc > 2 ? std::stoul(argv[2]) : 100;
+  int threads = argc > 3 ? std::stoi(argv[3]) : 16;
+  directories = std::max<size_t>(1, directories);
+
+  fs::path root = fs::temp_directory_path() / "music262_catalog_bench";
+  fs::path catalog_file =
+      fs::temp_directory_path() / "music262_catalog_bench.cat";
+  fs::remove_all(root);
+  fs::remove(catalog_file);
+
+  // Artist directories with one album directory each, songs spread evenly
+  std::vector<fs::path> albums;
+  for (size_t d = 0; d < directories; d++) {
+    albums.push_back(root / ("artist" + std::to_string(d)) / "album");
+    fs::create_directories(albums.back());
+  }
+  double generate_ms = TimeMs([&]() {
+    for (size_t i = 0; i < files; i++) {
+      WriteWav(albums[i % directories] /
+               ("track" + std::to_string(i) + ".wav"));
+    }
+  });
+  std::cout << "Library: " << files << " songs in " << directories * 2
+            << " directories, generated in " << std::fixed
+            << std::setprecision(0) << generate_ms << " ms" << std::endl;
+  std::cout << "Page cache dropped before cold scans: "
+            << (DropCaches() ? "yes" : "no (needs root)") << std::endl;
+  std::cout << std::left << std::setw(34) << "step" << std::right
+            << std::setw(12) << "ms" << std::setw(12) << "songs" << std::endl;
+
+  for (int scan_threads : {1, threads}) {
+    DropCaches();
+    SongCatalogOptions options;
+    options.scan_threads = scan_threads;
+    size_t songs = 0;
+    double ms = TimeMs([&]() {
+      SongCatalog catalog(root.string(), options);
+      songs = catalog.Snapshot()->songs.size();
+    });
+    Report("cold scan, scan_threads=" + std::to_string(scan_threads), ms,
+           songs);
+  }
+
+  // First boot with persistence: nothing to load, the reconcile scans the
+  // library and writes the catalog file
+  SongCatalogOptions options;
+  options.scan_threads = threads;
+  options.catalog_file = catalog_file.string();
+  {
+    SongCatalog catalog(root.string(), options);
+    DropCaches();
+    double ms = TimeMs([&]() { catalog.Rescan(); });
+    Report("first boot scan + save", ms, catalog.Snapshot()->songs.size());
+  }
+  std::cout << "Catalog file: " << fs::file_size(catalog_file) / 1024
+            << " KB" << std::endl;
+
+  // Warm boot: the first snapshot comes from the file, the reconcile only
+  // stats the library and reads the headers of files that changed
+  DropCaches();
+  std::unique_ptr<SongCatalog> catalog;
+  double load_ms = TimeMs([&]() {
+    catalog = std::make_unique<SongCatalog>(root.string(), options);
+  });
+  Report("warm boot, first snapshot", load_ms,
+         catalog->Snapshot()->songs.size());
+
+  double reconcile_ms = TimeMs([&]() { catalog->Rescan(); });
+  Report("reconcile, nothing changed", reconcile_ms,
+         catalog->Snapshot()->songs.size());
+
+  size_t changed = std::max<size_t>(1, files / 100);
+  for (size_t i = 0; i < changed; i++) {
+    WriteWav(albums[i % directories] / ("new" + std::to_string(i) + ".wav"));
+  }
+  reconcile_ms = TimeMs([&]() { catalog->Rescan(); });
+  Report("reconcile, " + std::to_string(changed) + " new songs", reconcile_ms,
+         catalog->Snapshot()->songs.size());
+
+  catalog.reset();
+  fs::remove_all(root);
+  fs::remove(catalog_file);
+  return 0;
+}
@@ -0,0 +1,177 @@
+// Streams a song from an in-process AsyncAudioService over loopback to a
+// growing number of concurrent clients, once per chunk size configuration.
+// Reports aggregate throughput and how evenly it was shared between clients
+// (Jain's fairness index, 1.0 means every client got the same rate).
+//
+// Usage: chunk_size_bench [song_mb] [clients...]
+
+#include <grpcpp/grpcpp.h>
+
+#include <algorithm>
+#include <chrono>
+#include <filesystem>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "async_audio_service.h"
+#include "audio_server.h"
+#include "audio_service.grpc.pb.h"
+#include "logger.h"
+
+namespace fs = std::filesystem;
+
+struct ChunkConfig {
+  std::string name;
+  size_t min_kb;
+  size_t max_kb;
+};
+
+struct RunResult {
+  double mb_per_sec = 0;
+  double fairness = 0;
+  int failures = 0;
+};
+
+// Download the whole song on its own channel and return the elapsed seconds
+double DownloadSong(const std::string& address, int client_id, bool* ok) {
+  // A distinct channel argument keeps clients off a shared connection
+  grpc::ChannelArguments args;
+  args.SetInt("music262.bench_client", client_id);
+  args.SetMaxReceiveMessageSize(-1);
+  auto channel = grpc::CreateCustomChannel(
+      address, grpc::InsecureChannelCredentials(), args);
+  auto stub = audio_service::audio_service::NewStub(channel);
+
+  audio_service::LoadAudioRequest request;
+  request.set_song_num(1);
+
+  auto start = std::chrono::steady_clock::now();
+  grpc::ClientContext context;
+  auto reader = stub->LoadAudio(&context, request);
+  audio_service::AudioChunk chunk;
+  while (reader->Read(&chunk)) {
+  }
+  *ok = reader->Finish().ok();
+
+  return std::chrono::duration<double>(std::chrono::steady_clock::now() -
+                                       start)
+      .count();
+}
+
+RunResult Run(const std::string& audio_dir, const ChunkConfig& config,
+              int clients, size_t song_bytes) {
+  AsyncServiceOptions options;
+  options.min_chunk_bytes = config.min_kb * 1024;
+  options.max_chunk_bytes = config.max_kb * 1024;
+
+  auto audio_server = std::make_shared<AudioServer>(audio_dir);
+  AsyncAudioService service(audio_server, options);
+
+  grpc::ServerBuilder builder;
+  int port = 0;
+  builder.AddListeningPort("127.0.0.1:0", grpc::InsecureServerCredentials(),
+                           &port);
+  service.RegisterWith(builder);
+  std::unique_ptr<grpc::Server> server = builder.BuildAndStart();
+  service.Start();
+  std::string address = "127.0.0.1:" + std::to_string(port);
+
+  std::vector<double> seconds(clients);
+  std::vector<char> ok(clients, false);
+  auto start = std::chrono::steady_clock::now();
+  std::vector<std::thread> threads;
+  for (int i = 0; i < clients; i++) {
+    threads.emplace_back([&, i]() {
+      bool success = false;
+      seconds[i] = DownloadSong(address, i, &success);
+      ok[i] = success;
+    });
+  }
+  for (auto& thread : threads) {
+    thread.join();
+  }
+  double elapsed = std::chrono::duration<double>(
+                       std::chrono::steady_clock::now() - start)
+                       .count();
+  service.Shutdown(server.get());
+
+  // Jain's index over the per-client download rates
+  RunResult result;
+  double sum = 0;
+  double sum_squares = 0;
+  for (int i = 0; i < clients; i++) {
+    if (!ok[i]) {
+      result.failures++;
+      continue;
+    }
+    double rate = song_bytes / seconds[i];
+    sum += rate;
+    sum_squares += rate * rate;
+  }
+  int succeeded = clients - result.failures;
+  result.mb_per_sec =
+      succeeded * (song_bytes / (1024.0 * 1024.0)) / std::max(elapsed, 1e-9);
+  result.fairness =
+      sum_squares > 0 ? sum * sum / (succeeded * sum_squares) : 0;
+  return result;
+}
+
+int main(int argc, char* argv[]) {
+  Logger::init("chunk_size_bench");
+  Logger::setLevel(spdlog::level::warn);
+
+  size_t song_mb = argc > 1 ? std::stoul(argv[1]) : 16;
+  std::vector<int> client_counts;
+  for (int i = 2; i < argc; i++) {
+    client_counts.push_back(std::stoi(argv[i]));
+  }
+  if (client_counts.empty()) {
+    client_counts = {1, 4, 16, 64};
+  }
+
+  // Create a synthetic song of the requested size
+  fs::path audio_dir = fs::temp_directory_path() / "music262_chunk_size_bench";
+  fs::create_directories(audio_dir);
+  {
+    std::ofstream file(audio_dir / "song.wav", std::ios::binary);
+    std::vector<char> block(1024 * 1024);
+    for (size_t i = 0; i < block.size(); i++) {
+      block[i] = static_cast<char>(i * 31);
+    }
+    for (size_t i = 0; i < song_mb; i++) {
+      file.write(block.data(), block.size());
+    }
+  }
+  size_t song_bytes = song_mb * 1024 * 1024;
+
+  const std::vector<ChunkConfig> configs = {
+      {"fixed 16K", 16, 16},     {"fixed 64K", 64, 64},
+      {"fixed 256K", 256, 256},  {"fixed 1M", 1024, 1024},
+      {"adaptive", 16, 1024},
+  };
+
+  std::cout << "Song size: " << song_mb << " MB" << std::endl;
+  std::cout << std::left << std::setw(14) << "chunks" << std::setw(10)
+            << "clients" << std::setw(12) << "MB/s" << std::setw(12)
+            << "fairness"
+            << "failures" << std::endl;
+
+  for (const auto& config : configs) {
+    for (int clients : client_counts) {
+      RunResult result = Run(audio_dir.string(), config, clients, song_bytes);
+      std::cout << std::left << std::setw(14) << config.name << std::setw(10)
+                << clients << std::setw(12) << std::fixed
+                << std::setprecision(1) << result.mb_per_sec << std::setw(12)
+                << std::setprecision(3) << result.fairness << result.failures
+                << std::endl;
+    }
+  }
+
+  fs::remove_all(audio_dir);
+  return 0;
+}
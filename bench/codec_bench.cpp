@@ -0,0 +1,129 @@
+// Measures the lossless codec on a synthetic stereo song: compression ratio,
+// encode speed, and decode speed with one thread and with every hardware
+// thread, and the conversions the server runs for clients asking for their
+// device's sample format. Speeds are in MB of decoded WAV per second.
+//
+// Usage: codec_bench [seconds_of_audio]
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "logger.h"
+#include "lossless_codec.h"
+#include "pcm_convert.h"
+
+// A 16-bit stereo WAV file with a few tones, their harmonics and some noise
+std::vector<char> MakeSong(size_t seconds) {
+  const uint32_t rate = 44100;
+  size_t frames = seconds * rate;
+  uint32_t data_size = static_cast<uint32_t>(frames * 4);
+  uint32_t header[] = {0x46464952, 36 + data_size, 0x45564157, 0x20746d66,
+                       16,         0x00020001,     rate,       rate * 4,
+                       0x00100004, 0x61746164,     data_size};
+
+  std::vector<char> wav(sizeof(header) + data_size);
+  std::memcpy(wav.data(), header, sizeof(header));
+  int16_t* samples = reinterpret_cast<int16_t*>(wav.data() + sizeof(header));
+
+  std::mt19937 rng(1);
+  std::normal_distribution<double> noise(0, 40);
+  for (size_t i = 0; i < frames; i++) {
+    double t = static_cast<double>(i) / rate;
+    double envelope = 0.6 + 0.4 * std::sin(2 * M_PI * 0.5 * t);
+    double tone = 0;
+    for (double freq : {110.0, 220.0, 277.2, 329.6, 440.0}) {
+      tone += 2000 / (freq / 110) * std::sin(2 * M_PI * freq * t);
+    }
+    double left = envelope * tone + noise(rng);
+    double right = envelope * tone * 0.7 + noise(rng);
+    samples[2 * i] = static_cast<int16_t>(std::lround(left));
+    samples[2 * i + 1] = static_cast<int16_t>(std::lround(right));
+  }
+  return wav;
+}
+
+template <typename Fn>
+double Seconds(Fn fn) {
+  auto start = std::chrono::steady_clock::now();
+  fn();
+  return std::chrono::duration<double>(std::chrono::steady_clock::now() -
+                                       start)
+      .count();
+}
+
+int main(int argc, char* argv[]) {
+  Logger::init("codec_bench");
+  Logger::setLevel(spdlog::level::warn);
+
+  size_t seconds = argc > 1 ? std::stoul(argv[1]) : 180;
+  std::vector<char> wav = MakeSong(seconds);
+  double mb = wav.size() / (1024.0 * 1024.0);
+
+  std::vector<char> encoded;
+  double encode_time = Seconds(
+      [&]() { music262::EncodeLossless(wav.data(), wav.size(), &encoded); });
+
+  unsigned threads = std::max(1u, std::thread::hardware_concurrency());
+  std::vector<char> decoded;
+  double serial_time = Seconds([&]() {
+    music262::DecodeLossless(encoded.data(), encoded.size(), &decoded, 1);
+  });
+  double parallel_time = Seconds([&]() {
+    music262::DecodeLossless(encoded.data(), encoded.size(), &decoded,
+                             threads);
+  });
+
+  // Conversions for a device playing float samples, at the song's rate and
+  // at 48 kHz
+  struct Conversion {
+    std::string name;
+    music262::PcmFormat format;
+    double seconds = 0;
+  };
+  std::vector<Conversion> conversions = {
+      {"f32", {music262::PcmSampleFormat::kFloat32, 0, 0}},
+      {"f32 48 kHz", {music262::PcmSampleFormat::kFloat32, 48000, 0}},
+      {"s16 48 kHz", {music262::PcmSampleFormat::kInt16, 48000, 0}},
+      {"f32 48 kHz mono", {music262::PcmSampleFormat::kFloat32, 48000, 1}},
+  };
+  std::vector<char> converted;
+  for (Conversion& conversion : conversions) {
+    conversion.seconds = Seconds([&]() {
+      music262::ConvertPcm(wav.data(), wav.size(), conversion.format,
+                           &converted);
+    });
+  }
+
+  std::cout << std::fixed << std::setprecision(1);
+  std::cout << "Song: " << seconds << " s stereo, " << mb << " MB"
+            << std::endl;
+  std::cout << "Encoded: " << encoded.size() / (1024.0 * 1024.0) << " MB ("
+            << 100.0 * encoded.size() / wav.size() << "% of PCM)"
+            << std::endl;
+  std::cout << "Decoder path: " << music262::CodecSimdPath() << std::endl;
+  std::cout << std::left << std::setw(24) << "stage" << "MB/s" << std::endl;
+  std::cout << std::setw(24) << "encode" << mb / encode_time << std::endl;
+  std::cout << std::setw(24) << "decode (1 thread)" << mb / serial_time
+            << std::endl;
+  std::cout << std::setw(24)
+            << "decode (" + std::to_string(threads) + " threads)"
+            << mb / parallel_time << std::endl;
+  for (const Conversion& conversion : conversions) {
+    std::cout << std::setw(24) << "convert " + conversion.name
+              << mb / conversion.seconds << std::endl;
+  }
+
+  if (decoded != wav) {
+    std::cerr << "Decoded song does not match the original" << std::endl;
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,714 @@
+// Drives an audio server with a fleet of simulated clients over loopback.
+// Every client has its own connection and loops over a weighted mix of
+// GetPlaylist, GetPeerClientIPs, whole-song LoadAudio and ranged LoadAudio
+// calls, pausing for an exponentially distributed think time between calls.
+// Reports throughput, per-RPC tail latency as seen by the clients and as
+// measured by the server, and the CPU time the server used, as a table or as
+// JSON for tracking regressions between releases.
+//
+// --broadcast_listeners adds listeners that each hold a JoinBroadcast stream
+// of the first song for the whole run on their own connection, to compare
+// the server CPU of a shared broadcast with per-client LoadAudio streams.
+//
+// --grpc_ flags tune the child server's gRPC transport like the music_server
+// flags of the same name, e.g. --grpc_stream_window_kb 1024.
+//
+// By default the server runs in a child process serving a synthetic catalog,
+// so its CPU time is measured apart from the clients'. --server points the
+// fleet at a running music_server instead; give --server_pid to also measure
+// its CPU time.
+//
+// Usage: music262_loadgen [--clients N] [--duration_s S] [--think_ms MS]
+//            [--mix playlist=1,peers=2,load=1,range=2] [--range_kb KB]
+//            [--songs N] [--song_mb MB] [--num_cqs N] [--pollers_per_cq N]
+//            [--egress_window_kb KB] [--broadcast_listeners N]
+//            [--grpc_<setting> VALUE]...
+//            [--server HOST:PORT] [--server_pid PID]
+//            [--format text|json] [--output FILE]
+
+#include <grpcpp/grpcpp.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <filesystem>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "async_audio_service.h"
+#include "audio_server.h"
+#include "audio_service.grpc.pb.h"
+#include "grpc_server_config.h"
+#include "logger.h"
+#include "server_stats.h"
+
+namespace fs = std::filesystem;
+using Clock = std::chrono::steady_clock;
+
+// Calls the simulated clients make
+enum Op { kPlaylist, kPeers, kLoad, kRange, kOpCount };
+
+const char* const kOpNames[kOpCount] = {"GetPlaylist", "GetPeerClientIPs",
+                                        "LoadAudio", "LoadAudioRange"};
+const char* const kMixKeys[kOpCount] = {"playlist", "peers", "load", "range"};
+
+struct Options {
+  int clients = 16;
+  std::chrono::seconds duration{10};
+  std::chrono::milliseconds think{50};
+  std::array<double, kOpCount> mix = {1, 2, 1, 2};
+  size_t range_bytes = 256 * 1024;
+  int songs = 4;
+  size_t song_mb = 8;
+  int broadcast_listeners = 0;
+  AsyncServiceOptions service;
+  music262::GrpcServerConfig grpc;
+  std::string server;  // Empty to start one
+  pid_t server_pid = 0;
+  std::string format = "text";
+  std::string output;
+};
+
+struct Song {
+  int id = 0;
+  int64_t size = 0;
+};
+
+// Counters of one kind of call, shared by all clients
+struct OpStats {
+  std::atomic<uint64_t> calls{0};
+  std::atomic<uint64_t> errors{0};
+  std::atomic<uint64_t> bytes{0};
+  LatencyHistogram latency;
+  LatencyHistogram first_chunk;  // Streams only
+};
+
+// Counters of the broadcast listeners
+struct ListenerStats {
+  std::atomic<uint64_t> chunks{0};
+  std::atomic<uint64_t> bytes{0};
+  std::atomic<uint64_t> skipped{0};  // Sequence gaps, chunks never received
+  std::atomic<uint64_t> errors{0};
+};
+
+struct CpuTime {
+  double server = -1;  // Seconds, -1 if unknown
+  double loadgen = 0;
+};
+
+// Server-side view of one RPC, from GetServerStats
+struct ServerRpc {
+  std::string method;
+  uint64_t calls = 0;
+  uint64_t errors = 0;
+  double p50_ms = 0;
+  double p99_ms = 0;
+  double p999_ms = 0;
+};
+
+struct Report {
+  double elapsed = 0;
+  CpuTime cpu;
+  const ListenerStats* listeners = nullptr;
+  std::vector<ServerRpc> server_rpcs;
+};
+
+double Millis(std::chrono::nanoseconds duration) {
+  return std::chrono::duration<double, std::milli>(duration).count();
+}
+
+// CPU time a process used so far, -1 if it cannot be read
+double ProcessCpuSeconds(pid_t pid) {
+  std::ifstream file("/proc/" + std::to_string(pid) + "/stat");
+  std::string stat((std::istreambuf_iterator<char>(file)),
+                   std::istreambuf_iterator<char>());
+  size_t name_end = stat.rfind(')');
+  if (name_end == std::string::npos) {
+    return -1;
+  }
+  // utime and stime are fields 14 and 15, the 12th and 13th after the name
+  std::istringstream fields(stat.substr(name_end + 1));
+  std::string field;
+  unsigned long long utime = 0, stime = 0;
+  for (int i = 1; i <= 13 && fields >> field; i++) {
+    if (i == 12) utime = std::stoull(field);
+    if (i == 13) stime = std::stoull(field);
+  }
+  return static_cast<double>(utime + stime) / sysconf(_SC_CLK_TCK);
+}
+
+double SelfCpuSeconds() {
+  rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  return usage.ru_utime.tv_sec + usage.ru_stime.tv_sec +
+         (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+}
+
+// 16-bit stereo 44.1 kHz WAV songs of a synthetic catalog, each with its
+// own byte pattern
+void WriteCatalog(const fs::path& dir, int songs, size_t song_mb) {
+  fs::create_directories(dir);
+  std::vector<char> block(1024 * 1024);
+  uint32_t data_size = static_cast<uint32_t>(song_mb * block.size());
+  uint32_t header[] = {0x46464952, 36 + data_size, 0x45564157, 0x20746d66,
+                       16,         0x00020001,     44100,      44100 * 4,
+                       0x00100004, 0x61746164,     data_size};
+  for (int song = 0; song < songs; song++) {
+    for (size_t i = 0; i < block.size(); i++) {
+      block[i] = static_cast<char>(i * 31 + song);
+    }
+    std::ofstream file(dir / ("song" + std::to_string(song) + ".wav"),
+                       std::ios::binary);
+    file.write(reinterpret_cast<const char*>(header), sizeof(header));
+    for (size_t i = 0; i < song_mb; i++) {
+      file.write(block.data(), block.size());
+    }
+  }
+}
+
+// Serve the catalog from a child process until the control pipe closes.
+// Must be called before the parent uses gRPC, a forked gRPC runtime is not
+// usable.
+pid_t StartServerProcess(const fs::path& audio_dir,
+                         const AsyncServiceOptions& options,
+                         const music262::GrpcServerConfig& grpc_config,
+                         int* port, int* control_fd) {
+  int ready[2];
+  int control[2];
+  if (pipe(ready) != 0 || pipe(control) != 0) {
+    return -1;
+  }
+
+  pid_t pid = fork();
+  if (pid == 0) {
+    close(ready[0]);
+    close(control[1]);
+    auto audio_server = std::make_shared<AudioServer>(audio_dir.string());
+    AsyncAudioService service(audio_server, options);
+    grpc::ServerBuilder builder;
+    int bound_port = 0;
+    builder.AddListeningPort("127.0.0.1:0", grpc::InsecureServerCredentials(),
+                             &bound_port);
+    grpc_config.Apply(&builder);
+    service.RegisterWith(builder);
+    std::unique_ptr<grpc::Server> server = builder.BuildAndStart();
+    if (server) {
+      service.Start();
+    }
+    if (write(ready[1], &bound_port, sizeof(bound_port)) < 0) {
+      _exit(1);
+    }
+    char byte;
+    while (read(control[0], &byte, 1) > 0) {
+    }
+    if (server) {
+      service.Shutdown(server.get());
+    }
+    _exit(0);
+  }
+
+  close(ready[1]);
+  close(control[0]);
+  *port = 0;
+  if (pid < 0 || read(ready[0], port, sizeof(*port)) != sizeof(*port)) {
+    *port = 0;
+  }
+  close(ready[0]);
+  *control_fd = control[1];
+  return pid;
+}
+
+std::unique_ptr<audio_service::audio_service::Stub> Connect(
+    const std::string& address, int client_id) {
+  // A distinct channel argument keeps clients off a shared connection
+  grpc::ChannelArguments args;
+  args.SetInt("music262.loadgen_client", client_id);
+  args.SetMaxReceiveMessageSize(-1);
+  auto channel = grpc::CreateCustomChannel(
+      address, grpc::InsecureChannelCredentials(), args);
+  channel->WaitForConnected(std::chrono::system_clock::now() +
+                            std::chrono::seconds(10));
+  return audio_service::audio_service::NewStub(channel);
+}
+
+std::vector<Song> ListSongs(audio_service::audio_service::Stub* stub) {
+  audio_service::PlaylistResponse response;
+  grpc::ClientContext context;
+  std::vector<Song> songs;
+  if (stub->GetPlaylist(&context, {}, &response).ok()) {
+    for (const auto& song : response.songs()) {
+      if (!song.name().empty() && song.size() > 0) {
+        songs.push_back({song.id(), song.size()});
+      }
+    }
+  }
+  return songs;
+}
+
+// Stream a song or a byte range of it, counting the bytes received
+grpc::Status Download(audio_service::audio_service::Stub* stub,
+                      const audio_service::LoadAudioRequest& request,
+                      Clock::time_point start, OpStats* stats,
+                      uint64_t* bytes) {
+  grpc::ClientContext context;
+  auto reader = stub->LoadAudio(&context, request);
+  audio_service::AudioChunk chunk;
+  bool first = true;
+  while (reader->Read(&chunk)) {
+    if (first) {
+      stats->first_chunk.Record(Clock::now() - start);
+      first = false;
+    }
+    *bytes += chunk.data().size();
+  }
+  return reader->Finish();
+}
+
+// Listen to a broadcast until the run ends
+void RunListener(audio_service::audio_service::Stub* stub, int song_num,
+                 Clock::time_point stop_at, ListenerStats* stats) {
+  grpc::ClientContext context;
+  context.set_deadline(std::chrono::system_clock::now() +
+                       (stop_at - Clock::now()));
+  audio_service::JoinBroadcastRequest request;
+  request.set_song_num(song_num);
+  auto reader = stub->JoinBroadcast(&context, request);
+  audio_service::BroadcastChunk chunk;
+  bool first = true;
+  uint64_t next_sequence = 0;
+  while (reader->Read(&chunk)) {
+    if (!first && chunk.sequence() > next_sequence) {
+      stats->skipped.fetch_add(chunk.sequence() - next_sequence,
+                               std::memory_order_relaxed);
+    }
+    first = false;
+    next_sequence = chunk.sequence() + 1;
+    stats->chunks.fetch_add(1, std::memory_order_relaxed);
+    stats->bytes.fetch_add(chunk.data().size(), std::memory_order_relaxed);
+  }
+  grpc::Status status = reader->Finish();
+  // The stream never ends on its own, the deadline ends it
+  if (!status.ok() &&
+      status.error_code() != grpc::StatusCode::DEADLINE_EXCEEDED) {
+    stats->errors.fetch_add(1, std::memory_order_relaxed);
+  }
+}
+
+void RunClient(audio_service::audio_service::Stub* stub, int client_id,
+               const Options& options, const std::vector<Song>& songs,
+               Clock::time_point stop_at,
+               std::array<OpStats, kOpCount>* stats) {
+  std::mt19937_64 random(client_id * 7919 + 1);
+  std::discrete_distribution<int> pick_op(options.mix.begin(),
+                                          options.mix.end());
+  std::uniform_int_distribution<size_t> pick_song(0, songs.size() - 1);
+  std::exponential_distribution<double> think(
+      options.think.count() > 0 ? 1.0 / options.think.count() : 1.0);
+
+  while (Clock::now() < stop_at) {
+    int op = pick_op(random);
+    const Song& song = songs[pick_song(random)];
+    OpStats& op_stats = (*stats)[op];
+    uint64_t bytes = 0;
+    grpc::Status status;
+    auto start = Clock::now();
+
+    switch (op) {
+      case kPlaylist: {
+        audio_service::PlaylistResponse response;
+        grpc::ClientContext context;
+        status = stub->GetPlaylist(&context, {}, &response);
+        bytes = response.ByteSizeLong();
+        break;
+      }
+      case kPeers: {
+        audio_service::PeerListRequest request;
+        request.set_song_num(song.id);
+        audio_service::PeerListResponse response;
+        grpc::ClientContext context;
+        status = stub->GetPeerClientIPs(&context, request, &response);
+        bytes = response.ByteSizeLong();
+        break;
+      }
+      case kLoad:
+      case kRange: {
+        audio_service::LoadAudioRequest request;
+        request.set_song_num(song.id);
+        if (op == kRange) {
+          int64_t length = std::min<int64_t>(options.range_bytes, song.size);
+          std::uniform_int_distribution<int64_t> pick_offset(
+              0, song.size - length);
+          request.set_offset(pick_offset(random));
+          request.set_length(length);
+        }
+        status = Download(stub, request, start, &op_stats, &bytes);
+        break;
+      }
+    }
+
+    op_stats.latency.Record(Clock::now() - start);
+    op_stats.calls.fetch_add(1, std::memory_order_relaxed);
+    op_stats.bytes.fetch_add(bytes, std::memory_order_relaxed);
+    if (!status.ok()) {
+      op_stats.errors.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    if (options.think.count() > 0) {
+      std::this_thread::sleep_for(
+          std::chrono::duration<double, std::milli>(think(random)));
+    }
+  }
+}
+
+std::vector<ServerRpc> FetchServerStats(
+    audio_service::audio_service::Stub* stub) {
+  audio_service::ServerStatsResponse response;
+  grpc::ClientContext context;
+  std::vector<ServerRpc> rpcs;
+  if (!stub->GetServerStats(&context, {}, &response).ok()) {
+    return rpcs;  // An older server
+  }
+  for (const auto& rpc : response.rpcs()) {
+    if (rpc.calls() > 0) {
+      rpcs.push_back({rpc.method(), rpc.calls(), rpc.errors(),
+                      rpc.latency().p50_us() / 1000,
+                      rpc.latency().p99_us() / 1000,
+                      rpc.latency().p999_us() / 1000});
+    }
+  }
+  return rpcs;
+}
+
+std::string Quote(const std::string& text) {
+  std::string quoted = "\"";
+  for (char c : text) {
+    if (c == '"' || c == '\\') quoted += '\\';
+    quoted += c;
+  }
+  return quoted + "\"";
+}
+
+void WriteJson(std::ostream& out, const Options& options,
+               const std::array<OpStats, kOpCount>& stats,
+               const Report& report) {
+  uint64_t calls = 0, errors = 0, bytes = 0;
+  for (const auto& op : stats) {
+    calls += op.calls;
+    errors += op.errors;
+    bytes += op.bytes;
+  }
+
+  out << std::fixed << std::setprecision(3);
+  out << "{\n  \"config\": {\"clients\": " << options.clients
+      << ", \"duration_s\": " << options.duration.count()
+      << ", \"think_ms\": " << options.think.count() << ", \"mix\": {";
+  for (int op = 0; op < kOpCount; op++) {
+    out << (op ? ", " : "") << Quote(kMixKeys[op]) << ": " << options.mix[op];
+  }
+  out << "}, \"range_kb\": " << options.range_bytes / 1024
+      << ", \"server\": "
+      << Quote(options.server.empty() ? "child" : options.server);
+  if (options.server.empty()) {
+    out << ", \"songs\": " << options.songs
+        << ", \"song_mb\": " << options.song_mb
+        << ", \"num_cqs\": " << options.service.num_cqs
+        << ", \"pollers_per_cq\": " << options.service.pollers_per_cq
+        << ", \"egress_window_kb\": "
+        << options.service.egress.window_bytes / 1024
+        << ", \"grpc\": " << Quote(options.grpc.Summary());
+  }
+  out << ", \"cores\": " << std::thread::hardware_concurrency() << "},\n";
+
+  out << "  \"elapsed_s\": " << report.elapsed << ",\n";
+  out << "  \"total\": {\"calls\": " << calls << ", \"errors\": " << errors
+      << ", \"calls_per_sec\": " << calls / report.elapsed
+      << ", \"bytes\": " << bytes
+      << ", \"mb_per_sec\": " << bytes / (1024.0 * 1024.0) / report.elapsed
+      << "},\n";
+
+  out << "  \"rpcs\": [";
+  for (int op = 0; op < kOpCount; op++) {
+    LatencySummary latency = stats[op].latency.Summarize();
+    out << (op ? ",\n" : "\n") << "    {\"name\": " << Quote(kOpNames[op])
+        << ", \"calls\": " << stats[op].calls
+        << ", \"errors\": " << stats[op].errors
+        << ", \"calls_per_sec\": " << stats[op].calls / report.elapsed
+        << ", \"bytes\": " << stats[op].bytes
+        << ", \"p50_ms\": " << Millis(latency.p50)
+        << ", \"p99_ms\": " << Millis(latency.p99)
+        << ", \"p999_ms\": " << Millis(latency.p999)
+        << ", \"max_ms\": " << Millis(latency.max);
+    if (op == kLoad || op == kRange) {
+      LatencySummary first = stats[op].first_chunk.Summarize();
+      out << ", \"first_chunk_p50_ms\": " << Millis(first.p50)
+          << ", \"first_chunk_p99_ms\": " << Millis(first.p99);
+    }
+    out << "}";
+  }
+  out << "\n  ],\n";
+
+  if (options.broadcast_listeners > 0) {
+    const ListenerStats& listeners = *report.listeners;
+    out << "  \"broadcast\": {\"listeners\": " << options.broadcast_listeners
+        << ", \"chunks\": " << listeners.chunks
+        << ", \"bytes\": " << listeners.bytes
+        << ", \"mb_per_sec\": "
+        << listeners.bytes / (1024.0 * 1024.0) / report.elapsed
+        << ", \"skipped_chunks\": " << listeners.skipped
+        << ", \"errors\": " << listeners.errors << "},\n";
+  }
+
+  out << "  \"server\": {\"cpu_seconds\": ";
+  if (report.cpu.server >= 0) {
+    out << report.cpu.server
+        << ", \"cpu_cores\": " << report.cpu.server / report.elapsed;
+  } else {
+    out << "null, \"cpu_cores\": null";
+  }
+  out << ", \"rpcs\": [";
+  for (size_t i = 0; i < report.server_rpcs.size(); i++) {
+    const ServerRpc& rpc = report.server_rpcs[i];
+    out << (i ? ",\n" : "\n") << "    {\"name\": " << Quote(rpc.method)
+        << ", \"calls\": " << rpc.calls << ", \"errors\": " << rpc.errors
+        << ", \"p50_ms\": " << rpc.p50_ms << ", \"p99_ms\": " << rpc.p99_ms
+        << ", \"p999_ms\": " << rpc.p999_ms << "}";
+  }
+  out << (report.server_rpcs.empty() ? "]},\n" : "\n  ]},\n");
+  out << "  \"loadgen\": {\"cpu_seconds\": " << report.cpu.loadgen
+      << ", \"cpu_cores\": " << report.cpu.loadgen / report.elapsed
+      << "}\n}\n";
+}
+
+void WriteText(std::ostream& out, const Options& options,
+               const std::array<OpStats, kOpCount>& stats,
+               const Report& report) {
+  out << options.clients << " clients, " << options.think.count()
+      << " ms think time, ";
+  if (options.server.empty()) {
+    out << "gRPC " << options.grpc.Summary() << ", ";
+  }
+  out << std::fixed << std::setprecision(1) << report.elapsed << " s, "
+      << std::thread::hardware_concurrency() << " cores" << std::endl;
+  out << std::left << std::setw(18) << "call" << std::right << std::setw(10)
+      << "calls/s" << std::setw(8) << "errors" << std::setw(10) << "MB/s"
+      << std::setw(10) << "p50 ms" << std::setw(10) << "p99 ms"
+      << std::setw(10) << "p999 ms" << std::setw(12) << "1st p99 ms"
+      << std::endl;
+  for (int op = 0; op < kOpCount; op++) {
+    LatencySummary latency = stats[op].latency.Summarize();
+    out << std::left << std::setw(18) << kOpNames[op] << std::right
+        << std::setprecision(0) << std::setw(10)
+        << stats[op].calls / report.elapsed << std::setw(8)
+        << stats[op].errors << std::setprecision(1) << std::setw(10)
+        << stats[op].bytes / (1024.0 * 1024.0) / report.elapsed
+        << std::setprecision(2) << std::setw(10) << Millis(latency.p50)
+        << std::setw(10) << Millis(latency.p99) << std::setw(10)
+        << Millis(latency.p999) << std::setw(12);
+    if (op == kLoad || op == kRange) {
+      out << Millis(stats[op].first_chunk.Summarize().p99);
+    } else {
+      out << "-";
+    }
+    out << std::endl;
+  }
+
+  if (options.broadcast_listeners > 0) {
+    const ListenerStats& listeners = *report.listeners;
+    out << "Broadcast: " << options.broadcast_listeners << " listeners, "
+        << std::setprecision(1)
+        << listeners.bytes / (1024.0 * 1024.0) / report.elapsed
+        << " MB/s received, " << listeners.skipped << " chunks skipped, "
+        << listeners.errors << " errors" << std::endl;
+  }
+  if (report.cpu.server >= 0) {
+    out << "Server CPU: " << std::setprecision(2) << report.cpu.server
+        << " s (" << report.cpu.server / report.elapsed << " cores)"
+        << std::endl;
+  }
+  out << "Loadgen CPU: " << std::setprecision(2) << report.cpu.loadgen
+      << " s (" << report.cpu.loadgen / report.elapsed << " cores)"
+      << std::endl;
+  for (const ServerRpc& rpc : report.server_rpcs) {
+    out << "  server " << std::left << std::setw(18) << rpc.method
+        << std::right << " p50 " << rpc.p50_ms << " ms, p99 " << rpc.p99_ms
+        << " ms, p999 " << rpc.p999_ms << " ms" << std::endl;
+  }
+}
+
+bool ParseMix(const std::string& text, std::array<double, kOpCount>* mix) {
+  std::array<double, kOpCount> weights = {0, 0, 0, 0};
+  std::stringstream entries(text);
+  std::string entry;
+  while (std::getline(entries, entry, ',')) {
+    size_t equals = entry.find('=');
+    if (equals == std::string::npos) {
+      return false;
+    }
+    std::string key = entry.substr(0, equals);
+    int op = 0;
+    while (op < kOpCount && key != kMixKeys[op]) {
+      op++;
+    }
+    if (op == kOpCount) {
+      return false;
+    }
+    weights[op] = std::stod(entry.substr(equals + 1));
+  }
+  double total = 0;
+  for (double weight : weights) {
+    if (weight < 0) return false;
+    total += weight;
+  }
+  if (total <= 0) {
+    return false;
+  }
+  *mix = weights;
+  return true;
+}
+
+int main(int argc, char* argv[]) {
+  // Logs go to stderr so the report on stdout stays machine-readable
+  spdlog::set_default_logger(spdlog::stderr_color_mt("music262_loadgen"));
+  Logger::setLevel(spdlog::level::warn);
+
+  Options options;
+  for (int i = 1; i < argc; i++) {
+    std::string arg = argv[i];
+    if (arg == "--clients" && i + 1 < argc) {
+      options.clients = std::max(1, std::stoi(argv[++i]));
+    } else if (arg == "--duration_s" && i + 1 < argc) {
+      options.duration = std::chrono::seconds(std::stoul(argv[++i]));
+    } else if (arg == "--think_ms" && i + 1 < argc) {
+      options.think = std::chrono::milliseconds(std::stoul(argv[++i]));
+    } else if (arg == "--mix" && i + 1 < argc) {
+      if (!ParseMix(argv[++i], &options.mix)) {
+        std::cerr << "Invalid --mix, expected e.g. "
+                     "playlist=1,peers=2,load=1,range=2"
+                  << std::endl;
+        return 2;
+      }
+    } else if (arg == "--range_kb" && i + 1 < argc) {
+      options.range_bytes = std::max(1ul, std::stoul(argv[++i])) * 1024;
+    } else if (arg == "--songs" && i + 1 < argc) {
+      options.songs = std::max(1, std::stoi(argv[++i]));
+    } else if (arg == "--song_mb" && i + 1 < argc) {
+      options.song_mb = std::max(1ul, std::stoul(argv[++i]));
+    } else if (arg == "--num_cqs" && i + 1 < argc) {
+      options.service.num_cqs = std::stoi(argv[++i]);
+    } else if (arg == "--pollers_per_cq" && i + 1 < argc) {
+      options.service.pollers_per_cq = std::stoi(argv[++i]);
+    } else if (arg == "--egress_window_kb" && i + 1 < argc) {
+      options.service.egress.window_bytes = std::stoul(argv[++i]) * 1024;
+    } else if (arg == "--broadcast_listeners" && i + 1 < argc) {
+      options.broadcast_listeners = std::max(0, std::stoi(argv[++i]));
+    } else if (arg.rfind("--grpc_", 0) == 0 && i + 1 < argc) {
+      if (!options.grpc.Set(arg.substr(2), argv[i + 1])) {
+        std::cerr << "Invalid gRPC setting " << arg << std::endl;
+        return 2;
+      }
+      i++;
+    } else if (arg == "--server" && i + 1 < argc) {
+      options.server = argv[++i];
+    } else if (arg == "--server_pid" && i + 1 < argc) {
+      options.server_pid = std::stoi(argv[++i]);
+    } else if (arg == "--format" && i + 1 < argc) {
+      options.format = argv[++i];
+    } else if (arg == "--output" && i + 1 < argc) {
+      options.output = argv[++i];
+    } else {
+      std::cerr << "Unknown argument: " << arg << std::endl;
+      return 2;
+    }
+  }
+
+  // Start the server before touching gRPC in this process
+  fs::path audio_dir = fs::temp_directory_path() /
+                       ("music262_loadgen_" + std::to_string(getpid()));
+  int control_fd = -1;
+  std::string address = options.server;
+  pid_t server_pid = options.server_pid;
+  if (address.empty()) {
+    WriteCatalog(audio_dir, options.songs, options.song_mb);
+    int port = 0;
+    server_pid =
+        StartServerProcess(audio_dir, options.service, options.grpc, &port,
+                           &control_fd);
+    if (server_pid <= 0 || port == 0) {
+      std::cerr << "Could not start the server" << std::endl;
+      fs::remove_all(audio_dir);
+      return 1;
+    }
+    address = "127.0.0.1:" + std::to_string(port);
+  }
+
+  std::vector<std::unique_ptr<audio_service::audio_service::Stub>> stubs;
+  for (int i = 0; i < options.clients + options.broadcast_listeners; i++) {
+    stubs.push_back(Connect(address, i));
+  }
+  std::vector<Song> songs = ListSongs(stubs[0].get());
+
+  int status = 0;
+  if (songs.empty()) {
+    std::cerr << "No songs to load from " << address << std::endl;
+    status = 1;
+  } else {
+    std::array<OpStats, kOpCount> stats;
+    Report report;
+    ListenerStats listener_stats;
+    report.listeners = &listener_stats;
+    double server_cpu = server_pid > 0 ? ProcessCpuSeconds(server_pid) : -1;
+    double loadgen_cpu = SelfCpuSeconds();
+    auto start = Clock::now();
+    std::vector<std::thread> clients;
+    for (int i = 0; i < options.clients; i++) {
+      clients.emplace_back(RunClient, stubs[i].get(), i, std::cref(options),
+                           std::cref(songs), start + options.duration,
+                           &stats);
+    }
+    for (int i = 0; i < options.broadcast_listeners; i++) {
+      clients.emplace_back(RunListener, stubs[options.clients + i].get(),
+                           songs[0].id, start + options.duration,
+                           &listener_stats);
+    }
+    for (auto& client : clients) {
+      client.join();
+    }
+    report.elapsed =
+        std::chrono::duration<double>(Clock::now() - start).count();
+    if (server_cpu >= 0) {
+      double end_cpu = ProcessCpuSeconds(server_pid);
+      report.cpu.server = end_cpu >= 0 ? end_cpu - server_cpu : -1;
+    }
+    report.cpu.loadgen = SelfCpuSeconds() - loadgen_cpu;
+    report.server_rpcs = FetchServerStats(stubs[0].get());
+
+    std::ofstream file;
+    if (!options.output.empty()) {
+      file.open(options.output);
+    }
+    std::ostream& out = options.output.empty() ? std::cout : file;
+    if (options.format == "json") {
+      WriteJson(out, options, stats, report);
+    } else {
+      WriteText(out, options, stats, report);
+    }
+  }
+
+  if (control_fd >= 0) {
+    stubs.clear();
+    close(control_fd);
+    waitpid(server_pid, nullptr, 0);
+    fs::remove_all(audio_dir);
+  }
+  return status;
+}
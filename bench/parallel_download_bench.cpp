@@ -0,0 +1,125 @@
+// Downloads a song through GrpcAudioService over 1 to N parallel streams and
+// reports the throughput of each mode. By default the song is served by an
+// in-process AsyncAudioService over loopback, where a single stream is rarely
+// limited by its flow-control window. Set MUSIC262_SERVER_ADDRESS to measure
+// song 1 of a remote server over a real high-latency link instead.
+//
+// Usage: parallel_download_bench [song_mb] [streams...]
+
+#include <grpcpp/grpcpp.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "async_audio_service.h"
+#include "audio_server.h"
+#include "audio_service_interface.h"
+#include "logger.h"
+
+namespace fs = std::filesystem;
+
+constexpr int kRuns = 3;
+
+// Write a 16-bit stereo WAV file of about song_mb megabytes
+void WriteSong(const fs::path& path, size_t song_mb) {
+  uint32_t data_size = static_cast<uint32_t>(song_mb * 1024 * 1024);
+  uint32_t header[] = {0x46464952, 36 + data_size, 0x45564157, 0x20746d66,
+                       16,         0x00020001,     44100,      44100 * 4,
+                       0x00100004, 0x61746164,     data_size};
+  std::ofstream file(path, std::ios::binary);
+  file.write(reinterpret_cast<const char*>(header), sizeof(header));
+  std::vector<char> block(1024 * 1024);
+  for (size_t i = 0; i < block.size(); i++) {
+    block[i] = static_cast<char>(i * 31);
+  }
+  for (size_t i = 0; i < song_mb; i++) {
+    file.write(block.data(), block.size());
+  }
+}
+
+// Best throughput in MB/s of kRuns downloads, 0 if any download failed
+double Measure(const std::string& address, int streams) {
+  music262::AudioServiceOptions options;
+  options.parallel_streams = streams;
+  auto service = music262::CreateAudioService(address, options);
+
+  double best = 0;
+  for (int run = 0; run < kRuns; run++) {
+    std::vector<char> song;
+    auto start = std::chrono::steady_clock::now();
+    bool ok = service->LoadAudioInto(1, &song);
+    size_t bytes = song.size();
+    double seconds = std::chrono::duration<double>(
+                         std::chrono::steady_clock::now() - start)
+                         .count();
+    if (!ok) {
+      return 0;
+    }
+    best = std::max(best, bytes / (1024.0 * 1024.0) / seconds);
+  }
+  return best;
+}
+
+int main(int argc, char* argv[]) {
+  Logger::init("parallel_download_bench");
+  Logger::setLevel(spdlog::level::warn);
+
+  size_t song_mb = argc > 1 ? std::stoul(argv[1]) : 64;
+  std::vector<int> stream_counts;
+  for (int i = 2; i < argc; i++) {
+    stream_counts.push_back(std::stoi(argv[i]));
+  }
+  if (stream_counts.empty()) {
+    stream_counts = {1, 2, 4, 8};
+  }
+
+  // Serve a synthetic song locally unless a remote server was given
+  const char* remote = std::getenv("MUSIC262_SERVER_ADDRESS");
+  fs::path audio_dir =
+      fs::temp_directory_path() / "music262_parallel_download_bench";
+  std::shared_ptr<AudioServer> audio_server;
+  std::unique_ptr<AsyncAudioService> service;
+  std::unique_ptr<grpc::Server> server;
+  std::string address;
+  if (remote) {
+    address = remote;
+  } else {
+    fs::create_directories(audio_dir);
+    WriteSong(audio_dir / "song.wav", song_mb);
+    audio_server = std::make_shared<AudioServer>(audio_dir.string());
+    service =
+        std::make_unique<AsyncAudioService>(audio_server, AsyncServiceOptions());
+
+    grpc::ServerBuilder builder;
+    int port = 0;
+    builder.AddListeningPort("127.0.0.1:0", grpc::InsecureServerCredentials(),
+                             &port);
+    service->RegisterWith(builder);
+    server = builder.BuildAndStart();
+    service->Start();
+    address = "127.0.0.1:" + std::to_string(port);
+  }
+
+  std::cout << "Server: " << address << std::endl;
+  std::cout << std::left << std::setw(10) << "streams"
+            << "MB/s (best of " << kRuns << ")" << std::endl;
+  for (int streams : stream_counts) {
+    double rate = Measure(address, streams);
+    std::cout << std::left << std::setw(10) << streams << std::fixed
+              << std::setprecision(1) << rate << std::endl;
+  }
+
+  if (server) {
+    service->Shutdown(server.get());
+    fs::remove_all(audio_dir);
+  }
+  return 0;
+}
@@ -0,0 +1,184 @@
+// Answers GetPeerClientIPs requests while other threads register and renew
+// clients, the way a join storm hits the server. Compares building a
+// response listing every client under the registry lock, as every request
+// used to, against picking at most max_peers peers from the published
+// snapshot and slicing the response from its cached encoding, and reports
+// the throughput and latency of both readers and writers.
+//
+// Usage: peer_list_bench [clients] [readers] [writers] [seconds] [max_peers]
+
+#include <grpcpp/support/byte_buffer.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "audio_service.pb.h"
+#include "chunk_encoder.h"
+#include "client_registry.h"
+#include "logger.h"
+#include "peer_selector.h"
+
+using Clock = std::chrono::steady_clock;
+
+struct RunResult {
+  double reads_per_sec = 0;
+  double writes_per_sec = 0;
+  double read_p50_us = 0;
+  double read_p99_us = 0;
+  size_t listed = 0;
+};
+
+std::string Address(size_t client) {
+  return "10." + std::to_string(client >> 16 & 0xff) + "." +
+         std::to_string(client >> 8 & 0xff) + "." +
+         std::to_string(client & 0xff) + ":50052";
+}
+
+// Clients spread over /24 subnets with a mix of uplinks, holding a few songs
+ClientAdvertisement Advertisement(size_t client) {
+  ClientAdvertisement advertisement;
+  advertisement.p2p_port = 50052;
+  advertisement.uplink_kbps = 1000 * (1 + client % 50);
+  advertisement.cached_songs = {static_cast<int>(client % 20) + 1};
+  return advertisement;
+}
+
+// The previous read path: list the live clients under the registry lock and
+// serialize a fresh response
+grpc::ByteBuffer LockedPeerList(const ClientRegistry& registry,
+                                const std::string& exclude) {
+  audio_service::PeerListResponse response;
+  for (const auto& client : registry.Leases()) {
+    if (client.address != exclude) {
+      response.add_client_ips(client.address);
+    }
+  }
+  std::string bytes = response.SerializeAsString();
+  grpc::Slice slice(bytes);
+  return grpc::ByteBuffer(&slice, 1);
+}
+
+RunResult Run(bool snapshot, size_t clients, int readers, int writers,
+              std::chrono::seconds duration, size_t max_peers) {
+  // As in the server, the expiry thread publishes the lists of a join storm
+  ClientRegistry registry;
+  registry.StartExpiring();
+  for (size_t i = 0; i < clients; i++) {
+    registry.Advertise(Address(i), Advertisement(i));
+  }
+
+  std::atomic<bool> stop{false};
+  std::atomic<uint64_t> writes{0};
+  std::atomic<size_t> listed{0};
+  std::vector<std::vector<double>> latencies(readers);
+  std::vector<std::thread> threads;
+
+  // Writers renew known clients and add a new one every tenth call
+  for (int w = 0; w < writers; w++) {
+    threads.emplace_back([&, w]() {
+      std::mt19937 random(w);
+      size_t next_client = clients + w;
+      uint64_t count = 0;
+      while (!stop.load(std::memory_order_relaxed)) {
+        if (count % 10 == 9) {
+          registry.Advertise(Address(next_client),
+                             Advertisement(next_client));
+          next_client += writers;
+        } else {
+          registry.Register(Address(random() % clients));
+        }
+        count++;
+      }
+      writes += count;
+    });
+  }
+
+  for (int r = 0; r < readers; r++) {
+    threads.emplace_back([&, r]() {
+      PeerQuery query;
+      query.address = Address(r);
+      query.max_peers = max_peers;
+      query.song_num = r + 1;
+      auto& samples = latencies[r];
+      while (!stop.load(std::memory_order_relaxed)) {
+        auto start = Clock::now();
+        grpc::ByteBuffer response;
+        if (snapshot) {
+          auto list = registry.Snapshot();
+          response = EncodePeerList(list, SelectPeers(*list, query));
+        } else {
+          response = LockedPeerList(registry, query.address);
+        }
+        samples.push_back(
+            std::chrono::duration<double, std::micro>(Clock::now() - start)
+                .count());
+        listed = response.Length();
+      }
+    });
+  }
+
+  std::this_thread::sleep_for(duration);
+  stop = true;
+  for (auto& thread : threads) {
+    thread.join();
+  }
+
+  std::vector<double> all;
+  for (const auto& samples : latencies) {
+    all.insert(all.end(), samples.begin(), samples.end());
+  }
+  std::sort(all.begin(), all.end());
+
+  RunResult result;
+  double seconds = std::chrono::duration<double>(duration).count();
+  result.reads_per_sec = all.size() / seconds;
+  result.writes_per_sec = writes / seconds;
+  if (!all.empty()) {
+    result.read_p50_us = all[all.size() / 2];
+    result.read_p99_us = all[all.size() * 99 / 100];
+  }
+  result.listed = listed;
+  return result;
+}
+
+int main(int argc, char* argv[]) {
+  Logger::init("peer_list_bench");
+  Logger::setLevel(spdlog::level::warn);
+
+  size_t clients = argc > 1 ? std::stoul(argv[1]) : 2000;
+  int readers = argc > 2 ? std::stoi(argv[2]) : 4;
+  int writers = argc > 3 ? std::stoi(argv[3]) : 4;
+  std::chrono::seconds duration(argc > 4 ? std::stoi(argv[4]) : 3);
+  size_t max_peers = argc > 5 ? std::stoul(argv[5]) : 8;
+
+  std::cout << clients << " clients, " << readers << " list threads, "
+            << writers << " register threads, " << duration.count()
+            << " s per run, " << max_peers << " peers per list, "
+            << std::thread::hardware_concurrency() << " cores" << std::endl;
+  std::cout << std::left << std::setw(12) << "read path" << std::right
+            << std::setw(14) << "lists/s" << std::setw(12) << "p50 us"
+            << std::setw(12) << "p99 us" << std::setw(16) << "registers/s"
+            << std::setw(12) << "list B" << std::endl;
+
+  for (bool snapshot : {false, true}) {
+    RunResult result =
+        Run(snapshot, clients, readers, writers, duration, max_peers);
+    std::cout << std::left << std::setw(12)
+              << (snapshot ? "selected" : "locked") << std::right
+              << std::fixed << std::setprecision(0) << std::setw(14)
+              << result.reads_per_sec << std::setprecision(1)
+              << std::setw(12) << result.read_p50_us << std::setw(12)
+              << result.read_p99_us << std::setprecision(0) << std::setw(16)
+              << result.writes_per_sec << std::setw(12)
+              << result.listed << std::endl;
+  }
+  return 0;
+}
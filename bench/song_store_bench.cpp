@@ -0,0 +1,222 @@
+// Measures the server-side cost of producing LoadAudio chunks for many
+// concurrent streams of the same song, comparing the original path (one
+// ifstream per stream, read into a buffer, copied into a protobuf and
+// serialized) against the shared mmap song store with slice-backed chunks.
+// Both of those columns are in-process chunk production rates. The last
+// column is the rate actually delivered to clients over LoadAudio streams
+// from an in-process AsyncAudioService on loopback.
+//
+// Usage: song_store_bench [song_mb] [streams...]
+
+#include <grpcpp/grpcpp.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <filesystem>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "async_audio_service.h"
+#include "audio_server.h"
+#include "audio_service.grpc.pb.h"
+#include "chunk_encoder.h"
+#include "logger.h"
+#include "song_store.h"
+
+namespace fs = std::filesystem;
+
+constexpr size_t kChunkSize = 64 * 1024;
+
+// Original path: every stream opens the file and copies each chunk twice
+size_t StreamWithIfstream(const std::string& path) {
+  std::ifstream file(path, std::ios::binary);
+  std::vector<char> buffer(kChunkSize);
+  size_t total = 0;
+
+  while (file) {
+    file.read(buffer.data(), kChunkSize);
+    std::streamsize bytes_read = file.gcount();
+    if (bytes_read > 0) {
+      audio_service::AudioChunk chunk;
+      chunk.set_data(buffer.data(), bytes_read);
+
+      grpc::ByteBuffer wire;
+      bool own_buffer;
+      grpc::SerializationTraits<audio_service::AudioChunk>::Serialize(
+          chunk, &wire, &own_buffer);
+      total += wire.Length();
+    }
+  }
+  return total;
+}
+
+// Mapped path: streams share one mapping and chunks reference it directly
+size_t StreamWithSongStore(SongStore& store, const std::string& path) {
+  std::shared_ptr<const MappedSong> song = store.Get(path);
+  size_t total = 0;
+
+  for (size_t offset = 0; offset < song->size(); offset += kChunkSize) {
+    size_t length = std::min(kChunkSize, song->size() - offset);
+    grpc::ByteBuffer wire = EncodeAudioChunk(song, offset, length);
+
+    // Walk the slices the way the transport does; the kernel copy into the
+    // socket is the same for both paths and is left out of the measurement
+    std::vector<grpc::Slice> slices;
+    wire.Dump(&slices);
+    for (const auto& slice : slices) {
+      total += slice.size();
+    }
+  }
+  return total;
+}
+
+// Run `streams` streams over a fixed set of worker threads and return
+// the aggregate payload rate in MB/s
+template <typename StreamFn>
+double RunStreams(int streams, StreamFn stream_fn) {
+  int workers = std::max(1u, std::thread::hardware_concurrency());
+  std::atomic<int> next_stream{0};
+  std::atomic<size_t> total_bytes{0};
+
+  auto start = std::chrono::steady_clock::now();
+  std::vector<std::thread> threads;
+  for (int w = 0; w < workers; w++) {
+    threads.emplace_back([&]() {
+      while (next_stream.fetch_add(1) < streams) {
+        total_bytes += stream_fn();
+      }
+    });
+  }
+  for (auto& thread : threads) {
+    thread.join();
+  }
+  auto elapsed = std::chrono::duration<double>(
+                     std::chrono::steady_clock::now() - start)
+                     .count();
+
+  return total_bytes.load() / (1024.0 * 1024.0) / elapsed;
+}
+
+// Download song 1 over its own channel and return the payload bytes read
+size_t StreamOverLoadAudio(const std::string& address, int stream_id) {
+  // A distinct channel argument keeps streams off a shared connection
+  grpc::ChannelArguments args;
+  args.SetInt("music262.bench_stream", stream_id);
+  args.SetMaxReceiveMessageSize(-1);
+  auto channel = grpc::CreateCustomChannel(
+      address, grpc::InsecureChannelCredentials(), args);
+  auto stub = audio_service::audio_service::NewStub(channel);
+
+  audio_service::LoadAudioRequest request;
+  request.set_song_num(1);
+  grpc::ClientContext context;
+  auto reader = stub->LoadAudio(&context, request);
+  audio_service::AudioChunk chunk;
+  size_t total = 0;
+  while (reader->Read(&chunk)) {
+    total += chunk.data().size();
+  }
+  return reader->Finish().ok() ? total : 0;
+}
+
+// Run `streams` LoadAudio downloads at once, one thread each so every
+// stream is open concurrently, and return the delivered rate in MB/s
+double RunLoadAudioStreams(const std::string& address, int streams) {
+  std::atomic<size_t> total_bytes{0};
+
+  auto start = std::chrono::steady_clock::now();
+  std::vector<std::thread> threads;
+  for (int i = 0; i < streams; i++) {
+    threads.emplace_back(
+        [&, i]() { total_bytes += StreamOverLoadAudio(address, i); });
+  }
+  for (auto& thread : threads) {
+    thread.join();
+  }
+  auto elapsed = std::chrono::duration<double>(
+                     std::chrono::steady_clock::now() - start)
+                     .count();
+
+  return total_bytes.load() / (1024.0 * 1024.0) / elapsed;
+}
+
+int main(int argc, char* argv[]) {
+  Logger::init("song_store_bench");
+  Logger::setLevel(spdlog::level::warn);
+
+  size_t song_mb = argc > 1 ? std::stoul(argv[1]) : 50;
+  std::vector<int> stream_counts;
+  for (int i = 2; i < argc; i++) {
+    stream_counts.push_back(std::stoi(argv[i]));
+  }
+  if (stream_counts.empty()) {
+    stream_counts = {1, 8, 50, 200};
+  }
+
+  // Create a synthetic song of the requested size
+  fs::path audio_dir = fs::temp_directory_path() / "music262_song_store_bench";
+  fs::create_directories(audio_dir);
+  fs::path path = audio_dir / "song.wav";
+  {
+    std::ofstream file(path, std::ios::binary);
+    std::vector<char> block(1024 * 1024);
+    for (size_t i = 0; i < block.size(); i++) {
+      block[i] = static_cast<char>(i * 31);
+    }
+    for (size_t i = 0; i < song_mb; i++) {
+      file.write(block.data(), block.size());
+    }
+  }
+
+  std::cout << "Song size: " << song_mb << " MB, chunk size: "
+            << kChunkSize / 1024 << " KB" << std::endl;
+  std::cout << std::left << std::setw(10) << "streams" << std::setw(18)
+            << "ifstream MB/s" << std::setw(18) << "mmap MB/s"
+            << std::setw(10) << "speedup"
+            << "LoadAudio MB/s" << std::endl;
+
+  // Serve the same song over loopback for the delivered rate
+  auto audio_server = std::make_shared<AudioServer>(audio_dir.string());
+  AsyncAudioService service(audio_server, AsyncServiceOptions());
+  grpc::ServerBuilder builder;
+  int port = 0;
+  builder.AddListeningPort("127.0.0.1:0", grpc::InsecureServerCredentials(),
+                           &port);
+  service.RegisterWith(builder);
+  std::unique_ptr<grpc::Server> server = builder.BuildAndStart();
+  service.Start();
+  std::string address = "127.0.0.1:" + std::to_string(port);
+
+  SongStore store;
+  for (int streams : stream_counts) {
+    double ifstream_rate =
+        RunStreams(streams, [&]() { return StreamWithIfstream(path); });
+
+    // Hold one reference so the song stays mapped across the whole run,
+    // as it would while a popular track is being served
+    auto pinned = store.Get(path);
+    double mmap_rate = RunStreams(
+        streams, [&]() { return StreamWithSongStore(store, path); });
+
+    double delivered_rate = RunLoadAudioStreams(address, streams);
+
+    std::ostringstream speedup;
+    speedup << std::fixed << std::setprecision(2)
+            << mmap_rate / ifstream_rate << "x";
+    std::cout << std::left << std::setw(10) << streams << std::setw(18)
+              << std::fixed << std::setprecision(1) << ifstream_rate
+              << std::setw(18) << mmap_rate << std::setw(10) << speedup.str()
+              << delivered_rate << std::endl;
+  }
+
+  service.Shutdown(server.get());
+  fs::remove_all(audio_dir);
+  return 0;
+}
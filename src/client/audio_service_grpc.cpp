@@ -1,8 +1,16 @@
 #include <grpcpp/grpcpp.h>
 
+#include <algorithm>
+#include <atomic>
 #include <chrono>
+#include <condition_variable>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <thread>
 
 #include "audio_service.grpc.pb.h"
+#include "crc32.h"
 #include "include/audio_service_interface.h"
 #include "logger.h"
 
@@ -15,68 +23,206 @@ namespace music262 {
 
 class GrpcAudioService : public AudioServiceInterface {
  public:
-  GrpcAudioService(std::shared_ptr<Channel> channel)
-      : stub_(audio_service::audio_service::NewStub(channel)) {
-    LOG_DEBUG("GrpcAudioService initialized");
+  // Parallel downloads spread their streams over stream_channels, which
+  // may hold the same channel several times
+  GrpcAudioService(std::shared_ptr<Channel> channel,
+                   const std::vector<std::shared_ptr<Channel>>& stream_channels,
+                   int playlist_page_size, bool heartbeat,
+                   std::optional<DeviceFormat> device_format)
+      : stub_(audio_service::audio_service::NewStub(channel)),
+        playlist_page_size_(playlist_page_size),
+        device_format_(device_format) {
+    for (const auto& stream_channel : stream_channels) {
+      stream_stubs_.push_back(
+          audio_service::audio_service::NewStub(stream_channel));
+    }
+    if (heartbeat) {
+      heartbeat_thread_ = std::thread(&GrpcAudioService::HeartbeatLoop, this);
+    }
+    LOG_DEBUG("GrpcAudioService initialized ({} download streams)",
+              std::max<size_t>(1, stream_stubs_.size()));
   }
 
-  ~GrpcAudioService() override { LOG_DEBUG("GrpcAudioService shutting down"); }
+  ~GrpcAudioService() override {
+    StopWatchingPeers();
+    {
+      std::lock_guard<std::mutex> lock(heartbeat_mutex_);
+      stop_heartbeat_ = true;
+      if (heartbeat_context_) {
+        heartbeat_context_->TryCancel();
+      }
+    }
+    heartbeat_cv_.notify_all();
+    if (heartbeat_thread_.joinable()) {
+      heartbeat_thread_.join();
+    }
+    LOG_DEBUG("GrpcAudioService shutting down");
+  }
 
   std::vector<std::string> GetPlaylist() override {
-    LOG_DEBUG("Requesting playlist from server");
+    std::vector<std::string> playlist;
+    for (const auto& song : GetPlaylistInfo()) {
+      playlist.push_back(song.name);
+    }
+    return playlist;
+  }
 
-    audio_service::PlaylistRequest request;
-    audio_service::PlaylistResponse response;
-    ClientContext context;
+  std::vector<SongInfo> GetPlaylistInfo() override {
+    std::lock_guard<std::mutex> lock(playlist_mutex_);
 
-    Status status = stub_->GetPlaylist(&context, request, &response);
+    // A version that went away while paging is simply fetched again
+    for (int attempt = 1;; attempt++) {
+      Status status = RefreshPlaylist();
+      if (status.ok()) {
+        return playlist_;
+      }
+      if (status.error_code() != grpc::StatusCode::ABORTED ||
+          attempt >= kMaxLoadAttempts) {
+        LOG_ERROR("GetPlaylist RPC failed: {}", status.error_message());
+        return {};
+      }
+    }
+  }
 
-    std::vector<std::string> playlist;
-    if (status.ok()) {
-      for (const auto& song : response.song_names()) {
-        playlist.push_back(song);
+  bool LoadAudio(int song_num, AudioChunkCallback callback) override {
+    AudioSegmentIndex index;
+    if (CanSplit(song_num, &index)) {
+      std::vector<char> song;
+      if (!LoadParallel(song_num, index, &song)) {
+        return false;
       }
-      LOG_INFO("Retrieved playlist with {} songs", playlist.size());
-    } else {
-      LOG_ERROR("GetPlaylist RPC failed: {}", status.error_message());
+      callback(song);
+      return true;
     }
 
-    return playlist;
+    // Whole songs may arrive losslessly encoded, the caller decodes them
+    return Load(stub_.get(), song_num, 0, 0, true, "",
+                [&callback](const char* data, size_t size) {
+                  callback(std::vector<char>(data, data + size));
+                },
+                device_format_ ? &*device_format_ : nullptr);
   }
 
-  bool LoadAudio(int song_num, AudioChunkCallback callback) override {
-    LOG_INFO("Loading audio for song: {}", song_num);
+  bool LoadAudioInto(int song_num, std::vector<char>* data) override {
+    data->clear();
+    AudioSegmentIndex index;
+    if (CanSplit(song_num, &index)) {
+      return LoadParallel(song_num, index, data);
+    }
+    return LoadWhole(song_num, data, nullptr);
+  }
 
-    // Create a request to load audio
-    audio_service::LoadAudioRequest request;
-    request.set_song_num(song_num);
+  bool PrefetchAudio(int song_num, std::vector<char>* data,
+                     const std::atomic<bool>& cancel) override {
+    // A single stream, parallel ones would compete with what is playing
+    data->clear();
+    return LoadWhole(song_num, data, &cancel);
+  }
 
+  void HintNextSongs(const std::vector<int>& song_nums) override {
+    audio_service::SongHintRequest request;
+    for (int song_num : song_nums) {
+      request.add_song_nums(song_num);
+    }
+    if (device_format_) {
+      SetOutputFormat(*device_format_, request.mutable_output_format());
+    }
+    audio_service::SongHintResponse response;
     ClientContext context;
-    std::unique_ptr<ClientReader<audio_service::AudioChunk>> reader(
-        stub_->LoadAudio(&context, request));
+    context.set_deadline(std::chrono::system_clock::now() + kHintTimeout);
 
-    // Process the audio stream
-    audio_service::AudioChunk chunk;
-    size_t total_bytes = 0;
+    // Only a hint, playback does not depend on it
+    Status status = stub_->HintNextSongs(&context, request, &response);
+    if (!status.ok()) {
+      LOG_DEBUG("HintNextSongs RPC failed: {}", status.error_message());
+    }
+  }
 
-    while (reader->Read(&chunk)) {
-      const std::string& data = chunk.data();
-      std::vector<char> chunk_data(data.begin(), data.end());
+  bool LoadAudioRange(int song_num, int64_t offset, int64_t length,
+                      AudioChunkCallback callback) override {
+    return Load(stub_.get(), song_num, offset, length, false, "",
+                [&callback](const char* data, size_t size) {
+                  callback(std::vector<char>(data, data + size));
+                });
+  }
 
-      // Call the callback with the chunk data
-      callback(chunk_data);
+  bool GetSegmentIndex(int song_num, AudioSegmentIndex* index) override {
+    LOG_DEBUG("Requesting segment index of song: {}", song_num);
 
-      total_bytes += data.size();
-    }
+    audio_service::SegmentIndexRequest request;
+    audio_service::SegmentIndexResponse response;
+    ClientContext context;
+    request.set_song_num(song_num);
 
-    Status status = reader->Finish();
-    if (status.ok()) {
-      LOG_INFO("Successfully received {} bytes for {}", total_bytes, song_num);
-      return true;
-    } else {
-      LOG_ERROR("LoadAudio RPC failed: {}", status.error_message());
+    Status status = stub_->GetSegmentIndex(&context, request, &response);
+    if (!status.ok()) {
+      LOG_ERROR("GetSegmentIndex RPC failed: {}", status.error_message());
       return false;
     }
+
+    index->resume_token = response.resume_token();
+    index->song_size = response.song_size();
+    index->sample_rate = response.sample_rate();
+    index->channels = response.channels();
+    index->bytes_per_frame = response.bytes_per_frame();
+    index->segments.clear();
+    for (const auto& entry : response.segments()) {
+      AudioSegment segment;
+      segment.id = entry.id();
+      segment.offset = entry.offset();
+      segment.size = entry.size();
+      segment.first_frame = entry.first_frame();
+      segment.frame_count = entry.frame_count();
+      segment.crc32 = entry.crc32();
+      index->segments.push_back(segment);
+    }
+    LOG_INFO("Retrieved segment index of song {} with {} segments", song_num,
+             index->segments.size());
+    return true;
+  }
+
+  bool LoadSegment(int song_num, const AudioSegment& segment,
+                   const std::string& resume_token,
+                   std::vector<char>* data) override {
+    audio_service::LoadSegmentRequest request;
+    request.set_song_num(song_num);
+    request.set_segment_id(segment.id);
+    request.set_resume_token(resume_token);
+
+    // Segments are small, so a failed transfer is simply fetched again
+    for (int attempt = 1;; attempt++) {
+      data->clear();
+      data->reserve(static_cast<size_t>(segment.size));
+
+      ClientContext context;
+      std::unique_ptr<ClientReader<audio_service::AudioChunk>> reader(
+          stub_->LoadSegment(&context, request));
+
+      audio_service::AudioChunk chunk;
+      while (reader->Read(&chunk)) {
+        data->insert(data->end(), chunk.data().begin(), chunk.data().end());
+      }
+
+      Status status = reader->Finish();
+      if (status.ok()) {
+        if (static_cast<int64_t>(data->size()) != segment.size ||
+            Crc32(data->data(), data->size()) != segment.crc32) {
+          LOG_ERROR("Segment {} of song {} failed its checksum", segment.id,
+                    song_num);
+          return false;
+        }
+        return true;
+      }
+
+      if (!IsResumable(status) || attempt >= kMaxLoadAttempts) {
+        LOG_ERROR("LoadSegment RPC failed: {}", status.error_message());
+        return false;
+      }
+
+      LOG_WARN("LoadSegment {} of song {} interrupted ({}), retrying",
+               segment.id, song_num, status.error_message());
+      std::this_thread::sleep_for(kRetryBackoff * attempt);
+    }
   }
 
   std::vector<std::string> GetPeerClientIPs() override {
@@ -85,6 +231,10 @@ class GrpcAudioService : public AudioServiceInterface {
     audio_service::PeerListRequest request;
     audio_service::PeerListResponse response;
     ClientContext context;
+    {
+      std::lock_guard<std::mutex> lock(heartbeat_mutex_);
+      request.set_song_num(advertisement_.current_song);
+    }
 
     Status status = stub_->GetPeerClientIPs(&context, request, &response);
 
@@ -101,13 +251,77 @@ class GrpcAudioService : public AudioServiceInterface {
     return peers;
   }
 
+  void Advertise(const PeerAdvertisement& advertisement) override {
+    {
+      std::lock_guard<std::mutex> lock(heartbeat_mutex_);
+      advertisement_ = advertisement;
+      advertise_now_ = true;
+    }
+    heartbeat_cv_.notify_all();
+  }
+
+  bool WatchPeers(uint64_t epoch, uint64_t sequence,
+                  PeerUpdateCallback callback) override {
+    audio_service::WatchPeersRequest request;
+    request.set_epoch(epoch);
+    request.set_sequence(sequence);
+
+    // No deadline, the stream stays open while the client runs
+    ClientContext context;
+    {
+      std::lock_guard<std::mutex> lock(watch_mutex_);
+      if (stop_watching_) {
+        return false;
+      }
+      watch_context_ = &context;
+    }
+
+    auto reader = stub_->WatchPeers(&context, request);
+    audio_service::PeerUpdate response;
+    while (reader->Read(&response)) {
+      PeerUpdate update;
+      update.epoch = response.epoch();
+      update.sequence = response.sequence();
+      update.reset = response.reset();
+      update.joined.assign(response.joined().begin(), response.joined().end());
+      update.left.assign(response.left().begin(), response.left().end());
+      callback(update);
+    }
+    Status status = reader->Finish();
+
+    bool stopped;
+    {
+      std::lock_guard<std::mutex> lock(watch_mutex_);
+      watch_context_ = nullptr;
+      stopped = stop_watching_;
+    }
+    if (!status.ok() && !stopped) {
+      LOG_WARN("WatchPeers stream ended: {}", status.error_message());
+    }
+    return status.ok();
+  }
+
+  void StopWatchingPeers() override {
+    std::lock_guard<std::mutex> lock(watch_mutex_);
+    stop_watching_ = true;
+    if (watch_context_) {
+      watch_context_->TryCancel();
+    }
+  }
+
   bool IsServerConnected() override {
     LOG_DEBUG("Verifying server connection");
 
-    // Try to get the playlist as a simple way to check if server is responsive
+    // Revalidating the cached playlist is the cheapest call that still
+    // reaches the service: at most one song or nothing at all comes back
     audio_service::PlaylistRequest request;
     audio_service::PlaylistResponse response;
     ClientContext context;
+    {
+      std::lock_guard<std::mutex> lock(playlist_mutex_);
+      request.set_if_none_match(playlist_etag_);
+    }
+    request.set_page_size(1);
 
     // Set a deadline for the RPC
     context.set_deadline(std::chrono::system_clock::now() +
@@ -125,15 +339,430 @@ class GrpcAudioService : public AudioServiceInterface {
   }
 
  private:
+  static constexpr int kMaxLoadAttempts = 5;
+
+  // Bring playlist_ up to date, page by page. Only the changes since
+  // playlist_etag_ are fetched, and nothing but a "not modified" answer if
+  // the playlist is current. Called with playlist_mutex_ held.
+  Status RefreshPlaylist() {
+    audio_service::PlaylistRequest request;
+    request.set_if_none_match(playlist_etag_);
+    request.set_delta(true);
+    request.set_page_size(playlist_page_size_);
+
+    std::vector<SongInfo> playlist;
+    std::string etag;
+    while (true) {
+      audio_service::PlaylistResponse response;
+      ClientContext context;
+      Status status = stub_->GetPlaylist(&context, request, &response);
+      if (!status.ok()) {
+        return status;
+      }
+      if (response.not_modified()) {
+        LOG_DEBUG("Playlist not modified");
+        return Status::OK;
+      }
+
+      // The first page decides whether the cached copy is updated or
+      // replaced, the rest come from the same version
+      if (etag.empty()) {
+        etag = response.etag();
+        if (response.delta()) {
+          playlist = playlist_;
+        }
+        playlist.resize(response.song_count());
+        for (int i = 0; i < response.song_count(); i++) {
+          playlist[i].id = i + 1;
+        }
+      }
+      for (const auto& info : response.songs()) {
+        if (info.id() <= 0 || info.id() > response.song_count()) {
+          continue;
+        }
+        SongInfo& song = playlist[info.id() - 1];
+        song.name = info.name();
+        song.size = info.size();
+        song.content_hash = info.content_hash();
+        song.sample_rate = info.sample_rate();
+        song.channels = info.channels();
+        song.bits_per_sample = info.bits_per_sample();
+        song.duration_ms = info.duration_ms();
+      }
+
+      if (response.next_page_token().empty()) {
+        break;
+      }
+      request.set_page_token(response.next_page_token());
+    }
+
+    LOG_INFO("Retrieved playlist with {} songs", playlist.size());
+    playlist_ = std::move(playlist);
+    playlist_etag_ = etag;
+    return Status::OK;
+  }
+
+  static constexpr std::chrono::milliseconds kRetryBackoff{200};
+  static constexpr std::chrono::milliseconds kHeartbeatRetry{5000};
+  static constexpr std::chrono::milliseconds kHintTimeout{2000};
+
+  // Most bytes allocated up front for a song the playlist does not size
+  static constexpr int64_t kMaxPreallocBytes = 512ll * 1024 * 1024;
+
+  // The server drops clients that stay silent for longer than their lease
+  // from the peer list, so renew ours at a third of the lease it grants
+  void HeartbeatLoop() {
+    std::unique_lock<std::mutex> lock(heartbeat_mutex_);
+    while (!stop_heartbeat_) {
+      audio_service::HeartbeatRequest request;
+      request.set_p2p_port(advertisement_.p2p_port);
+      request.set_uplink_kbps(advertisement_.uplink_kbps);
+      for (int song_num : advertisement_.cached_songs) {
+        request.add_cached_songs(song_num);
+      }
+      advertise_now_ = false;
+
+      audio_service::HeartbeatResponse response;
+      ClientContext context;
+      context.set_deadline(std::chrono::system_clock::now() +
+                           std::chrono::seconds(2));
+      heartbeat_context_ = &context;
+      lock.unlock();
+
+      Status status = stub_->Heartbeat(&context, request, &response);
+
+      lock.lock();
+      heartbeat_context_ = nullptr;
+      std::chrono::milliseconds interval = kHeartbeatRetry;
+      if (status.ok() && response.lease_ms() > 0) {
+        interval = std::chrono::milliseconds(response.lease_ms() / 3);
+      } else if (!status.ok() && !stop_heartbeat_) {
+        LOG_DEBUG("Heartbeat RPC failed: {}", status.error_message());
+      }
+      // A new advertisement is sent right away
+      heartbeat_cv_.wait_for(lock, interval, [this]() {
+        return stop_heartbeat_ || advertise_now_;
+      });
+    }
+  }
+
+  // Transport failures are worth retrying; anything else is final
+  static bool IsResumable(const Status& status) {
+    switch (status.error_code()) {
+      case grpc::StatusCode::UNAVAILABLE:
+      case grpc::StatusCode::DEADLINE_EXCEEDED:
+      case grpc::StatusCode::ABORTED:
+      case grpc::StatusCode::INTERNAL:
+      case grpc::StatusCode::RESOURCE_EXHAUSTED:
+      case grpc::StatusCode::CANCELLED:
+        return true;
+      default:
+        return false;
+    }
+  }
+
+  // The server pins a transfer to one version of the song with this token
+  static std::string GetResumeToken(const ClientContext& context,
+                                    const std::string& fallback) {
+    const auto& metadata = context.GetServerInitialMetadata();
+    auto it = metadata.find("resume-token");
+    if (it == metadata.end()) {
+      return fallback;
+    }
+    return std::string(it->second.data(), it->second.size());
+  }
+
+  // Size of the streamed file, sent by the server before the first chunk,
+  // 0 if the server did not send it
+  static int64_t GetSongSize(const ClientContext& context) {
+    const auto& metadata = context.GetServerInitialMetadata();
+    auto it = metadata.find("song-size");
+    if (it == metadata.end()) {
+      return 0;
+    }
+    std::string size(it->second.data(), it->second.size());
+    return std::strtoll(size.c_str(), nullptr, 10);
+  }
+
+  // Ask the server for songs in the format of the output device
+  static void SetOutputFormat(const DeviceFormat& device_format,
+                              audio_service::PcmFormat* format) {
+    format->set_sample_format(device_format.float_samples
+                                  ? audio_service::SAMPLE_FORMAT_F32
+                                  : audio_service::SAMPLE_FORMAT_S16);
+    format->set_sample_rate(device_format.sample_rate);
+    format->set_channels(device_format.channels);
+  }
+
+  // Receives the bytes of a stream as they arrive
+  using ByteSink = std::function<void(const char* data, size_t size)>;
+
+  // Told the size of the streamed file before its first bytes arrive
+  using SizeSink = std::function<void(int64_t size)>;
+
+  static double MegabytesPerSecond(
+      int64_t bytes, std::chrono::steady_clock::time_point start) {
+    double seconds = std::chrono::duration<double>(
+                         std::chrono::steady_clock::now() - start)
+                         .count();
+    return seconds > 0 ? bytes / (1024.0 * 1024.0) / seconds : 0.0;
+  }
+
+  // Stream a byte range of a song, resuming after transport failures. A
+  // non-empty resume_token pins the transfer to that version of the song,
+  // a device_format has the server convert the song first. A transfer with
+  // a cancel flag is a prefetch, which ends once the flag is set.
+  bool Load(audio_service::audio_service::Stub* stub, int song_num,
+            int64_t offset, int64_t length, bool accept_lossless,
+            std::string resume_token, const ByteSink& sink,
+            const DeviceFormat* device_format = nullptr,
+            const std::atomic<bool>* cancel = nullptr,
+            const SizeSink& size_sink = nullptr) {
+    LOG_INFO("Loading audio for song: {} (offset {}, length {})", song_num,
+             offset, length);
+
+    auto start = std::chrono::steady_clock::now();
+    int64_t total_bytes = 0;
+
+    for (int attempt = 1;; attempt++) {
+      // Continue from the last byte received by a previous attempt
+      audio_service::LoadAudioRequest request;
+      request.set_song_num(song_num);
+      request.set_offset(offset + total_bytes);
+      if (length > 0) {
+        request.set_length(length - total_bytes);
+      }
+      request.set_resume_token(resume_token);
+      if (accept_lossless) {
+        request.add_accepted_codecs(audio_service::CODEC_M262_LOSSLESS);
+      }
+      if (device_format) {
+        SetOutputFormat(*device_format, request.mutable_output_format());
+      }
+      request.set_prefetch(cancel != nullptr);
+
+      ClientContext context;
+      std::unique_ptr<ClientReader<audio_service::AudioChunk>> reader(
+          stub->LoadAudio(&context, request));
+
+      // Process the audio stream
+      audio_service::AudioChunk chunk;
+      bool have_metadata = false;
+
+      while (reader->Read(&chunk)) {
+        if (!have_metadata) {
+          resume_token = GetResumeToken(context, resume_token);
+          if (size_sink) {
+            size_sink(GetSongSize(context));
+          }
+          have_metadata = true;
+        }
+
+        const std::string& data = chunk.data();
+        sink(data.data(), data.size());
+        total_bytes += data.size();
+        if (cancel && *cancel) {
+          context.TryCancel();
+        }
+      }
+
+      Status status = reader->Finish();
+      if (cancel && *cancel) {
+        LOG_INFO("Prefetch of song {} cancelled after {} bytes", song_num,
+                 total_bytes);
+        return false;
+      }
+      if (status.ok() || (length > 0 && total_bytes >= length)) {
+        LOG_INFO("Successfully received {} bytes for {} ({:.1f} MB/s)",
+                 total_bytes, song_num, MegabytesPerSecond(total_bytes, start));
+        return true;
+      }
+
+      if (!IsResumable(status) || attempt >= kMaxLoadAttempts) {
+        LOG_ERROR("LoadAudio RPC failed: {}", status.error_message());
+        return false;
+      }
+
+      LOG_WARN("LoadAudio interrupted after {} bytes ({}), resuming",
+               total_bytes, status.error_message());
+      std::this_thread::sleep_for(kRetryBackoff * attempt);
+    }
+  }
+
+  // Most bytes to allocate for a song before they arrive. The song-size the
+  // server sends is only trusted up to the file the playlist lists, which
+  // the encoded stream never exceeds; a converted song may be larger.
+  int64_t PreallocLimit(int song_num) {
+    if (!device_format_) {
+      std::lock_guard<std::mutex> lock(playlist_mutex_);
+      if (song_num >= 1 && song_num <= static_cast<int>(playlist_.size()) &&
+          playlist_[song_num - 1].size > 0) {
+        return std::min(playlist_[song_num - 1].size, kMaxPreallocBytes);
+      }
+    }
+    return kMaxPreallocBytes;
+  }
+
+  // Stream a whole song into data, allocated once for the size the server
+  // sends. Each chunk is copied twice, by the reader into its protobuf
+  // string and from there to its place in data, but data never reallocates.
+  bool LoadWhole(int song_num, std::vector<char>* data,
+                 const std::atomic<bool>* cancel) {
+    int64_t limit = PreallocLimit(song_num);
+    return Load(
+        stub_.get(), song_num, 0, 0, true, "",
+        [data](const char* bytes, size_t size) {
+          data->insert(data->end(), bytes, bytes + size);
+        },
+        device_format_ ? &*device_format_ : nullptr, cancel,
+        [data, limit, song_num](int64_t size) {
+          // Past the limit the buffer grows as the bytes arrive instead
+          if (size > limit) {
+            LOG_WARN("Song {} claims {} bytes, not preallocating them",
+                     song_num, size);
+          } else if (size > 0) {
+            data->reserve(static_cast<size_t>(size));
+          }
+        });
+  }
+
+  // Only PCM songs have a segment index to split them along, and segments
+  // address the server's file, not the converted song
+  bool CanSplit(int song_num, AudioSegmentIndex* index) {
+    if (stream_stubs_.size() <= 1 || device_format_) {
+      return false;
+    }
+    if (GetSegmentIndex(song_num, index) && !index->segments.empty() &&
+        index->song_size <= PreallocLimit(song_num)) {
+      return true;
+    }
+    LOG_WARN("Song {} cannot be split, loading it over one stream", song_num);
+    return false;
+  }
+
+  // Stream segments [first, last) of a song as one byte range into their
+  // place in song, checking every segment's CRC as its bytes arrive
+  bool LoadSegments(audio_service::audio_service::Stub* stub, int song_num,
+                    const AudioSegmentIndex& index, size_t first, size_t last,
+                    char* song) {
+    int64_t begin = index.segments[first].offset;
+    int64_t end =
+        index.segments[last - 1].offset + index.segments[last - 1].size;
+    int64_t position = begin;
+    size_t segment = first;
+    uint32_t crc = 0;
+    bool corrupt = false;
+
+    bool ok = Load(
+        stub, song_num, begin, end - begin, false, index.resume_token,
+        [&](const char* data, size_t size) {
+          size = std::min<size_t>(size, end - position);
+          std::memcpy(song + position, data, size);
+          while (size > 0) {
+            const AudioSegment& current = index.segments[segment];
+            size_t part = std::min<size_t>(
+                size, current.offset + current.size - position);
+            crc = Crc32(data, part, crc);
+            data += part;
+            size -= part;
+            position += part;
+            if (position == current.offset + current.size) {
+              if (crc != current.crc32) {
+                LOG_ERROR("Segment {} of song {} failed its checksum",
+                          current.id, song_num);
+                corrupt = true;
+              }
+              crc = 0;
+              segment++;
+            }
+          }
+        });
+    return ok && !corrupt && position == end;
+  }
+
+  // Download a song as contiguous runs of whole segments, one per stream,
+  // written in place into a buffer of the final size
+  bool LoadParallel(int song_num, const AudioSegmentIndex& index,
+                    std::vector<char>* song) {
+    auto start = std::chrono::steady_clock::now();
+    size_t streams = std::min(stream_stubs_.size(), index.segments.size());
+    song->resize(static_cast<size_t>(index.song_size));
+
+    std::vector<std::thread> workers;
+    std::vector<char> ok(streams, false);
+    size_t first = 0;
+    for (size_t i = 0; i < streams; i++) {
+      size_t last = index.segments.size() * (i + 1) / streams;
+      workers.emplace_back([this, i, first, last, song_num, &index, song,
+                            &ok]() {
+        ok[i] = LoadSegments(stream_stubs_[i].get(), song_num, index, first,
+                             last, song->data());
+      });
+      first = last;
+    }
+    for (auto& worker : workers) {
+      worker.join();
+    }
+
+    if (std::find(ok.begin(), ok.end(), false) != ok.end()) {
+      LOG_ERROR("Parallel download of song {} failed", song_num);
+      return false;
+    }
+
+    LOG_INFO("Received {} bytes for {} over {} streams ({:.1f} MB/s)",
+             song->size(), song_num, streams,
+             MegabytesPerSecond(index.song_size, start));
+    return true;
+  }
+
   std::unique_ptr<audio_service::audio_service::Stub> stub_;
+  std::vector<std::unique_ptr<audio_service::audio_service::Stub>>
+      stream_stubs_;
+
+  // Local copy of the playlist, revalidated on every GetPlaylistInfo
+  int playlist_page_size_;
+  std::optional<DeviceFormat> device_format_;
+  std::vector<SongInfo> playlist_;
+  std::string playlist_etag_;
+  std::mutex playlist_mutex_;
+
+  // Keeps this client registered while it is idle and advertises it
+  std::thread heartbeat_thread_;
+  std::mutex heartbeat_mutex_;
+  std::condition_variable heartbeat_cv_;
+  ClientContext* heartbeat_context_ = nullptr;  // In-flight heartbeat
+  bool stop_heartbeat_ = false;
+  PeerAdvertisement advertisement_;  // Sent with every heartbeat
+  bool advertise_now_ = false;
+
+  // Running WatchPeers call, cancelled by StopWatchingPeers
+  std::mutex watch_mutex_;
+  ClientContext* watch_context_ = nullptr;
+  bool stop_watching_ = false;
 };
 
 // Factory implementation
 std::unique_ptr<AudioServiceInterface> CreateAudioService(
-    const std::string& server_address) {
+    const std::string& server_address, const AudioServiceOptions& options) {
   auto channel =
       grpc::CreateChannel(server_address, grpc::InsecureChannelCredentials());
-  return std::make_unique<GrpcAudioService>(channel);
+
+  std::vector<std::shared_ptr<Channel>> stream_channels;
+  for (int i = 0; options.parallel_streams > 1 && i < options.parallel_streams;
+       i++) {
+    if (!options.separate_channels) {
+      stream_channels.push_back(channel);
+      continue;
+    }
+    // Channels with a local subchannel pool never share a connection
+    grpc::ChannelArguments args;
+    args.SetInt(GRPC_ARG_USE_LOCAL_SUBCHANNEL_POOL, 1);
+    stream_channels.push_back(grpc::CreateCustomChannel(
+        server_address, grpc::InsecureChannelCredentials(), args));
+  }
+  return std::make_unique<GrpcAudioService>(
+      channel, stream_channels, options.playlist_page_size, options.heartbeat,
+      options.device_format);
 }
 
 }  // namespace music262
@@ -20,8 +20,7 @@ AudioPlayer::~AudioPlayer() {
   }
 }
 
-bool AudioPlayer::load(const std::string& filePath) {
-  // Always stop playback and cleanup when loading a new file
+void AudioPlayer::unload() {
   if (audioUnit) {
     playing.store(false);
     AudioOutputUnitStop(audioUnit);
@@ -29,6 +28,14 @@ bool AudioPlayer::load(const std::string& filePath) {
     AudioComponentInstanceDispose(audioUnit);
     audioUnit = nullptr;
   }
+  sampleData = nullptr;
+  sampleSize = 0;
+  sampleOwner.reset();
+}
+
+bool AudioPlayer::load(const std::string& filePath) {
+  // Always stop playback and cleanup when loading a new file
+  unload();
 
   std::ifstream file(filePath, std::ios::binary);
   if (!file) {
@@ -48,21 +55,14 @@ bool AudioPlayer::load(const std::string& filePath) {
   audioData.clear();
   file.seekg(sizeof(WavHeader), std::ios::beg);
   audioData.assign(std::istreambuf_iterator<char>(file), {});
+  sampleData = audioData.data();
+  sampleSize = audioData.size();
   currentPosition.store(sizeof(WavHeader));
 
   return setupAudioUnit();
 }
 
-bool AudioPlayer::loadFromMemory(const char* data, size_t size) {
-  // Always stop playback and cleanup when loading a new file
-  if (audioUnit) {
-    playing.store(false);
-    AudioOutputUnitStop(audioUnit);
-    AudioUnitUninitialize(audioUnit);
-    AudioComponentInstanceDispose(audioUnit);
-    audioUnit = nullptr;
-  }
-
+bool AudioPlayer::readHeader(const char* data, size_t size) {
   if (size < sizeof(WavHeader)) {
     std::cerr << "Data too small to be a valid WAV file." << std::endl;
     return false;
@@ -77,11 +77,39 @@ bool AudioPlayer::loadFromMemory(const char* data, size_t size) {
     std::cerr << "Invalid WAV file format in memory buffer." << std::endl;
     return false;
   }
+  return true;
+}
+
+bool AudioPlayer::loadFromMemory(const char* data, size_t size) {
+  // Always stop playback and cleanup when loading a new file
+  unload();
+  if (!readHeader(data, size)) {
+    return false;
+  }
 
   // Copy the audio data
   audioData.clear();
   audioData.assign(data + sizeof(WavHeader), data + size);
-  currentPosition.store(0);
+  sampleData = audioData.data();
+  sampleSize = audioData.size();
+  currentPosition.store(sizeof(WavHeader));
+
+  return setupAudioUnit();
+}
+
+bool AudioPlayer::loadShared(std::shared_ptr<const void> owner,
+                             const char* data, size_t size) {
+  unload();
+  if (!readHeader(data, size)) {
+    return false;
+  }
+
+  // Play straight out of the shared memory and drop any copied song
+  std::vector<char>().swap(audioData);
+  sampleOwner = std::move(owner);
+  sampleData = data + sizeof(WavHeader);
+  sampleSize = size - sizeof(WavHeader);
+  currentPosition.store(sizeof(WavHeader));
 
   return setupAudioUnit();
 }
@@ -140,13 +168,13 @@ bool AudioPlayer::setupAudioUnit() {
 }
 
 void AudioPlayer::play() {
-  if (audioData.empty()) {
+  if (sampleSize == 0) {
     std::cerr << "No audio data loaded.\n";
     return;
   }
 
   // Reset position to the beginning if we're at the end of the file
-  unsigned int totalSize = sizeof(WavHeader) + audioData.size();
+  unsigned int totalSize = sizeof(WavHeader) + sampleSize;
   if (currentPosition.load() >= totalSize) {
     currentPosition.store(sizeof(WavHeader));
   }
@@ -216,18 +244,24 @@ OSStatus AudioPlayer::RenderCallback(void* inRefCon,
   unsigned int dataPosition =
       position -
       sizeof(WavHeader);  // Adjust position to be relative to audio data
-  unsigned int bytesAvailable = player->audioData.size() - dataPosition;
+  unsigned int bytesAvailable = player->sampleSize - dataPosition;
   unsigned int framesAvailable = bytesAvailable / bytesPerFrame;
 
   UInt32 framesToRender = std::min(inNumberFrames, framesAvailable);
 
-  // Read audio to buffer
-  for (UInt32 i = 0; i < framesToRender; ++i) {
-    for (int ch = 0; ch < channels; ++ch) {
-      int idx = dataPosition + (i * bytesPerFrame) + (ch * bytesPerSample);
-      int16_t sample =
-          *reinterpret_cast<const int16_t*>(&player->audioData[idx]);
-      outBuffer[i * channels + ch] = sample / 32768.0f;
+  // Float songs are already in the unit's format, 16-bit ones are scaled
+  if (player->header.audioFormat == kWavFormatFloat &&
+      player->header.bitsPerSample == 32) {
+    std::memcpy(outBuffer, player->sampleData + dataPosition,
+                framesToRender * bytesPerFrame);
+  } else {
+    for (UInt32 i = 0; i < framesToRender; ++i) {
+      for (int ch = 0; ch < channels; ++ch) {
+        int idx = dataPosition + (i * bytesPerFrame) + (ch * bytesPerSample);
+        int16_t sample =
+            *reinterpret_cast<const int16_t*>(&player->sampleData[idx]);
+        outBuffer[i * channels + ch] = sample / 32768.0f;
+      }
     }
   }
 
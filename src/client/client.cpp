@@ -1,7 +1,11 @@
 #include "include/client.h"
 
+#include <algorithm>
+
+#include "content_hash.h"
 #include "include/peer_network.h"
 #include "logger.h"
+#include "lossless_codec.h"
 
 AudioClient::AudioClient(
     std::unique_ptr<music262::AudioServiceInterface> audio_service)
@@ -13,7 +17,13 @@ AudioClient::AudioClient(
   LOG_DEBUG("AudioClient initialized");
 }
 
-AudioClient::~AudioClient() { LOG_DEBUG("AudioClient shutting down"); }
+AudioClient::~AudioClient() {
+  LOG_DEBUG("AudioClient shutting down");
+  // The peer watch thread calls into the audio service
+  if (peer_network_) {
+    peer_network_->StopWatchingPeers();
+  }
+}
 
 std::vector<std::string> AudioClient::GetPlaylist() {
   LOG_DEBUG("Requesting playlist from server");
@@ -21,30 +31,111 @@ std::vector<std::string> AudioClient::GetPlaylist() {
   return audio_service_->GetPlaylist();
 }
 
+std::vector<music262::SongInfo> AudioClient::GetPlaylistInfo() {
+  LOG_DEBUG("Requesting playlist with song details from server");
+
+  return audio_service_->GetPlaylistInfo();
+}
+
 bool AudioClient::LoadAudio(int song_num) {
   LOG_INFO("Loading audio for song: {}", song_num);
 
-  // Clear previously loaded audio data
-  audio_data_.clear();
+  // Skip the transfer when the loaded buffer already holds this exact song
+  music262::SongInfo expected;
+  std::vector<music262::SongInfo> songs = audio_service_->GetPlaylistInfo();
+  if (!converted_songs_ && song_num >= 1 &&
+      song_num <= static_cast<int>(songs.size())) {
+    expected = songs[song_num - 1];
+  }
+  if (expected.content_hash != 0 && expected.content_hash == loaded_hash_ &&
+      audio_data_ &&
+      expected.size == static_cast<int64_t>(audio_data_->size())) {
+    LOG_INFO("Song {} is already loaded, skipping download", song_num);
+    if (!player_.loadShared(audio_data_, audio_data_->data(),
+                            audio_data_->size())) {
+      LOG_ERROR("Failed to load audio data into player");
+      return false;
+    }
+    SongLoaded(song_num);
+    return true;
+  }
 
-  // Use a callback to collect audio chunks
-  bool success = audio_service_->LoadAudio(
-      song_num, [this](const std::vector<char>& data) {
-        // Append data to our in-memory buffer
-        audio_data_.insert(audio_data_.end(), data.begin(), data.end());
-      });
+  // Play a cached copy straight from its mapping, without copying it
+  std::shared_ptr<SongDiskCache> disk_cache = GetDiskCache();
+  if (expected.content_hash != 0 && disk_cache) {
+    auto cached = disk_cache->Get(expected.content_hash,
+                                   static_cast<size_t>(expected.size));
+    if (cached) {
+      LOG_INFO("Playing song {} from the disk cache", song_num);
+      audio_data_.reset();
+      if (!player_.loadShared(cached, cached->data(), cached->size())) {
+        LOG_ERROR("Failed to load cached song into player");
+        loaded_hash_ = 0;
+        return false;
+      }
+      loaded_hash_ = expected.content_hash;
+      SongLoaded(song_num);
+      return true;
+    }
+  }
 
-  if (success) {
-    LOG_INFO("Successfully received {} bytes for {}", audio_data_.size(),
+  // Release previously loaded audio data
+  audio_data_.reset();
+  loaded_hash_ = 0;
+
+  // A song prefetched while the previous one played is ready in memory,
+  // unless it changed on the server since
+  std::vector<char> song;
+  bool success = prefetcher_ && prefetcher_->Take(song_num, &song);
+  if (success && expected.content_hash != 0 &&
+      music262::ContentHash(song.data(), song.size()) !=
+          expected.content_hash) {
+    LOG_INFO("Prefetched song {} changed on the server, downloading it again",
              song_num);
+    success = false;
+  }
+
+  // Receive the song straight into its buffer
+  if (!success) {
+    success = audio_service_->LoadAudioInto(song_num, &song);
+  }
+
+  if (success) {
+    LOG_INFO("Successfully received {} bytes for {}", song.size(), song_num);
 
-    // Load audio data into player from memory
-    if (!player_.loadFromMemory(audio_data_.data(), audio_data_.size())) {
+    // Decode losslessly encoded songs back into the WAV file
+    if (music262::IsLosslessStream(song.data(), song.size())) {
+      std::vector<char> wav;
+      if (!music262::DecodeLossless(song.data(), song.size(), &wav)) {
+        LOG_ERROR("Failed to decode song {}", song_num);
+        return false;
+      }
+      LOG_INFO("Decoded {} bytes into {} bytes of audio", song.size(),
+               wav.size());
+      song = std::move(wav);
+    }
+
+    // A converted song is not the file the playlist describes
+    if (!converted_songs_) {
+      loaded_hash_ = music262::ContentHash(song.data(), song.size());
+    }
+    if (expected.content_hash != 0 && expected.content_hash != loaded_hash_) {
+      LOG_WARN("Song {} does not match the playlist's content hash",
+               song_num);
+    }
+    if (disk_cache && loaded_hash_ != 0) {
+      disk_cache->Put(loaded_hash_, song.data(), song.size());
+    }
+
+    // The player plays the received buffer in place, without a copy
+    audio_data_ = std::make_shared<const std::vector<char>>(std::move(song));
+    if (!player_.loadShared(audio_data_, audio_data_->data(),
+                            audio_data_->size())) {
       LOG_ERROR("Failed to load audio data into player");
       return false;
     }
-    // Track loaded song for sync
-    current_song_num_ = song_num;
+    // Track loaded song for sync and advertise it to peers
+    SongLoaded(song_num);
     return true;
   } else {
     LOG_ERROR("LoadAudio failed");
@@ -52,6 +143,25 @@ bool AudioClient::LoadAudio(int song_num) {
   }
 }
 
+void AudioClient::SongLoaded(int song_num) {
+  current_song_num_ = song_num;
+  advertisement_.current_song = song_num;
+  auto& songs = advertisement_.cached_songs;
+  if (std::find(songs.begin(), songs.end(), song_num) == songs.end()) {
+    songs.push_back(song_num);
+  }
+  audio_service_->Advertise(advertisement_);
+  if (prefetcher_) {
+    prefetcher_->SongPlayed(song_num);
+  }
+}
+
+void AudioClient::AdvertisePeer(int p2p_port, int64_t uplink_kbps) {
+  advertisement_.p2p_port = p2p_port;
+  advertisement_.uplink_kbps = uplink_kbps;
+  audio_service_->Advertise(advertisement_);
+}
+
 void AudioClient::Play() {
   // Broadcast load then play to peers if sync-enabled
   if (peer_sync_enabled_ && !command_from_broadcast_ && peer_network_) {
@@ -106,11 +216,60 @@ std::vector<std::string> AudioClient::GetPeerClientIPs() {
   return audio_service_->GetPeerClientIPs();
 }
 
+bool AudioClient::WatchPeers(uint64_t epoch, uint64_t sequence,
+                             music262::PeerUpdateCallback callback) {
+  return audio_service_->WatchPeers(epoch, sequence, std::move(callback));
+}
+
+void AudioClient::StopWatchingPeers() { audio_service_->StopWatchingPeers(); }
+
 void AudioClient::EnablePeerSync(bool enable) {
   peer_sync_enabled_ = enable;
   LOG_INFO("Peer synchronization {}", enable ? "enabled" : "disabled");
 }
 
+void AudioClient::SetDiskCache(std::shared_ptr<SongDiskCache> disk_cache) {
+  LOG_DEBUG("Disk cache {}", disk_cache ? "enabled" : "disabled");
+  std::lock_guard<std::mutex> lock(disk_cache_mutex_);
+  disk_cache_ = std::move(disk_cache);
+}
+
+std::shared_ptr<SongDiskCache> AudioClient::GetDiskCache() const {
+  std::lock_guard<std::mutex> lock(disk_cache_mutex_);
+  return disk_cache_;
+}
+
+const std::vector<char>& AudioClient::GetAudioData() const {
+  static const std::vector<char> kNoSong;
+  return audio_data_ ? *audio_data_ : kNoSong;
+}
+
+void AudioClient::EnablePrefetch(size_t songs, size_t max_bytes) {
+  prefetcher_.reset();
+  if (songs == 0) {
+    LOG_DEBUG("Prefetching disabled");
+    return;
+  }
+  // Songs in the disk cache start as quickly without being prefetched. The
+  // check runs on the prefetch thread and must not count as playing them.
+  prefetcher_ = std::make_unique<SongPrefetcher>(
+      audio_service_.get(), songs, max_bytes,
+      [this](const music262::SongInfo& song) {
+        if (converted_songs_ || song.content_hash == 0) {
+          return false;
+        }
+        std::shared_ptr<SongDiskCache> disk_cache = GetDiskCache();
+        return disk_cache &&
+               disk_cache->Contains(song.content_hash,
+                                    static_cast<size_t>(song.size));
+      });
+  LOG_DEBUG("Prefetching {} songs into {} bytes", songs, max_bytes);
+}
+
+PrefetchStats AudioClient::GetPrefetchStats() const {
+  return prefetcher_ ? prefetcher_->GetStats() : PrefetchStats();
+}
+
 void AudioClient::SetPeerNetwork(std::shared_ptr<PeerNetwork> peer_network) {
   peer_network_ = peer_network;
   LOG_DEBUG("Peer network set");
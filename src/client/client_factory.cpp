@@ -11,12 +11,15 @@
  * implementations
  */
 std::unique_ptr<AudioClient> CreateAudioClient(
-    const std::string& server_address) {
+    const std::string& server_address,
+    const music262::AudioServiceOptions& service_options) {
   // Create the audio service implementation
-  auto audio_service = music262::CreateAudioService(server_address);
+  auto audio_service =
+      music262::CreateAudioService(server_address, service_options);
 
   // Create the client with the audio service
   auto client = std::make_unique<AudioClient>(std::move(audio_service));
+  client->SetConvertedSongs(service_options.device_format.has_value());
 
   // Create the peer network with the client
   auto peer_network = std::make_shared<PeerNetwork>(client.get());
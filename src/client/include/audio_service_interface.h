@@ -1,7 +1,10 @@
 #pragma once
 
+#include <atomic>
+#include <cstdint>
 #include <functional>
 #include <memory>
+#include <optional>
 #include <string>
 #include <vector>
 
@@ -10,6 +13,60 @@ namespace music262 {
 // Callback for streaming audio chunks
 using AudioChunkCallback = std::function<void(const std::vector<char>& data)>;
 
+// A song of the server's playlist
+// The format fields are 0 if the server does not know the song's format
+struct SongInfo {
+  std::string name;           // Empty if the song was removed
+  int64_t size = 0;           // Size of the WAV file in bytes
+  uint64_t content_hash = 0;  // ContentHash of the WAV file, 0 if unknown
+  int id = 0;                 // Song number to load the song with
+  int sample_rate = 0;
+  int channels = 0;
+  int bits_per_sample = 0;
+  int64_t duration_ms = 0;
+};
+
+// One frame-aligned piece of a song, see AudioServiceInterface::LoadSegment
+struct AudioSegment {
+  int id = 0;
+  int64_t offset = 0;       // First byte of the segment in the song file
+  int64_t size = 0;         // Number of bytes in the segment
+  int64_t first_frame = 0;  // First sample frame in the segment
+  int64_t frame_count = 0;  // Number of sample frames in the segment
+  uint32_t crc32 = 0;       // CRC-32 of the segment bytes
+};
+
+// Segments of a song, which together cover every byte of its WAV file
+struct AudioSegmentIndex {
+  std::string resume_token;  // Version of the song the segments belong to
+  int64_t song_size = 0;
+  int sample_rate = 0;
+  int channels = 0;
+  int bytes_per_frame = 0;
+  std::vector<AudioSegment> segments;
+};
+
+// What the client tells the server about itself as a peer, so the server
+// can hand it to other clients that are nearby or play the same songs
+struct PeerAdvertisement {
+  int p2p_port = 0;              // Port of the peer service, 0 if none
+  int64_t uplink_kbps = 0;       // Upload bandwidth, 0 if unknown
+  std::vector<int> cached_songs;  // Songs this client holds
+  int current_song = 0;          // Song being played, 0 if none
+};
+
+// Peers that joined or left the server since the previous update
+struct PeerUpdate {
+  uint64_t epoch = 0;     // Identifies the server run
+  uint64_t sequence = 0;  // Resume a watch from here with the epoch
+  bool reset = false;     // Forget known peers, joined lists all of them
+  std::vector<std::string> joined;  // "ip:p2p_port" of each peer
+  std::vector<std::string> left;
+};
+
+// Callback for the peer updates of a watch
+using PeerUpdateCallback = std::function<void(const PeerUpdate& update)>;
+
 /**
  * Interface for audio service operations
  * This abstracts the gRPC audio_service service to make testing easier
@@ -21,19 +78,100 @@ class AudioServiceInterface {
   // Get the list of available songs from the server
   virtual std::vector<std::string> GetPlaylist() = 0;
 
+  // Get the playlist with the size, content hash and format of every song
+  // Implementations may keep a copy and only fetch what changed since
+  virtual std::vector<SongInfo> GetPlaylistInfo() = 0;
+
   // Load audio data for a specific song
   // The callback will be called for each chunk of audio data received
+  // The song may arrive losslessly encoded, see IsLosslessStream
   virtual bool LoadAudio(int song_num, AudioChunkCallback callback) = 0;
 
-  // Get the list of connected client IPs
+  // Load a whole song like LoadAudio, into data instead of chunk by chunk
+  // Implementations that learn the song's size before it arrives allocate
+  // data once and copy every chunk straight into its place
+  virtual bool LoadAudioInto(int song_num, std::vector<char>* data) {
+    data->clear();
+    return LoadAudio(song_num, [data](const std::vector<char>& chunk) {
+      data->insert(data->end(), chunk.begin(), chunk.end());
+    });
+  }
+
+  // Load `length` bytes of a song starting at byte `offset` (0 = to the end)
+  // Interrupted transfers are resumed from the last received byte
+  virtual bool LoadAudioRange(int song_num, int64_t offset, int64_t length,
+                              AudioChunkCallback callback) = 0;
+
+  // Load a song nobody is waiting to play yet, like LoadAudio but sent by
+  // the server after the streams playback is waiting for
+  // Received into data like LoadAudioInto, gives up and returns false soon
+  // after cancel is set
+  virtual bool PrefetchAudio(int song_num, std::vector<char>* data,
+                             const std::atomic<bool>& cancel) = 0;
+
+  // Tell the server which songs are likely to be played next, most likely
+  // first, so it can have them ready
+  virtual void HintNextSongs(const std::vector<int>& song_nums) = 0;
+
+  // Get the segment index of a song, false if the song cannot be segmented
+  virtual bool GetSegmentIndex(int song_num, AudioSegmentIndex* index) = 0;
+
+  // Load one segment of the song version described by `resume_token` into
+  // `data`, false if it cannot be loaded or fails its checksum
+  virtual bool LoadSegment(int song_num, const AudioSegment& segment,
+                           const std::string& resume_token,
+                           std::vector<char>* data) = 0;
+
+  // Get the addresses of the peers the server picks for this client, at
+  // most a handful, preferring peers that hold the current song
   virtual std::vector<std::string> GetPeerClientIPs() = 0;
 
+  // Advertise this client to the server, sent with every heartbeat
+  virtual void Advertise(const PeerAdvertisement& advertisement) = 0;
+
+  // Receive the peers joining and leaving as the server pushes them,
+  // resuming after the update with epoch and sequence, 0 for a first watch
+  // Blocks until the stream ends or StopWatchingPeers is called
+  virtual bool WatchPeers(uint64_t epoch, uint64_t sequence,
+                          PeerUpdateCallback callback) = 0;
+
+  // End the running WatchPeers call, and any started later
+  virtual void StopWatchingPeers() = 0;
+
   // Check if the server is connected and responding
   virtual bool IsServerConnected() = 0;
 };
 
+// Sample format, rate and channels of the output device
+struct DeviceFormat {
+  bool float_samples = false;  // 32-bit float rather than 16-bit integer
+  int sample_rate = 0;         // 0 keeps the song's rate
+  int channels = 0;            // 1 or 2, 0 keeps the song's channels
+};
+
+// Transfer options of the gRPC audio service
+struct AudioServiceOptions {
+  // Number of concurrent streams LoadAudio splits a song over, 1 downloads
+  // it over a single stream
+  int parallel_streams = 1;
+  // Open a separate connection per stream, so every stream gets its own TCP
+  // congestion and HTTP/2 flow-control window
+  bool separate_channels = true;
+  // Songs per GetPlaylist response. The playlist is kept locally and later
+  // calls only fetch what changed, so only the first fetch needs many pages.
+  int playlist_page_size = 1000;
+  // Send heartbeats so the server keeps listing this client to its peers
+  // while it is idle
+  bool heartbeat = true;
+  // Have the server convert songs to the device's format, so playback needs
+  // no conversion. Converted songs are loaded over a single stream and are
+  // not byte-identical to the server's files.
+  std::optional<DeviceFormat> device_format;
+};
+
 // Factory function to create a concrete implementation
 std::unique_ptr<AudioServiceInterface> CreateAudioService(
-    const std::string& server_address);
+    const std::string& server_address,
+    const AudioServiceOptions& options = AudioServiceOptions());
 
 }  // namespace music262
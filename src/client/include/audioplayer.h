@@ -5,6 +5,7 @@
 #include <CoreAudio/CoreAudio.h>
 #endif
 #include <atomic>
+#include <memory>
 #include <string>
 #include <vector>
 
@@ -33,6 +34,21 @@ class AudioPlayer {
    */
   bool loadFromMemory(const char* data, size_t size);
 
+  /**
+   * @brief Load a song that stays in memory owned by someone else
+   *
+   * The samples are played in place, without copying, and the player keeps
+   * owner alive until another song is loaded. Used to play memory-mapped
+   * songs.
+   *
+   * @param owner keeps data valid while the song is loaded
+   * @param data pointer to the WAV file in memory
+   * @param size size of the WAV file in bytes
+   * @return true if loaded successfully, false otherwise
+   */
+  bool loadShared(std::shared_ptr<const void> owner, const char* data,
+                  size_t size);
+
   /**
    * @brief play a loaded song
    */
@@ -75,11 +91,23 @@ class AudioPlayer {
   const WavHeader& get_header() const { return header; }
 
   /**
-   * @brief Get the audio data
-   * @return The audio data
+   * @brief Get the audio data copied into the player
+   * @return The audio data, empty when playing shared memory
    */
   const std::vector<char>& get_audio_data() const { return audioData; }
 
+  /**
+   * @brief Get the samples being played, wherever they are stored
+   * @return Pointer to the first byte after the WAV header
+   */
+  const char* get_sample_data() const { return sampleData; }
+
+  /**
+   * @brief Get the size of the samples being played
+   * @return Number of bytes after the WAV header
+   */
+  size_t get_sample_size() const { return sampleSize; }
+
   /**
    * @brief Set the current position (for testing)
    * @param position The new position
@@ -101,9 +129,20 @@ class AudioPlayer {
 
   bool setupAudioUnit();
 
+  // Stop playback and release the previous song
+  void unload();
+
+  // Validate the WAV header at data and copy it into header
+  bool readHeader(const char* data, size_t size);
+
   WavHeader header;
   std::vector<char> audioData;
 
+  // Samples being played: audioData, or memory kept alive by sampleOwner
+  const char* sampleData = nullptr;
+  size_t sampleSize = 0;
+  std::shared_ptr<const void> sampleOwner;
+
   std::atomic<bool> playing;
   std::atomic<unsigned int> currentPosition;
 
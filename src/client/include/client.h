@@ -1,13 +1,17 @@
 #pragma once
 
 #include <atomic>
+#include <cstdint>
 #include <memory>
+#include <mutex>
 #include <string>
 #include <vector>
 
 #include "audio_service_interface.h"
 #include "audioplayer.h"
 #include "peer_service_interface.h"
+#include "song_disk_cache.h"
+#include "song_prefetcher.h"
 
 // Forward declaration
 class PeerNetwork;
@@ -21,7 +25,12 @@ class AudioClient {
   // Request the playlist from the server
   std::vector<std::string> GetPlaylist();
 
+  // Request the playlist with the format and content hash of every song
+  std::vector<music262::SongInfo> GetPlaylistInfo();
+
   // Load audio data for a specific song
+  // Nothing is downloaded if the loaded song already has the content hash
+  // the server lists for song_num, or if the disk cache holds it
   bool LoadAudio(int song_num);
 
   // Play the currently loaded audio
@@ -42,6 +51,14 @@ class AudioClient {
   // Get the list of connected client IPs
   std::vector<std::string> GetPeerClientIPs();
 
+  // Receive the peers joining and leaving the server, see
+  // AudioServiceInterface::WatchPeers
+  bool WatchPeers(uint64_t epoch, uint64_t sequence,
+                  music262::PeerUpdateCallback callback);
+
+  // End the running WatchPeers call
+  void StopWatchingPeers();
+
   // Verify connection to the server
   bool IsServerConnected();
 
@@ -51,13 +68,32 @@ class AudioClient {
   // Get reference to the peer network
   std::shared_ptr<PeerNetwork> GetPeerNetwork() { return peer_network_; }
 
-  // Get reference to the audio player's audio data
-  std::vector<char>& GetAudioData() { return audio_data_; }
+  // Get the WAV file of the song loaded from the server, shared with the
+  // player; empty if none was or it plays from the disk cache
+  const std::vector<char>& GetAudioData() const;
 
   // Control whether commands should be broadcast to peers
   void EnablePeerSync(bool enable);
   bool IsPeerSyncEnabled() const { return peer_sync_enabled_; }
 
+  // Advertise this client's peer service to the server, so it can be handed
+  // to other clients; songs loaded from then on are advertised as well
+  void AdvertisePeer(int p2p_port, int64_t uplink_kbps);
+
+  // Keep downloaded songs in a disk cache, nullptr to disable caching
+  void SetDiskCache(std::shared_ptr<SongDiskCache> disk_cache);
+
+  // Songs arrive converted to the output device's format, so they differ
+  // from the files the playlist's content hashes and the disk cache describe
+  void SetConvertedSongs(bool converted) { converted_songs_ = converted; }
+
+  // Download the songs likely played next while one plays, keeping up to
+  // max_bytes of them in memory; 0 songs disables prefetching
+  void EnablePrefetch(size_t songs, size_t max_bytes);
+
+  // Prefetch counters, all zero while prefetching is disabled
+  PrefetchStats GetPrefetchStats() const;
+
   // Set the peer network for command broadcasting
   void SetPeerNetwork(std::shared_ptr<PeerNetwork> peer_network);
 
@@ -68,8 +104,20 @@ class AudioClient {
  private:
   std::unique_ptr<music262::AudioServiceInterface> audio_service_;
   AudioPlayer player_;
-  std::vector<char> audio_data_;
+  std::shared_ptr<const std::vector<char>> audio_data_;  // Played in place
+  uint64_t loaded_hash_{0};  // ContentHash of the loaded song, 0 if none
+  std::atomic<bool> converted_songs_{false};  // Also read by the prefetcher
   int current_song_num_{-1};  // index of last loaded song
+  std::shared_ptr<SongDiskCache> disk_cache_;  // Guarded by disk_cache_mutex_
+  mutable std::mutex disk_cache_mutex_;
+  std::unique_ptr<SongPrefetcher> prefetcher_;  // nullptr if disabled
+  music262::PeerAdvertisement advertisement_;  // Sent to the server
+
+  // Get the disk cache, nullptr if disabled
+  std::shared_ptr<SongDiskCache> GetDiskCache() const;
+
+  // Record a loaded song and advertise it
+  void SongLoaded(int song_num);
 
   // Peer synchronization
   std::shared_ptr<PeerNetwork> peer_network_;
@@ -2,6 +2,9 @@
 
 #include <grpcpp/grpcpp.h>
 
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
 #include <map>
 #include <memory>
 #include <mutex>
@@ -9,7 +12,9 @@
 #include <thread>
 #include <vector>
 
+#include "audio_service_interface.h"
 #include "audio_sync.grpc.pb.h"
+#include "grpc_server_config.h"
 #include "peer_service_interface.h"
 #include "sync_clock.h"
 
@@ -54,8 +59,9 @@ class PeerNetwork {
       std::unique_ptr<music262::PeerServiceInterface> peer_service = nullptr);
   ~PeerNetwork();
 
-  // Start a server to accept peer connections
-  bool StartServer(int port = 50052);
+  // Start a server to accept peer connections, tuned by grpc_config
+  bool StartServer(int port = 50052,
+                   const music262::GrpcServerConfig& grpc_config = {});
 
   // Stop the server
   void StopServer();
@@ -75,6 +81,26 @@ class PeerNetwork {
   // Get list of connected peers
   std::vector<std::string> GetConnectedPeers() const;
 
+  // Default of the most peers connected to from the server's updates
+  static constexpr size_t kDefaultMaxPeers = 8;
+
+  // Follow the peers the server pushes on a background thread. Peers that
+  // join are connected to while fewer than max_peers are connected, peers
+  // that leave are dropped; 0 only keeps track of the peers.
+  void StartWatchingPeers(size_t max_peers = kDefaultMaxPeers);
+
+  // Stop following the server's peer updates
+  void StopWatchingPeers();
+
+  // Check whether the server's peer updates are followed
+  bool IsWatchingPeers() const { return watching_; }
+
+  // Apply one update of the peers on the server
+  void ApplyPeerUpdate(const music262::PeerUpdate& update);
+
+  // Get the peers on the server, connected or not, in the order they joined
+  std::vector<std::string> GetKnownPeers() const;
+
   // Calculate average offset from peers
   float CalculateAverageOffset();
 
@@ -115,6 +141,21 @@ class PeerNetwork {
   std::vector<std::string> connected_peers_;
   mutable std::mutex peers_mutex_;
 
+  // Peers the server announced, guarded by peers_mutex_
+  std::vector<std::string> known_peers_;
+  size_t max_peers_ = kDefaultMaxPeers;
+
+  // Follows the server's peer updates, resuming after the last one received
+  // when the stream drops
+  void WatchPeersLoop();
+  static constexpr std::chrono::seconds kWatchRetry{5};
+  std::thread watch_thread_;
+  std::atomic<bool> watching_{false};
+  std::mutex watch_mutex_;
+  std::condition_variable watch_cv_;
+  uint64_t watch_epoch_ = 0;
+  uint64_t watch_sequence_ = 0;
+
   // Sync clock for time synchronization
   SyncClock sync_clock_;
 };
@@ -0,0 +1,128 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+/**
+ * @brief A song file of the disk cache, mapped read-only into memory
+ *
+ * The mapping stays valid for as long as a reference is held, even if the
+ * song is evicted from the cache in the meantime.
+ */
+class CachedSong {
+ public:
+  ~CachedSong();
+
+  CachedSong(const CachedSong&) = delete;
+  CachedSong& operator=(const CachedSong&) = delete;
+
+  /**
+   * @brief Get a pointer to the first byte of the WAV file
+   */
+  const char* data() const { return data_; }
+
+  /**
+   * @brief Get the size of the WAV file in bytes
+   */
+  size_t size() const { return size_; }
+
+ private:
+  friend class SongDiskCache;
+  CachedSong(const char* data, size_t size) : data_(data), size_(size) {}
+
+  const char* data_;
+  size_t size_;
+};
+
+/**
+ * @brief Content-addressed, size-limited on-disk cache of downloaded songs
+ *
+ * Songs are stored as "<content hash>.wav" files and looked up by the
+ * content hash the server lists in the playlist, so a song that was renamed
+ * or renumbered on the server is still found, and a changed song is never
+ * mistaken for the cached one. When the cache exceeds its budget, the least
+ * recently played songs are deleted. The recency order survives restarts
+ * through the files' modification times.
+ */
+class SongDiskCache {
+ public:
+  /**
+   * @brief Default byte budget of the cache
+   */
+  static constexpr size_t kDefaultMaxBytes = 2048ull * 1024 * 1024;
+
+  /**
+   * @brief Open the cache, indexing the songs already stored in directory
+   *
+   * @param directory Directory holding the cached songs, created if needed
+   * @param max_bytes Byte budget of the cache
+   */
+  SongDiskCache(const std::string& directory,
+                size_t max_bytes = kDefaultMaxBytes);
+
+  /**
+   * @brief Map a cached song into memory
+   *
+   * @param content_hash Content hash of the song
+   * @param size Expected size of the song in bytes
+   * @return std::shared_ptr<const CachedSong> The mapping, nullptr if the
+   * song is not cached
+   */
+  std::shared_ptr<const CachedSong> Get(uint64_t content_hash, size_t size);
+
+  /**
+   * @brief Check whether a song is cached, without mapping it or counting it
+   * as used
+   *
+   * @param content_hash Content hash of the song
+   * @param size Expected size of the song in bytes
+   * @return true if a song of that hash and size is indexed, false otherwise
+   */
+  bool Contains(uint64_t content_hash, size_t size) const;
+
+  /**
+   * @brief Store a song, evicting the least recently used songs if needed
+   *
+   * @param content_hash Content hash of data
+   * @param data The WAV file
+   * @param size Size of the WAV file in bytes
+   * @return true if the song is now cached, false otherwise
+   */
+  bool Put(uint64_t content_hash, const char* data, size_t size);
+
+  /**
+   * @brief Get the number of cached songs
+   */
+  size_t entries() const;
+
+  /**
+   * @brief Get the total size of the cached songs in bytes
+   */
+  size_t bytes_used() const;
+
+ private:
+  struct Entry {
+    size_t size;
+    std::list<uint64_t>::iterator lru;
+  };
+
+  std::string PathFor(uint64_t content_hash) const;
+
+  // Remove a song from the index and the disk
+  void RemoveLocked(uint64_t content_hash);
+
+  // Evict songs until `incoming` more bytes fit into the budget
+  void EvictLocked(size_t incoming);
+
+  std::string directory_;
+  size_t max_bytes_;
+  size_t bytes_used_ = 0;
+  std::list<uint64_t> lru_;  // Least recently used first
+  std::unordered_map<uint64_t, Entry> entries_;
+  mutable std::mutex mutex_;
+};
@@ -0,0 +1,145 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "audio_service_interface.h"
+
+/**
+ * @brief Counters of a SongPrefetcher
+ */
+struct PrefetchStats {
+  uint64_t hits = 0;       // Songs played from the prefetch buffer
+  uint64_t misses = 0;     // Songs played that had not been prefetched
+  uint64_t fetched = 0;    // Songs downloaded ahead of time
+  uint64_t cancelled = 0;  // Downloads dropped for a song played instead
+  size_t entries = 0;      // Songs in the buffer
+  size_t bytes_used = 0;   // Bytes held by the buffer
+};
+
+/**
+ * @brief Downloads the songs a listener is likely to play next while the
+ * current one plays, so the next track starts without waiting
+ *
+ * Whenever a song starts playing, the songs most often played after it so
+ * far are predicted next, followed by the songs after it in the playlist.
+ * The server is told about them so it can have them in memory, and a
+ * background thread downloads them at low priority into an in-memory buffer
+ * with a byte budget. Songs that are no longer predicted are dropped from
+ * the buffer, and playing a song that was not predicted cancels the running
+ * download so it does not compete with the song the listener waits for.
+ */
+class SongPrefetcher {
+ public:
+  /**
+   * @brief Returns true for songs that are available without downloading
+   * them, e.g. from a disk cache
+   */
+  using LocalCheck = std::function<bool(const music262::SongInfo& song)>;
+
+  /**
+   * @brief Default number of songs prefetched
+   */
+  static constexpr size_t kDefaultSongs = 1;
+
+  /**
+   * @brief Default byte budget of the prefetch buffer
+   */
+  static constexpr size_t kDefaultMaxBytes = 256ull * 1024 * 1024;
+
+  /**
+   * @brief Start the prefetch thread
+   *
+   * @param audio_service Service to download from, must outlive the
+   * prefetcher
+   * @param songs Number of songs predicted and prefetched
+   * @param max_bytes Byte budget of the buffer, 0 only hints the server
+   * @param is_local Songs for which it returns true are not downloaded, may
+   * be empty
+   */
+  SongPrefetcher(music262::AudioServiceInterface* audio_service,
+                 size_t songs = kDefaultSongs,
+                 size_t max_bytes = kDefaultMaxBytes,
+                 LocalCheck is_local = nullptr);
+
+  /**
+   * @brief Cancel the running download and stop the prefetch thread
+   */
+  ~SongPrefetcher();
+
+  SongPrefetcher(const SongPrefetcher&) = delete;
+  SongPrefetcher& operator=(const SongPrefetcher&) = delete;
+
+  /**
+   * @brief Record that a song started playing and prefetch what may follow
+   *
+   * @param song_num The song
+   */
+  void SongPlayed(int song_num);
+
+  /**
+   * @brief Take a prefetched song out of the buffer
+   *
+   * Waits for the song if it is being downloaded. A song that was not
+   * prefetched cancels the running download.
+   *
+   * @param song_num The song
+   * @param data Receives the song as a WAV file, already decoded
+   * @return true if the song was prefetched, false otherwise
+   */
+  bool Take(int song_num, std::vector<char>* data);
+
+  /**
+   * @brief Predict the songs played after a song
+   *
+   * @param song_num Song playing
+   * @param playlist Playlist of the server
+   * @return std::vector<int> Up to the configured number of songs, most
+   * likely first
+   */
+  std::vector<int> Predict(
+      int song_num, const std::vector<music262::SongInfo>& playlist) const;
+
+  /**
+   * @brief Get a snapshot of the prefetch counters
+   */
+  PrefetchStats GetStats() const;
+
+ private:
+  // Prefetch thread loop
+  void Run();
+
+  // Download the predicted songs that are missing, until done or the plan
+  // changes
+  void FetchPredicted(std::unique_lock<std::mutex>& lock,
+                      const std::vector<music262::SongInfo>& playlist);
+
+  music262::AudioServiceInterface* audio_service_;
+  size_t songs_;
+  size_t max_bytes_;
+  LocalCheck is_local_;
+
+  // How often each song was played after another, by the song before
+  std::map<int, std::map<int, uint32_t>> transitions_;
+  int last_played_ = 0;
+  int played_ = 0;           // Song to predict from, 0 once planned
+  std::vector<int> wanted_;  // Songs predicted for the current song
+
+  std::map<int, std::vector<char>> buffer_;
+  size_t bytes_used_ = 0;
+  int in_flight_ = 0;  // Song being downloaded, 0 if none
+  std::atomic<bool> cancel_{false};
+  PrefetchStats stats_;
+
+  bool stop_ = false;
+  mutable std::mutex mutex_;
+  std::condition_variable cv_;
+  std::thread thread_;
+};
@@ -10,6 +10,12 @@
  * specification.
  */
 
+/**
+ * @brief audioFormat of 32-bit IEEE float samples, as sent by servers that
+ * convert songs to the output device's format
+ */
+constexpr unsigned short kWavFormatFloat = 3;
+
 /**
  * @struct WavHeader
  * @brief Structure representing a standard WAV file header
@@ -1,6 +1,9 @@
+#include <cstdint>
 #include <cstdlib>
+#include <iomanip>
 #include <iostream>
 #include <memory>
+#include <sstream>
 #include <string>
 #include <vector>
 
@@ -11,7 +14,8 @@
 // Factory function to create an AudioClient with real gRPC service
 // implementations
 std::unique_ptr<AudioClient> CreateAudioClient(
-    const std::string& server_address);
+    const std::string& server_address,
+    const music262::AudioServiceOptions& service_options);
 
 void PrintUsage() {
   std::cout << "Usage: \n"
@@ -20,7 +24,7 @@ void PrintUsage() {
             << "  pause - Pause the currently playing song\n"
             << "  resume - Resume the currently paused song\n"
             << "  stop - Stop the currently playing song\n"
-            << "  peers - Get list of connected peers from server\n"
+            << "  peers - List the peers the server announced\n"
             << "  join <ip:port> - Join a peer for synchronized playback\n"
             << "  leave <ip:port> - Leave a connected peer\n"
             << "  connections - List all active peer connections\n"
@@ -29,6 +33,24 @@ void PrintUsage() {
             << "  quit - Exit the client\n";
 }
 
+// Parse a device format given as s16|f32[:rate[:channels]]
+bool ParseDeviceFormat(const std::string& text,
+                       music262::DeviceFormat* format) {
+  std::stringstream stream(text);
+  std::string sample_format, rate, channels;
+  std::getline(stream, sample_format, ':');
+  std::getline(stream, rate, ':');
+  std::getline(stream, channels, ':');
+  if (sample_format != "s16" && sample_format != "f32") {
+    return false;
+  }
+  format->float_samples = sample_format == "f32";
+  format->sample_rate = rate.empty() ? 0 : std::atoi(rate.c_str());
+  format->channels = channels.empty() ? 0 : std::atoi(channels.c_str());
+  return format->sample_rate >= 0 && format->channels >= 0 &&
+         format->channels <= 2;
+}
+
 int main(int argc, char** argv) {
   // Initialize logger
   Logger::init("music_client");
@@ -37,22 +59,85 @@ int main(int argc, char** argv) {
   const char* env_addr = std::getenv("MUSIC262_SERVER_ADDRESS");
   std::string server_address = env_addr ? env_addr : "localhost:50051";
   int p2p_port = 50052;
+  int64_t uplink_kbps = 0;
+  size_t max_peers = PeerNetwork::kDefaultMaxPeers;
+  music262::AudioServiceOptions service_options;
+  music262::GrpcServerConfig grpc_config;
+  const char* home = std::getenv("HOME");
+  std::string cache_dir = std::string(home ? home : ".") + "/.music262/cache";
+  size_t cache_mb = SongDiskCache::kDefaultMaxBytes / (1024 * 1024);
+  size_t prefetch_songs = SongPrefetcher::kDefaultSongs;
+  size_t prefetch_mb = SongPrefetcher::kDefaultMaxBytes / (1024 * 1024);
 
-  // Parse command line arguments
-  for (int i = 1; i < argc; i++) {
-    std::string arg = argv[i];
-    if (arg == "--server" && i + 1 < argc) {
-      server_address = argv[++i];
-    } else if (arg == "--p2p-port" && i + 1 < argc) {
-      p2p_port = std::stoi(argv[++i]);
+  // Parse command line arguments, a config file's flags are read in its
+  // place so later flags override them
+  std::vector<std::string> args(argv + 1, argv + argc);
+  for (size_t i = 0; i < args.size(); i++) {
+    std::string arg = args[i];
+    if (arg == "--config" && i + 1 < args.size()) {
+      std::string config_file = args[++i];
+      std::vector<std::string> file_args;
+      std::string error;
+      if (!music262::ReadConfigFile(config_file, &file_args, &error)) {
+        std::cerr << "Cannot read config file: " << error << std::endl;
+        return 1;
+      }
+      args.insert(args.begin() + i + 1, file_args.begin(), file_args.end());
+    } else if (arg.rfind("--grpc-", 0) == 0 && i + 1 < args.size()) {
+      // Settings of the peer server
+      if (!grpc_config.Set(arg.substr(2), args[i + 1])) {
+        std::cerr << "Invalid gRPC setting " << arg << " " << args[i + 1]
+                  << std::endl;
+        return 1;
+      }
+      i++;
+    } else if (arg == "--server" && i + 1 < args.size()) {
+      server_address = args[++i];
+    } else if (arg == "--p2p-port" && i + 1 < args.size()) {
+      p2p_port = std::stoi(args[++i]);
+    } else if (arg == "--uplink-kbps" && i + 1 < args.size()) {
+      uplink_kbps = std::stoll(args[++i]);
+    } else if (arg == "--max-peers" && i + 1 < args.size()) {
+      max_peers = std::stoul(args[++i]);
+    } else if (arg == "--streams" && i + 1 < args.size()) {
+      service_options.parallel_streams = std::stoi(args[++i]);
+    } else if (arg == "--shared-channel") {
+      service_options.separate_channels = false;
+    } else if (arg == "--cache-dir" && i + 1 < args.size()) {
+      cache_dir = args[++i];
+    } else if (arg == "--cache-mb" && i + 1 < args.size()) {
+      cache_mb = std::stoul(args[++i]);
+    } else if (arg == "--no-cache") {
+      cache_mb = 0;
+    } else if (arg == "--prefetch-songs" && i + 1 < args.size()) {
+      prefetch_songs = std::stoul(args[++i]);
+    } else if (arg == "--prefetch-mb" && i + 1 < args.size()) {
+      prefetch_mb = std::stoul(args[++i]);
+    } else if (arg == "--device-format" && i + 1 < args.size()) {
+      music262::DeviceFormat format;
+      if (!ParseDeviceFormat(args[++i], &format)) {
+        std::cerr << "Invalid device format: " << args[i]
+                  << " (expected s16|f32[:rate[:channels]])" << std::endl;
+        return 1;
+      }
+      service_options.device_format = format;
     }
   }
 
   // Create the client using the factory function
   LOG_INFO("Connecting to server at {}", server_address);
-  auto client_ptr = CreateAudioClient(server_address);
+  auto client_ptr = CreateAudioClient(server_address, service_options);
   AudioClient& client = *client_ptr;
 
+  // Keep downloaded songs across runs
+  if (cache_mb > 0) {
+    client.SetDiskCache(
+        std::make_shared<SongDiskCache>(cache_dir, cache_mb * 1024 * 1024));
+  }
+
+  // Download the next song while one plays, so it starts without waiting
+  client.EnablePrefetch(prefetch_songs, prefetch_mb * 1024 * 1024);
+
   // Verify server connection and display status to the user
   if (client.IsServerConnected()) {
     std::cout << "Successfully connected to server at " << server_address
@@ -66,9 +151,11 @@ int main(int argc, char** argv) {
   auto peer_network = client.GetPeerNetwork();
 
   // Start peer server automatically
-  if (peer_network->StartServer(p2p_port)) {
+  if (peer_network->StartServer(p2p_port, grpc_config)) {
     LOG_INFO("P2P server started on port {}", p2p_port);
     std::cout << "P2P server started on port " << p2p_port << std::endl;
+    // Let the server hand this client to others as a peer
+    client.AdvertisePeer(p2p_port, uplink_kbps);
   } else {
     LOG_ERROR("Failed to start P2P server on port {}", p2p_port);
     std::cout
@@ -79,6 +166,9 @@ int main(int argc, char** argv) {
   // Enable peer sync by default
   client.EnablePeerSync(true);
 
+  // Learn about peers as the server pushes them instead of polling
+  peer_network->StartWatchingPeers(max_peers);
+
   bool running = true;
   std::string command;
 
@@ -90,15 +180,32 @@ int main(int argc, char** argv) {
     std::getline(std::cin, command);
 
     if (command == "playlist") {
-      std::vector<std::string> playlist = client.GetPlaylist();
+      std::vector<music262::SongInfo> playlist = client.GetPlaylistInfo();
 
       std::cout << "Available songs:" << std::endl;
-      if (playlist.empty()) {
-        std::cout << "No songs available on the server." << std::endl;
-      } else {
-        for (size_t i = 0; i < playlist.size(); i++) {
-          std::cout << i + 1 << ". " << playlist[i] << std::endl;
+      bool any = false;
+      for (const auto& song : playlist) {
+        if (song.name.empty()) {
+          continue;  // Removed from the server
         }
+        any = true;
+        std::cout << song.id << ". " << song.name;
+        if (song.sample_rate > 0) {
+          int64_t seconds = song.duration_ms / 1000;
+          std::cout << " (" << seconds / 60 << ":" << std::setw(2)
+                    << std::setfill('0') << seconds % 60 << std::setfill(' ')
+                    << ", " << song.sample_rate << " Hz, "
+                    << song.bits_per_sample << "-bit, "
+                    << (song.channels == 1   ? "mono"
+                        : song.channels == 2 ? "stereo"
+                                             : std::to_string(song.channels) +
+                                                   " channels")
+                    << ")";
+        }
+        std::cout << std::endl;
+      }
+      if (!any) {
+        std::cout << "No songs available on the server." << std::endl;
       }
     } else if (command.substr(0, 5) == "play ") {
       int song_num = std::stoi(command.substr(5));
@@ -117,7 +224,9 @@ int main(int argc, char** argv) {
       client.Stop();
       std::cout << "Playback stopped." << std::endl;
     } else if (command == "peers") {
-      std::vector<std::string> peers = client.GetPeerClientIPs();
+      std::vector<std::string> peers = peer_network->IsWatchingPeers()
+                                           ? peer_network->GetKnownPeers()
+                                           : client.GetPeerClientIPs();
 
       std::cout << "Clients connected to server:" << std::endl;
       if (peers.empty()) {
@@ -2,6 +2,7 @@
 
 #include <ifaddrs.h>
 
+#include <algorithm>
 #include <chrono>
 
 #include "include/client.h"
@@ -191,13 +192,15 @@ PeerNetwork::PeerNetwork(
 
 PeerNetwork::~PeerNetwork() {
   LOG_DEBUG("PeerNetwork shutting down");
+  StopWatchingPeers();
   // Notify peers that we are exiting
   BroadcastExit();
   StopServer();
   DisconnectFromAllPeers();
 }
 
-bool PeerNetwork::StartServer(int port) {
+bool PeerNetwork::StartServer(int port,
+                              const music262::GrpcServerConfig& grpc_config) {
   if (server_running_) {
     LOG_INFO("Peer server already running on port {}", server_port_);
     return true;
@@ -213,6 +216,7 @@ bool PeerNetwork::StartServer(int port) {
   grpc::ServerBuilder builder;
 
   builder.AddListeningPort(server_address, grpc::InsecureServerCredentials());
+  grpc_config.Apply(&builder);
   builder.RegisterService(service_.get());
 
   LOG_INFO("Starting peer server on {}", server_address);
@@ -315,6 +319,109 @@ std::vector<std::string> PeerNetwork::GetConnectedPeers() const {
   return connected_peers_;
 }
 
+void PeerNetwork::StartWatchingPeers(size_t max_peers) {
+  if (watch_thread_.joinable()) {
+    return;
+  }
+  {
+    std::lock_guard<std::mutex> lock(peers_mutex_);
+    max_peers_ = max_peers;
+  }
+  watching_ = true;
+  watch_thread_ = std::thread(&PeerNetwork::WatchPeersLoop, this);
+}
+
+void PeerNetwork::StopWatchingPeers() {
+  if (!watch_thread_.joinable()) {
+    return;
+  }
+  {
+    std::lock_guard<std::mutex> lock(watch_mutex_);
+    watching_ = false;
+  }
+  watch_cv_.notify_all();
+  client_->StopWatchingPeers();
+  watch_thread_.join();
+}
+
+void PeerNetwork::WatchPeersLoop() {
+  LOG_DEBUG("Watching peers on the server");
+  while (watching_) {
+    client_->WatchPeers(watch_epoch_, watch_sequence_,
+                        [this](const music262::PeerUpdate& update) {
+                          watch_epoch_ = update.epoch;
+                          watch_sequence_ = update.sequence;
+                          ApplyPeerUpdate(update);
+                        });
+
+    std::unique_lock<std::mutex> lock(watch_mutex_);
+    watch_cv_.wait_for(lock, kWatchRetry, [this]() { return !watching_; });
+  }
+}
+
+void PeerNetwork::ApplyPeerUpdate(const music262::PeerUpdate& update) {
+  std::vector<std::string> candidates;
+  size_t max_peers;
+  {
+    std::lock_guard<std::mutex> lock(peers_mutex_);
+    if (update.reset) {
+      // The list replaces everything known, e.g. after the server restarted,
+      // so peers missing from it left while nobody was watching
+      known_peers_.clear();
+      auto departed = std::remove_if(
+          connected_peers_.begin(), connected_peers_.end(),
+          [&update](const std::string& peer) {
+            return std::find(update.joined.begin(), update.joined.end(),
+                             peer) == update.joined.end();
+          });
+      for (auto it = departed; it != connected_peers_.end(); ++it) {
+        LOG_INFO("Peer no longer on the server: {}", *it);
+      }
+      connected_peers_.erase(departed, connected_peers_.end());
+    }
+    for (const auto& peer : update.left) {
+      known_peers_.erase(
+          std::remove(known_peers_.begin(), known_peers_.end(), peer),
+          known_peers_.end());
+      auto it = std::find(connected_peers_.begin(), connected_peers_.end(),
+                          peer);
+      if (it != connected_peers_.end()) {
+        connected_peers_.erase(it);
+        LOG_INFO("Peer left the server: {}", peer);
+      }
+    }
+    for (const auto& peer : update.joined) {
+      if (std::find(known_peers_.begin(), known_peers_.end(), peer) ==
+          known_peers_.end()) {
+        known_peers_.push_back(peer);
+      }
+    }
+
+    // Fill free connection slots, peers that failed before are retried
+    for (const auto& peer : known_peers_) {
+      if (std::find(connected_peers_.begin(), connected_peers_.end(), peer) ==
+          connected_peers_.end()) {
+        candidates.push_back(peer);
+      }
+    }
+    max_peers = max_peers_;
+  }
+
+  LOG_INFO("Peer update {}: {} joined, {} left", update.sequence,
+           update.joined.size(), update.left.size());
+  for (const auto& peer : candidates) {
+    if (GetConnectedPeers().size() >= max_peers) {
+      break;
+    }
+    ConnectToPeer(peer);
+  }
+}
+
+std::vector<std::string> PeerNetwork::GetKnownPeers() const {
+  std::lock_guard<std::mutex> lock(peers_mutex_);
+  return known_peers_;
+}
+
 float PeerNetwork::CalculateAverageOffset() {
   std::vector<std::string> peer_list;
   {
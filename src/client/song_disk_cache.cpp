@@ -0,0 +1,223 @@
+#include "include/song_disk_cache.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
+#include <vector>
+
+#include "logger.h"
+
+namespace fs = std::filesystem;
+
+namespace {
+
+constexpr const char* kSongExtension = ".wav";
+
+// Parse "<16 hex digits>.wav" back into a content hash
+bool ParseSongFileName(const std::string& name, uint64_t* content_hash) {
+  if (name.size() != 16 + 4 || name.compare(16, 4, kSongExtension) != 0) {
+    return false;
+  }
+  uint64_t hash = 0;
+  for (int i = 0; i < 16; i++) {
+    char c = name[i];
+    int digit = c >= '0' && c <= '9'   ? c - '0'
+                : c >= 'a' && c <= 'f' ? c - 'a' + 10
+                                       : -1;
+    if (digit < 0) {
+      return false;
+    }
+    hash = hash << 4 | static_cast<uint64_t>(digit);
+  }
+  *content_hash = hash;
+  return true;
+}
+
+}  // namespace
+
+CachedSong::~CachedSong() {
+  if (data_ && size_ > 0) {
+    munmap(const_cast<char*>(data_), size_);
+  }
+}
+
+SongDiskCache::SongDiskCache(const std::string& directory, size_t max_bytes)
+    : directory_(directory), max_bytes_(max_bytes) {
+  std::error_code ec;
+  fs::create_directories(directory_, ec);
+  if (ec) {
+    LOG_ERROR("Cannot create song cache directory {}: {}", directory_,
+              ec.message());
+    return;
+  }
+
+  // Rebuild the recency order from the modification times, which Get
+  // refreshes whenever a song is played
+  struct Found {
+    uint64_t content_hash;
+    size_t size;
+    fs::file_time_type used;
+  };
+  std::vector<Found> found;
+  for (const auto& entry : fs::directory_iterator(directory_, ec)) {
+    std::string name = entry.path().filename().string();
+    uint64_t content_hash = 0;
+    if (!entry.is_regular_file(ec)) {
+      continue;
+    }
+    if (!ParseSongFileName(name, &content_hash)) {
+      // Leftover of an interrupted Put
+      if (entry.path().extension() == ".tmp") {
+        fs::remove(entry.path(), ec);
+      }
+      continue;
+    }
+    found.push_back({content_hash, static_cast<size_t>(entry.file_size(ec)),
+                     entry.last_write_time(ec)});
+  }
+  std::sort(found.begin(), found.end(),
+            [](const Found& a, const Found& b) { return a.used < b.used; });
+
+  std::lock_guard<std::mutex> lock(mutex_);
+  for (const auto& song : found) {
+    lru_.push_back(song.content_hash);
+    entries_[song.content_hash] = {song.size, std::prev(lru_.end())};
+    bytes_used_ += song.size;
+  }
+  EvictLocked(0);
+  LOG_INFO("Song cache {}: {} songs, {} of {} MB", directory_, entries_.size(),
+           bytes_used_ / (1024 * 1024), max_bytes_ / (1024 * 1024));
+}
+
+std::shared_ptr<const CachedSong> SongDiskCache::Get(uint64_t content_hash,
+                                                     size_t size) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto it = entries_.find(content_hash);
+  if (it == entries_.end()) {
+    return nullptr;
+  }
+
+  std::string path = PathFor(content_hash);
+  if (it->second.size != size || size == 0) {
+    LOG_WARN("Cached song {} has the wrong size, dropping it", path);
+    RemoveLocked(content_hash);
+    return nullptr;
+  }
+
+  int fd = open(path.c_str(), O_RDONLY);
+  struct stat st;
+  if (fd < 0 || fstat(fd, &st) != 0 ||
+      static_cast<size_t>(st.st_size) != size) {
+    LOG_WARN("Cached song {} is missing or truncated, dropping it", path);
+    if (fd >= 0) {
+      close(fd);
+    }
+    RemoveLocked(content_hash);
+    return nullptr;
+  }
+  void* data = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED) {
+    LOG_ERROR("Failed to map cached song {}", path);
+    return nullptr;
+  }
+  madvise(data, size, MADV_SEQUENTIAL);
+
+  // Record the use on disk so the order survives restarts
+  lru_.splice(lru_.end(), lru_, it->second.lru);
+  utimes(path.c_str(), nullptr);
+
+  return std::shared_ptr<const CachedSong>(
+      new CachedSong(static_cast<const char*>(data), size));
+}
+
+bool SongDiskCache::Contains(uint64_t content_hash, size_t size) const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto it = entries_.find(content_hash);
+  return it != entries_.end() && it->second.size == size && size > 0;
+}
+
+bool SongDiskCache::Put(uint64_t content_hash, const char* data, size_t size) {
+  if (size == 0 || size > max_bytes_) {
+    return false;
+  }
+
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto it = entries_.find(content_hash);
+  if (it != entries_.end() && it->second.size == size) {
+    lru_.splice(lru_.end(), lru_, it->second.lru);
+    return true;
+  }
+  if (it != entries_.end()) {
+    RemoveLocked(content_hash);
+  }
+  EvictLocked(size);
+
+  // Write to a temporary file first so a crash never leaves a partial song
+  // under its final name
+  std::string path = PathFor(content_hash);
+  std::string tmp_path = path + ".tmp";
+  {
+    std::ofstream file(tmp_path, std::ios::binary | std::ios::trunc);
+    file.write(data, static_cast<std::streamsize>(size));
+    if (!file) {
+      LOG_ERROR("Failed to write song cache file {}", tmp_path);
+      std::remove(tmp_path.c_str());
+      return false;
+    }
+  }
+  if (std::rename(tmp_path.c_str(), path.c_str()) != 0) {
+    LOG_ERROR("Failed to move song cache file into place: {}", path);
+    std::remove(tmp_path.c_str());
+    return false;
+  }
+
+  lru_.push_back(content_hash);
+  entries_[content_hash] = {size, std::prev(lru_.end())};
+  bytes_used_ += size;
+  LOG_DEBUG("Cached song {} ({} bytes)", path, size);
+  return true;
+}
+
+size_t SongDiskCache::entries() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return entries_.size();
+}
+
+size_t SongDiskCache::bytes_used() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return bytes_used_;
+}
+
+std::string SongDiskCache::PathFor(uint64_t content_hash) const {
+  char name[32];
+  snprintf(name, sizeof(name), "%016llx%s",
+           static_cast<unsigned long long>(content_hash), kSongExtension);
+  return (fs::path(directory_) / name).string();
+}
+
+void SongDiskCache::RemoveLocked(uint64_t content_hash) {
+  auto it = entries_.find(content_hash);
+  if (it == entries_.end()) {
+    return;
+  }
+  // Mapped copies stay readable until they are unmapped
+  std::remove(PathFor(content_hash).c_str());
+  bytes_used_ -= it->second.size;
+  lru_.erase(it->second.lru);
+  entries_.erase(it);
+}
+
+void SongDiskCache::EvictLocked(size_t incoming) {
+  while (!lru_.empty() && bytes_used_ + incoming > max_bytes_) {
+    LOG_DEBUG("Evicting song {} from the song cache", PathFor(lru_.front()));
+    RemoveLocked(lru_.front());
+  }
+}
@@ -0,0 +1,195 @@
+#include "include/song_prefetcher.h"
+
+#include <algorithm>
+#include <utility>
+
+#include "logger.h"
+#include "lossless_codec.h"
+
+SongPrefetcher::SongPrefetcher(music262::AudioServiceInterface* audio_service,
+                               size_t songs, size_t max_bytes,
+                               LocalCheck is_local)
+    : audio_service_(audio_service),
+      songs_(songs),
+      max_bytes_(max_bytes),
+      is_local_(std::move(is_local)) {
+  thread_ = std::thread(&SongPrefetcher::Run, this);
+}
+
+SongPrefetcher::~SongPrefetcher() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stop_ = true;
+    cancel_ = true;
+  }
+  cv_.notify_all();
+  thread_.join();
+}
+
+void SongPrefetcher::SongPlayed(int song_num) {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (last_played_ != 0 && last_played_ != song_num) {
+      transitions_[last_played_][song_num]++;
+    }
+    last_played_ = song_num;
+    played_ = song_num;
+  }
+  cv_.notify_all();
+}
+
+bool SongPrefetcher::Take(int song_num, std::vector<char>* data) {
+  std::unique_lock<std::mutex> lock(mutex_);
+  cv_.wait(lock, [this, song_num]() { return in_flight_ != song_num; });
+
+  auto it = buffer_.find(song_num);
+  if (it == buffer_.end()) {
+    // The listener went elsewhere, leave the connection to that song
+    stats_.misses++;
+    wanted_.clear();
+    if (in_flight_ != 0) {
+      cancel_ = true;
+    }
+    return false;
+  }
+  LOG_INFO("Playing song {} from the prefetch buffer", song_num);
+  stats_.hits++;
+  bytes_used_ -= it->second.size();
+  *data = std::move(it->second);
+  buffer_.erase(it);
+  return true;
+}
+
+std::vector<int> SongPrefetcher::Predict(
+    int song_num, const std::vector<music262::SongInfo>& playlist) const {
+  std::vector<int> predicted;
+  auto add = [&](int next) {
+    if (predicted.size() < songs_ && next != song_num && next >= 1 &&
+        next <= static_cast<int>(playlist.size()) &&
+        !playlist[next - 1].name.empty() &&
+        std::find(predicted.begin(), predicted.end(), next) ==
+            predicted.end()) {
+      predicted.push_back(next);
+    }
+  };
+
+  // Songs this listener played after it before, most often first
+  std::vector<std::pair<uint32_t, int>> learned;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = transitions_.find(song_num);
+    if (it != transitions_.end()) {
+      for (const auto& [next, count] : it->second) {
+        learned.emplace_back(count, next);
+      }
+    }
+  }
+  std::stable_sort(
+      learned.begin(), learned.end(),
+      [](const auto& a, const auto& b) { return a.first > b.first; });
+  for (const auto& [count, next] : learned) {
+    add(next);
+  }
+
+  // Then the playlist order, wrapping around at its end
+  int songs = static_cast<int>(playlist.size());
+  for (int i = 1; i < songs && predicted.size() < songs_; i++) {
+    add((song_num - 1 + i) % songs + 1);
+  }
+  return predicted;
+}
+
+PrefetchStats SongPrefetcher::GetStats() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  PrefetchStats stats = stats_;
+  stats.entries = buffer_.size();
+  stats.bytes_used = bytes_used_;
+  return stats;
+}
+
+void SongPrefetcher::Run() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  while (true) {
+    cv_.wait(lock, [this]() { return stop_ || played_ != 0; });
+    if (stop_) {
+      return;
+    }
+    int song_num = played_;
+    played_ = 0;
+    lock.unlock();
+
+    std::vector<music262::SongInfo> playlist =
+        audio_service_->GetPlaylistInfo();
+    std::vector<int> wanted = Predict(song_num, playlist);
+    if (!wanted.empty()) {
+      audio_service_->HintNextSongs(wanted);
+    }
+
+    lock.lock();
+    wanted_ = wanted;
+    for (auto it = buffer_.begin(); it != buffer_.end();) {
+      if (std::find(wanted_.begin(), wanted_.end(), it->first) ==
+          wanted_.end()) {
+        LOG_DEBUG("Dropping prefetched song {}, no longer expected",
+                  it->first);
+        bytes_used_ -= it->second.size();
+        it = buffer_.erase(it);
+      } else {
+        ++it;
+      }
+    }
+    FetchPredicted(lock, playlist);
+  }
+}
+
+void SongPrefetcher::FetchPredicted(
+    std::unique_lock<std::mutex>& lock,
+    const std::vector<music262::SongInfo>& playlist) {
+  // A newly played song or one that was not predicted changes the plan
+  auto still_wanted = [this](int song_num) {
+    return !stop_ && played_ == 0 &&
+           std::find(wanted_.begin(), wanted_.end(), song_num) !=
+               wanted_.end();
+  };
+
+  std::vector<int> wanted = wanted_;
+  for (int song_num : wanted) {
+    const music262::SongInfo& song = playlist[song_num - 1];
+    if (!still_wanted(song_num) || buffer_.count(song_num) ||
+        bytes_used_ + static_cast<size_t>(song.size) > max_bytes_) {
+      continue;
+    }
+    lock.unlock();
+    bool local = is_local_ && is_local_(song);
+    lock.lock();
+    if (local || !still_wanted(song_num)) {
+      continue;
+    }
+
+    in_flight_ = song_num;
+    cancel_ = false;
+    lock.unlock();
+
+    std::vector<char> data;
+    bool success = audio_service_->PrefetchAudio(song_num, &data, cancel_);
+    if (success && music262::IsLosslessStream(data.data(), data.size())) {
+      std::vector<char> wav;
+      success = music262::DecodeLossless(data.data(), data.size(), &wav);
+      data = std::move(wav);
+    }
+
+    lock.lock();
+    in_flight_ = 0;
+    if (cancel_) {
+      stats_.cancelled++;
+    } else if (!success) {
+      LOG_WARN("Failed to prefetch song {}", song_num);
+    } else if (bytes_used_ + data.size() <= max_bytes_) {
+      LOG_DEBUG("Prefetched song {} ({} bytes)", song_num, data.size());
+      stats_.fetched++;
+      bytes_used_ += data.size();
+      buffer_[song_num] = std::move(data);
+    }
+    cv_.notify_all();
+  }
+}
@@ -0,0 +1,184 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+/**
+ * @brief MSB-first bit writer used by the lossless encoder
+ */
+class BitWriter {
+ public:
+  /**
+   * @brief Append the low `bits` bits of a value
+   *
+   * @param value Value to write
+   * @param bits Number of bits to write, at most 32
+   */
+  void Write(uint32_t value, int bits) {
+    if (bits == 0) {
+      return;
+    }
+    uint64_t mask = (uint64_t{1} << bits) - 1;
+    accumulator_ = (accumulator_ << bits) | (value & mask);
+    pending_bits_ += bits;
+    while (pending_bits_ >= 8) {
+      pending_bits_ -= 8;
+      bytes_.push_back(static_cast<uint8_t>(accumulator_ >> pending_bits_));
+    }
+  }
+
+  /**
+   * @brief Append `zeros` zero bits followed by a one bit
+   */
+  void WriteUnary(uint32_t zeros) {
+    while (zeros >= 32) {
+      Write(0, 32);
+      zeros -= 32;
+    }
+    Write(1, zeros + 1);
+  }
+
+  /**
+   * @brief Append a Rice code with parameter k
+   */
+  void WriteRice(uint32_t value, int k) {
+    WriteUnary(value >> k);
+    Write(value, k);
+  }
+
+  /**
+   * @brief Pad with zero bits up to the next byte boundary
+   */
+  void AlignToByte() {
+    if (pending_bits_ > 0) {
+      Write(0, 8 - pending_bits_);
+    }
+  }
+
+  /**
+   * @brief Get the bytes written so far, call AlignToByte first
+   */
+  const std::vector<uint8_t>& bytes() const { return bytes_; }
+
+ private:
+  uint64_t accumulator_ = 0;
+  int pending_bits_ = 0;
+  std::vector<uint8_t> bytes_;
+};
+
+/**
+ * @brief MSB-first bit reader used by the lossless decoder
+ *
+ * Reads past the end of the buffer return zero bits and clear ok(), so a
+ * truncated or corrupt frame is detected once it has been parsed.
+ */
+class BitReader {
+ public:
+  BitReader(const uint8_t* data, size_t size)
+      : data_(data), size_(size), total_bits_(uint64_t{size} * 8) {}
+
+  /**
+   * @brief Read an unsigned value of `bits` bits, at most 32
+   */
+  uint32_t Read(int bits) {
+    if (bits == 0) {
+      return 0;
+    }
+    Refill();
+    uint32_t value = static_cast<uint32_t>(cache_ >> (64 - bits));
+    Consume(bits);
+    return value;
+  }
+
+  /**
+   * @brief Read a two's complement signed value of `bits` bits
+   */
+  int32_t ReadSigned(int bits) {
+    uint32_t value = Read(bits);
+    uint32_t sign = uint32_t{1} << (bits - 1);
+    return static_cast<int32_t>((value ^ sign) - sign);
+  }
+
+  /**
+   * @brief Count zero bits up to and including the next one bit
+   */
+  uint32_t ReadUnary() {
+    uint32_t zeros = 0;
+    while (ok()) {
+      Refill();
+      if (cache_ != 0) {
+        int leading = __builtin_clzll(cache_);
+        if (leading < cache_bits_) {
+          zeros += leading;
+          Consume(leading + 1);
+          return zeros;
+        }
+      }
+      zeros += cache_bits_;
+      Consume(cache_bits_);
+    }
+    return zeros;
+  }
+
+  /**
+   * @brief Read a Rice code with parameter k
+   */
+  uint32_t ReadRice(int k) {
+    // Fast path: the whole code is already in the cache
+    Refill();
+    if (cache_ != 0) {
+      int leading = __builtin_clzll(cache_);
+      if (leading + 1 + k <= cache_bits_) {
+        uint64_t rest = (cache_ << leading) << 1;
+        uint32_t low = k > 0 ? static_cast<uint32_t>(rest >> (64 - k)) : 0;
+        Consume(leading + 1 + k);
+        return (static_cast<uint32_t>(leading) << k) | low;
+      }
+    }
+    uint32_t high = ReadUnary();
+    return (high << k) | Read(k);
+  }
+
+  /**
+   * @brief Check that no read went past the end of the buffer
+   */
+  bool ok() const { return consumed_bits_ <= total_bits_; }
+
+ private:
+  // Top up the cache to at least 57 bits. Bits below cache_bits_ may already
+  // hold the following data, which later refills overwrite with itself.
+  void Refill() {
+    if (cache_bits_ <= 56 && position_ + 8 <= size_) {
+      uint64_t word = 0;
+      for (int i = 0; i < 8; i++) {
+        word = (word << 8) | data_[position_ + i];
+      }
+      cache_ |= word >> cache_bits_;
+      int bytes = (64 - cache_bits_) / 8;
+      position_ += bytes;
+      cache_bits_ += bytes * 8;
+      return;
+    }
+    while (cache_bits_ <= 56) {
+      uint64_t byte = position_ < size_ ? data_[position_] : 0;
+      position_++;
+      cache_ |= byte << (56 - cache_bits_);
+      cache_bits_ += 8;
+    }
+  }
+
+  void Consume(int bits) {
+    cache_ = bits >= 64 ? 0 : cache_ << bits;
+    cache_bits_ -= bits;
+    consumed_bits_ += bits;
+  }
+
+  const uint8_t* data_;
+  size_t size_;
+  size_t position_ = 0;
+  uint64_t cache_ = 0;  // Next unread bits, left aligned
+  int cache_bits_ = 0;
+  uint64_t consumed_bits_ = 0;
+  uint64_t total_bits_;
+};
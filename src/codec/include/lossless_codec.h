@@ -0,0 +1,120 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace music262 {
+
+/**
+ * @file lossless_codec.h
+ * @brief Lossless compression of 16-bit PCM WAV files
+ *
+ * The codec follows the FLAC design: each channel of a frame is predicted
+ * with a quantized linear predictor (or a fixed polynomial one) and the
+ * residual is Rice coded in partitions with their own parameters. Stereo
+ * frames pick the cheapest of left/right, left/side, side/right and
+ * mid/side decorrelation.
+ *
+ * An encoded stream starts with "M2LC" and the identity of the file it was
+ * encoded from, followed by the WAV bytes before and after the PCM data
+ * (kept verbatim, so decoding reproduces the exact input file) and a table
+ * of frame offsets. Frames are independent, so they can be decoded in
+ * parallel. Like FLAC, every frame carries a CRC-32, as does everything
+ * before the frames, so corruption is detected instead of decoded.
+ */
+
+/**
+ * @brief Identity of the file a stream was encoded from
+ *
+ * Stored in the stream header so a cached encoding can be checked against
+ * the current version of its source without decoding it.
+ */
+struct LosslessSource {
+  uint64_t size = 0;         /**< Size of the source file in bytes */
+  int64_t mtime_ns = 0;      /**< Modification time of the source file */
+  uint64_t content_hash = 0; /**< XXH64 of the source file */
+
+  bool operator==(const LosslessSource& other) const {
+    return size == other.size && mtime_ns == other.mtime_ns &&
+           content_hash == other.content_hash;
+  }
+  bool operator!=(const LosslessSource& other) const {
+    return !(*this == other);
+  }
+};
+
+/**
+ * @brief Options controlling the lossless encoder
+ */
+struct LosslessEncodeOptions {
+  uint32_t block_size = 4096; /**< Samples per channel in a frame */
+  int max_lpc_order = 8;      /**< Highest predictor order tried */
+  LosslessSource source;      /**< Stored in the header as is */
+};
+
+/**
+ * @brief Check whether a WAV file can be losslessly encoded
+ *
+ * Only 16-bit PCM with one or two channels is supported.
+ *
+ * @param wav Contents of the WAV file
+ * @param size Size of the file in bytes
+ * @return true if the file can be encoded, false otherwise
+ */
+bool CanEncodeLossless(const char* wav, size_t size);
+
+/**
+ * @brief Encode a WAV file into a lossless stream
+ *
+ * @param wav Contents of the WAV file
+ * @param size Size of the file in bytes
+ * @param encoded Receives the encoded stream
+ * @param options Encoder options
+ * @return true on success, false if the file is not supported
+ */
+bool EncodeLossless(const char* wav, size_t size, std::vector<char>* encoded,
+                    const LosslessEncodeOptions& options = {});
+
+/**
+ * @brief Check whether a buffer starts with a lossless stream header
+ *
+ * @param data Buffer to check
+ * @param size Size of the buffer in bytes
+ * @return true if the buffer holds an encoded stream
+ */
+bool IsLosslessStream(const char* data, size_t size);
+
+/**
+ * @brief Read the identity of the source file from a stream header
+ *
+ * @param data Encoded stream
+ * @param size Size of the stream in bytes
+ * @param source Receives the identity of the source file
+ * @return true if the buffer starts with a supported stream header
+ */
+bool ReadLosslessSource(const char* data, size_t size, LosslessSource* source);
+
+/**
+ * @brief Decode a lossless stream back into the original WAV file
+ *
+ * Frames are decoded on up to `num_threads` threads. Fails if any
+ * checksum does not match.
+ *
+ * @param data Encoded stream
+ * @param size Size of the stream in bytes
+ * @param wav Receives the WAV file
+ * @param num_threads Decoder threads, 0 uses one per hardware thread
+ * @return true on success, false if the stream is malformed or corrupt
+ */
+bool DecodeLossless(const char* data, size_t size, std::vector<char>* wav,
+                    unsigned num_threads = 0);
+
+/**
+ * @brief Name of the vector instruction set the codec was built with
+ *
+ * @return const char* "neon", "sse4.1" or "scalar"
+ */
+const char* CodecSimdPath();
+
+}  // namespace music262
@@ -0,0 +1,120 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+#include "lossless_codec.h"
+#include "lpc.h"
+
+namespace music262 {
+
+// Layout of the lossless stream shared by the encoder and the decoder.
+//
+// Stream:   header | prefix | suffix | frame offsets | table crc | frames
+// Header:   "M2LC" version:u8 channels:u8 bits:u8 reserved:u8
+//           block_size:u32 total_samples:u64 frame_count:u32
+//           prefix_size:u32 suffix_size:u32 source_size:u64
+//           source_mtime_ns:u64 source_hash:u64       (little endian)
+// Offsets:  frame_count + 1 u32 offsets of each frame from the first frame
+// Table crc: u32 CRC-32 of everything before it
+// Frame:    stereo_mode:2 then one subframe per channel, byte aligned,
+//           followed by a u32 CRC-32 of the frame bytes
+// Subframe: order:4 [shift:4 coef:12 * order] warmup:17 * order
+//           partition_order:4 (rice_param:5 residual * n) per partition
+
+constexpr char kLosslessMagic[4] = {'M', '2', 'L', 'C'};
+constexpr uint8_t kLosslessVersion = 2;
+constexpr size_t kStreamHeaderSize = 56;
+constexpr size_t kCrcSize = 4;
+
+constexpr int kStereoModeBits = 2;
+constexpr int kOrderBits = 4;
+constexpr int kShiftBits = 4;
+constexpr int kWarmupBits = 17;
+constexpr int kPartitionOrderBits = 4;
+constexpr int kRiceParamBits = 5;
+constexpr int kMaxPartitionOrder = 8;
+constexpr int kMaxRiceParam = 31;
+
+/**
+ * @brief Channel decorrelation applied to a stereo frame
+ */
+enum StereoMode : uint32_t {
+  kLeftRight = 0, /**< Channels coded independently */
+  kLeftSide = 1,  /**< Left and left - right */
+  kSideRight = 2, /**< Left - right and right */
+  kMidSide = 3,   /**< (left + right) >> 1 and left - right */
+};
+
+/**
+ * @brief Fixed header at the start of every lossless stream
+ */
+struct StreamHeader {
+  uint8_t channels = 0;
+  uint32_t block_size = 0;
+  uint64_t total_samples = 0; /**< Samples per channel */
+  uint32_t frame_count = 0;
+  uint32_t prefix_size = 0; /**< WAV bytes before the PCM data */
+  uint32_t suffix_size = 0; /**< WAV bytes after the PCM data */
+  LosslessSource source;    /**< File the stream was encoded from */
+};
+
+inline void PutLE(uint64_t value, int bytes, uint8_t* out) {
+  for (int i = 0; i < bytes; i++) {
+    out[i] = static_cast<uint8_t>(value >> (8 * i));
+  }
+}
+
+inline uint64_t GetLE(const uint8_t* in, int bytes) {
+  uint64_t value = 0;
+  for (int i = 0; i < bytes; i++) {
+    value |= uint64_t{in[i]} << (8 * i);
+  }
+  return value;
+}
+
+inline void WriteStreamHeader(const StreamHeader& header, uint8_t* out) {
+  std::memcpy(out, kLosslessMagic, 4);
+  out[4] = kLosslessVersion;
+  out[5] = header.channels;
+  out[6] = 16;
+  out[7] = 0;
+  PutLE(header.block_size, 4, out + 8);
+  PutLE(header.total_samples, 8, out + 12);
+  PutLE(header.frame_count, 4, out + 20);
+  PutLE(header.prefix_size, 4, out + 24);
+  PutLE(header.suffix_size, 4, out + 28);
+  PutLE(header.source.size, 8, out + 32);
+  PutLE(static_cast<uint64_t>(header.source.mtime_ns), 8, out + 40);
+  PutLE(header.source.content_hash, 8, out + 48);
+}
+
+inline bool ReadStreamHeader(const uint8_t* in, size_t size,
+                             StreamHeader* header) {
+  if (size < kStreamHeaderSize || std::memcmp(in, kLosslessMagic, 4) != 0 ||
+      in[4] != kLosslessVersion || in[6] != 16) {
+    return false;
+  }
+  header->channels = in[5];
+  header->block_size = static_cast<uint32_t>(GetLE(in + 8, 4));
+  header->total_samples = GetLE(in + 12, 8);
+  header->frame_count = static_cast<uint32_t>(GetLE(in + 20, 4));
+  header->prefix_size = static_cast<uint32_t>(GetLE(in + 24, 4));
+  header->suffix_size = static_cast<uint32_t>(GetLE(in + 28, 4));
+  header->source.size = GetLE(in + 32, 8);
+  header->source.mtime_ns = static_cast<int64_t>(GetLE(in + 40, 8));
+  header->source.content_hash = GetLE(in + 48, 8);
+  return true;
+}
+
+inline uint32_t ZigZagEncode(int32_t value) {
+  return (static_cast<uint32_t>(value) << 1) ^
+         static_cast<uint32_t>(value >> 31);
+}
+
+inline int32_t ZigZagDecode(uint32_t value) {
+  return static_cast<int32_t>((value >> 1) ^ (~(value & 1) + 1));
+}
+
+}  // namespace music262
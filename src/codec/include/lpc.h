@@ -0,0 +1,62 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+namespace music262 {
+
+/** @brief Highest predictor order used by the lossless codec */
+constexpr int kMaxLpcOrder = 8;
+
+/** @brief Bits of a quantized predictor coefficient, including the sign */
+constexpr int kLpcCoefPrecision = 12;
+
+/** @brief Largest right shift applied to a prediction */
+constexpr int kMaxLpcShift = 15;
+
+/**
+ * @brief Compute quantized linear prediction coefficients for a block
+ *
+ * Runs Levinson-Durbin on the windowed autocorrelation of the block and
+ * quantizes the result to kLpcCoefPrecision bits. The prediction of sample n
+ * is (sum of coefs[j] * samples[n - 1 - j]) >> shift.
+ *
+ * @param samples Samples of one channel
+ * @param count Number of samples
+ * @param order Predictor order, at most kMaxLpcOrder
+ * @param coefs Receives `order` coefficients
+ * @param shift Receives the prediction shift
+ * @return true if a usable predictor was found, false for silent blocks
+ */
+bool ComputeLpc(const int32_t* samples, size_t count, int order,
+                int32_t* coefs, int* shift);
+
+/**
+ * @brief Compute the prediction residual of a block
+ *
+ * Predicts four samples at a time with NEON or SSE4.1 when available.
+ *
+ * @param samples Samples of one channel
+ * @param count Number of samples
+ * @param order Predictor order, the first `order` samples are not predicted
+ * @param coefs Predictor coefficients
+ * @param shift Prediction shift
+ * @param residual Receives count - order residuals
+ */
+void ComputeResidual(const int32_t* samples, size_t count, int order,
+                     const int32_t* coefs, int shift, int32_t* residual);
+
+/**
+ * @brief Rebuild a block from its warm-up samples and residual
+ *
+ * @param residual count - order residuals
+ * @param count Number of samples
+ * @param order Predictor order
+ * @param coefs Predictor coefficients
+ * @param shift Prediction shift
+ * @param samples Holds the `order` warm-up samples and receives the rest
+ */
+void RestoreSignal(const int32_t* residual, size_t count, int order,
+                   const int32_t* coefs, int shift, int32_t* samples);
+
+}  // namespace music262
@@ -0,0 +1,68 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace music262 {
+
+/**
+ * @file pcm_convert.h
+ * @brief Conversion of WAV files to the sample format of an output device
+ *
+ * Samples are converted to planar float, mixed to the target channel
+ * layout, resampled with a windowed sinc polyphase filter and quantized to
+ * the target sample format. The result is a canonical 44-byte header WAV
+ * file a player can hand to the device without any further work.
+ */
+
+/**
+ * @brief Sample encodings a WAV file can be converted to
+ */
+enum class PcmSampleFormat {
+  kInt16,   /**< 16-bit signed integer PCM */
+  kFloat32, /**< 32-bit IEEE float in [-1, 1] */
+};
+
+/**
+ * @brief Sample format, rate and channel layout of converted audio
+ */
+struct PcmFormat {
+  PcmSampleFormat sample_format = PcmSampleFormat::kInt16;
+  uint32_t sample_rate = 0; /**< Frames per second, 0 keeps the source's */
+  uint16_t channels = 0;    /**< 1 or 2, 0 keeps the source's */
+
+  bool operator==(const PcmFormat& other) const {
+    return sample_format == other.sample_format &&
+           sample_rate == other.sample_rate && channels == other.channels;
+  }
+};
+
+/**
+ * @brief Check whether a WAV file can be converted to a format
+ *
+ * Sources are 16, 24 or 32-bit integer PCM or 32-bit float with one or two
+ * channels. Rates between 8 and 384 kHz are supported as long as the
+ * resampling ratio reduces to at most 1024 filter phases, which covers
+ * every common pair of rates.
+ *
+ * @param wav Contents of the WAV file
+ * @param size Size of the file in bytes
+ * @param target Format to convert to
+ * @return true if the file can be converted, false otherwise
+ */
+bool CanConvertPcm(const char* wav, size_t size, const PcmFormat& target);
+
+/**
+ * @brief Convert a WAV file to another sample format, rate and layout
+ *
+ * @param wav Contents of the WAV file
+ * @param size Size of the file in bytes
+ * @param target Format to convert to
+ * @param converted Receives the converted WAV file
+ * @return true on success, false if the conversion is not supported
+ */
+bool ConvertPcm(const char* wav, size_t size, const PcmFormat& target,
+                std::vector<char>* converted);
+
+}  // namespace music262
@@ -0,0 +1,11 @@
+#pragma once
+
+// Vector instruction set available to the codec. NEON is part of every
+// arm64 target, SSE4.1 is enabled for x86 builds by the codec's CMakeLists.
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define MUSIC262_SIMD_NEON 1
+#elif defined(__SSE4_1__)
+#include <smmintrin.h>
+#define MUSIC262_SIMD_SSE41 1
+#endif
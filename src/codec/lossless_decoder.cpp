@@ -0,0 +1,337 @@
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <thread>
+
+#include "crc32.h"
+#include "include/bit_stream.h"
+#include "include/lossless_codec.h"
+#include "include/lossless_format.h"
+#include "include/lpc.h"
+#include "include/simd.h"
+#include "logger.h"
+
+namespace music262 {
+
+namespace {
+
+// Frames below this many per thread are not worth another decoder thread
+constexpr uint32_t kMinFramesPerThread = 16;
+
+// Per-thread buffers reused across frames
+struct DecodeScratch {
+  std::vector<int32_t> channel[2];
+  std::vector<int32_t> residual;
+};
+
+inline int32_t WrappingAdd(int32_t a, int32_t b) {
+  return static_cast<int32_t>(static_cast<uint32_t>(a) +
+                              static_cast<uint32_t>(b));
+}
+
+inline int32_t WrappingSub(int32_t a, int32_t b) {
+  return static_cast<int32_t>(static_cast<uint32_t>(a) -
+                              static_cast<uint32_t>(b));
+}
+
+// Undo the stereo decorrelation in place, leaving left in a and right in b
+void RestoreStereo(StereoMode mode, int32_t* a, int32_t* b, size_t count) {
+  size_t i = 0;
+  switch (mode) {
+    case kLeftRight:
+      break;
+    case kLeftSide:
+      for (; i < count; i++) {
+        b[i] = WrappingSub(a[i], b[i]);
+      }
+      break;
+    case kSideRight:
+      for (; i < count; i++) {
+        a[i] = WrappingAdd(a[i], b[i]);
+      }
+      break;
+    case kMidSide:
+#if defined(MUSIC262_SIMD_NEON)
+      for (; i + 4 <= count; i += 4) {
+        int32x4_t side = vld1q_s32(b + i);
+        int32x4_t mid = vorrq_s32(vshlq_n_s32(vld1q_s32(a + i), 1),
+                                  vandq_s32(side, vdupq_n_s32(1)));
+        vst1q_s32(a + i, vshrq_n_s32(vaddq_s32(mid, side), 1));
+        vst1q_s32(b + i, vshrq_n_s32(vsubq_s32(mid, side), 1));
+      }
+#elif defined(MUSIC262_SIMD_SSE41)
+      for (; i + 4 <= count; i += 4) {
+        __m128i side = _mm_loadu_si128(reinterpret_cast<__m128i*>(b + i));
+        __m128i mid = _mm_or_si128(
+            _mm_slli_epi32(_mm_loadu_si128(reinterpret_cast<__m128i*>(a + i)),
+                           1),
+            _mm_and_si128(side, _mm_set1_epi32(1)));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(a + i),
+                         _mm_srai_epi32(_mm_add_epi32(mid, side), 1));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(b + i),
+                         _mm_srai_epi32(_mm_sub_epi32(mid, side), 1));
+      }
+#endif
+      for (; i < count; i++) {
+        int32_t mid = static_cast<int32_t>(static_cast<uint32_t>(a[i]) << 1) |
+                      (b[i] & 1);
+        a[i] = WrappingAdd(mid, b[i]) >> 1;
+        b[i] = WrappingSub(mid, b[i]) >> 1;
+      }
+      break;
+  }
+}
+
+// Pack one or two channels into interleaved little-endian 16-bit samples
+void InterleavePcm16(const int32_t* left, const int32_t* right, size_t count,
+                     uint8_t* out) {
+  size_t i = 0;
+#if defined(MUSIC262_SIMD_NEON)
+  if (right) {
+    for (; i + 4 <= count; i += 4) {
+      int16x4x2_t pair = {{vmovn_s32(vld1q_s32(left + i)),
+                           vmovn_s32(vld1q_s32(right + i))}};
+      vst2_s16(reinterpret_cast<int16_t*>(out + i * 4), pair);
+    }
+  } else {
+    for (; i + 4 <= count; i += 4) {
+      vst1_s16(reinterpret_cast<int16_t*>(out + i * 2),
+               vmovn_s32(vld1q_s32(left + i)));
+    }
+  }
+#elif defined(MUSIC262_SIMD_SSE41)
+  // Valid samples fit in 16 bits, so the saturating pack is exact
+  if (right) {
+    for (; i + 4 <= count; i += 4) {
+      __m128i l = _mm_loadu_si128(reinterpret_cast<const __m128i*>(left + i));
+      __m128i r = _mm_loadu_si128(reinterpret_cast<const __m128i*>(right + i));
+      __m128i packed = _mm_packs_epi32(_mm_unpacklo_epi32(l, r),
+                                       _mm_unpackhi_epi32(l, r));
+      _mm_storeu_si128(reinterpret_cast<__m128i*>(out + i * 4), packed);
+    }
+  } else {
+    for (; i + 8 <= count; i += 8) {
+      __m128i low = _mm_loadu_si128(reinterpret_cast<const __m128i*>(left + i));
+      __m128i high =
+          _mm_loadu_si128(reinterpret_cast<const __m128i*>(left + i + 4));
+      _mm_storeu_si128(reinterpret_cast<__m128i*>(out + i * 2),
+                       _mm_packs_epi32(low, high));
+    }
+  }
+#endif
+
+  int channels = right ? 2 : 1;
+  for (; i < count; i++) {
+    uint8_t* frame = out + i * channels * 2;
+    PutLE(static_cast<uint16_t>(left[i]), 2, frame);
+    if (right) {
+      PutLE(static_cast<uint16_t>(right[i]), 2, frame + 2);
+    }
+  }
+}
+
+bool DecodeSubframe(BitReader* reader, size_t count, int32_t* samples,
+                    std::vector<int32_t>* residual) {
+  int order = static_cast<int>(reader->Read(kOrderBits));
+  if (order > kMaxLpcOrder || static_cast<size_t>(order) > count) {
+    return false;
+  }
+
+  int shift = 0;
+  int32_t coefs[kMaxLpcOrder] = {};
+  if (order > 0) {
+    shift = static_cast<int>(reader->Read(kShiftBits));
+    for (int j = 0; j < order; j++) {
+      coefs[j] = reader->ReadSigned(kLpcCoefPrecision);
+    }
+  }
+  for (int i = 0; i < order; i++) {
+    samples[i] = reader->ReadSigned(kWarmupBits);
+  }
+
+  int partition_order = static_cast<int>(reader->Read(kPartitionOrderBits));
+  size_t partition_size = count >> partition_order;
+  if (partition_order > kMaxPartitionOrder ||
+      count % (size_t{1} << partition_order) != 0 ||
+      partition_size < static_cast<size_t>(order)) {
+    return false;
+  }
+
+  residual->resize(count - order);
+  int32_t* out = residual->data();
+  size_t index = 0;
+  for (int p = 0; p < (1 << partition_order); p++) {
+    int k = static_cast<int>(reader->Read(kRiceParamBits));
+    size_t end = (p + 1) * partition_size - order;
+    for (; index < end; index++) {
+      out[index] = ZigZagDecode(reader->ReadRice(k));
+    }
+    if (!reader->ok()) {
+      return false;
+    }
+  }
+
+  RestoreSignal(out, count, order, coefs, shift, samples);
+  return true;
+}
+
+// Check the CRC at the end of a frame, then decode it into interleaved
+// little-endian 16-bit samples
+bool DecodeFrame(const uint8_t* data, size_t size, int channels, size_t count,
+                 DecodeScratch* scratch, uint8_t* pcm) {
+  if (size < kCrcSize) {
+    return false;
+  }
+  size -= kCrcSize;
+  if (Crc32(data, size) != GetLE(data + size, 4)) {
+    return false;
+  }
+
+  BitReader reader(data, size);
+  uint32_t mode = reader.Read(kStereoModeBits);
+  if (channels == 1 && mode != kLeftRight) {
+    return false;
+  }
+
+  for (int ch = 0; ch < channels; ch++) {
+    scratch->channel[ch].resize(count);
+    if (!DecodeSubframe(&reader, count, scratch->channel[ch].data(),
+                        &scratch->residual)) {
+      return false;
+    }
+  }
+  if (!reader.ok()) {
+    return false;
+  }
+
+  int32_t* left = scratch->channel[0].data();
+  int32_t* right = channels == 2 ? scratch->channel[1].data() : nullptr;
+  if (right) {
+    RestoreStereo(static_cast<StereoMode>(mode), left, right, count);
+  }
+  InterleavePcm16(left, right, count, pcm);
+  return true;
+}
+
+}  // namespace
+
+const char* CodecSimdPath() {
+#if defined(MUSIC262_SIMD_NEON)
+  return "neon";
+#elif defined(MUSIC262_SIMD_SSE41)
+  return "sse4.1";
+#else
+  return "scalar";
+#endif
+}
+
+bool IsLosslessStream(const char* data, size_t size) {
+  return size >= kStreamHeaderSize &&
+         std::memcmp(data, kLosslessMagic, sizeof(kLosslessMagic)) == 0;
+}
+
+bool ReadLosslessSource(const char* data, size_t size,
+                        LosslessSource* source) {
+  StreamHeader header;
+  if (!ReadStreamHeader(reinterpret_cast<const uint8_t*>(data), size,
+                        &header)) {
+    return false;
+  }
+  *source = header.source;
+  return true;
+}
+
+bool DecodeLossless(const char* data, size_t size, std::vector<char>* wav,
+                    unsigned num_threads) {
+  const uint8_t* in = reinterpret_cast<const uint8_t*>(data);
+  StreamHeader header;
+  if (!ReadStreamHeader(in, size, &header) || header.channels < 1 ||
+      header.channels > 2 || header.block_size == 0) {
+    LOG_ERROR("Not a supported lossless audio stream");
+    return false;
+  }
+
+  // Validate the layout before trusting any size from the stream
+  uint64_t expected_frames =
+      (header.total_samples + header.block_size - 1) / header.block_size;
+  uint64_t table_offset =
+      uint64_t{kStreamHeaderSize} + header.prefix_size + header.suffix_size;
+  uint64_t crc_offset = table_offset + (uint64_t{header.frame_count} + 1) * 4;
+  uint64_t frames_offset = crc_offset + kCrcSize;
+  // Every sample costs at least one bit, which bounds the decoded size
+  if (expected_frames != header.frame_count || frames_offset > size ||
+      header.total_samples * header.channels > uint64_t{size} * 8) {
+    LOG_ERROR("Lossless stream header is inconsistent with its size");
+    return false;
+  }
+  if (Crc32(in, crc_offset) != GetLE(in + crc_offset, 4)) {
+    LOG_ERROR("Lossless stream has a corrupt header or frame table");
+    return false;
+  }
+
+  std::vector<uint32_t> offsets(header.frame_count + 1);
+  for (size_t i = 0; i < offsets.size(); i++) {
+    offsets[i] = static_cast<uint32_t>(GetLE(in + table_offset + i * 4, 4));
+    if ((i > 0 && offsets[i] < offsets[i - 1]) ||
+        frames_offset + offsets[i] > size) {
+      LOG_ERROR("Lossless stream has a corrupt frame table");
+      return false;
+    }
+  }
+
+  // Prefix and suffix are restored verbatim around the decoded samples
+  size_t frame_bytes = size_t{header.block_size} * header.channels * 2;
+  size_t pcm_bytes = header.total_samples * header.channels * 2;
+  const uint8_t* prefix = in + kStreamHeaderSize;
+  const uint8_t* suffix = prefix + header.prefix_size;
+  wav->resize(header.prefix_size + pcm_bytes + header.suffix_size);
+  uint8_t* out = reinterpret_cast<uint8_t*>(wav->data());
+  std::memcpy(out, prefix, header.prefix_size);
+  std::memcpy(out + header.prefix_size + pcm_bytes, suffix,
+              header.suffix_size);
+  uint8_t* pcm = out + header.prefix_size;
+
+  // Frames are independent, so workers take the next undecoded one
+  std::atomic<uint32_t> next_frame{0};
+  std::atomic<bool> failed{false};
+  auto worker = [&]() {
+    DecodeScratch scratch;
+    uint32_t i;
+    while (!failed.load(std::memory_order_relaxed) &&
+           (i = next_frame.fetch_add(1)) < header.frame_count) {
+      size_t count = std::min<uint64_t>(
+          header.block_size,
+          header.total_samples - uint64_t{i} * header.block_size);
+      if (!DecodeFrame(in + frames_offset + offsets[i],
+                       offsets[i + 1] - offsets[i], header.channels, count,
+                       &scratch, pcm + i * frame_bytes)) {
+        failed = true;
+      }
+    }
+  };
+
+  if (num_threads == 0) {
+    num_threads = std::max(1u, std::thread::hardware_concurrency());
+  }
+  num_threads = std::max(
+      1u, std::min<unsigned>(num_threads,
+                             header.frame_count / kMinFramesPerThread));
+
+  std::vector<std::thread> threads;
+  for (unsigned t = 1; t < num_threads; t++) {
+    threads.emplace_back(worker);
+  }
+  worker();
+  for (auto& thread : threads) {
+    thread.join();
+  }
+
+  if (failed) {
+    LOG_ERROR("Lossless stream has a corrupt frame");
+    wav->clear();
+    return false;
+  }
+  return true;
+}
+
+}  // namespace music262
@@ -0,0 +1,352 @@
+#include <algorithm>
+#include <cstring>
+#include <limits>
+
+#include "crc32.h"
+#include "include/bit_stream.h"
+#include "include/lossless_codec.h"
+#include "include/lossless_format.h"
+#include "include/lpc.h"
+#include "logger.h"
+
+namespace music262 {
+
+namespace {
+
+// Where the PCM samples are in a WAV file
+struct WavLayout {
+  size_t data_offset = 0;
+  size_t pcm_bytes = 0;  // Whole sample frames only
+  int channels = 0;
+};
+
+// Walk the RIFF chunks to the "data" chunk of a 16-bit PCM file
+bool ParseWav(const char* wav, size_t size, WavLayout* layout) {
+  const uint8_t* bytes = reinterpret_cast<const uint8_t*>(wav);
+  if (size < 12 || std::memcmp(wav, "RIFF", 4) != 0 ||
+      std::memcmp(wav + 8, "WAVE", 4) != 0) {
+    return false;
+  }
+
+  bool have_format = false;
+  uint64_t format = 0, channels = 0, block_align = 0, bits = 0;
+  size_t position = 12;
+  while (position + 8 <= size) {
+    const char* id = wav + position;
+    uint64_t chunk_size = GetLE(bytes + position + 4, 4);
+    size_t body = position + 8;
+
+    if (std::memcmp(id, "fmt ", 4) == 0 && chunk_size >= 16 &&
+        body + 16 <= size) {
+      format = GetLE(bytes + body, 2);
+      channels = GetLE(bytes + body + 2, 2);
+      block_align = GetLE(bytes + body + 12, 2);
+      bits = GetLE(bytes + body + 14, 2);
+      have_format = true;
+    } else if (std::memcmp(id, "data", 4) == 0) {
+      if (!have_format || format != 1 || bits != 16 || channels < 1 ||
+          channels > 2 || block_align != channels * 2) {
+        return false;
+      }
+      size_t available = std::min<uint64_t>(chunk_size, size - body);
+      layout->data_offset = body;
+      layout->pcm_bytes = available / block_align * block_align;
+      layout->channels = static_cast<int>(channels);
+      return true;
+    }
+    position = body + chunk_size + (chunk_size & 1);
+  }
+  return false;
+}
+
+// Fixed polynomial predictors of order 1 to 4
+constexpr int32_t kFixedCoefs[5][4] = {
+    {}, {1}, {2, -1}, {3, -3, 1}, {4, -6, 4, -1}};
+
+// Prediction and residual coding chosen for one channel of a frame
+struct Subframe {
+  int order = 0;
+  int shift = 0;
+  int32_t coefs[kMaxLpcOrder] = {};
+  int partition_order = 0;
+  int rice_params[1 << kMaxPartitionOrder] = {};
+  std::vector<int32_t> residual;
+  uint64_t bits = std::numeric_limits<uint64_t>::max();
+};
+
+// Rice parameter with the fewest bits for a partition, from the sum of its
+// zigzagged residuals
+int BestRiceParam(uint64_t sum, uint64_t count, uint64_t* bits) {
+  int k = 0;
+  while (k < kMaxRiceParam && (count << (k + 1)) < sum) {
+    k++;
+  }
+  *bits = count * (k + 1) + (sum >> k);
+  if (k > 0) {
+    uint64_t lower = count * k + (sum >> (k - 1));
+    if (lower < *bits) {
+      *bits = lower;
+      k--;
+    }
+  }
+  return k;
+}
+
+// Choose the partition order and Rice parameters for a residual and return
+// the estimated size of the residual section in bits
+uint64_t ChooseRiceCoding(const std::vector<int32_t>& residual, size_t count,
+                          int order, int* partition_order, int* params) {
+  // Finest partitioning the block allows
+  int max_order = 0;
+  while (max_order < kMaxPartitionOrder &&
+         count % (size_t{2} << max_order) == 0 &&
+         (count >> (max_order + 1)) > static_cast<size_t>(order)) {
+    max_order++;
+  }
+
+  size_t partitions = size_t{1} << max_order;
+  size_t partition_size = count >> max_order;
+  std::vector<uint64_t> sums(partitions, 0);
+  std::vector<uint64_t> counts(partitions, 0);
+  for (size_t i = 0; i < residual.size(); i++) {
+    size_t partition = (i + order) / partition_size;
+    sums[partition] += ZigZagEncode(residual[i]);
+    counts[partition]++;
+  }
+
+  // Evaluate each partition order, merging neighbours on the way up
+  uint64_t best_bits = std::numeric_limits<uint64_t>::max();
+  for (int p = max_order; p >= 0; p--) {
+    size_t n = size_t{1} << p;
+    uint64_t bits = kPartitionOrderBits;
+    int candidate[1 << kMaxPartitionOrder];
+    for (size_t i = 0; i < n; i++) {
+      uint64_t partition_bits;
+      candidate[i] = BestRiceParam(sums[i], counts[i], &partition_bits);
+      bits += kRiceParamBits + partition_bits;
+    }
+    if (bits < best_bits) {
+      best_bits = bits;
+      *partition_order = p;
+      std::copy(candidate, candidate + n, params);
+    }
+    for (size_t i = 0; i < n / 2; i++) {
+      sums[i] = sums[2 * i] + sums[2 * i + 1];
+      counts[i] = counts[2 * i] + counts[2 * i + 1];
+    }
+  }
+  return best_bits;
+}
+
+// Try one predictor and keep it if it beats the best one so far
+void TryPredictor(const int32_t* samples, size_t count, int order,
+                  const int32_t* coefs, int shift, Subframe* best,
+                  Subframe* scratch) {
+  scratch->order = order;
+  scratch->shift = shift;
+  std::copy(coefs, coefs + order, scratch->coefs);
+  scratch->residual.resize(count - order);
+  ComputeResidual(samples, count, order, coefs, shift,
+                  scratch->residual.data());
+
+  uint64_t bits = kOrderBits + uint64_t{kWarmupBits} * order;
+  if (order > 0) {
+    bits += kShiftBits + uint64_t{kLpcCoefPrecision} * order;
+  }
+  bits += ChooseRiceCoding(scratch->residual, count, order,
+                           &scratch->partition_order, scratch->rice_params);
+  scratch->bits = bits;
+
+  if (bits < best->bits) {
+    std::swap(*best, *scratch);
+  }
+}
+
+// Find the cheapest fixed or LPC predictor for one channel of a frame
+Subframe AnalyzeChannel(const int32_t* samples, size_t count,
+                        int max_lpc_order) {
+  Subframe best;
+  Subframe scratch;
+
+  for (int order = 0; order <= 4 && static_cast<size_t>(order) < count;
+       order++) {
+    TryPredictor(samples, count, order, kFixedCoefs[order], 0, &best,
+                 &scratch);
+  }
+
+  for (int order : {4, 8}) {
+    order = std::min(order, max_lpc_order);
+    int32_t coefs[kMaxLpcOrder];
+    int shift;
+    if (ComputeLpc(samples, count, order, coefs, &shift)) {
+      TryPredictor(samples, count, order, coefs, shift, &best, &scratch);
+    }
+  }
+  return best;
+}
+
+void WriteSubframe(const Subframe& subframe, const int32_t* samples,
+                   size_t count, BitWriter* writer) {
+  int order = subframe.order;
+  writer->Write(order, kOrderBits);
+  if (order > 0) {
+    writer->Write(subframe.shift, kShiftBits);
+    for (int j = 0; j < order; j++) {
+      writer->Write(static_cast<uint32_t>(subframe.coefs[j]),
+                    kLpcCoefPrecision);
+    }
+  }
+  for (int i = 0; i < order; i++) {
+    writer->Write(static_cast<uint32_t>(samples[i]), kWarmupBits);
+  }
+
+  writer->Write(subframe.partition_order, kPartitionOrderBits);
+  size_t partition_size = count >> subframe.partition_order;
+  size_t index = 0;
+  for (int p = 0; p < (1 << subframe.partition_order); p++) {
+    int k = subframe.rice_params[p];
+    writer->Write(k, kRiceParamBits);
+    size_t end = (p + 1) * partition_size - order;
+    for (; index < end; index++) {
+      writer->WriteRice(ZigZagEncode(subframe.residual[index]), k);
+    }
+  }
+}
+
+// Encode one frame of interleaved 16-bit samples
+void EncodeFrame(const uint8_t* pcm, size_t count, int channels,
+                 int max_lpc_order, BitWriter* writer) {
+  std::vector<int32_t> left(count), right(count);
+  for (size_t i = 0; i < count; i++) {
+    const uint8_t* frame = pcm + i * channels * 2;
+    left[i] = static_cast<int16_t>(GetLE(frame, 2));
+    if (channels == 2) {
+      right[i] = static_cast<int16_t>(GetLE(frame + 2, 2));
+    }
+  }
+
+  if (channels == 1) {
+    writer->Write(kLeftRight, kStereoModeBits);
+    WriteSubframe(AnalyzeChannel(left.data(), count, max_lpc_order),
+                  left.data(), count, writer);
+    writer->AlignToByte();
+    return;
+  }
+
+  std::vector<int32_t> mid(count), side(count);
+  for (size_t i = 0; i < count; i++) {
+    mid[i] = (left[i] + right[i]) >> 1;
+    side[i] = left[i] - right[i];
+  }
+
+  Subframe l = AnalyzeChannel(left.data(), count, max_lpc_order);
+  Subframe r = AnalyzeChannel(right.data(), count, max_lpc_order);
+  Subframe m = AnalyzeChannel(mid.data(), count, max_lpc_order);
+  Subframe s = AnalyzeChannel(side.data(), count, max_lpc_order);
+
+  // Pick the decorrelation with the smallest pair of subframes
+  struct Candidate {
+    StereoMode mode;
+    const Subframe* first;
+    const int32_t* first_samples;
+    const Subframe* second;
+    const int32_t* second_samples;
+  };
+  const Candidate candidates[] = {
+      {kLeftRight, &l, left.data(), &r, right.data()},
+      {kLeftSide, &l, left.data(), &s, side.data()},
+      {kSideRight, &s, side.data(), &r, right.data()},
+      {kMidSide, &m, mid.data(), &s, side.data()},
+  };
+  const Candidate* best = &candidates[0];
+  for (const auto& candidate : candidates) {
+    if (candidate.first->bits + candidate.second->bits <
+        best->first->bits + best->second->bits) {
+      best = &candidate;
+    }
+  }
+
+  writer->Write(best->mode, kStereoModeBits);
+  WriteSubframe(*best->first, best->first_samples, count, writer);
+  WriteSubframe(*best->second, best->second_samples, count, writer);
+  writer->AlignToByte();
+}
+
+}  // namespace
+
+bool CanEncodeLossless(const char* wav, size_t size) {
+  WavLayout layout;
+  return ParseWav(wav, size, &layout);
+}
+
+bool EncodeLossless(const char* wav, size_t size, std::vector<char>* encoded,
+                    const LosslessEncodeOptions& options) {
+  WavLayout layout;
+  if (!ParseWav(wav, size, &layout)) {
+    LOG_ERROR("Lossless codec only supports 16-bit mono or stereo PCM WAV");
+    return false;
+  }
+
+  StreamHeader header;
+  header.channels = static_cast<uint8_t>(layout.channels);
+  header.block_size = std::clamp<uint32_t>(options.block_size, 16, 65536);
+  header.total_samples = layout.pcm_bytes / (layout.channels * 2);
+  header.frame_count = static_cast<uint32_t>(
+      (header.total_samples + header.block_size - 1) / header.block_size);
+  header.prefix_size = static_cast<uint32_t>(layout.data_offset);
+  header.suffix_size = static_cast<uint32_t>(size - layout.data_offset -
+                                             layout.pcm_bytes);
+  header.source = options.source;
+  int max_lpc_order = std::clamp(options.max_lpc_order, 1, kMaxLpcOrder);
+
+  // Frames are encoded first so the offset table can precede them
+  std::vector<uint32_t> offsets;
+  offsets.reserve(header.frame_count + 1);
+  std::vector<uint8_t> frames;
+  const uint8_t* pcm =
+      reinterpret_cast<const uint8_t*>(wav) + layout.data_offset;
+  size_t frame_bytes = header.block_size * layout.channels * 2;
+
+  for (uint32_t i = 0; i < header.frame_count; i++) {
+    size_t count = std::min<uint64_t>(
+        header.block_size, header.total_samples - uint64_t{i} * header.block_size);
+    BitWriter writer;
+    EncodeFrame(pcm + i * frame_bytes, count, layout.channels, max_lpc_order,
+                &writer);
+
+    const std::vector<uint8_t>& bytes = writer.bytes();
+    if (frames.size() + bytes.size() + kCrcSize >
+        std::numeric_limits<uint32_t>::max()) {
+      LOG_ERROR("Encoded stream exceeds the 4 GB frame table limit");
+      return false;
+    }
+    offsets.push_back(static_cast<uint32_t>(frames.size()));
+    frames.insert(frames.end(), bytes.begin(), bytes.end());
+    frames.resize(frames.size() + kCrcSize);
+    PutLE(Crc32(bytes.data(), bytes.size()), 4, &frames[frames.size() - 4]);
+  }
+  offsets.push_back(static_cast<uint32_t>(frames.size()));
+
+  encoded->resize(kStreamHeaderSize + header.prefix_size +
+                  header.suffix_size + offsets.size() * 4 + kCrcSize +
+                  frames.size());
+  uint8_t* start = reinterpret_cast<uint8_t*>(encoded->data());
+  uint8_t* out = start;
+  WriteStreamHeader(header, out);
+  out += kStreamHeaderSize;
+  std::memcpy(out, wav, header.prefix_size);
+  out += header.prefix_size;
+  std::memcpy(out, wav + layout.data_offset + layout.pcm_bytes,
+              header.suffix_size);
+  out += header.suffix_size;
+  for (uint32_t offset : offsets) {
+    PutLE(offset, 4, out);
+    out += 4;
+  }
+  PutLE(Crc32(start, out - start), 4, out);
+  out += kCrcSize;
+  std::copy(frames.begin(), frames.end(), out);
+  return true;
+}
+
+}  // namespace music262
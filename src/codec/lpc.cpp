@@ -0,0 +1,213 @@
+#include "include/lpc.h"
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+#include "include/simd.h"
+
+namespace music262 {
+
+namespace {
+
+// The encoder keeps |coefs| below 2^11 and samples within 17 bits, so with
+// at most 8 taps every prediction sum fits in 32 bits. Sums are accumulated
+// as uint32 so corrupt streams wrap instead of overflowing.
+inline int32_t Predict(const int32_t* samples, size_t n, int order,
+                       const int32_t* coefs, int shift) {
+  uint32_t sum = 0;
+  for (int j = 0; j < order; j++) {
+    sum += static_cast<uint32_t>(coefs[j]) *
+           static_cast<uint32_t>(samples[n - 1 - j]);
+  }
+  return static_cast<int32_t>(sum) >> shift;
+}
+
+// Reconstruction is a recursive filter: every sample depends on the one
+// decoded just before it, so it cannot be vectorized across samples and a
+// per-sample vector dot product loses to the latency of reloading the sample
+// just stored. With the order known at compile time the coefficients and the
+// history stay in registers and the dependency chain is one multiply-add.
+template <int Order>
+void RestoreOrder(const int32_t* residual, size_t count, const int32_t* coefs,
+                  int shift, int32_t* samples) {
+  uint32_t c[Order];
+  uint32_t history[Order];  // history[j] is samples[n - 1 - j]
+  for (int j = 0; j < Order; j++) {
+    c[j] = static_cast<uint32_t>(coefs[j]);
+    history[j] = static_cast<uint32_t>(samples[Order - 1 - j]);
+  }
+
+  for (size_t n = Order; n < count; n++) {
+    uint32_t sum = 0;
+    for (int j = 0; j < Order; j++) {
+      sum += c[j] * history[j];
+    }
+    uint32_t value = static_cast<uint32_t>(residual[n - Order]) +
+                     static_cast<uint32_t>(static_cast<int32_t>(sum) >> shift);
+    samples[n] = static_cast<int32_t>(value);
+
+    for (int j = Order - 1; j > 0; j--) {
+      history[j] = history[j - 1];
+    }
+    history[0] = value;
+  }
+}
+
+}  // namespace
+
+bool ComputeLpc(const int32_t* samples, size_t count, int order,
+                int32_t* coefs, int* shift) {
+  order = std::min(order, kMaxLpcOrder);
+  if (order <= 0 || count <= static_cast<size_t>(order)) {
+    return false;
+  }
+
+  // Autocorrelation of the Welch-windowed block
+  std::vector<double> windowed(count);
+  double half = (count - 1) / 2.0;
+  for (size_t i = 0; i < count; i++) {
+    double x = (i - half) / (half + 1);
+    windowed[i] = samples[i] * (1.0 - x * x);
+  }
+
+  double autoc[kMaxLpcOrder + 1] = {};
+  for (int lag = 0; lag <= order; lag++) {
+    double sum = 0;
+    for (size_t i = lag; i < count; i++) {
+      sum += windowed[i] * windowed[i - lag];
+    }
+    autoc[lag] = sum;
+  }
+  if (autoc[0] == 0) {
+    return false;
+  }
+
+  // Levinson-Durbin recursion
+  double lpc[kMaxLpcOrder] = {};
+  double error = autoc[0];
+  for (int i = 0; i < order; i++) {
+    double reflection = -autoc[i + 1];
+    for (int j = 0; j < i; j++) {
+      reflection -= lpc[j] * autoc[i - j];
+    }
+    reflection /= error;
+
+    lpc[i] = reflection;
+    for (int j = 0; j < i / 2; j++) {
+      double tmp = lpc[j];
+      lpc[j] += reflection * lpc[i - 1 - j];
+      lpc[i - 1 - j] += reflection * tmp;
+    }
+    if (i % 2) {
+      lpc[i / 2] += lpc[i / 2] * reflection;
+    }
+    error *= 1.0 - reflection * reflection;
+    if (error <= 0) {
+      break;
+    }
+  }
+
+  // Predictor coefficients are the negated filter coefficients
+  double max_coef = 0;
+  for (int j = 0; j < order; j++) {
+    lpc[j] = -lpc[j];
+    max_coef = std::max(max_coef, std::fabs(lpc[j]));
+  }
+  if (max_coef == 0 || !std::isfinite(max_coef)) {
+    return false;
+  }
+
+  // Use as many fractional bits as the largest coefficient leaves room for
+  int exponent;
+  std::frexp(max_coef, &exponent);
+  *shift = std::clamp(kLpcCoefPrecision - 1 - exponent, 0, kMaxLpcShift);
+
+  // Quantize with error feedback so rounding errors do not accumulate
+  const int32_t max_q = (1 << (kLpcCoefPrecision - 1)) - 1;
+  const int32_t min_q = -(1 << (kLpcCoefPrecision - 1));
+  double carry = 0;
+  for (int j = 0; j < order; j++) {
+    double value = lpc[j] * (1 << *shift) + carry;
+    int32_t q = static_cast<int32_t>(std::lround(value));
+    q = std::clamp(q, min_q, max_q);
+    carry = value - q;
+    coefs[j] = q;
+  }
+  return true;
+}
+
+void ComputeResidual(const int32_t* samples, size_t count, int order,
+                     const int32_t* coefs, int shift, int32_t* residual) {
+  size_t n = order;
+
+  // Unlike reconstruction, residuals are independent of each other, so four
+  // consecutive samples are predicted at once
+#if defined(MUSIC262_SIMD_NEON)
+  int32x4_t shift_right = vdupq_n_s32(-shift);
+  for (; n + 4 <= count; n += 4) {
+    int32x4_t sum = vdupq_n_s32(0);
+    for (int j = 0; j < order; j++) {
+      sum = vmlaq_n_s32(sum, vld1q_s32(samples + n - 1 - j), coefs[j]);
+    }
+    int32x4_t prediction = vshlq_s32(sum, shift_right);
+    vst1q_s32(residual + n - order,
+              vsubq_s32(vld1q_s32(samples + n), prediction));
+  }
+#elif defined(MUSIC262_SIMD_SSE41)
+  __m128i shift_right = _mm_cvtsi32_si128(shift);
+  for (; n + 4 <= count; n += 4) {
+    __m128i sum = _mm_setzero_si128();
+    for (int j = 0; j < order; j++) {
+      __m128i history = _mm_loadu_si128(
+          reinterpret_cast<const __m128i*>(samples + n - 1 - j));
+      sum = _mm_add_epi32(sum,
+                          _mm_mullo_epi32(history, _mm_set1_epi32(coefs[j])));
+    }
+    __m128i prediction = _mm_sra_epi32(sum, shift_right);
+    __m128i current =
+        _mm_loadu_si128(reinterpret_cast<const __m128i*>(samples + n));
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(residual + n - order),
+                     _mm_sub_epi32(current, prediction));
+  }
+#endif
+
+  for (; n < count; n++) {
+    residual[n - order] = samples[n] - Predict(samples, n, order, coefs, shift);
+  }
+}
+
+void RestoreSignal(const int32_t* residual, size_t count, int order,
+                   const int32_t* coefs, int shift, int32_t* samples) {
+  switch (order) {
+    case 0:
+      std::copy(residual, residual + count, samples);
+      break;
+    case 1:
+      RestoreOrder<1>(residual, count, coefs, shift, samples);
+      break;
+    case 2:
+      RestoreOrder<2>(residual, count, coefs, shift, samples);
+      break;
+    case 3:
+      RestoreOrder<3>(residual, count, coefs, shift, samples);
+      break;
+    case 4:
+      RestoreOrder<4>(residual, count, coefs, shift, samples);
+      break;
+    case 5:
+      RestoreOrder<5>(residual, count, coefs, shift, samples);
+      break;
+    case 6:
+      RestoreOrder<6>(residual, count, coefs, shift, samples);
+      break;
+    case 7:
+      RestoreOrder<7>(residual, count, coefs, shift, samples);
+      break;
+    default:
+      RestoreOrder<8>(residual, count, coefs, shift, samples);
+      break;
+  }
+}
+
+}  // namespace music262
@@ -0,0 +1,455 @@
+#include "include/pcm_convert.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <limits>
+#include <numeric>
+
+#include "include/lossless_format.h"
+#include "include/simd.h"
+
+namespace music262 {
+
+namespace {
+
+constexpr uint32_t kMinRate = 8000;
+constexpr uint32_t kMaxRate = 384000;
+constexpr uint32_t kMaxPhases = 1024;
+constexpr size_t kWavHeaderSize = 44;
+constexpr double kPi = 3.14159265358979323846;
+
+// Zero crossings of the sinc kept on each side of an output sample, and the
+// share of the lower Nyquist frequency passed. With the Kaiser window below
+// (about 80 dB of stopband attenuation) the transition band ends right at
+// Nyquist.
+constexpr int kZeroCrossings = 24;
+constexpr double kPassband = 0.9;
+constexpr double kKaiserBeta = 8.6;
+
+// Output frames produced and interleaved at a time
+constexpr size_t kBlockFrames = 4096;
+
+// Where the samples are in a WAV file and how they are encoded
+struct SourceLayout {
+  size_t data_offset = 0;
+  size_t frames = 0;
+  int channels = 0;
+  uint32_t sample_rate = 0;
+  int bytes_per_sample = 0;
+  bool is_float = false;
+};
+
+// Walk the RIFF chunks to the "data" chunk of a supported file
+bool ParseSource(const char* wav, size_t size, SourceLayout* layout) {
+  const uint8_t* bytes = reinterpret_cast<const uint8_t*>(wav);
+  if (size < 12 || std::memcmp(wav, "RIFF", 4) != 0 ||
+      std::memcmp(wav + 8, "WAVE", 4) != 0) {
+    return false;
+  }
+
+  bool have_format = false;
+  uint64_t format = 0, channels = 0, rate = 0, block_align = 0, bits = 0;
+  size_t position = 12;
+  while (position + 8 <= size) {
+    const char* id = wav + position;
+    uint64_t chunk_size = GetLE(bytes + position + 4, 4);
+    size_t body = position + 8;
+
+    if (std::memcmp(id, "fmt ", 4) == 0 && chunk_size >= 16 &&
+        body + 16 <= size) {
+      format = GetLE(bytes + body, 2);
+      channels = GetLE(bytes + body + 2, 2);
+      rate = GetLE(bytes + body + 4, 4);
+      block_align = GetLE(bytes + body + 12, 2);
+      bits = GetLE(bytes + body + 14, 2);
+      // WAVE_FORMAT_EXTENSIBLE keeps the real format in its sub-format GUID
+      if (format == 0xFFFE && chunk_size >= 40 && body + 26 <= size) {
+        format = GetLE(bytes + body + 24, 2);
+      }
+      have_format = true;
+    } else if (std::memcmp(id, "data", 4) == 0) {
+      bool is_int = format == 1 && (bits == 16 || bits == 24 || bits == 32);
+      bool is_float = format == 3 && bits == 32;
+      if (!have_format || !(is_int || is_float) || channels < 1 ||
+          channels > 2 || block_align != channels * bits / 8 ||
+          rate < kMinRate || rate > kMaxRate) {
+        return false;
+      }
+      size_t available = std::min<uint64_t>(chunk_size, size - body);
+      layout->data_offset = body;
+      layout->frames = available / block_align;
+      layout->channels = static_cast<int>(channels);
+      layout->sample_rate = static_cast<uint32_t>(rate);
+      layout->bytes_per_sample = static_cast<int>(bits / 8);
+      layout->is_float = is_float;
+      return true;
+    }
+    position = body + chunk_size + (chunk_size & 1);
+  }
+  return false;
+}
+
+// Fill in the parts of the target left to the source
+PcmFormat Resolve(const PcmFormat& target, const SourceLayout& layout) {
+  PcmFormat format = target;
+  if (format.sample_rate == 0) {
+    format.sample_rate = layout.sample_rate;
+  }
+  if (format.channels == 0) {
+    format.channels = static_cast<uint16_t>(layout.channels);
+  }
+  return format;
+}
+
+// Zeroth order modified Bessel function of the first kind
+double BesselI0(double x) {
+  double sum = 1, term = 1;
+  for (int k = 1; k < 64 && term > sum * 1e-12; k++) {
+    term *= (x / (2 * k)) * (x / (2 * k));
+    sum += term;
+  }
+  return sum;
+}
+
+// Polyphase filter resampling by up / down. Output frame n sits at input
+// position n * down / up, and is the dot product of the taps input samples
+// around it with the coefficients of its phase (n * down) % up.
+struct Resampler {
+  uint32_t up = 1;
+  uint32_t down = 1;
+  int taps = 0;     // Multiple of 4, the tail is zero padded
+  int history = 0;  // Input samples before the current one in each dot
+  std::vector<float> coefs;
+
+  void Init(uint32_t from, uint32_t to) {
+    uint32_t gcd = std::gcd(from, to);
+    up = to / gcd;
+    down = from / gcd;
+
+    // Downsampling lowers the cutoff and widens the filter to match
+    double cutoff = kPassband * std::min(1.0, static_cast<double>(up) / down);
+    int half = static_cast<int>(std::ceil(kZeroCrossings / cutoff));
+    history = half - 1;
+    taps = (2 * half + 3) / 4 * 4;
+    coefs.assign(static_cast<size_t>(up) * taps, 0.0f);
+
+    double norm = BesselI0(kKaiserBeta);
+    std::vector<double> phase(2 * half);
+    for (uint32_t p = 0; p < up; p++) {
+      double frac = static_cast<double>(p) / up;
+      double sum = 0;
+      for (int k = 0; k < 2 * half; k++) {
+        double x = k - history - frac;
+        double r = x / half;
+        double window =
+            r * r < 1 ? BesselI0(kKaiserBeta * std::sqrt(1 - r * r)) / norm
+                      : 0;
+        double arg = kPi * cutoff * x;
+        double sinc = x == 0 ? 1 : std::sin(arg) / arg;
+        phase[k] = sinc * window;
+        sum += phase[k];
+      }
+      // Unity gain at DC for every phase
+      float* out = &coefs[static_cast<size_t>(p) * taps];
+      for (int k = 0; k < 2 * half; k++) {
+        out[k] = static_cast<float>(phase[k] / sum);
+      }
+    }
+  }
+
+  size_t OutputFrames(size_t input_frames) const {
+    return (input_frames * up + down - 1) / down;
+  }
+};
+
+float Dot(const float* x, const float* h, int taps) {
+  int k = 0;
+#if defined(MUSIC262_SIMD_NEON)
+  float32x4_t acc = vdupq_n_f32(0);
+  for (; k < taps; k += 4) {
+    acc = vmlaq_f32(acc, vld1q_f32(x + k), vld1q_f32(h + k));
+  }
+  float32x2_t pair = vadd_f32(vget_low_f32(acc), vget_high_f32(acc));
+  return vget_lane_f32(vpadd_f32(pair, pair), 0);
+#elif defined(MUSIC262_SIMD_SSE41)
+  __m128 acc = _mm_setzero_ps();
+  for (; k < taps; k += 4) {
+    acc = _mm_add_ps(acc, _mm_mul_ps(_mm_loadu_ps(x + k), _mm_loadu_ps(h + k)));
+  }
+  acc = _mm_hadd_ps(acc, acc);
+  acc = _mm_hadd_ps(acc, acc);
+  return _mm_cvtss_f32(acc);
+#else
+  float acc[4] = {};
+  for (; k < taps; k += 4) {
+    for (int lane = 0; lane < 4; lane++) {
+      acc[lane] += x[k + lane] * h[k + lane];
+    }
+  }
+  return (acc[0] + acc[2]) + (acc[1] + acc[3]);
+#endif
+}
+
+// Read one channel of the source into planar float, with pad zeros before
+// and after for the resampler
+void Deinterleave(const char* data, const SourceLayout& layout, int channel,
+                  size_t pad_front, std::vector<float>* plane) {
+  const uint8_t* in = reinterpret_cast<const uint8_t*>(data) +
+                      channel * layout.bytes_per_sample;
+  size_t stride = static_cast<size_t>(layout.channels) *
+                  layout.bytes_per_sample;
+  float* out = plane->data() + pad_front;
+  if (layout.is_float) {
+    for (size_t i = 0; i < layout.frames; i++) {
+      std::memcpy(&out[i], in + i * stride, 4);
+    }
+    return;
+  }
+  switch (layout.bytes_per_sample) {
+    case 2:
+      for (size_t i = 0; i < layout.frames; i++) {
+        int16_t sample = static_cast<int16_t>(GetLE(in + i * stride, 2));
+        out[i] = sample * (1.0f / 32768);
+      }
+      break;
+    case 3:
+      for (size_t i = 0; i < layout.frames; i++) {
+        // Place the 24 bits at the top of an int32 to sign extend them
+        int32_t sample = static_cast<int32_t>(
+            static_cast<uint32_t>(GetLE(in + i * stride, 3)) << 8);
+        out[i] = sample * (1.0f / 2147483648.0f);
+      }
+      break;
+    case 4:
+      for (size_t i = 0; i < layout.frames; i++) {
+        int32_t sample = static_cast<int32_t>(GetLE(in + i * stride, 4));
+        out[i] = sample * (1.0f / 2147483648.0f);
+      }
+      break;
+  }
+}
+
+// Clamp and interleave one or two planes into the output samples. right is
+// left for mono sources played on two channels.
+void InterleaveFloat(const float* left, const float* right, int channels,
+                     size_t count, uint8_t* out) {
+  float* samples = reinterpret_cast<float*>(out);
+  size_t i = 0;
+#if defined(MUSIC262_SIMD_SSE41)
+  __m128 low = _mm_set1_ps(-1.0f), high = _mm_set1_ps(1.0f);
+  for (; i + 4 <= count; i += 4) {
+    __m128 l = _mm_min_ps(_mm_max_ps(_mm_loadu_ps(left + i), low), high);
+    if (channels == 1) {
+      _mm_storeu_ps(samples + i, l);
+      continue;
+    }
+    __m128 r = _mm_min_ps(_mm_max_ps(_mm_loadu_ps(right + i), low), high);
+    _mm_storeu_ps(samples + i * 2, _mm_unpacklo_ps(l, r));
+    _mm_storeu_ps(samples + i * 2 + 4, _mm_unpackhi_ps(l, r));
+  }
+#elif defined(MUSIC262_SIMD_NEON)
+  float32x4_t low = vdupq_n_f32(-1.0f), high = vdupq_n_f32(1.0f);
+  for (; i + 4 <= count; i += 4) {
+    float32x4_t l = vminq_f32(vmaxq_f32(vld1q_f32(left + i), low), high);
+    if (channels == 1) {
+      vst1q_f32(samples + i, l);
+      continue;
+    }
+    float32x4x2_t pair = {
+        {l, vminq_f32(vmaxq_f32(vld1q_f32(right + i), low), high)}};
+    vst2q_f32(samples + i * 2, pair);
+  }
+#endif
+  for (; i < count; i++) {
+    samples[i * channels] = std::clamp(left[i], -1.0f, 1.0f);
+    if (channels == 2) {
+      samples[i * 2 + 1] = std::clamp(right[i], -1.0f, 1.0f);
+    }
+  }
+}
+
+void InterleaveInt16(const float* left, const float* right, int channels,
+                     size_t count, uint8_t* out) {
+  int16_t* samples = reinterpret_cast<int16_t*>(out);
+  size_t i = 0;
+#if defined(MUSIC262_SIMD_SSE41)
+  // Rounds to nearest, and the saturating pack clamps
+  __m128 scale = _mm_set1_ps(32767.0f);
+  __m128 low = _mm_set1_ps(-32768.0f), high = _mm_set1_ps(32767.0f);
+  auto quantize4 = [&](const float* in) {
+    __m128 x = _mm_mul_ps(_mm_loadu_ps(in), scale);
+    return _mm_cvtps_epi32(_mm_min_ps(_mm_max_ps(x, low), high));
+  };
+  for (; i + 4 <= count; i += 4) {
+    __m128i l = quantize4(left + i);
+    if (channels == 1) {
+      _mm_storel_epi64(reinterpret_cast<__m128i*>(samples + i),
+                       _mm_packs_epi32(l, l));
+      continue;
+    }
+    __m128i r = quantize4(right + i);
+    _mm_storeu_si128(
+        reinterpret_cast<__m128i*>(samples + i * 2),
+        _mm_packs_epi32(_mm_unpacklo_epi32(l, r), _mm_unpackhi_epi32(l, r)));
+  }
+#elif defined(MUSIC262_SIMD_NEON)
+  float32x4_t scale = vdupq_n_f32(32767.0f);
+  for (; i + 4 <= count; i += 4) {
+    // Round to nearest, then narrow with saturation
+    int16x4_t l = vqmovn_s32(
+        vcvtq_s32_f32(vrndnq_f32(vmulq_f32(vld1q_f32(left + i), scale))));
+    if (channels == 1) {
+      vst1_s16(samples + i, l);
+      continue;
+    }
+    int16x4x2_t pair = {{l, vqmovn_s32(vcvtq_s32_f32(vrndnq_f32(
+                                vmulq_f32(vld1q_f32(right + i), scale))))}};
+    vst2_s16(samples + i * 2, pair);
+  }
+#endif
+  auto quantize = [](float x) {
+    return static_cast<int16_t>(
+        std::lrint(std::clamp(x * 32767.0f, -32768.0f, 32767.0f)));
+  };
+  for (; i < count; i++) {
+    samples[i * channels] = quantize(left[i]);
+    if (channels == 2) {
+      samples[i * 2 + 1] = quantize(right[i]);
+    }
+  }
+}
+
+void WriteHeader(const PcmFormat& format, uint32_t data_size, uint8_t* out) {
+  uint16_t bits = format.sample_format == PcmSampleFormat::kFloat32 ? 32 : 16;
+  uint16_t block_align = format.channels * bits / 8;
+  std::memcpy(out, "RIFF", 4);
+  PutLE(kWavHeaderSize - 8 + data_size, 4, out + 4);
+  std::memcpy(out + 8, "WAVEfmt ", 8);
+  PutLE(16, 4, out + 16);
+  PutLE(format.sample_format == PcmSampleFormat::kFloat32 ? 3 : 1, 2,
+        out + 20);
+  PutLE(format.channels, 2, out + 22);
+  PutLE(format.sample_rate, 4, out + 24);
+  PutLE(static_cast<uint64_t>(format.sample_rate) * block_align, 4, out + 28);
+  PutLE(block_align, 2, out + 32);
+  PutLE(bits, 2, out + 34);
+  std::memcpy(out + 36, "data", 4);
+  PutLE(data_size, 4, out + 40);
+}
+
+// Whether the source can be converted to the resolved target format
+bool SupportedTarget(const PcmFormat& format, const SourceLayout& layout) {
+  if (format.channels < 1 || format.channels > 2 ||
+      format.sample_rate < kMinRate || format.sample_rate > kMaxRate) {
+    return false;
+  }
+  uint32_t gcd = std::gcd(layout.sample_rate, format.sample_rate);
+  return format.sample_rate / gcd <= kMaxPhases;
+}
+
+}  // namespace
+
+bool CanConvertPcm(const char* wav, size_t size, const PcmFormat& target) {
+  SourceLayout layout;
+  if (!ParseSource(wav, size, &layout)) {
+    return false;
+  }
+  return SupportedTarget(Resolve(target, layout), layout);
+}
+
+bool ConvertPcm(const char* wav, size_t size, const PcmFormat& target,
+                std::vector<char>* converted) {
+  SourceLayout layout;
+  if (!ParseSource(wav, size, &layout)) {
+    return false;
+  }
+  PcmFormat format = Resolve(target, layout);
+  if (!SupportedTarget(format, layout)) {
+    return false;
+  }
+  bool resample = format.sample_rate != layout.sample_rate;
+  Resampler resampler;
+  if (resample) {
+    resampler.Init(layout.sample_rate, format.sample_rate);
+  }
+
+  size_t out_frames =
+      resample ? resampler.OutputFrames(layout.frames) : layout.frames;
+  size_t frame_bytes =
+      format.channels *
+      (format.sample_format == PcmSampleFormat::kFloat32 ? 4 : 2);
+  uint64_t data_size = static_cast<uint64_t>(out_frames) * frame_bytes;
+  if (data_size > std::numeric_limits<uint32_t>::max() - kWavHeaderSize) {
+    return false;
+  }
+
+  // Planar float input, mixed down before resampling so mono output only
+  // filters one channel. Mono sources are upmixed after resampling.
+  int planes = std::min<int>(layout.channels, format.channels);
+  size_t pad_front = resample ? resampler.history : 0;
+  size_t pad_back = resample ? resampler.taps : 0;
+  std::vector<std::vector<float>> input(layout.channels);
+  for (int ch = 0; ch < layout.channels; ch++) {
+    input[ch].assign(pad_front + layout.frames + pad_back, 0.0f);
+    Deinterleave(wav + layout.data_offset, layout, ch, pad_front, &input[ch]);
+  }
+  if (planes < layout.channels) {
+    float* left = input[0].data() + pad_front;
+    const float* right = input[1].data() + pad_front;
+    for (size_t i = 0; i < layout.frames; i++) {
+      left[i] = 0.5f * (left[i] + right[i]);
+    }
+    input.resize(1);
+  }
+
+  converted->resize(kWavHeaderSize + data_size);
+  uint8_t* out = reinterpret_cast<uint8_t*>(converted->data());
+  WriteHeader(format, static_cast<uint32_t>(data_size), out);
+  out += kWavHeaderSize;
+
+  // Resample a block of frames at a time and interleave it straight into
+  // the output
+  std::vector<std::vector<float>> block(planes,
+                                        std::vector<float>(kBlockFrames));
+  uint64_t position = 0;  // Input frame of the next output frame
+  uint32_t phase = 0;     // Its phase, (frame * down) % up
+  for (size_t first = 0; first < out_frames; first += kBlockFrames) {
+    size_t count = std::min(kBlockFrames, out_frames - first);
+    const float* planar[2] = {};
+    if (resample) {
+      uint64_t start_position = position;
+      uint32_t start_phase = phase;
+      for (int ch = 0; ch < planes; ch++) {
+        position = start_position;
+        phase = start_phase;
+        const float* in = input[ch].data();
+        float* dst = block[ch].data();
+        for (size_t i = 0; i < count; i++) {
+          dst[i] = Dot(in + position,
+                       &resampler.coefs[static_cast<size_t>(phase) *
+                                        resampler.taps],
+                       resampler.taps);
+          phase += resampler.down;
+          position += phase / resampler.up;
+          phase %= resampler.up;
+        }
+        planar[ch] = dst;
+      }
+    } else {
+      for (int ch = 0; ch < planes; ch++) {
+        planar[ch] = input[ch].data() + first;
+      }
+    }
+    const float* right = planes == 2 ? planar[1] : planar[0];
+    uint8_t* dst = out + first * frame_bytes;
+    if (format.sample_format == PcmSampleFormat::kFloat32) {
+      InterleaveFloat(planar[0], right, format.channels, count, dst);
+    } else {
+      InterleaveInt16(planar[0], right, format.channels, count, dst);
+    }
+  }
+  return true;
+}
+
+}  // namespace music262
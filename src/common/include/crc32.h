@@ -0,0 +1,64 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+
+namespace music262 {
+
+namespace crc32_detail {
+
+// Slicing-by-8 tables of the reflected CRC-32 (IEEE 802.3) polynomial
+inline const std::array<std::array<uint32_t, 256>, 8>& Tables() {
+  static const auto tables = [] {
+    std::array<std::array<uint32_t, 256>, 8> t{};
+    for (uint32_t i = 0; i < 256; i++) {
+      uint32_t crc = i;
+      for (int bit = 0; bit < 8; bit++) {
+        crc = (crc >> 1) ^ (0xEDB88320u & (0u - (crc & 1)));
+      }
+      t[0][i] = crc;
+    }
+    for (uint32_t i = 0; i < 256; i++) {
+      for (int k = 1; k < 8; k++) {
+        t[k][i] = (t[k - 1][i] >> 8) ^ t[0][t[k - 1][i] & 0xFF];
+      }
+    }
+    return t;
+  }();
+  return tables;
+}
+
+}  // namespace crc32_detail
+
+/**
+ * @brief Compute the CRC-32 (as used by zlib and PNG) of a buffer
+ *
+ * Pass the result of a previous call as crc to checksum data that arrives in
+ * pieces.
+ *
+ * @param data Bytes to checksum
+ * @param size Number of bytes
+ * @param crc CRC of the preceding bytes, 0 for the first piece
+ * @return uint32_t CRC of all bytes so far
+ */
+inline uint32_t Crc32(const void* data, size_t size, uint32_t crc = 0) {
+  const auto& t = crc32_detail::Tables();
+  const uint8_t* p = static_cast<const uint8_t*>(data);
+  crc = ~crc;
+  for (; size >= 8; size -= 8, p += 8) {
+    uint32_t low = crc ^ (static_cast<uint32_t>(p[0]) |
+                          static_cast<uint32_t>(p[1]) << 8 |
+                          static_cast<uint32_t>(p[2]) << 16 |
+                          static_cast<uint32_t>(p[3]) << 24);
+    crc = t[7][low & 0xFF] ^ t[6][(low >> 8) & 0xFF] ^
+          t[5][(low >> 16) & 0xFF] ^ t[4][low >> 24] ^ t[3][p[4]] ^
+          t[2][p[5]] ^ t[1][p[6]] ^ t[0][p[7]];
+  }
+  for (; size > 0; size--, p++) {
+    crc = (crc >> 8) ^ t[0][(crc ^ *p) & 0xFF];
+  }
+  return ~crc;
+}
+
+}  // namespace music262
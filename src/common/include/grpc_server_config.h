@@ -0,0 +1,274 @@
+#pragma once
+
+#include <grpcpp/resource_quota.h>
+#include <grpcpp/server_builder.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <climits>
+#include <cstdint>
+#include <cstdlib>
+#include <fstream>
+#include <string>
+#include <vector>
+
+namespace music262 {
+
+/**
+ * @brief Resource limits, thread model and HTTP/2 transport settings of a
+ * gRPC server
+ *
+ * Every setting defaults to 0, which keeps gRPC's own default. Settings are
+ * named like the flags that set them, e.g. grpc_max_streams.
+ */
+struct GrpcServerConfig {
+  /** @brief Memory the server's transport may use in MB, 0 for unlimited */
+  int memory_mb = 0;
+
+  /** @brief Threads a sync server may run its calls on, 0 for unlimited */
+  int max_threads = 0;
+
+  /** @brief Minimum and maximum polling threads of a sync server */
+  int min_pollers = 0;
+  int max_pollers = 0;
+
+  /** @brief Completion queues of a sync server */
+  int sync_cqs = 0;
+
+  /** @brief Concurrent streams on one client connection */
+  int max_streams = 0;
+
+  /** @brief Largest message sent or received in MB */
+  int max_message_mb = 0;
+
+  /** @brief Idle time before the server pings a connection, and how long it
+   * waits for the answer, in ms */
+  int keepalive_ms = 0;
+  int keepalive_timeout_ms = 0;
+
+  /** @brief Shortest interval between a client's keepalive pings the server
+   * accepts in ms */
+  int min_client_ping_ms = 0;
+
+  /**
+   * @brief HTTP/2 flow-control window of each stream in KB
+   *
+   * Setting it turns off gRPC's bandwidth-delay probing, which otherwise
+   * grows the window of busy connections on its own.
+   */
+  int stream_window_kb = 0;
+
+  /** @brief Largest HTTP/2 frame the server accepts in KB (16 to 16384,
+   * smaller values are raised to 16) */
+  int max_frame_kb = 0;
+
+  /** @brief Bytes a stream may queue for the transport before a write
+   * completes, in KB */
+  int write_buffer_kb = 0;
+
+  /**
+   * @brief Set one setting by the name of its flag
+   *
+   * @param name Flag name without leading dashes, with underscores or dashes
+   * (grpc_max_streams or grpc-max-streams)
+   * @param value Non-negative integer value, at most the setting's limit
+   * (e.g. 2047 for grpc_max_message_mb, whose bytes must fit an int)
+   * @return true If the name is a setting and the value is valid
+   */
+  bool Set(std::string name, const std::string& value) {
+    std::replace(name.begin(), name.end(), '-', '_');
+    for (const auto& setting : Settings()) {
+      if (name == setting.name) {
+        errno = 0;
+        char* end = nullptr;
+        long parsed = std::strtol(value.c_str(), &end, 10);
+        if (value.empty() || *end != '\0' || errno != 0 || parsed < 0 ||
+            parsed > setting.max) {
+          return false;
+        }
+        this->*setting.field = static_cast<int>(parsed);
+        return true;
+      }
+    }
+    return false;
+  }
+
+  /**
+   * @brief Apply the settings to a server before it is built
+   *
+   * @param builder Builder of the server
+   */
+  void Apply(grpc::ServerBuilder* builder) const {
+    if (memory_mb > 0 || max_threads > 0) {
+      grpc::ResourceQuota quota("music262");
+      if (memory_mb > 0) {
+        quota.Resize(static_cast<size_t>(memory_mb) * 1024 * 1024);
+      }
+      if (max_threads > 0) {
+        quota.SetMaxThreads(max_threads);
+      }
+      builder->SetResourceQuota(quota);
+    }
+
+    using SyncOption = grpc::ServerBuilder::SyncServerOption;
+    if (min_pollers > 0) {
+      builder->SetSyncServerOption(SyncOption::MIN_POLLERS, min_pollers);
+    }
+    if (max_pollers > 0) {
+      builder->SetSyncServerOption(SyncOption::MAX_POLLERS, max_pollers);
+    }
+    if (sync_cqs > 0) {
+      builder->SetSyncServerOption(SyncOption::NUM_CQS, sync_cqs);
+    }
+
+    if (max_streams > 0) {
+      builder->AddChannelArgument(GRPC_ARG_MAX_CONCURRENT_STREAMS,
+                                  max_streams);
+    }
+    if (max_message_mb > 0) {
+      builder->SetMaxReceiveMessageSize(Bytes(max_message_mb, 1024 * 1024));
+      builder->SetMaxSendMessageSize(Bytes(max_message_mb, 1024 * 1024));
+    }
+    if (keepalive_ms > 0) {
+      builder->AddChannelArgument(GRPC_ARG_KEEPALIVE_TIME_MS, keepalive_ms);
+    }
+    if (keepalive_timeout_ms > 0) {
+      builder->AddChannelArgument(GRPC_ARG_KEEPALIVE_TIMEOUT_MS,
+                                  keepalive_timeout_ms);
+    }
+    if (min_client_ping_ms > 0) {
+      builder->AddChannelArgument(
+          GRPC_ARG_HTTP2_MIN_RECV_PING_INTERVAL_WITHOUT_DATA_MS,
+          min_client_ping_ms);
+    }
+    if (stream_window_kb > 0) {
+      builder->AddChannelArgument(GRPC_ARG_HTTP2_STREAM_LOOKAHEAD_BYTES,
+                                  Bytes(stream_window_kb, 1024));
+      builder->AddChannelArgument(GRPC_ARG_HTTP2_BDP_PROBE, 0);
+    }
+    if (max_frame_kb > 0) {
+      builder->AddChannelArgument(GRPC_ARG_HTTP2_MAX_FRAME_SIZE,
+                                  std::clamp(max_frame_kb, 16, 16384) * 1024);
+    }
+    if (write_buffer_kb > 0) {
+      builder->AddChannelArgument(GRPC_ARG_HTTP2_WRITE_BUFFER_SIZE,
+                                  Bytes(write_buffer_kb, 1024));
+    }
+  }
+
+  /**
+   * @brief Describe the settings that differ from gRPC's defaults
+   *
+   * @return std::string e.g. "grpc_max_streams=256 grpc_sync_cqs=2", or
+   * "defaults"
+   */
+  std::string Summary() const {
+    std::string summary;
+    for (const auto& setting : Settings()) {
+      if (this->*setting.field > 0) {
+        summary += (summary.empty() ? "" : " ") + std::string(setting.name) +
+                   "=" + std::to_string(this->*setting.field);
+      }
+    }
+    return summary.empty() ? "defaults" : summary;
+  }
+
+ private:
+  struct Setting {
+    const char* name;
+    int GrpcServerConfig::*field;
+    long max;  // Largest value whose bytes still fit the int gRPC takes
+  };
+
+  static constexpr long kMaxCount = 1 << 30;
+  static constexpr long kMaxKb = INT_MAX / 1024;
+  static constexpr long kMaxMb = INT_MAX / (1024 * 1024);
+
+  // Size in bytes of a setting in units, capped for fields set directly
+  static int Bytes(int value, int unit) {
+    return static_cast<int>(
+        std::min<int64_t>(static_cast<int64_t>(value) * unit, INT_MAX));
+  }
+
+  static const std::vector<Setting>& Settings() {
+    static const std::vector<Setting> settings = {
+        {"grpc_memory_mb", &GrpcServerConfig::memory_mb, kMaxCount},
+        {"grpc_max_threads", &GrpcServerConfig::max_threads, kMaxCount},
+        {"grpc_min_pollers", &GrpcServerConfig::min_pollers, kMaxCount},
+        {"grpc_max_pollers", &GrpcServerConfig::max_pollers, kMaxCount},
+        {"grpc_sync_cqs", &GrpcServerConfig::sync_cqs, kMaxCount},
+        {"grpc_max_streams", &GrpcServerConfig::max_streams, kMaxCount},
+        {"grpc_max_message_mb", &GrpcServerConfig::max_message_mb, kMaxMb},
+        {"grpc_keepalive_ms", &GrpcServerConfig::keepalive_ms, kMaxCount},
+        {"grpc_keepalive_timeout_ms", &GrpcServerConfig::keepalive_timeout_ms,
+         kMaxCount},
+        {"grpc_min_client_ping_ms", &GrpcServerConfig::min_client_ping_ms,
+         kMaxCount},
+        {"grpc_stream_window_kb", &GrpcServerConfig::stream_window_kb,
+         kMaxKb},
+        {"grpc_max_frame_kb", &GrpcServerConfig::max_frame_kb, 16384},
+        {"grpc_write_buffer_kb", &GrpcServerConfig::write_buffer_kb, kMaxKb},
+    };
+    return settings;
+  }
+};
+
+/**
+ * @brief Read a config file into command-line arguments
+ *
+ * Each line holds one flag as it is written on the command line without the
+ * leading dashes, followed by its value if it takes one, optionally after an
+ * '=': "num_cqs = 4", "grpc_max_streams 256" or "no_watch". Blank lines and
+ * lines starting with '#' are skipped. A config file may not name another
+ * with "config", which could include itself.
+ *
+ * @param path File to read
+ * @param args Receives the arguments, e.g. "--num_cqs", "4"
+ * @param error Receives why the file was rejected, may be nullptr
+ * @return true If the file could be read
+ */
+inline bool ReadConfigFile(const std::string& path,
+                           std::vector<std::string>* args,
+                           std::string* error = nullptr) {
+  std::ifstream file(path);
+  if (!file) {
+    if (error) {
+      *error = "cannot open " + path;
+    }
+    return false;
+  }
+  std::vector<std::string> file_args;
+  const char* const kSpace = " \t\r";
+  std::string line;
+  while (std::getline(file, line)) {
+    size_t start = line.find_first_not_of(kSpace);
+    if (start == std::string::npos || line[start] == '#') {
+      continue;
+    }
+    size_t name_end = line.find_first_of(" \t\r=", start);
+    std::string name = line.substr(start, name_end - start);
+    if (name == "config") {
+      if (error) {
+        *error = path + " names another config file";
+      }
+      return false;
+    }
+    file_args.push_back("--" + name);
+    if (name_end == std::string::npos) {
+      continue;
+    }
+    size_t value_start = line.find_first_not_of(kSpace, name_end);
+    if (value_start != std::string::npos && line[value_start] == '=') {
+      value_start = line.find_first_not_of(kSpace, value_start + 1);
+    }
+    if (value_start != std::string::npos) {
+      size_t value_end = line.find_last_not_of(kSpace);
+      file_args.push_back(
+          line.substr(value_start, value_end - value_start + 1));
+    }
+  }
+  args->insert(args->end(), file_args.begin(), file_args.end());
+  return true;
+}
+
+}  // namespace music262
@@ -0,0 +1,1308 @@
+#include "include/async_audio_service.h"
+
+#include <grpcpp/alarm.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+
+#include "../common/include/logger.h"
+#include "include/chunk_encoder.h"
+#include "include/chunk_sizer.h"
+
+// Alarms of the WatchPeers calls waiting for the next peer change. A peer
+// change cancels every alarm, which wakes its call right away.
+class PeerWatchers {
+ public:
+  explicit PeerWatchers(const AudioServer* server) : server_(server) {}
+
+  // Wake the call owning the alarm on the next change after sequence.
+  // Returns false if there already was one or once shut down, the caller
+  // then cancels the alarm itself. Otherwise the call may be woken on
+  // another thread before this returns.
+  bool Add(grpc::Alarm* alarm, uint64_t sequence) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (shut_down_ || server_->GetPeerSequence() != sequence) {
+      return false;
+    }
+    alarms_.insert(alarm);
+    return true;
+  }
+
+  // Must be called when the alarm fires, before it is set again
+  void Remove(grpc::Alarm* alarm) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    alarms_.erase(alarm);
+  }
+
+  void WakeAll() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (grpc::Alarm* alarm : alarms_) {
+      alarm->Cancel();
+    }
+    alarms_.clear();
+  }
+
+  // Wake every call and stop accepting new ones
+  void Shutdown() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    shut_down_ = true;
+    for (grpc::Alarm* alarm : alarms_) {
+      alarm->Cancel();
+    }
+    alarms_.clear();
+  }
+
+ private:
+  const AudioServer* server_;
+  std::mutex mutex_;
+  std::unordered_set<grpc::Alarm*> alarms_;
+  bool shut_down_ = false;
+};
+
+namespace {
+
+// Host part of a gRPC peer string such as "ipv4:10.0.0.7:52134", streams of
+// one client share its egress rate cap whatever port they come from
+std::string ClientHost(const std::string& peer) {
+  std::string address = AudioServer::ExtractIPFromPeer(peer);
+  size_t port = address.rfind(':');
+  if (port == std::string::npos || address.back() == ']') {
+    return address;
+  }
+  return address.substr(0, port);
+}
+
+// Sample format of a client's output device
+music262::PcmFormat ToPcmFormat(const audio_service::PcmFormat& format) {
+  music262::PcmFormat pcm;
+  if (format.sample_format() == audio_service::SAMPLE_FORMAT_F32) {
+    pcm.sample_format = music262::PcmSampleFormat::kFloat32;
+  }
+  // Negative values wrap to out of range ones the converter rejects
+  pcm.sample_rate = static_cast<uint32_t>(format.sample_rate());
+  pcm.channels = static_cast<uint16_t>(
+      std::min<uint32_t>(static_cast<uint32_t>(format.channels()), 0xFFFF));
+  return pcm;
+}
+
+// Base class of all in-flight calls. A call is used as the tag of its own
+// operations and reacts to each completion in Proceed. Each call has at most
+// one outstanding operation, so Proceed never runs concurrently for a call.
+class ServerCall {
+ public:
+  virtual ~ServerCall() = default;
+
+  /**
+   * @brief Handle the completion of the call's pending operation
+   *
+   * @param ok Whether the operation succeeded
+   */
+  virtual void Proceed(bool ok) = 0;
+};
+
+// Generic unary call that delegates to a handler function, timed from the
+// request arriving to the response being sent
+template <class Request, class Response>
+class UnaryCall : public ServerCall {
+ public:
+  using Responder = grpc::ServerAsyncResponseWriter<Response>;
+  using RequestFn =
+      std::function<void(grpc::ServerContext*, Request*, Responder*,
+                         grpc::ServerCompletionQueue*, void*)>;
+  using HandlerFn = std::function<grpc::Status(grpc::ServerContext*,
+                                               const Request&, Response*)>;
+
+  UnaryCall(AsyncAudioService* owner, grpc::ServerCompletionQueue* cq,
+            RpcMethod method, RequestFn request_fn, HandlerFn handler)
+      : owner_(owner),
+        cq_(cq),
+        method_(method),
+        request_fn_(std::move(request_fn)),
+        handler_(std::move(handler)),
+        responder_(&context_) {
+    request_fn_(&context_, &request_, &responder_, cq_, this);
+  }
+
+  void Proceed(bool ok) override {
+    if (finishing_) {
+      owner_->stats()->CallFinished(
+          method_, std::chrono::steady_clock::now() - start_, ok && status_ok_);
+      delete this;
+      return;
+    }
+    if (!ok) {
+      delete this;
+      return;
+    }
+    start_ = std::chrono::steady_clock::now();
+    owner_->stats()->CallStarted(method_);
+
+    // Accept the next call of this type before handling this one
+    if (!owner_->IsShuttingDown()) {
+      new UnaryCall(owner_, cq_, method_, request_fn_, handler_);
+    }
+
+    Response response;
+    grpc::Status status = handler_(&context_, request_, &response);
+    status_ok_ = status.ok();
+    finishing_ = true;
+    responder_.Finish(response, status, this);
+  }
+
+ private:
+  AsyncAudioService* owner_;
+  grpc::ServerCompletionQueue* cq_;
+  RpcMethod method_;
+  RequestFn request_fn_;
+  HandlerFn handler_;
+  grpc::ServerContext context_;
+  Request request_;
+  Responder responder_;
+  bool finishing_ = false;
+  bool status_ok_ = false;
+  std::chrono::steady_clock::time_point start_;
+};
+
+// Streams a byte range of a mapped song to one client in chunks sized from
+// the stream's own backpressure. Every chunk is a slice of the shared
+// mapping, so no audio bytes are copied per stream, and the stream only needs
+// a thread while a write completion is handled. Subclasses request their RPC
+// and pick the song and range to send. The time each step takes is recorded
+// in the service's stats.
+class SongStreamCall : public ServerCall {
+ public:
+  void Proceed(bool ok) override {
+    switch (state_) {
+      case State::kRequested:
+        if (!ok) {
+          delete this;  // Server is shutting down
+          return;
+        }
+        started_ = std::chrono::steady_clock::now();
+        owner_->stats()->CallStarted(method_);
+        if (!owner_->IsShuttingDown()) {
+          RequestNext();
+        }
+        OnStart();
+        break;
+
+      case State::kPreparing:
+        // The work handed to another thread is done
+        OnPrepared();
+        break;
+
+      case State::kQueued:
+        // The scheduler granted the chunk, or is shutting down
+        Write();
+        break;
+
+      case State::kWriting: {
+        owner_->egress()->Complete(chunk_size_);
+        if (!ok) {
+          LOG_ERROR("Failed to write audio chunk to client");
+          OnDone(false);
+          return;
+        }
+        auto now = std::chrono::steady_clock::now();
+        auto latency = std::chrono::duration_cast<std::chrono::microseconds>(
+            now - write_start_);
+        sizer_.OnWriteComplete(chunk_size_, latency);
+        ServerStats* stats = owner_->stats();
+        stats->BytesSent(method_, chunk_size_);
+        stats->RecordStage(StreamStage::kChunkWrite, now - write_start_);
+        if (chunks_sent_ == 1) {
+          stats->RecordStage(StreamStage::kFirstChunk, now - started_);
+        }
+        OnWriteDone();
+        break;
+      }
+
+      case State::kFinishing:
+        OnDone(ok && status_ok_);
+        break;
+    }
+  }
+
+ protected:
+  SongStreamCall(AsyncAudioService* owner, grpc::ServerCompletionQueue* cq,
+                 RpcMethod method)
+      : owner_(owner),
+        cq_(cq),
+        writer_(&context_),
+        method_(method),
+        sizer_(owner->options().min_chunk_bytes,
+               owner->options().max_chunk_bytes,
+               owner->options().target_write_latency) {}
+
+  // Create the call that accepts the next request of the same RPC
+  virtual void RequestNext() = 0;
+
+  // Handle the request, ends with either Stream, Finish or WaitForPrepare
+  virtual void OnStart() = 0;
+
+  // Continue once the work OnStart waited for is done, ends with either
+  // Stream or Finish
+  virtual void OnPrepared() {}
+
+  // Wait for work handed to another thread instead of blocking the poller.
+  // Must be called before the work can finish; once it has, Resume wakes
+  // the call and OnPrepared runs on its completion queue.
+  void WaitForPrepare() { state_ = State::kPreparing; }
+
+  // May be called on any thread
+  void Resume() { alarm_.Set(cq_, std::chrono::system_clock::now(), this); }
+
+  template <class Request>
+  bool ParseRequest(Request* request) {
+    return grpc::SerializationTraits<Request>::Deserialize(&request_, request)
+        .ok();
+  }
+
+  // Send the bytes [start, end) of a song and finish the call
+  void Stream(std::shared_ptr<const MappedSong> song, size_t start,
+              size_t end) {
+    song_ = std::move(song);
+    start_ = offset_ = start;
+    end_ = end;
+
+    // Let the client resume from its last received byte if the stream drops
+    context_.AddInitialMetadata(kResumeTokenKey, song_->resume_token());
+    // and allocate the whole file before the first chunk arrives
+    context_.AddInitialMetadata(kSongSizeKey, std::to_string(song_->size()));
+
+    // Register client in the connected clients list
+    std::string client_ip = context_.peer();
+    owner_->server()->RegisterClient(client_ip);
+
+    flow_ = owner_->egress()->AddFlow(ClientHost(client_ip));
+    OnWriteDone();
+  }
+
+  void Finish(const grpc::Status& status) {
+    state_ = State::kFinishing;
+    status_ok_ = status.ok();
+    writer_.Finish(status, this);
+  }
+
+  static constexpr const char* kResumeTokenKey = "resume-token";
+  static constexpr const char* kSongSizeKey = "song-size";
+
+  // Set by subclasses whose client is downloading ahead of playback
+  bool prefetch_ = false;
+
+  AsyncAudioService* owner_;
+  grpc::ServerCompletionQueue* cq_;
+  grpc::ServerContext context_;
+  grpc::ByteBuffer request_;
+  grpc::ServerAsyncWriter<grpc::ByteBuffer> writer_;
+
+  // Record the time taken to find and map the song to stream
+  void SongOpened(std::chrono::steady_clock::time_point open_start) {
+    owner_->stats()->RecordStage(StreamStage::kSongOpen,
+                                 std::chrono::steady_clock::now() - open_start);
+  }
+
+ private:
+  enum class State { kRequested, kPreparing, kQueued, kWriting, kFinishing };
+
+  // Ask the egress scheduler for the next chunk, waits on the alarm until
+  // the chunk is granted unless it is granted right away
+  void OnWriteDone() {
+    if (offset_ >= end_) {
+      Finish(grpc::Status::OK);
+      return;
+    }
+
+    chunk_size_ = std::min(sizer_.NextChunkSize(), end_ - offset_);
+    EgressScheduler* egress = owner_->egress();
+    bool urgent =
+        !prefetch_ && offset_ - start_ < egress->options().urgent_bytes;
+    state_ = State::kQueued;
+    bool granted = egress->Request(flow_, chunk_size_, urgent, [this]() {
+      alarm_.Set(cq_, std::chrono::system_clock::now(), this);
+    });
+    if (granted) {
+      Write();
+    }
+  }
+
+  void Write() {
+    auto encode_start = std::chrono::steady_clock::now();
+    chunk_ = EncodeAudioChunk(song_, offset_, chunk_size_);
+    write_start_ = std::chrono::steady_clock::now();
+    owner_->stats()->RecordStage(StreamStage::kChunkEncode,
+                                 write_start_ - encode_start);
+    offset_ += chunk_size_;
+    chunks_sent_++;
+    state_ = State::kWriting;
+    writer_.Write(chunk_, this);
+  }
+
+  void OnDone(bool ok) {
+    if (flow_ != 0) {
+      owner_->egress()->RemoveFlow(flow_);
+    }
+    if (song_) {
+      LOG_INFO("Sent {} bytes of audio data in {} chunks (last chunk {} KB)",
+               offset_ - start_, chunks_sent_, chunk_size_ / 1024);
+    }
+    owner_->stats()->CallFinished(
+        method_, std::chrono::steady_clock::now() - started_, ok);
+    delete this;
+  }
+
+  State state_ = State::kRequested;
+  RpcMethod method_;
+  bool status_ok_ = true;
+  std::chrono::steady_clock::time_point started_;  // Request arrived
+
+  std::shared_ptr<const MappedSong> song_;
+  grpc::ByteBuffer chunk_;
+  size_t start_ = 0;   // First byte of the requested range
+  size_t offset_ = 0;  // Next byte to send
+  size_t end_ = 0;     // One past the last byte of the requested range
+
+  ChunkSizer sizer_;
+  size_t chunk_size_ = 0;  // Size of the chunk being written
+  EgressScheduler::FlowId flow_ = 0;
+  grpc::Alarm alarm_;  // Fires once prepared or the queued chunk is granted
+  size_t chunks_sent_ = 0;
+  std::chrono::steady_clock::time_point write_start_;
+};
+
+// Streams a whole song or a byte range of it
+class LoadAudioCall : public SongStreamCall {
+ public:
+  LoadAudioCall(AsyncAudioService* owner, grpc::ServerCompletionQueue* cq)
+      : SongStreamCall(owner, cq, RpcMethod::kLoadAudio) {
+    owner_->service()->RequestLoadAudio(&context_, &request_, &writer_, cq_,
+                                        cq_, this);
+  }
+
+ private:
+  void RequestNext() override { new LoadAudioCall(owner_, cq_); }
+
+  void OnStart() override {
+    if (!ParseRequest(&load_request_)) {
+      Finish(grpc::Status(grpc::StatusCode::INVALID_ARGUMENT,
+                          "Malformed LoadAudio request"));
+      return;
+    }
+
+    int song_num = load_request_.song_num();
+    prefetch_ = load_request_.prefetch();
+    LOG_INFO("Received request to load song: {} (offset {}, length {})",
+             song_num, load_request_.offset(), load_request_.length());
+
+    // Prefer the losslessly encoded song when the client can decode it, but
+    // a resumed download has to stay on the encoding it started with.
+    // Clients asking for their device's format get PCM converted to it.
+    open_start_ = std::chrono::steady_clock::now();
+    std::shared_ptr<const MappedSong> song;
+    bool convert = load_request_.has_output_format();
+    if (!convert && AcceptsLossless(load_request_)) {
+      auto encoded = owner_->server()->GetEncodedSong(song_num);
+      if (encoded &&
+          (load_request_.resume_token().empty() ||
+           load_request_.resume_token() == encoded->resume_token())) {
+        song = std::move(encoded);
+        codec_ = kLosslessCodec;
+      }
+    }
+
+    // Get the shared mapping of the song from the server
+    if (!song) {
+      song = owner_->server()->GetSong(song_num);
+    }
+    if (!song || !convert) {
+      Serve(std::move(song));
+      return;
+    }
+
+    // A format not converted yet is converted on a worker thread
+    WaitForPrepare();
+    if (owner_->server()->GetConvertedSong(
+            song_num, song, ToPcmFormat(load_request_.output_format()),
+            &converted_, [this](std::shared_ptr<const MappedSong> converted) {
+              converted_ = std::move(converted);
+              Resume();
+            })) {
+      OnPrepared();
+    }
+  }
+
+  void OnPrepared() override {
+    if (!converted_) {
+      SongOpened(open_start_);
+      Finish(grpc::Status(grpc::StatusCode::INVALID_ARGUMENT,
+                          "Song cannot be converted to the output format"));
+      return;
+    }
+    Serve(std::move(converted_));
+  }
+
+  // Stream the requested range of the song picked for the request
+  void Serve(std::shared_ptr<const MappedSong> song) {
+    SongOpened(open_start_);
+    if (!song) {
+      Finish(grpc::Status(grpc::StatusCode::NOT_FOUND, "Song not found"));
+      return;
+    }
+
+    // A resumed download must continue from the same version of the song
+    if (!load_request_.resume_token().empty() &&
+        load_request_.resume_token() != song->resume_token()) {
+      Finish(grpc::Status(grpc::StatusCode::FAILED_PRECONDITION,
+                          "Song has changed since the download started"));
+      return;
+    }
+
+    // Serve only the requested byte range
+    int64_t size = static_cast<int64_t>(song->size());
+    int64_t offset = load_request_.offset();
+    int64_t length = load_request_.length();
+    if (offset < 0 || length < 0 || offset > size) {
+      Finish(grpc::Status(grpc::StatusCode::OUT_OF_RANGE,
+                          "Requested range is outside the song"));
+      return;
+    }
+    // Compare against the remaining bytes, as offset + length can overflow
+    size_t end = (length == 0 || length > size - offset)
+                     ? song->size()
+                     : static_cast<size_t>(offset + length);
+
+    context_.AddInitialMetadata(kCodecKey, codec_);
+    Stream(std::move(song), static_cast<size_t>(offset), end);
+  }
+
+  static bool AcceptsLossless(const audio_service::LoadAudioRequest& request) {
+    for (int codec : request.accepted_codecs()) {
+      if (codec == audio_service::CODEC_M262_LOSSLESS) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  static constexpr const char* kCodecKey = "audio-codec";
+  static constexpr const char* kPcmCodec = "pcm";
+  static constexpr const char* kLosslessCodec = "m262-lossless";
+
+  audio_service::LoadAudioRequest load_request_;
+  const char* codec_ = kPcmCodec;
+  std::chrono::steady_clock::time_point open_start_;
+  std::shared_ptr<const MappedSong> converted_;  // Song in the output format
+};
+
+// Streams one segment of a song's segment index
+class LoadSegmentCall : public SongStreamCall {
+ public:
+  LoadSegmentCall(AsyncAudioService* owner, grpc::ServerCompletionQueue* cq)
+      : SongStreamCall(owner, cq, RpcMethod::kLoadSegment) {
+    owner_->service()->RequestLoadSegment(&context_, &request_, &writer_, cq_,
+                                          cq_, this);
+  }
+
+ private:
+  void RequestNext() override { new LoadSegmentCall(owner_, cq_); }
+
+  void OnStart() override {
+    audio_service::LoadSegmentRequest segment_request;
+    if (!ParseRequest(&segment_request)) {
+      Finish(grpc::Status(grpc::StatusCode::INVALID_ARGUMENT,
+                          "Malformed LoadSegment request"));
+      return;
+    }
+
+    int song_num = segment_request.song_num();
+    segment_id_ = segment_request.segment_id();
+    resume_token_ = segment_request.resume_token();
+    LOG_DEBUG("Received request to load segment {} of song {}", segment_id_,
+              song_num);
+
+    // A song that has not been indexed yet is indexed on a worker thread
+    open_start_ = std::chrono::steady_clock::now();
+    WaitForPrepare();
+    if (owner_->server()->GetSegmentIndex(
+            song_num, &index_, &mapping_,
+            [this](std::shared_ptr<const SegmentIndex> index,
+                   std::shared_ptr<const MappedSong> song) {
+              index_ = std::move(index);
+              mapping_ = std::move(song);
+              Resume();
+            })) {
+      OnPrepared();
+    }
+  }
+
+  void OnPrepared() override {
+    SongOpened(open_start_);
+    if (!index_) {
+      Finish(grpc::Status(grpc::StatusCode::NOT_FOUND,
+                          "Song not found or cannot be segmented"));
+      return;
+    }
+
+    // Segments of different versions of a song do not fit together
+    if (!resume_token_.empty() && resume_token_ != index_->resume_token) {
+      Finish(grpc::Status(grpc::StatusCode::FAILED_PRECONDITION,
+                          "Song has changed since the index was fetched"));
+      return;
+    }
+
+    if (segment_id_ < 0 ||
+        segment_id_ >= static_cast<int>(index_->segments.size())) {
+      Finish(grpc::Status(grpc::StatusCode::OUT_OF_RANGE,
+                          "Segment is outside the song"));
+      return;
+    }
+
+    const SongSegment& segment = index_->segments[segment_id_];
+    Stream(std::move(mapping_), segment.offset, segment.offset + segment.size);
+  }
+
+  int segment_id_ = 0;
+  std::string resume_token_;  // Version of the song the client expects
+  std::chrono::steady_clock::time_point open_start_;
+  std::shared_ptr<const SegmentIndex> index_;
+  std::shared_ptr<const MappedSong> mapping_;  // Version index_ describes
+};
+
+// Answers GetSegmentIndex. A song that has not been indexed yet is indexed
+// on a worker thread while the call waits on an alarm, so checksumming the
+// song never holds a poller thread.
+class SegmentIndexCall : public ServerCall {
+ public:
+  SegmentIndexCall(AsyncAudioService* owner, grpc::ServerCompletionQueue* cq)
+      : owner_(owner), cq_(cq), responder_(&context_) {
+    owner_->service()->RequestGetSegmentIndex(&context_, &request_,
+                                              &responder_, cq_, cq_, this);
+  }
+
+  void Proceed(bool ok) override {
+    switch (state_) {
+      case State::kRequested:
+        if (!ok) {
+          delete this;  // Server is shutting down
+          return;
+        }
+        started_ = std::chrono::steady_clock::now();
+        owner_->stats()->CallStarted(RpcMethod::kGetSegmentIndex);
+        if (!owner_->IsShuttingDown()) {
+          new SegmentIndexCall(owner_, cq_);
+        }
+        LOG_INFO("Received segment index request for song: {}",
+                 request_.song_num());
+        state_ = State::kIndexing;
+        if (owner_->server()->GetSegmentIndex(
+                request_.song_num(), &index_, &song_,
+                [this](std::shared_ptr<const SegmentIndex> index,
+                       std::shared_ptr<const MappedSong> song) {
+                  index_ = std::move(index);
+                  song_ = std::move(song);
+                  alarm_.Set(cq_, std::chrono::system_clock::now(), this);
+                })) {
+          Respond();
+        }
+        break;
+
+      case State::kIndexing:
+        Respond();
+        break;
+
+      case State::kFinishing:
+        owner_->stats()->CallFinished(
+            RpcMethod::kGetSegmentIndex,
+            std::chrono::steady_clock::now() - started_, ok && status_ok_);
+        delete this;
+        break;
+    }
+  }
+
+ private:
+  enum class State { kRequested, kIndexing, kFinishing };
+
+  void Respond() {
+    audio_service::SegmentIndexResponse response;
+    grpc::Status status;
+    if (!index_) {
+      status = grpc::Status(grpc::StatusCode::NOT_FOUND,
+                            "Song not found or cannot be segmented");
+    } else {
+      response.set_resume_token(index_->resume_token);
+      response.set_song_size(static_cast<int64_t>(index_->song_size));
+      response.set_sample_rate(static_cast<int32_t>(index_->sample_rate));
+      response.set_channels(index_->channels);
+      response.set_bytes_per_frame(index_->bytes_per_frame);
+      for (const auto& segment : index_->segments) {
+        auto* entry = response.add_segments();
+        entry->set_id(segment.id);
+        entry->set_offset(static_cast<int64_t>(segment.offset));
+        entry->set_size(static_cast<int64_t>(segment.size));
+        entry->set_first_frame(static_cast<int64_t>(segment.first_frame));
+        entry->set_frame_count(static_cast<int64_t>(segment.frame_count));
+        entry->set_crc32(segment.crc32);
+      }
+    }
+    status_ok_ = status.ok();
+    state_ = State::kFinishing;
+    responder_.Finish(response, status, this);
+  }
+
+  AsyncAudioService* owner_;
+  grpc::ServerCompletionQueue* cq_;
+  grpc::ServerContext context_;
+  audio_service::SegmentIndexRequest request_;
+  grpc::ServerAsyncResponseWriter<audio_service::SegmentIndexResponse>
+      responder_;
+  grpc::Alarm alarm_;  // Fires once the index has been built
+  State state_ = State::kRequested;
+  bool status_ok_ = false;
+  std::chrono::steady_clock::time_point started_;
+
+  std::shared_ptr<const SegmentIndex> index_;
+  std::shared_ptr<const MappedSong> song_;
+};
+
+// Pushes the peers joining and leaving to one client. Between updates the
+// call waits on an alarm that the registry's change listener cancels, so a
+// watching client needs neither a thread nor polling.
+class WatchPeersCall : public ServerCall {
+ public:
+  WatchPeersCall(AsyncAudioService* owner, grpc::ServerCompletionQueue* cq)
+      : owner_(owner), cq_(cq), writer_(&context_) {
+    owner_->service()->RequestWatchPeers(&context_, &request_, &writer_, cq_,
+                                         cq_, this);
+  }
+
+  void Proceed(bool ok) override {
+    switch (state_) {
+      case State::kRequested:
+        if (!ok) {
+          delete this;  // Server is shutting down
+          return;
+        }
+        started_ = std::chrono::steady_clock::now();
+        owner_->stats()->CallStarted(RpcMethod::kWatchPeers);
+        if (!owner_->IsShuttingDown()) {
+          new WatchPeersCall(owner_, cq_);
+        }
+        address_ = AudioServer::ExtractIPFromPeer(context_.peer());
+        owner_->server()->RegisterClient(context_.peer());
+        epoch_ = request_.epoch();
+        sequence_ = request_.sequence();
+        LOG_INFO("Client {} watching peers from sequence {}", address_,
+                 sequence_);
+        SendChanges(false);
+        break;
+
+      case State::kWriting:
+        if (!ok) {
+          LOG_DEBUG("Peer watcher {} went away", address_);
+          Done(false);
+          return;
+        }
+        SendChanges(false);
+        break;
+
+      case State::kWaiting:
+        // The alarm expires unless a change cancels it first
+        owner_->peer_watchers()->Remove(&alarm_);
+        SendChanges(ok);
+        break;
+
+      case State::kFinishing:
+        Done(ok);
+        break;
+    }
+  }
+
+ private:
+  enum class State { kRequested, kWriting, kWaiting, kFinishing };
+
+  void Done(bool ok) {
+    owner_->stats()->CallFinished(
+        RpcMethod::kWatchPeers, std::chrono::steady_clock::now() - started_,
+        ok);
+    delete this;
+  }
+
+  // Send the changes since the last update, or wait for some
+  void SendChanges(bool keepalive) {
+    if (owner_->IsShuttingDown()) {
+      state_ = State::kFinishing;
+      writer_.Finish(grpc::Status::OK, this);
+      return;
+    }
+
+    PeerChanges changes = owner_->server()->GetPeerChanges(epoch_, sequence_);
+    epoch_ = changes.epoch;
+    sequence_ = changes.sequence;
+
+    // Only the last change of each peer counts, the watcher's own peer
+    // service is left out
+    std::vector<std::string> order;
+    std::unordered_map<std::string, bool> joined;
+    for (const PeerEvent& event : changes.events) {
+      if (event.address == address_) {
+        continue;
+      }
+      if (joined.find(event.peer_address) == joined.end()) {
+        order.push_back(event.peer_address);
+      }
+      joined[event.peer_address] = event.joined;
+    }
+    if (order.empty() && !changes.reset && !keepalive) {
+      Wait();
+      return;
+    }
+
+    audio_service::PeerUpdate update;
+    update.set_epoch(epoch_);
+    update.set_sequence(sequence_);
+    update.set_reset(changes.reset);
+    for (const std::string& peer : order) {
+      if (joined[peer]) {
+        update.add_joined(peer);
+      } else {
+        update.add_left(peer);
+      }
+    }
+    state_ = State::kWriting;
+    writer_.Write(update, this);
+  }
+
+  void Wait() {
+    state_ = State::kWaiting;
+    alarm_.Set(cq_, std::chrono::system_clock::now() + kKeepalive, this);
+    if (!owner_->peer_watchers()->Add(&alarm_, sequence_)) {
+      alarm_.Cancel();
+    }
+  }
+
+  // Time between updates sent to check that an idle watcher is still there
+  static constexpr std::chrono::seconds kKeepalive{30};
+
+  AsyncAudioService* owner_;
+  grpc::ServerCompletionQueue* cq_;
+  grpc::ServerContext context_;
+  audio_service::WatchPeersRequest request_;
+  grpc::ServerAsyncWriter<audio_service::PeerUpdate> writer_;
+  grpc::Alarm alarm_;
+  State state_ = State::kRequested;
+
+  std::string address_;  // "ip:port" the watcher connects from
+  std::chrono::steady_clock::time_point started_;
+  uint64_t epoch_ = 0;
+  uint64_t sequence_ = 0;  // Latest change sent to the watcher
+};
+
+// Sends a live broadcast to one listener. Each chunk was serialized once
+// into the broadcast's ring and is shared by every listener's write. Between
+// chunks the call waits on an alarm set for the next chunk's publish time,
+// so a listener holds neither a thread nor a lock while it waits.
+class JoinBroadcastCall : public ServerCall {
+ public:
+  JoinBroadcastCall(AsyncAudioService* owner, grpc::ServerCompletionQueue* cq)
+      : owner_(owner), cq_(cq), writer_(&context_) {
+    owner_->service()->RequestJoinBroadcast(&context_, &request_, &writer_,
+                                            cq_, cq_, this);
+  }
+
+  void Proceed(bool ok) override {
+    switch (state_) {
+      case State::kRequested:
+        if (!ok) {
+          delete this;  // Server is shutting down
+          return;
+        }
+        started_ = std::chrono::steady_clock::now();
+        owner_->stats()->CallStarted(RpcMethod::kJoinBroadcast);
+        if (!owner_->IsShuttingDown()) {
+          new JoinBroadcastCall(owner_, cq_);
+        }
+        Join();
+        break;
+
+      case State::kWriting:
+        if (!ok) {
+          LOG_DEBUG("Broadcast listener went away");
+          Done(false);
+          return;
+        }
+        owner_->stats()->BytesSent(RpcMethod::kJoinBroadcast, frame_->bytes);
+        frame_.reset();
+        SendNext();
+        break;
+
+      case State::kWaiting:
+        SendNext();
+        break;
+
+      case State::kFinishing:
+        Done(ok && status_ok_);
+        break;
+    }
+  }
+
+ private:
+  enum class State { kRequested, kWriting, kWaiting, kFinishing };
+
+  void Join() {
+    audio_service::JoinBroadcastRequest join_request;
+    if (!grpc::SerializationTraits<audio_service::JoinBroadcastRequest>::
+             Deserialize(&request_, &join_request)
+                 .ok()) {
+      Finish(grpc::Status(grpc::StatusCode::INVALID_ARGUMENT,
+                          "Malformed JoinBroadcast request"));
+      return;
+    }
+
+    owner_->server()->RegisterClient(context_.peer());
+    channel_ = owner_->broadcasts()->Join(join_request.song_num());
+    if (!channel_) {
+      Finish(grpc::Status(grpc::StatusCode::NOT_FOUND, "Song not found"));
+      return;
+    }
+
+    // Start with the chunks still ahead of their play time
+    cursor_ = channel_->JoinSequence();
+    LOG_INFO("Client {} joined broadcast {} at chunk {}",
+             AudioServer::ExtractIPFromPeer(context_.peer()),
+             channel_->song_num(), cursor_);
+    SendNext();
+  }
+
+  // Send the chunk at the cursor, or wait until it is published
+  void SendNext() {
+    if (owner_->IsShuttingDown()) {
+      Finish(grpc::Status::OK);
+      return;
+    }
+
+    const BroadcastChannel::Ring& ring = channel_->ring();
+    auto result = ring.Read(cursor_, &frame_);
+    while (result == BroadcastChannel::Ring::ReadResult::kOverwritten) {
+      // The listener fell behind by more than the ring holds, continue with
+      // the live chunks
+      uint64_t next = channel_->JoinSequence();
+      LOG_WARN("Broadcast listener fell behind, skipping {} chunks",
+               next - cursor_);
+      owner_->broadcasts()->ChunksSkipped(next - cursor_);
+      cursor_ = next;
+      result = ring.Read(cursor_, &frame_);
+    }
+
+    if (result == BroadcastChannel::Ring::ReadResult::kOk) {
+      cursor_++;
+      state_ = State::kWriting;
+      writer_.Write(frame_->message, this);
+      return;
+    }
+
+    if (channel_->finished()) {
+      Finish(grpc::Status::OK);
+      return;
+    }
+    auto now = std::chrono::system_clock::now();
+    state_ = State::kWaiting;
+    alarm_.Set(cq_, std::max(channel_->NextPublishTime(), now) + kPublishSlack,
+               this);
+  }
+
+  void Finish(const grpc::Status& status) {
+    state_ = State::kFinishing;
+    status_ok_ = status.ok();
+    writer_.Finish(status, this);
+  }
+
+  void Done(bool ok) {
+    if (channel_) {
+      owner_->broadcasts()->Leave(channel_);
+    }
+    owner_->stats()->CallFinished(
+        RpcMethod::kJoinBroadcast,
+        std::chrono::steady_clock::now() - started_, ok);
+    delete this;
+  }
+
+  // Time the producer is given to publish a chunk that is due
+  static constexpr std::chrono::milliseconds kPublishSlack{1};
+
+  AsyncAudioService* owner_;
+  grpc::ServerCompletionQueue* cq_;
+  grpc::ServerContext context_;
+  grpc::ByteBuffer request_;
+  grpc::ServerAsyncWriter<grpc::ByteBuffer> writer_;
+  grpc::Alarm alarm_;
+  State state_ = State::kRequested;
+  bool status_ok_ = true;
+  std::chrono::steady_clock::time_point started_;
+
+  std::shared_ptr<BroadcastChannel> channel_;
+  std::shared_ptr<const BroadcastFrame> frame_;  // Chunk being written
+  uint64_t cursor_ = 0;  // Sequence number of the next chunk to send
+};
+
+}  // namespace
+
+AsyncAudioService::AsyncAudioService(std::shared_ptr<AudioServer> server,
+                                     const AsyncServiceOptions& options)
+    : server_(server),
+      options_(options),
+      shutting_down_(false),
+      peer_watchers_(std::make_unique<PeerWatchers>(server.get())),
+      egress_(options.egress),
+      broadcasts_(server.get(), options.broadcast) {
+  options_.num_cqs = std::max(1, options_.num_cqs);
+  options_.pollers_per_cq = std::max(1, options_.pollers_per_cq);
+  options_.min_chunk_bytes = std::max<size_t>(1, options_.min_chunk_bytes);
+  options_.max_chunk_bytes =
+      std::max(options_.min_chunk_bytes, options_.max_chunk_bytes);
+  server_->SetPeerChangeListener(
+      [watchers = peer_watchers_.get()]() { watchers->WakeAll(); });
+  LOG_INFO("AsyncAudioService initialized");
+}
+
+AsyncAudioService::~AsyncAudioService() {
+  server_->SetPeerChangeListener(nullptr);
+
+  // Poller threads must not outlive the call objects they dispatch to
+  for (auto& poller : pollers_) {
+    if (poller.joinable()) {
+      poller.join();
+    }
+  }
+}
+
+void AsyncAudioService::RegisterWith(grpc::ServerBuilder& builder) {
+  builder.RegisterService(&service_);
+  for (int i = 0; i < options_.num_cqs; i++) {
+    cqs_.push_back(builder.AddCompletionQueue());
+  }
+}
+
+void AsyncAudioService::Start() {
+  for (auto& cq : cqs_) {
+    RequestCalls(cq.get());
+    for (int i = 0; i < options_.pollers_per_cq; i++) {
+      pollers_.emplace_back(&AsyncAudioService::Poll, this, cq.get());
+    }
+  }
+
+  LOG_INFO("Serving with {} completion queues, {} pollers each",
+           options_.num_cqs, options_.pollers_per_cq);
+  LOG_INFO("LoadAudio chunks between {} KB and {} KB",
+           options_.min_chunk_bytes / 1024, options_.max_chunk_bytes / 1024);
+  LOG_INFO("Egress window {} KB, first {} KB of every stream urgent",
+           options_.egress.window_bytes / 1024,
+           options_.egress.urgent_bytes / 1024);
+  LOG_INFO("Broadcast chunks of {} ms published {} ms ahead",
+           options_.broadcast.chunk_duration.count(),
+           options_.broadcast.lead.count());
+}
+
+void AsyncAudioService::Shutdown(grpc::Server* server) {
+  shutting_down_ = true;
+
+  // Idle peer watchers only wake on a change, the server would wait for them
+  peer_watchers_->Shutdown();
+
+  // Streams waiting for a grant would never finish either
+  egress_.Shutdown();
+  broadcasts_.Shutdown();
+  server->Shutdown();
+
+  // Drain every queue so pending calls are released
+  for (auto& cq : cqs_) {
+    cq->Shutdown();
+  }
+  for (auto& poller : pollers_) {
+    if (poller.joinable()) {
+      poller.join();
+    }
+  }
+  pollers_.clear();
+}
+
+void AsyncAudioService::RequestCalls(grpc::ServerCompletionQueue* cq) {
+  using audio_service::HeartbeatRequest;
+  using audio_service::HeartbeatResponse;
+  using audio_service::PlaylistRequest;
+  using audio_service::PlaylistResponse;
+  using audio_service::ServerStatsRequest;
+  using audio_service::ServerStatsResponse;
+  using audio_service::SongHintRequest;
+  using audio_service::SongHintResponse;
+
+  new UnaryCall<PlaylistRequest, PlaylistResponse>(
+      this, cq, RpcMethod::kGetPlaylist,
+      [this](auto* context, auto* request, auto* responder, auto* cq,
+             void* tag) {
+        service_.RequestGetPlaylist(context, request, responder, cq, cq, tag);
+      },
+      [this](auto* context, const auto& request, auto* response) {
+        return HandleGetPlaylist(context, request, response);
+      });
+
+  new UnaryCall<grpc::ByteBuffer, grpc::ByteBuffer>(
+      this, cq, RpcMethod::kGetPeerClientIPs,
+      [this](auto* context, auto* request, auto* responder, auto* cq,
+             void* tag) {
+        service_.RequestGetPeerClientIPs(context, request, responder, cq, cq,
+                                         tag);
+      },
+      [this](auto* context, const auto& request, auto* response) {
+        return HandleGetPeerClientIPs(context, request, response);
+      });
+
+  new UnaryCall<HeartbeatRequest, HeartbeatResponse>(
+      this, cq, RpcMethod::kHeartbeat,
+      [this](auto* context, auto* request, auto* responder, auto* cq,
+             void* tag) {
+        service_.RequestHeartbeat(context, request, responder, cq, cq, tag);
+      },
+      [this](auto* context, const auto& request, auto* response) {
+        return HandleHeartbeat(context, request, response);
+      });
+
+  new UnaryCall<ServerStatsRequest, ServerStatsResponse>(
+      this, cq, RpcMethod::kGetServerStats,
+      [this](auto* context, auto* request, auto* responder, auto* cq,
+             void* tag) {
+        service_.RequestGetServerStats(context, request, responder, cq, cq,
+                                       tag);
+      },
+      [this](auto* context, const auto& request, auto* response) {
+        return HandleGetServerStats(context, request, response);
+      });
+
+  new UnaryCall<SongHintRequest, SongHintResponse>(
+      this, cq, RpcMethod::kHintNextSongs,
+      [this](auto* context, auto* request, auto* responder, auto* cq,
+             void* tag) {
+        service_.RequestHintNextSongs(context, request, responder, cq, cq,
+                                      tag);
+      },
+      [this](auto* context, const auto& request, auto* response) {
+        return HandleHintNextSongs(context, request, response);
+      });
+
+  new SegmentIndexCall(this, cq);
+  new LoadAudioCall(this, cq);
+  new LoadSegmentCall(this, cq);
+  new WatchPeersCall(this, cq);
+  new JoinBroadcastCall(this, cq);
+}
+
+void AsyncAudioService::Poll(grpc::ServerCompletionQueue* cq) {
+  void* tag = nullptr;
+  bool ok = false;
+  while (cq->Next(&tag, &ok)) {
+    static_cast<ServerCall*>(tag)->Proceed(ok);
+  }
+}
+
+grpc::Status AsyncAudioService::HandleGetPlaylist(
+    grpc::ServerContext* context, const audio_service::PlaylistRequest& request,
+    audio_service::PlaylistResponse* response) {
+  LOG_DEBUG("Received playlist request from client");
+
+  // Register client in the connected clients list
+  std::string client_ip = context->peer();
+  server_->RegisterClient(client_ip);
+
+  // Pages after the first come from the version the first page listed, in
+  // the form "<etag>:<since>:<first id>"
+  std::shared_ptr<const PlaylistSnapshot> playlist;
+  uint64_t since = 0;
+  size_t first_id = 1;
+  if (!request.page_token().empty()) {
+    char etag[40];
+    unsigned long long epoch = 0, version = 0, since_version = 0, id = 0;
+    if (sscanf(request.page_token().c_str(), "%39[^:]:%llu:%llu", etag,
+               &since_version, &id) != 3 ||
+        sscanf(etag, "%llx-%llx", &epoch, &version) != 2) {
+      return grpc::Status(grpc::StatusCode::INVALID_ARGUMENT,
+                          "invalid page token");
+    }
+    uint64_t tag_version = 0;
+    playlist = server_->GetPlaylistSnapshot(version);
+    if (!playlist || !playlist->ParseEtag(etag, &tag_version)) {
+      return grpc::Status(grpc::StatusCode::ABORTED,
+                          "playlist changed while paging, start over");
+    }
+    since = since_version;
+    first_id = std::max<size_t>(1, id);
+  } else {
+    playlist = server_->GetPlaylistSnapshot();
+    uint64_t known = 0;
+    if (!request.if_none_match().empty() &&
+        playlist->ParseEtag(request.if_none_match(), &known)) {
+      if (known == playlist->version) {
+        response->set_etag(playlist->etag());
+        response->set_not_modified(true);
+        response->set_song_count(
+            static_cast<int32_t>(playlist->entries.size()));
+        return grpc::Status::OK;
+      }
+      if (request.delta() && known < playlist->version) {
+        since = known;
+      }
+    }
+  }
+
+  response->set_etag(playlist->etag());
+  response->set_delta(since > 0);
+  response->set_song_count(static_cast<int32_t>(playlist->entries.size()));
+
+  // List each song with its format and the size and hash that let clients
+  // skip songs they already hold. Songs are hashed in the background, so a
+  // song may be listed without a hash for a while. Ids of removed songs are
+  // listed without a name to keep the numbering.
+  size_t page_size = request.page_size() > 0
+                         ? static_cast<size_t>(request.page_size())
+                         : playlist->entries.size();
+  bool whole_playlist = since == 0 && first_id == 1 &&
+                        page_size >= playlist->entries.size();
+  for (size_t id = first_id; id <= playlist->entries.size(); id++) {
+    const PlaylistEntry& entry = playlist->entries[id - 1];
+    if (entry.version <= since) {
+      continue;
+    }
+    if (static_cast<size_t>(response->songs_size()) == page_size) {
+      response->set_next_page_token(playlist->etag() + ":" +
+                                    std::to_string(since) + ":" +
+                                    std::to_string(id));
+      break;
+    }
+
+    const SongMetadata& metadata = entry.song;
+    auto* song = response->add_songs();
+    song->set_id(static_cast<int32_t>(id));
+    if (whole_playlist) {
+      response->add_song_names(metadata.name);
+    }
+    if (metadata.name.empty()) {
+      continue;
+    }
+    song->set_name(metadata.name);
+    song->set_size(static_cast<int64_t>(metadata.size));
+    song->set_content_hash(entry.content_hash);
+    song->set_sample_rate(static_cast<int32_t>(metadata.sample_rate));
+    song->set_channels(metadata.channels);
+    song->set_bits_per_sample(metadata.bits_per_sample);
+    song->set_duration_ms(static_cast<int64_t>(metadata.duration_ms));
+  }
+
+  return grpc::Status::OK;
+}
+
+grpc::Status AsyncAudioService::HandleGetPeerClientIPs(
+    grpc::ServerContext* context, const grpc::ByteBuffer& request,
+    grpc::ByteBuffer* response) {
+  audio_service::PeerListRequest peer_request;
+  grpc::ByteBuffer request_bytes(request);
+  if (!grpc::SerializationTraits<audio_service::PeerListRequest>::Deserialize(
+           &request_bytes, &peer_request)
+           .ok()) {
+    return grpc::Status(grpc::StatusCode::INVALID_ARGUMENT,
+                        "Malformed peer list request");
+  }
+
+  // Register the requesting client
+  std::string requester_ip = context->peer();
+  server_->RegisterClient(requester_ip);
+
+  PeerSelection selection = server_->SelectPeers(
+      requester_ip, std::max(0, peer_request.max_peers()),
+      peer_request.song_num());
+  LOG_INFO("Received peer list request, listing {} of {} peers",
+           selection.peers.size(), selection.clients->peers.size());
+  *response = EncodePeerList(selection.clients, selection.peers);
+  return grpc::Status::OK;
+}
+
+grpc::Status AsyncAudioService::HandleHeartbeat(
+    grpc::ServerContext* context,
+    const audio_service::HeartbeatRequest& request,
+    audio_service::HeartbeatResponse* response) {
+  ClientAdvertisement advertisement;
+  advertisement.p2p_port = request.p2p_port();
+  advertisement.uplink_kbps = request.uplink_kbps();
+  advertisement.cached_songs.assign(request.cached_songs().begin(),
+                                    request.cached_songs().end());
+
+  // Sent every few seconds by every client, so not worth a log line
+  response->set_client_id(
+      server_->AdvertiseClient(context->peer(), advertisement));
+  response->set_lease_ms(server_->GetClientLease().count());
+  return grpc::Status::OK;
+}
+
+grpc::Status AsyncAudioService::HandleHintNextSongs(
+    grpc::ServerContext* context, const audio_service::SongHintRequest& request,
+    audio_service::SongHintResponse* response) {
+  // A client only expects a few songs next, a long list would have the
+  // server read songs nobody plays
+  constexpr int kMaxHintedSongs = 4;
+  int hinted = std::min(request.song_nums_size(), kMaxHintedSongs);
+  music262::PcmFormat format;
+  if (request.has_output_format()) {
+    format = ToPcmFormat(request.output_format());
+  }
+  int warmed = 0;
+  for (int i = 0; i < hinted; i++) {
+    if (server_->WarmSong(request.song_nums(i),
+                          request.has_output_format() ? &format : nullptr)) {
+      warmed++;
+    }
+  }
+  LOG_DEBUG("Warmed {} of {} songs hinted by {}", warmed, hinted,
+            context->peer());
+  response->set_warmed(warmed);
+  return grpc::Status::OK;
+}
+
+grpc::Status AsyncAudioService::HandleGetServerStats(
+    grpc::ServerContext* context,
+    const audio_service::ServerStatsRequest& request,
+    audio_service::ServerStatsResponse* response) {
+  auto fill_latency = [](const LatencySummary& summary,
+                         audio_service::LatencyStats* latency) {
+    auto micros = [](std::chrono::nanoseconds duration) {
+      return std::chrono::duration<double, std::micro>(duration).count();
+    };
+    latency->set_count(summary.count);
+    latency->set_p50_us(micros(summary.p50));
+    latency->set_p99_us(micros(summary.p99));
+    latency->set_p999_us(micros(summary.p999));
+    latency->set_max_us(micros(summary.max));
+    latency->set_sum_us(micros(summary.sum));
+  };
+
+  ServerStatsSnapshot snapshot = stats_.Snapshot();
+  response->set_uptime_ms(snapshot.uptime.count());
+  for (const RpcStatsSnapshot& rpc : snapshot.rpcs) {
+    auto* entry = response->add_rpcs();
+    entry->set_method(RpcMethodName(rpc.method));
+    entry->set_calls(rpc.calls);
+    entry->set_errors(rpc.errors);
+    entry->set_active(rpc.active);
+    fill_latency(rpc.latency, entry->mutable_latency());
+    entry->set_bytes_sent(rpc.bytes_sent);
+    entry->set_bytes_per_sec(rpc.bytes_per_sec);
+  }
+  for (const StageStatsSnapshot& stage : snapshot.stages) {
+    auto* entry = response->add_stages();
+    entry->set_stage(StreamStageName(stage.stage));
+    fill_latency(stage.latency, entry->mutable_latency());
+  }
+  return grpc::Status::OK;
+}
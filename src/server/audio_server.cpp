@@ -1,44 +1,114 @@
 #include "include/audio_server.h"
 
+#include <algorithm>
+#include <fstream>
 #include <iostream>
 
+#include "../codec/include/lossless_codec.h"
+#include "../common/include/content_hash.h"
 #include "../common/include/logger.h"
+#include "include/wav_format.h"
 
-// Helper function to get all .wav files in the given directory
-std::vector<std::string> get_audio_files(const std::string& directory) {
-  std::vector<std::string> audio_files;
+AudioServer::AudioServer(const std::string& audio_dir, size_t cache_bytes,
+                         std::chrono::milliseconds segment_duration,
+                         const SongCatalogOptions& catalog_options)
+    : audio_directory_(audio_dir),
+      catalog_(audio_dir, catalog_options),
+      song_cache_(cache_bytes),
+      segment_duration_(segment_duration) {
+  auto catalog = catalog_.Snapshot();
+  LOG_INFO("Loaded {} songs from {}", catalog->songs.size(), audio_directory_);
+  playlist_.UpdateSongs(*catalog, catalog->songs);
+  catalog_.SetChangeListener(
+      [this](const std::vector<SongMetadata>& changed) {
+        OnCatalogChange(changed);
+      });
 
-  if (!fs::exists(directory) || !fs::is_directory(directory)) {
-    std::cerr << "Directory does not exist: " << directory << std::endl;
-    return audio_files;
+  // Peers that go silent leave as soon as their lease runs out
+  clients_.StartExpiring();
+}
+
+AudioServer::~AudioServer() {
+  workers_.Shutdown();
+  clients_.StopExpiring();
+  catalog_.StopWatching();
+  {
+    std::lock_guard<std::mutex> lock(pending_mutex_);
+    stop_catalog_ = true;
+  }
+  pending_cv_.notify_all();
+  if (catalog_thread_.joinable()) {
+    catalog_thread_.join();
   }
+}
 
-  for (const auto& entry : fs::directory_iterator(directory)) {
-    if (entry.is_regular_file() && entry.path().extension() == ".wav") {
-      audio_files.push_back(entry.path().filename());
-    }
+std::vector<std::string> AudioServer::GetPlaylist() const {
+  auto catalog = catalog_.Snapshot();
+  std::vector<std::string> playlist(catalog->max_id());
+  for (const auto& song : catalog->songs) {
+    playlist[song.id - 1] = song.name;
   }
+  return playlist;
+}
+
+std::shared_ptr<const CatalogSnapshot> AudioServer::GetCatalog() const {
+  return catalog_.Snapshot();
+}
 
-  return audio_files;
+std::shared_ptr<const PlaylistSnapshot> AudioServer::GetPlaylistSnapshot() {
+  return playlist_.Snapshot();
 }
 
-AudioServer::AudioServer(const std::string& audio_dir)
-    : audio_directory_(audio_dir), next_client_id_(0) {
-  // Load the available songs on startup
-  playlist_ = get_audio_files(audio_directory_);
-  LOG_INFO("Loaded {} songs from {}", playlist_.size(), audio_directory_);
+std::shared_ptr<const PlaylistSnapshot> AudioServer::GetPlaylistSnapshot(
+    uint64_t version) const {
+  return playlist_.Snapshot(version);
 }
 
-std::vector<std::string> AudioServer::GetPlaylist() const { return playlist_; }
+bool AudioServer::WatchCatalog() { return catalog_.StartWatching(); }
+
+size_t AudioServer::RescanCatalog() { return catalog_.Rescan(); }
+
+void AudioServer::OnCatalogChange(const std::vector<SongMetadata>& changed) {
+  playlist_.UpdateSongs(*catalog_.Snapshot(), changed);
+  for (const auto& song : changed) {
+    song_cache_.Invalidate(song.id);
+    transcode_cache_.Invalidate(song.id);
+    song_store_.Forget(audio_directory_ + "/" + song.name);
+    {
+      std::lock_guard<std::mutex> lock(digests_mutex_);
+      song_digests_.erase(song.id);
+    }
+    {
+      std::lock_guard<std::mutex> lock(segments_mutex_);
+      segment_indexes_.erase(song.id);
+    }
+    {
+      std::lock_guard<std::mutex> lock(encoded_mutex_);
+      encoded_songs_.erase(song.id);
+      encoded_source_bytes_.erase(song.id);
+    }
+  }
+
+  if (indexing_) {
+    {
+      std::lock_guard<std::mutex> lock(pending_mutex_);
+      for (const auto& song : changed) {
+        pending_songs_.insert(song.id);
+      }
+    }
+    pending_cv_.notify_all();
+  }
+}
 
 std::string AudioServer::GetAudioFilePath(int song_num) const {
-  if (song_num <= 0 || song_num > static_cast<int>(playlist_.size())) {
+  auto catalog = catalog_.Snapshot();
+  const SongMetadata* song = catalog->Find(song_num);
+  if (!song) {
     LOG_ERROR("Invalid song number: {}", song_num);
     return "";
   }
 
-  std::string song_name = playlist_[song_num - 1];
-  std::string file_path = audio_directory_ + "/" + song_name;
+  std::string file_path = audio_directory_ + "/" + song->name;
 
   if (!fs::exists(file_path)) {
     LOG_ERROR("Song file not found: {}", file_path);
@@ -48,44 +118,508 @@ std::string AudioServer::GetAudioFilePath(int song_num) const {
   return file_path;
 }
 
-int AudioServer::RegisterClient(const std::string& client_id) {
-  std::lock_guard<std::mutex> lock(clients_mutex_);
+std::shared_ptr<const MappedSong> AudioServer::GetSong(int song_num) {
+  // Only look the file up on disk when the song is not cached
+  return song_cache_.Get(
+      song_num, [this, song_num]() -> std::shared_ptr<const MappedSong> {
+        std::string file_path = GetAudioFilePath(song_num);
+        if (file_path.empty()) {
+          return nullptr;
+        }
+        return song_store_.Get(file_path);
+      });
+}
+
+std::shared_ptr<const MappedSong> AudioServer::MapSong(int song_num) {
+  // Shares the mapping of a cached song, if there is one
+  std::string file_path = GetAudioFilePath(song_num);
+  if (file_path.empty()) {
+    return nullptr;
+  }
+  return song_store_.Get(file_path);
+}
+
+bool AudioServer::GetSongDigest(int song_num, SongDigest* digest,
+                                bool compute) {
+  std::shared_ptr<const MappedSong> song = MapSong(song_num);
+  if (!song) {
+    return false;
+  }
+
+  {
+    std::lock_guard<std::mutex> lock(digests_mutex_);
+    auto it = song_digests_.find(song_num);
+    if (it != song_digests_.end() &&
+        it->second.resume_token == song->resume_token()) {
+      *digest = it->second;
+      return true;
+    }
+  }
+
+  if (!compute) {
+    return false;
+  }
+
+  // Hashing reads the whole song, so do it outside the lock
+  digest->resume_token = song->resume_token();
+  digest->size = song->size();
+  digest->content_hash = music262::ContentHash(song->data(), song->size());
+
+  playlist_.SetDigest(song_num, song->size(), song->mtime_ns(),
+                     digest->content_hash);
+  std::lock_guard<std::mutex> lock(digests_mutex_);
+  song_digests_[song_num] = *digest;
+  return true;
+}
+
+size_t AudioServer::HashCatalog() {
+  auto catalog = catalog_.Snapshot();
+  size_t hashed = 0;
+  for (const auto& song : catalog->songs) {
+    if (stop_catalog_) {
+      break;
+    }
+    SongDigest digest;
+    if (GetSongDigest(song.id, &digest)) {
+      hashed++;
+    }
+  }
+  LOG_INFO("Hashed {} of {} songs", hashed, catalog->songs.size());
+  return hashed;
+}
+
+std::shared_ptr<const SegmentIndex> AudioServer::GetSegmentIndex(
+    int song_num, std::shared_ptr<const MappedSong>* song) {
+  std::shared_ptr<const MappedSong> mapping = MapSong(song_num);
+  if (!mapping) {
+    return nullptr;
+  }
+  if (song) {
+    *song = mapping;
+  }
+
+  {
+    std::lock_guard<std::mutex> lock(segments_mutex_);
+    auto it = segment_indexes_.find(song_num);
+    if (it != segment_indexes_.end() &&
+        it->second->resume_token == mapping->resume_token()) {
+      return it->second;
+    }
+  }
+
+  // Checksumming reads the whole song, so do it outside the lock. Two
+  // concurrent first requests both build the same index, which is harmless.
+  auto index = SegmentIndex::Build(*mapping, segment_duration_);
+  if (index) {
+    std::lock_guard<std::mutex> lock(segments_mutex_);
+    segment_indexes_[song_num] = index;
+    LOG_INFO("Built segment index of song {}: {} segments", song_num,
+             index->segments.size());
+  }
+  return index;
+}
+
+bool AudioServer::GetSegmentIndex(int song_num,
+                                  std::shared_ptr<const SegmentIndex>* index,
+                                  std::shared_ptr<const MappedSong>* song,
+                                  SegmentIndexReady done) {
+  *index = nullptr;
+  *song = GetSong(song_num);
+  if (!*song) {
+    return true;
+  }
 
-  // Clean up the IP address by extracting and decoding it
-  std::string clean_ip = ExtractIPFromPeer(client_id);
+  std::shared_ptr<const MappedSong> mapping = *song;
+  {
+    std::lock_guard<std::mutex> lock(segments_mutex_);
+    auto it = segment_indexes_.find(song_num);
+    if (it != segment_indexes_.end() &&
+        it->second->resume_token == mapping->resume_token()) {
+      *index = it->second;
+      return true;
+    }
 
-  // Check if this client is already registered
-  for (const auto& [id, ip] : connected_clients_) {
-    if (ip == clean_ip) {
-      return id;  // Client already registered, return existing ID
+    // Wait for a build of the same version rather than running it twice
+    auto& waiters =
+        building_indexes_[std::make_pair(song_num, mapping->resume_token())];
+    waiters.push_back(std::move(done));
+    if (waiters.size() > 1) {
+      return false;
     }
   }
 
-  // Register new client with the clean IP
-  int new_id = next_client_id_++;
-  connected_clients_[new_id] = clean_ip;
-  LOG_INFO("Client connected: {} (raw: {})", clean_ip, client_id);
+  auto build = [this, song_num, mapping]() {
+    BuildSegmentIndex(song_num, mapping);
+  };
+  if (!workers_.Submit(build)) {
+    build();  // Shutting down, nobody else will
+  }
+  return false;
+}
 
-  return new_id;
+void AudioServer::BuildSegmentIndex(int song_num,
+                                    std::shared_ptr<const MappedSong> song) {
+  auto index = SegmentIndex::Build(*song, segment_duration_);
+
+  std::vector<SegmentIndexReady> waiters;
+  {
+    std::lock_guard<std::mutex> lock(segments_mutex_);
+    if (index) {
+      segment_indexes_[song_num] = index;
+      LOG_INFO("Built segment index of song {}: {} segments", song_num,
+               index->segments.size());
+    }
+    auto it =
+        building_indexes_.find(std::make_pair(song_num, song->resume_token()));
+    if (it != building_indexes_.end()) {
+      waiters.swap(it->second);
+      building_indexes_.erase(it);
+    }
+  }
+  for (auto& done : waiters) {
+    done(index, song);
+  }
+}
+
+size_t AudioServer::IndexCatalogSegments() {
+  auto catalog = catalog_.Snapshot();
+  size_t indexed = 0;
+  for (const auto& song : catalog->songs) {
+    if (stop_catalog_) {
+      break;
+    }
+    // Only PCM WAV songs have a sample format the catalog could read
+    if (song.sample_rate > 0 && GetSegmentIndex(song.id)) {
+      indexed++;
+    }
+  }
+  LOG_INFO("Built segment indexes of {} of {} songs", indexed,
+           catalog->songs.size());
+  return indexed;
+}
+
+std::shared_ptr<const MappedSong> AudioServer::GetEncodedSong(
+    int song_num) const {
+  std::lock_guard<std::mutex> lock(encoded_mutex_);
+  auto it = encoded_songs_.find(song_num);
+  return it != encoded_songs_.end() ? it->second : nullptr;
+}
+
+bool AudioServer::GetConvertedSong(
+    int song_num, const std::shared_ptr<const MappedSong>& song,
+    const music262::PcmFormat& format,
+    std::shared_ptr<const MappedSong>* converted, TranscodeCache::Done done) {
+  // Songs in the format with nothing but the canonical header before the
+  // samples need no conversion
+  WavFormat source;
+  if (format.sample_format == music262::PcmSampleFormat::kInt16 &&
+      ParseWavFormat(song->data(), song->size(), song->size(), &source) &&
+      source.data_offset == 44 && source.bits_per_sample == 16 &&
+      source.block_align == source.channels * 2 &&
+      (format.sample_rate == 0 || format.sample_rate == source.sample_rate) &&
+      (format.channels == 0 || format.channels == source.channels)) {
+    *converted = song;
+    return true;
+  }
+  return transcode_cache_.Get(song_num, song, format, &workers_, converted,
+                              std::move(done));
+}
+
+size_t AudioServer::EncodeCatalog(const std::string& codec_dir) {
+  std::error_code ec;
+  fs::create_directories(codec_dir, ec);
+  if (ec) {
+    LOG_ERROR("Cannot create codec directory {}: {}", codec_dir,
+              ec.message());
+    return 0;
+  }
+
+  auto catalog = catalog_.Snapshot();
+  size_t encoded = 0;
+  for (const auto& song : catalog->songs) {
+    if (stop_catalog_) {
+      break;
+    }
+
+    std::shared_ptr<const MappedSong> encoded_song =
+        EncodeSong(song.id, codec_dir);
+    if (encoded_song) {
+      StoreEncodedSong(song.id, std::move(encoded_song));
+      encoded++;
+    }
+  }
+
+  LOG_INFO("{} of {} songs available losslessly encoded", encoded,
+           catalog->songs.size());
+  return encoded;
+}
+
+void AudioServer::StoreEncodedSong(int song_num,
+                                   std::shared_ptr<const MappedSong> song) {
+  std::error_code ec;
+  size_t source_bytes = fs::file_size(GetAudioFilePath(song_num), ec);
+
+  std::lock_guard<std::mutex> lock(encoded_mutex_);
+  encoded_songs_[song_num] = std::move(song);
+  encoded_source_bytes_[song_num] = ec ? 0 : source_bytes;
+}
+
+void AudioServer::StartCatalogIndexing(const std::string& codec_dir) {
+  if (catalog_thread_.joinable()) {
+    return;
+  }
+  indexing_ = true;
+  catalog_thread_ = std::thread([this, codec_dir]() {
+    HashCatalog();
+    IndexCatalogSegments();
+    if (!codec_dir.empty()) {
+      EncodeCatalog(codec_dir);
+    }
+
+    // Then keep up with the songs the catalog reports as changed
+    std::unique_lock<std::mutex> lock(pending_mutex_);
+    while (true) {
+      pending_cv_.wait(
+          lock, [this]() { return stop_catalog_ || !pending_songs_.empty(); });
+      if (stop_catalog_) {
+        break;
+      }
+      std::set<int> songs;
+      songs.swap(pending_songs_);
+      lock.unlock();
+      for (int song_num : songs) {
+        IndexSong(song_num, codec_dir);
+      }
+      lock.lock();
+    }
+  });
+}
+
+void AudioServer::IndexSong(int song_num, const std::string& codec_dir) {
+  SongDigest digest;
+  if (!GetSongDigest(song_num, &digest)) {
+    return;  // Removed
+  }
+  auto catalog = catalog_.Snapshot();
+  const SongMetadata* metadata = catalog->Find(song_num);
+  if (metadata && metadata->sample_rate > 0) {
+    GetSegmentIndex(song_num);
+  }
+  if (codec_dir.empty()) {
+    return;
+  }
+  std::error_code ec;
+  fs::create_directories(codec_dir, ec);
+  std::shared_ptr<const MappedSong> song = EncodeSong(song_num, codec_dir);
+  if (song) {
+    StoreEncodedSong(song_num, std::move(song));
+  }
+}
+
+std::shared_ptr<const MappedSong> AudioServer::EncodeSong(
+    int song_num, const fs::path& codec_dir) {
+  std::string file_path = GetAudioFilePath(song_num);
+  if (file_path.empty()) {
+    return nullptr;
+  }
+  // Songs in subdirectories are encoded into the same subdirectories
+  fs::path encoded_path =
+      codec_dir /
+      (fs::path(file_path).lexically_relative(audio_directory_).string() +
+       ".m2lc");
+
+  // The encoding records the size, modification time and hash of the song
+  // it was made from, so it is reused only for that exact version
+  auto catalog = catalog_.Snapshot();
+  const SongMetadata* metadata = catalog->Find(song_num);
+  std::shared_ptr<const MappedSong> song = MapSong(song_num);
+  SongDigest digest;
+  if (!metadata || !song || !GetSongDigest(song_num, &digest) ||
+      digest.resume_token != song->resume_token()) {
+    return nullptr;
+  }
+  if (song->size() != metadata->size ||
+      song->mtime_ns() != metadata->mtime_ns) {
+    // Changed since the catalog saw it, the next rescan indexes it again
+    return nullptr;
+  }
+  music262::LosslessSource source{metadata->size, metadata->mtime_ns,
+                                  digest.content_hash};
+
+  std::error_code exists_ec;
+  if (fs::exists(encoded_path, exists_ec)) {
+    std::shared_ptr<const MappedSong> cached =
+        song_store_.Get(encoded_path.string());
+    music262::LosslessSource cached_source;
+    if (cached &&
+        music262::ReadLosslessSource(cached->data(), cached->size(),
+                                     &cached_source) &&
+        cached_source == source) {
+      return cached;
+    }
+    LOG_DEBUG("Encoding of song {} is stale, encoding it again", song_num);
+  }
+
+  if (!music262::CanEncodeLossless(song->data(), song->size())) {
+    LOG_DEBUG("Song {} cannot be losslessly encoded", song_num);
+    return nullptr;
+  }
+
+  music262::LosslessEncodeOptions options;
+  options.source = source;
+  std::vector<char> encoded;
+  if (!music262::EncodeLossless(song->data(), song->size(), &encoded,
+                                options) ||
+      encoded.size() >= song->size()) {
+    return nullptr;
+  }
+
+  // Write to a temporary file first so readers never see a partial encoding
+  fs::path temp_path = encoded_path;
+  temp_path += ".tmp";
+  std::error_code ec;
+  fs::create_directories(encoded_path.parent_path(), ec);
+  {
+    std::ofstream file(temp_path, std::ios::binary | std::ios::trunc);
+    file.write(encoded.data(), encoded.size());
+    if (!file) {
+      LOG_ERROR("Failed to write encoded song {}", temp_path.string());
+      fs::remove(temp_path, ec);
+      return nullptr;
+    }
+  }
+  fs::rename(temp_path, encoded_path, ec);
+  if (ec) {
+    LOG_ERROR("Failed to store encoded song {}: {}", encoded_path.string(),
+              ec.message());
+    return nullptr;
+  }
+  song_store_.Forget(encoded_path.string());  // Drop a stale encoding
+
+  LOG_INFO("Encoded song {} losslessly: {} -> {} bytes", song_num,
+           song->size(), encoded.size());
+  return song_store_.Get(encoded_path.string());
+}
+
+bool AudioServer::PinSong(int song_num) {
+  if (!catalog_.Snapshot()->Find(song_num)) {
+    LOG_ERROR("Cannot pin invalid song number: {}", song_num);
+    return false;
+  }
+
+  song_cache_.Pin(song_num);
+  pinned_songs_.push_back(song_num);
+  LOG_INFO("Pinned song {} in cache", song_num);
+  return true;
+}
+
+size_t AudioServer::Preload() {
+  // Pinned songs first, then the playlist in order
+  std::vector<int> order = pinned_songs_;
+  for (const auto& song : catalog_.Snapshot()->songs) {
+    order.push_back(song.id);
+  }
+
+  size_t loaded = 0;
+  for (int song_num : order) {
+    if (song_cache_.Contains(song_num)) {
+      continue;
+    }
+
+    std::string file_path = GetAudioFilePath(song_num);
+    if (file_path.empty()) {
+      continue;
+    }
+
+    // Skip songs that would only evict what was already preloaded
+    std::error_code ec;
+    auto size = fs::file_size(file_path, ec);
+    if (ec || !song_cache_.HasRoomFor(size)) {
+      continue;
+    }
+
+    if (GetSong(song_num)) {
+      loaded++;
+    }
+  }
+
+  auto stats = song_cache_.GetStats();
+  LOG_INFO("Preloaded {} songs ({} bytes) into cache", loaded,
+           stats.bytes_used);
+  return loaded;
+}
+
+bool AudioServer::WarmSong(int song_num, const music262::PcmFormat* format) {
+  auto song = GetSong(song_num);
+  if (!song) {
+    return false;
+  }
+  song->Prefetch();
+  if (auto encoded = GetEncodedSong(song_num)) {
+    encoded->Prefetch();
+  }
+  if (format) {
+    // Only kept in the transcode cache for the LoadAudio call that follows
+    std::shared_ptr<const MappedSong> converted;
+    GetConvertedSong(song_num, song, *format, &converted, nullptr);
+  }
+  return true;
+}
+
+SongCacheStats AudioServer::GetCacheStats() const {
+  return song_cache_.GetStats();
+}
+
+int AudioServer::RegisterClient(const std::string& client_id) {
+  return clients_.Register(ExtractIPFromPeer(client_id));
 }
 
 std::vector<std::string> AudioServer::GetConnectedClients(
     const std::string& exclude_client_id) const {
-  std::lock_guard<std::mutex> lock(clients_mutex_);
-
   std::string clean_exclude_id = "";
   if (!exclude_client_id.empty()) {
     clean_exclude_id = ExtractIPFromPeer(exclude_client_id);
   }
+  return clients_.List(clean_exclude_id);
+}
 
-  std::vector<std::string> clients;
-  for (const auto& [id, ip] : connected_clients_) {
-    if (ip != clean_exclude_id) {
-      clients.push_back(ip);
-    }
+int AudioServer::AdvertiseClient(const std::string& client_id,
+                                 const ClientAdvertisement& advertisement) {
+  return clients_.Advertise(ExtractIPFromPeer(client_id), advertisement);
+}
+
+PeerSelection AudioServer::SelectPeers(const std::string& client_id,
+                                       size_t max_peers, int song_num) const {
+  PeerQuery query;
+  query.address = ExtractIPFromPeer(client_id);
+  query.max_peers = max_peers_;
+  if (max_peers > 0) {
+    query.max_peers = std::min(max_peers, query.max_peers);
   }
+  query.song_num = song_num;
 
-  return clients;
+  PeerSelection selection;
+  selection.clients = clients_.Snapshot();
+  selection.peers = ::SelectPeers(*selection.clients, query);
+  return selection;
+}
+
+PeerChanges AudioServer::GetPeerChanges(uint64_t epoch,
+                                        uint64_t since) const {
+  return clients_.Changes(epoch, since);
+}
+
+void AudioServer::SetPeerChangeListener(
+    ClientRegistry::ChangeListener listener) {
+  clients_.SetChangeListener(std::move(listener));
+}
+
+std::chrono::milliseconds AudioServer::GetClientLease() const {
+  return clients_.lease();
+}
+
+void AudioServer::SetClientLease(std::chrono::milliseconds lease) {
+  clients_.set_lease(lease);
 }
 
 std::string AudioServer::ExtractIPFromPeer(const std::string& peer) {
@@ -102,16 +636,58 @@ std::string AudioServer::ExtractIPFromPeer(const std::string& peer) {
 
 void AudioServer::PrintStatus(const std::string& local_ip, int port) const {
   std::cout << "Server Status:" << std::endl;
-  std::cout << "  Songs available: " << playlist_.size() << std::endl;
+  auto catalog = catalog_.Snapshot();
+  std::cout << "  Songs available: " << catalog->songs.size()
+            << " (catalog version " << catalog->version << ")" << std::endl;
+  std::cout << "  Songs mapped: " << song_store_.MappedCount() << std::endl;
+
+  auto cache = song_cache_.GetStats();
+  uint64_t lookups = cache.hits + cache.misses;
+  double hit_rate = lookups > 0 ? 100.0 * cache.hits / lookups : 0.0;
+  std::cout << "  Song cache: " << cache.entries << " songs ("
+            << cache.pinned << " pinned), " << cache.bytes_used / (1024 * 1024)
+            << "/" << cache.budget_bytes / (1024 * 1024) << " MB" << std::endl;
+  std::cout << "    Hits: " << cache.hits << ", misses: " << cache.misses
+            << ", evictions: " << cache.evictions << " (hit rate "
+            << static_cast<int>(hit_rate) << "%)" << std::endl;
+
+  auto transcode = transcode_cache_.GetStats();
+  std::cout << "  Transcode cache: " << transcode.entries << " songs, "
+            << transcode.bytes_used / (1024 * 1024) << "/"
+            << transcode.budget_bytes / (1024 * 1024) << " MB" << std::endl;
+  std::cout << "    Hits: " << transcode.hits
+            << ", conversions: " << transcode.conversions
+            << ", unsupported: " << transcode.failures
+            << ", evictions: " << transcode.evictions << std::endl;
+
+  {
+    std::lock_guard<std::mutex> lock(encoded_mutex_);
+    size_t encoded_bytes = 0;
+    size_t source_bytes = 0;
+    for (const auto& [song_num, song] : encoded_songs_) {
+      encoded_bytes += song->size();
+      source_bytes += encoded_source_bytes_.at(song_num);
+    }
+    std::cout << "  Songs encoded: " << encoded_songs_.size();
+    if (source_bytes > 0) {
+      std::cout << " (" << 100 * encoded_bytes / source_bytes
+                << "% of PCM size)";
+    }
+    std::cout << std::endl;
+  }
 
   std::cout << "  IP Address: " << local_ip << std::endl;
   std::cout << "  Port: " << port << std::endl;
 
-  std::lock_guard<std::mutex> lock(clients_mutex_);
-  std::cout << "  Connected clients: " << connected_clients_.size()
-            << std::endl;
+  auto now = ClientRegistry::Clock::now();
+  auto clients = clients_.Leases(now);
+  std::cout << "  Connected clients: " << clients.size() << " (lease "
+            << clients_.lease().count() / 1000 << " s)" << std::endl;
   int i = 1;
-  for (const auto& [id, ip] : connected_clients_) {
-    std::cout << "    " << i++ << ". " << ip << std::endl;
+  for (const auto& client : clients) {
+    auto idle = std::chrono::duration_cast<std::chrono::seconds>(
+        now - client.last_seen);
+    std::cout << "    " << i++ << ". " << client.address << " (seen "
+              << idle.count() << " s ago)" << std::endl;
   }
 }
@@ -0,0 +1,211 @@
+#include "include/broadcast_hub.h"
+
+#include <algorithm>
+#include <string>
+
+#include "../common/include/logger.h"
+#include "include/chunk_encoder.h"
+#include "include/wav_format.h"
+
+namespace {
+
+// Map a song if it is a WAV file that can be sliced into frames
+std::shared_ptr<const MappedSong> OpenSong(AudioServer* server, int song_num,
+                                           WavFormat* format) {
+  auto song = server->GetSong(song_num);
+  if (!song ||
+      !ParseWavFormat(song->data(), song->size(), song->size(), format) ||
+      format->data_size < format->block_align) {
+    return nullptr;
+  }
+  return song;
+}
+
+}  // namespace
+
+BroadcastChannel::BroadcastChannel(AudioServer* server, int song_num,
+                                   const BroadcastOptions& options)
+    : server_(server),
+      song_num_(song_num),
+      options_(options),
+      ring_(std::max<size_t>(
+          options.ring_chunks,
+          2 * (options.lead / std::max(options.chunk_duration,
+                                       std::chrono::milliseconds(1)) +
+               1))) {
+  options_.chunk_duration =
+      std::max(options_.chunk_duration, std::chrono::milliseconds(1));
+  next_publish_ns_ =
+      std::chrono::duration_cast<std::chrono::nanoseconds>(
+          std::chrono::system_clock::now().time_since_epoch())
+          .count();
+  producer_ = std::thread(&BroadcastChannel::Run, this);
+}
+
+BroadcastChannel::~BroadcastChannel() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stop_ = true;
+  }
+  cv_.notify_all();
+  producer_.join();
+}
+
+uint64_t BroadcastChannel::JoinSequence() const {
+  uint64_t lead_chunks = options_.lead / options_.chunk_duration;
+  uint64_t head = ring_.head();
+  return std::max(ring_.oldest(), head > lead_chunks ? head - lead_chunks : 0);
+}
+
+std::chrono::system_clock::time_point BroadcastChannel::NextPublishTime()
+    const {
+  return std::chrono::system_clock::time_point(
+      std::chrono::duration_cast<std::chrono::system_clock::duration>(
+          std::chrono::nanoseconds(next_publish_ns_.load())));
+}
+
+void BroadcastChannel::Run() {
+  using std::chrono::duration_cast;
+  using std::chrono::microseconds;
+  using std::chrono::nanoseconds;
+
+  // Chunks are paced on the steady clock and stamped with the system clock
+  // time they play at, which clients can compare with their own
+  auto steady_start = std::chrono::steady_clock::now();
+  auto system_start = std::chrono::system_clock::now();
+  nanoseconds elapsed(0);  // Play time of the audio published so far
+
+  int song_num = song_num_;
+  WavFormat format;
+  auto song = OpenSong(server_, song_num, &format);
+  if (!song) {
+    song = NextSong(&song_num, &format);
+  }
+
+  while (song) {
+    size_t frames_per_chunk = std::max<size_t>(
+        1, format.sample_rate * options_.chunk_duration.count() / 1000);
+    size_t chunk_bytes = frames_per_chunk * format.block_align;
+    LOG_INFO("Broadcast {} playing song {}", song_num_, song_num);
+
+    audio_service::BroadcastChunk metadata;
+    metadata.set_song_num(song_num);
+    metadata.set_wav_header(song->data(), format.data_offset);
+
+    size_t end = format.data_offset + format.data_size;
+    end -= (end - format.data_offset) % format.block_align;
+    for (size_t offset = format.data_offset; offset < end;) {
+      {
+        std::unique_lock<std::mutex> lock(mutex_);
+        if (cv_.wait_until(lock, steady_start + elapsed,
+                           [this]() { return stop_; })) {
+          finished_ = true;
+          return;
+        }
+      }
+
+      size_t length = std::min(chunk_bytes, end - offset);
+      metadata.set_sequence(ring_.head());
+      metadata.set_song_offset(static_cast<int64_t>(offset));
+      metadata.set_play_time_us(
+          duration_cast<microseconds>(
+              (system_start + elapsed + options_.lead).time_since_epoch())
+              .count());
+      auto frame = std::make_shared<BroadcastFrame>();
+      frame->message = EncodeBroadcastChunk(metadata, song, offset, length);
+      frame->bytes = length;
+      ring_.Publish(std::move(frame));
+      bytes_ += length;
+
+      offset += length;
+      elapsed += nanoseconds(static_cast<int64_t>(
+          length / format.block_align * 1000000000ull / format.sample_rate));
+      next_publish_ns_ =
+          duration_cast<nanoseconds>(system_start.time_since_epoch() + elapsed)
+              .count();
+    }
+    song = NextSong(&song_num, &format);
+  }
+
+  LOG_WARN("Broadcast {} has no song left to play", song_num_);
+  finished_ = true;
+}
+
+std::shared_ptr<const MappedSong> BroadcastChannel::NextSong(
+    int* song_num, WavFormat* format) {
+  size_t songs = server_->GetPlaylistSnapshot()->entries.size();
+  for (size_t tries = 0; tries < songs; tries++) {
+    *song_num = *song_num >= static_cast<int>(songs) ? 1 : *song_num + 1;
+    if (auto song = OpenSong(server_, *song_num, format)) {
+      return song;
+    }
+  }
+  return nullptr;
+}
+
+BroadcastHub::BroadcastHub(AudioServer* server, const BroadcastOptions& options)
+    : server_(server), options_(options) {}
+
+std::shared_ptr<BroadcastChannel> BroadcastHub::Join(int song_num) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (shut_down_) {
+    return nullptr;
+  }
+  auto it = channels_.find(song_num);
+  if (it == channels_.end()) {
+    WavFormat format;
+    if (!OpenSong(server_, song_num, &format)) {
+      return nullptr;
+    }
+    LOG_INFO("Starting broadcast {}", song_num);
+    it = channels_
+             .emplace(song_num,
+                      Listened{std::make_shared<BroadcastChannel>(
+                          server_, song_num, options_)})
+             .first;
+  }
+  it->second.listeners++;
+  return it->second.channel;
+}
+
+void BroadcastHub::Leave(const std::shared_ptr<BroadcastChannel>& channel) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto it = channels_.find(channel->song_num());
+  if (it == channels_.end() || it->second.channel != channel ||
+      --it->second.listeners > 0) {
+    return;
+  }
+
+  // The producer stops once the last listener lets go of the channel
+  LOG_INFO("Stopping broadcast {}, its last listener left",
+           channel->song_num());
+  stopped_chunks_ += channel->chunks();
+  stopped_bytes_ += channel->bytes();
+  channels_.erase(it);
+}
+
+void BroadcastHub::Shutdown() {
+  std::map<int, Listened> channels;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    shut_down_ = true;
+    channels.swap(channels_);
+  }
+  // Channels still referenced by a listener stop when it finishes
+  channels.clear();
+}
+
+BroadcastStats BroadcastHub::GetStats() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  BroadcastStats stats;
+  stats.channels = channels_.size();
+  stats.chunks = stopped_chunks_;
+  stats.bytes = stopped_bytes_;
+  for (const auto& [song_num, listened] : channels_) {
+    stats.listeners += listened.listeners;
+    stats.chunks += listened.channel->chunks();
+    stats.bytes += listened.channel->bytes();
+  }
+  stats.skipped_chunks = skipped_chunks_.load();
+  return stats;
+}
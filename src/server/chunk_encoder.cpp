@@ -0,0 +1,89 @@
+#include "include/chunk_encoder.h"
+
+#include <grpcpp/support/slice.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace {
+
+// Field 1 (AudioChunk.data and BroadcastChunk.data) with the
+// length-delimited wire type
+constexpr uint8_t kDataFieldTag = (1 << 3) | 2;
+
+// Releases the song reference held by a slice once gRPC is done with it
+void ReleaseSong(void* user_data) {
+  delete static_cast<std::shared_ptr<const MappedSong>*>(user_data);
+}
+
+// Releases the client list reference held by a slice
+void ReleaseClients(void* user_data) {
+  delete static_cast<std::shared_ptr<const ClientListSnapshot>*>(user_data);
+}
+
+// Slice of the client list's encoding [start, end) that keeps it alive
+grpc::Slice ClientsSlice(
+    const std::shared_ptr<const ClientListSnapshot>& clients, size_t start,
+    size_t end) {
+  return grpc::Slice(const_cast<char*>(clients->encoded.data() + start),
+                     end - start, ReleaseClients,
+                     new std::shared_ptr<const ClientListSnapshot>(clients));
+}
+
+}  // namespace
+
+grpc::ByteBuffer EncodeAudioChunk(const std::shared_ptr<const MappedSong>& song,
+                                  size_t offset, size_t length) {
+  // Tag byte plus a varint length, at most 11 bytes
+  uint8_t header[11];
+  size_t header_size = 0;
+  header[header_size++] = kDataFieldTag;
+  uint64_t value = length;
+  while (value >= 0x80) {
+    header[header_size++] = static_cast<uint8_t>(value | 0x80);
+    value >>= 7;
+  }
+  header[header_size++] = static_cast<uint8_t>(value);
+
+  grpc::Slice slices[2] = {grpc::Slice(header, header_size), grpc::Slice()};
+  if (length == 0) {
+    return grpc::ByteBuffer(slices, 1);
+  }
+
+  slices[1] = grpc::Slice(const_cast<char*>(song->data() + offset), length,
+                          ReleaseSong,
+                          new std::shared_ptr<const MappedSong>(song));
+  return grpc::ByteBuffer(slices, 2);
+}
+
+grpc::ByteBuffer EncodeBroadcastChunk(
+    const audio_service::BroadcastChunk& metadata,
+    const std::shared_ptr<const MappedSong>& song, size_t offset,
+    size_t length) {
+  // Serialized fields may come in any order, so the data field is simply
+  // appended to the others
+  std::string header = metadata.SerializeAsString();
+  grpc::ByteBuffer data = EncodeAudioChunk(song, offset, length);
+  std::vector<grpc::Slice> slices;
+  data.Dump(&slices);
+  slices.insert(slices.begin(), grpc::Slice(header));
+  return grpc::ByteBuffer(slices.data(), slices.size());
+}
+
+grpc::ByteBuffer EncodePeerList(
+    const std::shared_ptr<const ClientListSnapshot>& clients,
+    const std::vector<size_t>& peers) {
+  std::vector<grpc::Slice> slices;
+  slices.reserve(std::max<size_t>(peers.size(), 1));
+  for (size_t i : peers) {
+    auto [start, end] = clients->peers[i].range;
+    slices.push_back(ClientsSlice(clients, start, end));
+  }
+  // An empty message is a buffer with one empty slice
+  if (slices.empty()) {
+    slices.emplace_back();
+  }
+  return grpc::ByteBuffer(slices.data(), slices.size());
+}
@@ -0,0 +1,36 @@
+#include "include/chunk_sizer.h"
+
+#include <algorithm>
+
+namespace {
+
+// Weight of the newest sample in the smoothed drain rate
+constexpr double kSmoothing = 0.25;
+
+}  // namespace
+
+ChunkSizer::ChunkSizer(size_t min_bytes, size_t max_bytes,
+                       std::chrono::microseconds target_latency)
+    : min_bytes_(std::max<size_t>(1, min_bytes)),
+      max_bytes_(std::max(min_bytes_, max_bytes)),
+      target_us_(std::max<double>(1, target_latency.count())),
+      chunk_size_(std::clamp(kInitialChunkSize, min_bytes_, max_bytes_)) {}
+
+void ChunkSizer::OnWriteComplete(size_t bytes,
+                                 std::chrono::microseconds latency) {
+  if (min_bytes_ == max_bytes_ || bytes == 0) {
+    return;
+  }
+
+  double sample = bytes / std::max<double>(1, latency.count());
+  bytes_per_us_ = bytes_per_us_ == 0
+                      ? sample
+                      : kSmoothing * sample + (1 - kSmoothing) * bytes_per_us_;
+
+  // Move towards the size that drains in the target time, one step at a time
+  double ideal = bytes_per_us_ * target_us_;
+  double next = std::clamp(ideal, chunk_size_ / 2.0, chunk_size_ * 2.0);
+
+  size_t size = static_cast<size_t>(next) / kGranularity * kGranularity;
+  chunk_size_ = std::clamp(size, min_bytes_, max_bytes_);
+}
@@ -0,0 +1,384 @@
+#include "include/client_registry.h"
+
+#include <arpa/inet.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <random>
+
+#include "logger.h"
+
+namespace {
+
+// Field 1 (PeerListResponse.client_ips) with the length-delimited wire type
+constexpr uint8_t kClientIpsFieldTag = (1 << 3) | 2;
+
+void AppendField(std::string* encoded, const std::string& value) {
+  encoded->push_back(static_cast<char>(kClientIpsFieldTag));
+  uint64_t length = value.size();
+  while (length >= 0x80) {
+    encoded->push_back(static_cast<char>(length | 0x80));
+    length >>= 7;
+  }
+  encoded->push_back(static_cast<char>(length));
+  encoded->append(value);
+}
+
+// Address peers connect to: the client's host with its P2P port
+std::string PeerAddress(const std::string& address, int p2p_port) {
+  return address.substr(0, address.rfind(':')) + ":" +
+         std::to_string(p2p_port);
+}
+
+}  // namespace
+
+ClientRegistry::ClientRegistry(std::chrono::milliseconds lease)
+    : lease_(lease), snapshot_(std::make_shared<const ClientListSnapshot>()) {
+  // Sequence numbers restart with every run, the epoch tells watchers of an
+  // earlier run to start over
+  std::random_device random;
+  epoch_ = (static_cast<uint64_t>(random()) << 32) ^ random() ^
+           static_cast<uint64_t>(Clock::now().time_since_epoch().count());
+}
+
+ClientRegistry::~ClientRegistry() { StopExpiring(); }
+
+bool PeerEntry::HasSong(int song_num) const {
+  return std::binary_search(cached_songs.begin(), cached_songs.end(),
+                            song_num);
+}
+
+std::string SubnetOf(const std::string& address) {
+  // Strip the port, and the brackets of an IPv6 address
+  std::string host = address.substr(0, address.rfind(':'));
+  if (host.size() >= 2 && host.front() == '[' && host.back() == ']') {
+    host = host.substr(1, host.size() - 2);
+  }
+
+  unsigned char bytes[16];
+  char text[INET6_ADDRSTRLEN];
+  if (inet_pton(AF_INET, host.c_str(), bytes) == 1) {
+    bytes[3] = 0;
+    inet_ntop(AF_INET, bytes, text, sizeof(text));
+    return std::string(text) + "/24";
+  }
+  if (inet_pton(AF_INET6, host.c_str(), bytes) == 1) {
+    std::fill(bytes + 8, bytes + 16, 0);
+    inet_ntop(AF_INET6, bytes, text, sizeof(text));
+    return std::string(text) + "/64";
+  }
+  return host;
+}
+
+int ClientRegistry::Register(const std::string& address,
+                             Clock::time_point now) {
+  uint64_t sequence = latest_sequence_.load();
+  int id;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    id = RegisterLocked(address, now)->id;
+    PublishIfDueLocked(now);
+  }
+  NotifyChanges(sequence);
+  return id;
+}
+
+int ClientRegistry::Advertise(const std::string& address,
+                              const ClientAdvertisement& advertisement,
+                              Clock::time_point now) {
+  ClientAdvertisement sorted = advertisement;
+  std::sort(sorted.cached_songs.begin(), sorted.cached_songs.end());
+
+  uint64_t sequence = latest_sequence_.load();
+  int id;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto client = RegisterLocked(address, now);
+    id = client->id;
+    if (!(client->advertisement == sorted)) {
+      // A new P2P port makes the client a different peer
+      int old_port = client->advertisement.p2p_port;
+      if (old_port != sorted.p2p_port) {
+        if (old_port > 0) {
+          LogPeerLocked(false, address, old_port);
+        }
+        if (sorted.p2p_port > 0) {
+          LogPeerLocked(true, address, sorted.p2p_port);
+        }
+      }
+      client->advertisement = std::move(sorted);
+      stale_ = true;
+    }
+    PublishIfDueLocked(now);
+  }
+  NotifyChanges(sequence);
+  return id;
+}
+
+ClientRegistry::LeaseList::iterator ClientRegistry::RegisterLocked(
+    const std::string& address, Clock::time_point now) {
+  ExpireLocked(now);
+
+  auto it = by_address_.find(address);
+  if (it != by_address_.end()) {
+    // Renewing moves the lease to the back, keeping the list in order
+    it->second->last_seen = now;
+    leases_.splice(leases_.end(), leases_, it->second);
+    return it->second;
+  }
+
+  ClientLease client;
+  client.id = next_id_++;
+  client.address = address;
+  client.last_seen = now;
+  if (leases_.empty()) {
+    expiry_cv_.notify_one();  // The expiry thread waits for a first lease
+  }
+  auto lease = leases_.insert(leases_.end(), client);
+  by_address_.emplace(address, lease);
+  stale_ = true;
+  LOG_INFO("Client connected: {} (id {})", address, client.id);
+  return lease;
+}
+
+std::shared_ptr<const ClientListSnapshot> ClientRegistry::Snapshot() const {
+  return std::atomic_load(&snapshot_);
+}
+
+std::vector<std::string> ClientRegistry::List(const std::string& exclude,
+                                              Clock::time_point now) const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  std::vector<std::string> clients;
+  for (auto it = leases_.rbegin(); it != leases_.rend() && !expired(*it, now);
+       ++it) {
+    if (it->address != exclude) {
+      clients.push_back(it->address);
+    }
+  }
+  return clients;
+}
+
+std::vector<ClientLease> ClientRegistry::Leases(Clock::time_point now) const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  std::vector<ClientLease> clients;
+  for (auto it = leases_.rbegin(); it != leases_.rend() && !expired(*it, now);
+       ++it) {
+    clients.push_back(*it);
+  }
+  return clients;
+}
+
+PeerChanges ClientRegistry::Changes(uint64_t epoch, uint64_t since,
+                                    Clock::time_point now) const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  PeerChanges changes;
+  changes.epoch = epoch_;
+  changes.sequence = sequence_;
+
+  // Changes after since are all still logged if the one following it is
+  uint64_t oldest = events_.empty() ? sequence_ + 1 : events_.front().sequence;
+  if (epoch == epoch_ && since > 0 && since <= sequence_ &&
+      since + 1 >= oldest) {
+    changes.events.assign(events_.end() - (sequence_ - since), events_.end());
+    return changes;
+  }
+
+  changes.reset = true;
+  for (auto it = leases_.rbegin(); it != leases_.rend() && !expired(*it, now);
+       ++it) {
+    if (it->advertisement.p2p_port > 0) {
+      PeerEvent event;
+      event.sequence = sequence_;
+      event.joined = true;
+      event.address = it->address;
+      event.peer_address = PeerAddress(it->address, it->advertisement.p2p_port);
+      changes.events.push_back(std::move(event));
+    }
+  }
+  return changes;
+}
+
+void ClientRegistry::SetChangeListener(ChangeListener listener) {
+  std::lock_guard<std::mutex> lock(listener_mutex_);
+  listener_ = std::move(listener);
+}
+
+void ClientRegistry::StartExpiring() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (expiry_thread_.joinable()) {
+    return;
+  }
+  stop_expiry_ = false;
+  expiring_ = true;
+  expiry_thread_ = std::thread([this]() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (!stop_expiry_) {
+      uint64_t sequence = sequence_;
+      Clock::time_point now = Clock::now();
+      ExpireLocked(now);
+      PublishIfDueLocked(now);
+      if (sequence_ != sequence) {
+        lock.unlock();
+        NotifyChanges(sequence);
+        lock.lock();
+        continue;
+      }
+      // Renewals only push the oldest lease further out
+      Clock::time_point wake = Clock::time_point::max();
+      if (!leases_.empty()) {
+        wake = leases_.front().last_seen + lease_;
+      }
+      if (stale_) {
+        wake = std::min(wake, snapshot_->published + kMaxStaleness);
+      }
+      if (wake == Clock::time_point::max()) {
+        expiry_cv_.wait(lock);
+      } else {
+        expiry_cv_.wait_until(lock, wake);
+      }
+    }
+  });
+}
+
+void ClientRegistry::StopExpiring() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stop_expiry_ = true;
+  }
+  expiry_cv_.notify_all();
+  if (expiry_thread_.joinable()) {
+    expiry_thread_.join();
+  }
+
+  // Nobody publishes deferred changes anymore
+  std::lock_guard<std::mutex> lock(mutex_);
+  expiring_ = false;
+  PublishIfDueLocked(Clock::now());
+}
+
+size_t ClientRegistry::Expire(Clock::time_point now) {
+  uint64_t sequence = latest_sequence_.load();
+  size_t expired_count;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    expired_count = ExpireLocked(now);
+    PublishIfDueLocked(now);
+  }
+  NotifyChanges(sequence);
+  return expired_count;
+}
+
+std::chrono::milliseconds ClientRegistry::lease() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return lease_;
+}
+
+void ClientRegistry::set_lease(std::chrono::milliseconds lease) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  lease_ = lease;
+  stale_ = true;
+  PublishIfDueLocked(Clock::now());
+  expiry_cv_.notify_one();
+}
+
+size_t ClientRegistry::ExpireLocked(Clock::time_point now) {
+  size_t expired_count = 0;
+  while (!leases_.empty() && expired(leases_.front(), now)) {
+    LOG_INFO("Client lease expired: {} (id {})", leases_.front().address,
+             leases_.front().id);
+    if (leases_.front().advertisement.p2p_port > 0) {
+      LogPeerLocked(false, leases_.front().address,
+                    leases_.front().advertisement.p2p_port);
+    }
+    by_address_.erase(leases_.front().address);
+    leases_.pop_front();
+    expired_count++;
+  }
+  if (expired_count > 0) {
+    stale_ = true;
+  }
+  return expired_count;
+}
+
+void ClientRegistry::LogPeerLocked(bool joined, const std::string& address,
+                                   int p2p_port) {
+  PeerEvent event;
+  event.sequence = ++sequence_;
+  event.joined = joined;
+  event.address = address;
+  event.peer_address = PeerAddress(address, p2p_port);
+  events_.push_back(std::move(event));
+  if (events_.size() > kMaxPeerEvents) {
+    events_.pop_front();
+  }
+  latest_sequence_.store(sequence_);
+}
+
+void ClientRegistry::NotifyChanges(uint64_t since) {
+  if (latest_sequence_.load() == since) {
+    return;
+  }
+  std::lock_guard<std::mutex> lock(listener_mutex_);
+  if (listener_) {
+    listener_();
+  }
+}
+
+void ClientRegistry::PublishIfDueLocked(Clock::time_point now) {
+  if (!stale_) {
+    return;
+  }
+  if (expiring_ && now - snapshot_->published < kMaxStaleness) {
+    expiry_cv_.notify_one();  // Publishes once the interval has passed
+    return;
+  }
+  PublishLocked(now);
+}
+
+void ClientRegistry::PublishLocked(Clock::time_point now) {
+  auto snapshot = std::make_shared<ClientListSnapshot>();
+  snapshot->version = snapshot_->version + 1;
+  snapshot->published = now;
+  for (auto it = leases_.rbegin(); it != leases_.rend() && !expired(*it, now);
+       ++it) {
+    snapshot->addresses.push_back(it->address);
+    // Leases are visited newest first, the last one runs out first
+    snapshot->expires = it->last_seen + lease_;
+
+    // Only clients running a peer service can be connected to
+    const ClientAdvertisement& advertisement = it->advertisement;
+    if (advertisement.p2p_port <= 0) {
+      continue;
+    }
+    PeerEntry peer;
+    peer.address = it->address;
+    peer.peer_address = PeerAddress(it->address, advertisement.p2p_port);
+    peer.subnet = SubnetOf(it->address);
+    peer.uplink_kbps = advertisement.uplink_kbps;
+    peer.cached_songs = advertisement.cached_songs;
+    size_t start = snapshot->encoded.size();
+    AppendField(&snapshot->encoded, peer.peer_address);
+    peer.range = std::make_pair(start, snapshot->encoded.size());
+    snapshot->by_address.emplace(peer.address, snapshot->peers.size());
+    snapshot->peers.push_back(std::move(peer));
+  }
+
+  // Best provisioned first, the most recently seen first among equals
+  const auto& peers = snapshot->peers;
+  snapshot->ranked.resize(peers.size());
+  for (size_t i = 0; i < peers.size(); i++) {
+    snapshot->ranked[i] = i;
+  }
+  std::stable_sort(snapshot->ranked.begin(), snapshot->ranked.end(),
+                   [&peers](size_t a, size_t b) {
+                     return peers[a].uplink_kbps > peers[b].uplink_kbps;
+                   });
+  for (size_t i : snapshot->ranked) {
+    snapshot->by_subnet[peers[i].subnet].push_back(i);
+  }
+
+  stale_ = false;
+  std::atomic_store(&snapshot_,
+                    std::shared_ptr<const ClientListSnapshot>(
+                        std::move(snapshot)));
+}
@@ -0,0 +1,295 @@
+#include "include/egress_scheduler.h"
+
+#include <algorithm>
+
+namespace {
+
+// Bytes a bucket holds when full, a tenth of a second at its rate
+double BurstOf(uint64_t rate) { return std::max(1.0, rate / 10.0); }
+
+}  // namespace
+
+template <class Fn>
+void EgressScheduler::ForEachQueuedLocked(Fn fn) {
+  for (FlowId id : urgent_) {
+    fn(&flows_[id]);
+  }
+  for (const auto& [start, id] : fair_) {
+    fn(&flows_[id]);
+  }
+}
+
+EgressScheduler::EgressScheduler(const EgressOptions& options)
+    : options_(options) {
+  global_.rate = options_.rate_bytes_per_sec;
+  global_.tokens = BurstOf(global_.rate);
+  global_.refilled = Clock::now();
+  if (options_.rate_bytes_per_sec > 0 ||
+      options_.client_rate_bytes_per_sec > 0) {
+    rate_thread_ = std::thread(&EgressScheduler::RunRateThread, this);
+  }
+}
+
+EgressScheduler::~EgressScheduler() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stop_rate_thread_ = true;
+  }
+  rate_cv_.notify_all();
+  if (rate_thread_.joinable()) {
+    rate_thread_.join();
+  }
+}
+
+EgressScheduler::FlowId EgressScheduler::AddFlow(const std::string& client) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  ClientState& state = clients_[client];
+  if (state.flows++ == 0) {
+    state.bucket.rate = options_.client_rate_bytes_per_sec;
+    state.bucket.tokens = BurstOf(state.bucket.rate);
+    state.bucket.refilled = Clock::now();
+  }
+  FlowId id = next_id_++;
+  Flow& flow = flows_[id];
+  flow.client = &state;
+  flow.client_name = client;
+  return id;
+}
+
+void EgressScheduler::RemoveFlow(FlowId id) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto it = flows_.find(id);
+  if (it == flows_.end()) {
+    return;
+  }
+  Flow& flow = it->second;
+  if (flow.pending > 0 && flow.urgent) {
+    urgent_.erase(std::find(urgent_.begin(), urgent_.end(), id));
+  } else if (flow.pending > 0) {
+    fair_.erase({flow.start, id});
+  }
+  if (--flow.client->flows == 0) {
+    clients_.erase(flow.client_name);
+  }
+  flows_.erase(it);
+}
+
+bool EgressScheduler::Request(FlowId id, size_t bytes, bool urgent,
+                              Wake wake) {
+  bool granted = false;
+  std::vector<Wake> wakes;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = flows_.find(id);
+    if (shut_down_ || it == flows_.end()) {
+      return true;
+    }
+    Flow& flow = it->second;
+    bytes = std::max<size_t>(1, bytes);
+
+    // A stream that fell behind starts level with the others rather than
+    // catching up on the bytes it did not ask for. Urgent chunks are free.
+    uint64_t start = std::max(virtual_time_, flow.finish);
+    if (!urgent) {
+      flow.finish = start + bytes;
+    }
+
+    // Nobody is waiting, so there is no order to keep
+    auto now = Clock::now();
+    if (urgent_.empty() && fair_.empty() &&
+        HasTokens(&flow.client->bucket, now) && CanSendLocked(bytes, now)) {
+      if (!urgent) {
+        virtual_time_ = start;
+      }
+      GrantLocked(&flow, bytes);
+      return true;
+    }
+
+    flow.pending = bytes;
+    flow.urgent = urgent;
+    flow.start = start;
+    flow.wake = std::move(wake);
+    if (urgent) {
+      urgent_.push_back(id);
+    } else {
+      fair_.emplace(start, id);
+    }
+    PumpLocked(now, id, &granted, &wakes);
+  }
+  for (auto& other : wakes) {
+    other();
+  }
+  return granted;
+}
+
+void EgressScheduler::Complete(size_t bytes) {
+  std::vector<Wake> wakes;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    inflight_ -= std::min(inflight_, std::max<size_t>(1, bytes));
+    PumpLocked(Clock::now(), 0, nullptr, &wakes);
+  }
+  for (auto& wake : wakes) {
+    wake();
+  }
+}
+
+void EgressScheduler::Shutdown() {
+  std::vector<Wake> wakes;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    shut_down_ = true;
+    ForEachQueuedLocked([&wakes](Flow* flow) {
+      flow->pending = 0;
+      wakes.push_back(std::move(flow->wake));
+    });
+    urgent_.clear();
+    fair_.clear();
+  }
+  for (auto& wake : wakes) {
+    wake();
+  }
+}
+
+size_t EgressScheduler::inflight_bytes() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return inflight_;
+}
+
+size_t EgressScheduler::queued() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return urgent_.size() + fair_.size();
+}
+
+bool EgressScheduler::HasTokens(Bucket* bucket, Clock::time_point now) {
+  if (bucket->rate == 0) {
+    return true;
+  }
+  double elapsed =
+      std::chrono::duration<double>(now - bucket->refilled).count();
+  if (elapsed > 0) {
+    bucket->tokens = std::min(BurstOf(bucket->rate),
+                              bucket->tokens + elapsed * bucket->rate);
+    bucket->refilled = now;
+  }
+  return bucket->tokens > 0;
+}
+
+EgressScheduler::Clock::time_point EgressScheduler::RefillTime(
+    const Bucket& bucket) {
+  if (bucket.tokens > 0) {
+    return bucket.refilled;
+  }
+  double seconds = (1 - bucket.tokens) / bucket.rate;
+  return bucket.refilled +
+         std::chrono::duration_cast<Clock::duration>(
+             std::chrono::duration<double>(seconds));
+}
+
+bool EgressScheduler::CanSendLocked(size_t bytes, Clock::time_point now) {
+  // A chunk larger than the window still goes out once nothing else is
+  bool window = options_.window_bytes == 0 || inflight_ == 0 ||
+                inflight_ + bytes <= options_.window_bytes;
+  return window && HasTokens(&global_, now);
+}
+
+void EgressScheduler::GrantLocked(Flow* flow, size_t bytes) {
+  inflight_ += bytes;
+  if (global_.rate > 0) {
+    global_.tokens -= bytes;
+  }
+  if (flow->client->bucket.rate > 0) {
+    flow->client->bucket.tokens -= bytes;
+  }
+}
+
+void EgressScheduler::PumpLocked(Clock::time_point now, FlowId self,
+                                 bool* self_granted,
+                                 std::vector<Wake>* wakes) {
+  while (!urgent_.empty() || !fair_.empty()) {
+    FlowId id = PickLocked(now);
+    if (id == 0) {
+      break;  // Every waiting client is over its rate
+    }
+    Flow& flow = flows_[id];
+    if (!CanSendLocked(flow.pending, now)) {
+      break;  // The pick stays first in line
+    }
+
+    GrantLocked(&flow, flow.pending);
+    if (flow.urgent) {
+      urgent_.pop_front();
+    } else {
+      fair_.erase({flow.start, id});
+      virtual_time_ = flow.start;
+    }
+    flow.pending = 0;
+    if (id == self) {
+      *self_granted = true;
+      flow.wake = nullptr;
+    } else {
+      wakes->push_back(std::move(flow.wake));
+    }
+  }
+
+  // Come back when the bucket holding the queue back has refilled
+  if (!rate_thread_.joinable() || (urgent_.empty() && fair_.empty())) {
+    return;
+  }
+  Clock::time_point refill = Clock::time_point::max();
+  if (global_.rate > 0 && global_.tokens <= 0) {
+    refill = RefillTime(global_);
+  } else {
+    ForEachQueuedLocked([&refill](Flow* flow) {
+      const Bucket& bucket = flow->client->bucket;
+      if (bucket.rate > 0 && bucket.tokens <= 0) {
+        refill = std::min(refill, RefillTime(bucket));
+      }
+    });
+  }
+  if (refill < next_refill_) {
+    next_refill_ = refill;
+    rate_cv_.notify_all();
+  }
+}
+
+EgressScheduler::FlowId EgressScheduler::PickLocked(Clock::time_point now) {
+  // Urgent chunks in arrival order, the one picked moves to the front
+  for (auto it = urgent_.begin(); it != urgent_.end(); ++it) {
+    if (HasTokens(&flows_[*it].client->bucket, now)) {
+      FlowId id = *it;
+      urgent_.erase(it);
+      urgent_.push_front(id);
+      return id;
+    }
+  }
+
+  // Then the lowest start time
+  for (const auto& [start, id] : fair_) {
+    if (HasTokens(&flows_[id].client->bucket, now)) {
+      return id;
+    }
+  }
+  return 0;
+}
+
+void EgressScheduler::RunRateThread() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  while (!stop_rate_thread_) {
+    if (next_refill_ == Clock::time_point::max()) {
+      rate_cv_.wait(lock);
+      continue;
+    }
+    if (rate_cv_.wait_until(lock, next_refill_) != std::cv_status::timeout) {
+      continue;
+    }
+    next_refill_ = Clock::time_point::max();
+    std::vector<Wake> wakes;
+    PumpLocked(Clock::now(), 0, nullptr, &wakes);
+    lock.unlock();
+    for (auto& wake : wakes) {
+      wake();
+    }
+    lock.lock();
+  }
+}
@@ -0,0 +1,176 @@
+#pragma once
+
+#include <grpcpp/grpcpp.h>
+
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#include "audio_server.h"
+#include "audio_service.grpc.pb.h"
+#include "broadcast_hub.h"
+#include "egress_scheduler.h"
+#include "server_stats.h"
+
+/**
+ * @brief Threading and streaming options of the asynchronous audio service
+ */
+struct AsyncServiceOptions {
+  int num_cqs = 2;        /**< Number of completion queues */
+  int pollers_per_cq = 2; /**< Poller threads draining each completion queue */
+  size_t min_chunk_bytes = 16 * 1024;   /**< Smallest LoadAudio chunk */
+  size_t max_chunk_bytes = 1024 * 1024; /**< Largest LoadAudio chunk */
+  /** Time a single LoadAudio write should take, see ChunkSizer */
+  std::chrono::microseconds target_write_latency{5000};
+  /** Window and rate caps of the LoadAudio and LoadSegment writes */
+  EgressOptions egress;
+  /** Pacing and buffering of the JoinBroadcast streams */
+  BroadcastOptions broadcast;
+};
+
+class PeerWatchers;
+
+/**
+ * @brief Completion-queue based implementation of the audio_service service
+ *
+ * Every RPC is handled by a reactor-style call object that is driven by the
+ * completion of its own operations, so an in-flight stream only occupies a
+ * thread while one of its completions is being handled. All calls are
+ * multiplexed over num_cqs * pollers_per_cq threads no matter how many
+ * clients are streaming at the same time.
+ */
+class AsyncAudioService {
+ public:
+  // The song streaming methods are raw so chunks can be sent as slices of the
+  // song mapping
+  using Generated = audio_service::audio_service;
+  using Service = Generated::WithAsyncMethod_GetPlaylist<
+      Generated::WithRawMethod_GetPeerClientIPs<
+          Generated::WithAsyncMethod_GetSegmentIndex<
+              Generated::WithAsyncMethod_Heartbeat<
+                  Generated::WithRawMethod_LoadAudio<
+                      Generated::WithRawMethod_LoadSegment<
+                          Generated::WithAsyncMethod_WatchPeers<
+                              Generated::WithAsyncMethod_GetServerStats<
+                                  Generated::WithRawMethod_JoinBroadcast<
+                                      Generated::WithAsyncMethod_HintNextSongs<
+                                          Generated::Service>>>>>>>>>>;
+
+  /**
+   * @brief Construct a new Async Audio Service object
+   *
+   * @param server Server business logic shared with the CLI
+   * @param options Completion queue and poller thread counts
+   */
+  AsyncAudioService(std::shared_ptr<AudioServer> server,
+                    const AsyncServiceOptions& options);
+  ~AsyncAudioService();
+
+  /**
+   * @brief Register the service and its completion queues with a builder
+   *
+   * Must be called before grpc::ServerBuilder::BuildAndStart.
+   *
+   * @param builder Builder of the server that will host the service
+   */
+  void RegisterWith(grpc::ServerBuilder& builder);
+
+  /**
+   * @brief Start accepting calls on every completion queue
+   *
+   * Must be called after the server has been built and started.
+   */
+  void Start();
+
+  /**
+   * @brief Shut down the server and drain all completion queues
+   *
+   * @param server Server hosting this service
+   */
+  void Shutdown(grpc::Server* server);
+
+  /**
+   * @brief Get the generated async service used to request new calls
+   */
+  Service* service() { return &service_; }
+
+  /**
+   * @brief Get the server business logic
+   */
+  AudioServer* server() { return server_.get(); }
+
+  /**
+   * @brief Check whether the service is shutting down
+   *
+   * Calls stop requesting new calls of their type once this is set.
+   */
+  bool IsShuttingDown() const { return shutting_down_.load(); }
+
+  /**
+   * @brief Get the options the service was created with
+   */
+  const AsyncServiceOptions& options() const { return options_; }
+
+  /**
+   * @brief Get the WatchPeers calls waiting for the next peer change
+   */
+  PeerWatchers* peer_watchers() { return peer_watchers_.get(); }
+
+  /**
+   * @brief Get the counters and latencies of the calls served
+   */
+  ServerStats* stats() { return &stats_; }
+
+  /**
+   * @brief Get the scheduler ordering the chunk writes of all streams
+   */
+  EgressScheduler* egress() { return &egress_; }
+
+  /**
+   * @brief Get the live broadcasts JoinBroadcast calls listen to
+   */
+  BroadcastHub* broadcasts() { return &broadcasts_; }
+
+ private:
+  grpc::Status HandleGetPlaylist(grpc::ServerContext* context,
+                                 const audio_service::PlaylistRequest& request,
+                                 audio_service::PlaylistResponse* response);
+
+  // Raw, the response is sliced from the cached encoding of the client list
+  grpc::Status HandleGetPeerClientIPs(grpc::ServerContext* context,
+                                      const grpc::ByteBuffer& request,
+                                      grpc::ByteBuffer* response);
+
+  grpc::Status HandleHeartbeat(grpc::ServerContext* context,
+                               const audio_service::HeartbeatRequest& request,
+                               audio_service::HeartbeatResponse* response);
+
+  grpc::Status HandleGetServerStats(
+      grpc::ServerContext* context,
+      const audio_service::ServerStatsRequest& request,
+      audio_service::ServerStatsResponse* response);
+
+  grpc::Status HandleHintNextSongs(
+      grpc::ServerContext* context,
+      const audio_service::SongHintRequest& request,
+      audio_service::SongHintResponse* response);
+
+  // Seed a completion queue with one pending call of every RPC type
+  void RequestCalls(grpc::ServerCompletionQueue* cq);
+
+  // Poller thread loop, dispatches completed operations to their calls
+  void Poll(grpc::ServerCompletionQueue* cq);
+
+  std::shared_ptr<AudioServer> server_;
+  AsyncServiceOptions options_;
+  Service service_;
+  std::vector<std::unique_ptr<grpc::ServerCompletionQueue>> cqs_;
+  std::vector<std::thread> pollers_;
+  std::atomic<bool> shutting_down_;
+  std::unique_ptr<PeerWatchers> peer_watchers_;
+  ServerStats stats_;
+  EgressScheduler egress_;
+  BroadcastHub broadcasts_;
+};
@@ -1,13 +1,41 @@
 #pragma once
 
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
 #include <filesystem>
+#include <functional>
 #include <map>
+#include <memory>
 #include <mutex>
+#include <set>
 #include <string>
+#include <thread>
+#include <utility>
 #include <vector>
 
+#include "client_registry.h"
+#include "peer_selector.h"
+#include "playlist_index.h"
+#include "segment_index.h"
+#include "song_cache.h"
+#include "song_catalog.h"
+#include "song_store.h"
+#include "transcode_cache.h"
+#include "work_queue.h"
+
 namespace fs = std::filesystem;
 
+/**
+ * @brief Size and content hash of one version of a song file
+ */
+struct SongDigest {
+  std::string resume_token; /**< Version of the song that was hashed */
+  size_t size = 0;          /**< Size of the song file in bytes */
+  uint64_t content_hash = 0; /**< XXH64 of the song file */
+};
+
 /**
  * @brief Core server logic for the music streaming server
  *
@@ -20,16 +48,94 @@ class AudioServer {
    * @brief Construct a new Audio Server object
    *
    * @param audio_dir Directory containing audio files
+   * @param cache_bytes Byte budget of the in-memory song cache, 0 disables it
+   * @param segment_duration Playback time covered by each song segment
+   * @param catalog_options Persistence and scan parallelism of the catalog
+   */
+  AudioServer(const std::string& audio_dir,
+              size_t cache_bytes = kDefaultCacheBytes,
+              std::chrono::milliseconds segment_duration =
+                  kDefaultSegmentDuration,
+              const SongCatalogOptions& catalog_options =
+                  SongCatalogOptions());
+
+  /**
+   * @brief Destroy the Audio Server object, stopping catalog indexing and
+   * watching
+   */
+  ~AudioServer();
+
+  /**
+   * @brief Default byte budget of the song cache
    */
-  AudioServer(const std::string& audio_dir);
+  static constexpr size_t kDefaultCacheBytes = 256 * 1024 * 1024;
+
+  /**
+   * @brief Default playback time covered by each song segment
+   */
+  static constexpr std::chrono::milliseconds kDefaultSegmentDuration{2000};
+
+  /**
+   * @brief Shortest playback time of a song segment accepted, shorter ones
+   * make indexes of millions of segments that no response can carry
+   */
+  static constexpr std::chrono::milliseconds kMinSegmentDuration{100};
 
   /**
    * @brief Get the list of available audio files
    *
+   * Song n is at index n - 1. Songs that were removed while the server is
+   * running leave an empty name, so the other songs keep their number.
+   *
    * @return std::vector<std::string> List of audio file names
    */
   std::vector<std::string> GetPlaylist() const;
 
+  /**
+   * @brief Get the current snapshot of the song catalog
+   *
+   * @return std::shared_ptr<const CatalogSnapshot> Metadata of every song
+   */
+  std::shared_ptr<const CatalogSnapshot> GetCatalog() const;
+
+  /**
+   * @brief Get the current version of the playlist listed to clients
+   *
+   * Unlike the catalog, the playlist also changes when a song is hashed.
+   *
+   * @return std::shared_ptr<const PlaylistSnapshot> Every song id with its
+   * metadata, content hash and the version that last changed it
+   */
+  std::shared_ptr<const PlaylistSnapshot> GetPlaylistSnapshot();
+
+  /**
+   * @brief Get a recent version of the playlist, for paging through it
+   *
+   * @param version Version from an earlier GetPlaylistSnapshot()
+   * @return std::shared_ptr<const PlaylistSnapshot> The version, nullptr if
+   * it is no longer kept
+   */
+  std::shared_ptr<const PlaylistSnapshot> GetPlaylistSnapshot(
+      uint64_t version) const;
+
+  /**
+   * @brief Reconcile the catalog with the audio directory in the background
+   * and apply added, changed and removed songs as they appear
+   *
+   * Changed songs are dropped from the caches and, if catalog indexing is
+   * running, hashed and encoded again.
+   *
+   * @return true if the directory is being watched, false otherwise
+   */
+  bool WatchCatalog();
+
+  /**
+   * @brief Compare the audio directory with the catalog right away
+   *
+   * @return size_t Number of songs added, changed or removed
+   */
+  size_t RescanCatalog();
+
   /**
    * @brief Load an audio file by its index in the playlist
    *
@@ -39,7 +145,197 @@ class AudioServer {
   std::string GetAudioFilePath(int song_num) const;
 
   /**
-   * @brief Register a client with the server
+   * @brief Get the shared memory mapping of a song by its playlist index
+   *
+   * Hot songs are served from the song cache. All concurrent streams of
+   * the same song share one mapping.
+   *
+   * @param song_num Index of the song in the playlist (1-based)
+   * @return std::shared_ptr<const MappedSong> The mapping, nullptr if the
+   * song cannot be found or mapped
+   */
+  std::shared_ptr<const MappedSong> GetSong(int song_num);
+
+  /**
+   * @brief Get the size and content hash of a song
+   *
+   * The hash is computed on first use and kept until the song file changes.
+   * The song is read without going through the song cache.
+   *
+   * @param song_num Index of the song in the playlist (1-based)
+   * @param digest Receives the size and hash of the song
+   * @param compute Whether to hash the song if it has no current digest yet
+   * @return true if a digest was found or computed, false otherwise
+   */
+  bool GetSongDigest(int song_num, SongDigest* digest, bool compute = true);
+
+  /**
+   * @brief Compute the digest of every song of the playlist
+   *
+   * @return size_t Number of songs with a digest
+   */
+  size_t HashCatalog();
+
+  /**
+   * @brief Get the segment index of a song, building it on the calling
+   * thread if needed
+   *
+   * The index is built on first use and kept until the song file changes.
+   * Meant for background indexing, the song is read without going through
+   * the song cache.
+   *
+   * @param song_num Index of the song in the playlist (1-based)
+   * @param song Receives the mapping the index describes, so segments can be
+   * served from the same version of the song, may be nullptr
+   * @return std::shared_ptr<const SegmentIndex> The index, nullptr if the
+   * song cannot be found or is not a PCM WAV file
+   */
+  std::shared_ptr<const SegmentIndex> GetSegmentIndex(
+      int song_num, std::shared_ptr<const MappedSong>* song = nullptr);
+
+  /**
+   * @brief Function told the segment index of a song once it is built
+   */
+  using SegmentIndexReady =
+      std::function<void(std::shared_ptr<const SegmentIndex> index,
+                         std::shared_ptr<const MappedSong> song)>;
+
+  /**
+   * @brief Get the segment index of a song without building it on the
+   * calling thread
+   *
+   * Indexes are normally built while the catalog is indexed. A song without
+   * an index yet is indexed on a worker thread, once no matter how many
+   * calls ask for it at the same time.
+   *
+   * @param song_num Index of the song in the playlist (1-based)
+   * @param index Receives the index if it is returned right away, nullptr if
+   * the song cannot be found
+   * @param song Receives the mapping the index describes
+   * @param done Called with the index, nullptr if the song is not a PCM WAV
+   * file, and its mapping once built, unless they are returned right away.
+   * It may be called on another thread before this returns.
+   * @return true if index and song were set right away, false if done will
+   * be called instead
+   */
+  bool GetSegmentIndex(int song_num, std::shared_ptr<const SegmentIndex>* index,
+                       std::shared_ptr<const MappedSong>* song,
+                       SegmentIndexReady done);
+
+  /**
+   * @brief Get the losslessly encoded version of a song
+   *
+   * @param song_num Index of the song in the playlist (1-based)
+   * @return std::shared_ptr<const MappedSong> Mapping of the encoded song,
+   * nullptr if the song has not been encoded (yet)
+   */
+  std::shared_ptr<const MappedSong> GetEncodedSong(int song_num) const;
+
+  /**
+   * @brief Get a song converted to the format of a client's output device
+   *
+   * Each format of a song is converted once, on a worker thread, and kept in
+   * the transcode cache until the song changes or is evicted. A song already
+   * stored as a plain 16-bit WAV file in the format is served as it is.
+   *
+   * @param song_num Index of the song in the playlist (1-based)
+   * @param song Version of the song to convert, from GetSong
+   * @param format Sample format, rate and channel layout to convert to
+   * @param converted Receives the song in the format if it is returned right
+   * away
+   * @param done Called with the converted song, nullptr if the song cannot be
+   * converted to the format, unless it is returned right away. It may be
+   * called on another thread before this returns, and may be nullptr.
+   * @return true if converted was set right away, false if done will be
+   * called instead
+   */
+  bool GetConvertedSong(int song_num,
+                        const std::shared_ptr<const MappedSong>& song,
+                        const music262::PcmFormat& format,
+                        std::shared_ptr<const MappedSong>* converted,
+                        TranscodeCache::Done done);
+
+  /**
+   * @brief Set the byte budget of the transcode cache
+   */
+  void SetTranscodeCacheBytes(size_t bytes) {
+    transcode_cache_.SetBudget(bytes);
+  }
+
+  /**
+   * @brief Get the transcode cache counters
+   *
+   * @return TranscodeCacheStats Current cache counters
+   */
+  TranscodeCacheStats GetTranscodeStats() const {
+    return transcode_cache_.GetStats();
+  }
+
+  /**
+   * @brief Losslessly encode every song of the playlist
+   *
+   * Encoded songs are written to codec_dir as "<song>.m2lc" and reused on
+   * later runs while they are newer than the song. Songs that cannot be
+   * encoded, or that would not get smaller, are only served as PCM.
+   *
+   * @param codec_dir Directory holding the encoded songs
+   * @return size_t Number of songs available in encoded form
+   */
+  size_t EncodeCatalog(const std::string& codec_dir);
+
+  /**
+   * @brief Run HashCatalog, build the segment indexes and then run
+   * EncodeCatalog on a background thread
+   *
+   * Songs are listed without a digest until they have been hashed and are
+   * served as PCM until their encoded version is ready. Afterwards the
+   * thread indexes songs the catalog reports as added or changed.
+   *
+   * @param codec_dir Directory holding the encoded songs, empty to only hash
+   */
+  void StartCatalogIndexing(const std::string& codec_dir);
+
+  /**
+   * @brief Pin a song in the cache so it is never evicted
+   *
+   * @param song_num Index of the song in the playlist (1-based)
+   * @return true if the song exists, false otherwise
+   */
+  bool PinSong(int song_num);
+
+  /**
+   * @brief Warm the song cache at startup
+   *
+   * Pinned songs are loaded first, then the rest of the playlist in order
+   * for as long as the songs fit in the cache budget.
+   *
+   * @return size_t Number of songs loaded into the cache
+   */
+  size_t Preload();
+
+  /**
+   * @brief Get a song a client expects to play soon ready to stream
+   *
+   * The song is moved to the front of the song cache, and the kernel is
+   * asked to read its file, and its encoded version if there is one, into
+   * memory in the background. Given a format, the song is also converted to
+   * it on a worker thread unless the transcode cache already holds it.
+   *
+   * @param song_num Index of the song in the playlist (1-based)
+   * @param format Format the client will load the song in, nullptr for none
+   * @return true if the song exists, false otherwise
+   */
+  bool WarmSong(int song_num, const music262::PcmFormat* format = nullptr);
+
+  /**
+   * @brief Get the song cache counters
+   *
+   * @return SongCacheStats Current cache counters
+   */
+  SongCacheStats GetCacheStats() const;
+
+  /**
+   * @brief Register a client with the server or renew its lease
    *
    * @param client_id Unique identifier for the client
    * @return int Client ID assigned by the server
@@ -49,12 +345,86 @@ class AudioServer {
   /**
    * @brief Get the list of connected clients
    *
+   * Clients that have not called the server within their lease are left
+   * out.
+   *
    * @param exclude_client_id Client ID to exclude from the list
    * @return std::vector<std::string> List of client IDs
    */
   std::vector<std::string> GetConnectedClients(
       const std::string& exclude_client_id = "") const;
 
+  /**
+   * @brief Register a client and record what it advertises as a peer
+   *
+   * @param client_id Unique identifier for the client
+   * @param advertisement Peer service, bandwidth and songs of the client
+   * @return int Client ID assigned by the server
+   */
+  int AdvertiseClient(const std::string& client_id,
+                      const ClientAdvertisement& advertisement);
+
+  /**
+   * @brief Pick the peers a client should connect to
+   *
+   * Only clients that advertised a peer service are picked, preferring
+   * clients on the same subnet, holding song_num and with the most uplink
+   * bandwidth. Reading the client list does not wait for clients
+   * registering at the same time.
+   *
+   * @param client_id Client asking for peers, never picked
+   * @param max_peers Most peers to pick, 0 or more than the server's limit
+   * picks up to the limit
+   * @param song_num Song the client plays, 0 for none
+   * @return PeerSelection The picked peers
+   */
+  PeerSelection SelectPeers(const std::string& client_id, size_t max_peers,
+                            int song_num) const;
+
+  /**
+   * @brief Set the most peers handed to a client
+   */
+  void SetMaxPeers(size_t max_peers) { max_peers_ = max_peers; }
+
+  /**
+   * @brief Default of the most peers handed to a client
+   */
+  static constexpr size_t kDefaultMaxPeers = 8;
+
+  /**
+   * @brief Get the peers that joined or left after a change
+   *
+   * @param epoch Epoch of the changes the caller has seen, 0 for none
+   * @param since Sequence number of the last change the caller has seen
+   * @return PeerChanges The changes after since, or every current peer if
+   * the caller has to start over
+   */
+  PeerChanges GetPeerChanges(uint64_t epoch, uint64_t since) const;
+
+  /**
+   * @brief Get the sequence number of the latest peer change
+   */
+  uint64_t GetPeerSequence() const { return clients_.sequence(); }
+
+  /**
+   * @brief Set the function told when peers join or leave
+   *
+   * @param listener Function to call, nullptr to stop notifications
+   */
+  void SetPeerChangeListener(ClientRegistry::ChangeListener listener);
+
+  /**
+   * @brief Get the time a client stays connected without calling
+   */
+  std::chrono::milliseconds GetClientLease() const;
+
+  /**
+   * @brief Set the time a client stays connected without calling
+   *
+   * @param lease New lease, also applied to clients already connected
+   */
+  void SetClientLease(std::chrono::milliseconds lease);
+
   /**
    * @brief Extract the clean IP:port from a peer string
    *
@@ -73,11 +443,72 @@ class AudioServer {
   void PrintStatus(const std::string& local_ip, int port) const;
 
  private:
+  // Map a song for background work, bypassing the song cache so neither its
+  // order nor its counters reflect requests no client made
+  std::shared_ptr<const MappedSong> MapSong(int song_num);
+
+  // Drop everything derived from songs that changed on disk
+  void OnCatalogChange(const std::vector<SongMetadata>& changed);
+
+  // Hash, segment and, if codec_dir is not empty, encode one song
+  void IndexSong(int song_num, const std::string& codec_dir);
+
+  // Build the segment index of every PCM WAV song of the catalog
+  size_t IndexCatalogSegments();
+
+  // Build the segment index of one version of a song on a worker thread,
+  // then tell the calls waiting for it
+  void BuildSegmentIndex(int song_num, std::shared_ptr<const MappedSong> song);
+
+  // Keep an encoded song mapped and count the PCM bytes it replaces
+  void StoreEncodedSong(int song_num, std::shared_ptr<const MappedSong> song);
+
   std::string audio_directory_;
-  std::vector<std::string> playlist_;
+  SongCatalog catalog_;
+  PlaylistIndex playlist_;
+  SongStore song_store_;
+  SongCache song_cache_;
+  std::vector<int> pinned_songs_;
+
+  // Content hashes by song number, recomputed when the song changes
+  std::map<int, SongDigest> song_digests_;
+  mutable std::mutex digests_mutex_;
+
+  // Segment indexes by song number, rebuilt when the song changes
+  std::chrono::milliseconds segment_duration_;
+  std::map<int, std::shared_ptr<const SegmentIndex>> segment_indexes_;
+  // Builds running on the workers by song number and version, with the
+  // calls waiting for them
+  std::map<std::pair<int, std::string>, std::vector<SegmentIndexReady>>
+      building_indexes_;
+  mutable std::mutex segments_mutex_;
+
+  // Encode one song into codec_dir, returns its mapping or nullptr
+  std::shared_ptr<const MappedSong> EncodeSong(int song_num,
+                                               const fs::path& codec_dir);
+
+  // Losslessly encoded songs, kept mapped until the song changes
+  std::map<int, std::shared_ptr<const MappedSong>> encoded_songs_;
+  std::map<int, size_t> encoded_source_bytes_;
+  mutable std::mutex encoded_mutex_;
+
+  // Songs converted to the formats of client devices
+  TranscodeCache transcode_cache_;
+
+  // Background thread hashing and encoding the catalog, then the songs
+  // queued in pending_songs_ as they change
+  std::thread catalog_thread_;
+  std::atomic<bool> stop_catalog_{false};
+  std::atomic<bool> indexing_{false};
+  std::set<int> pending_songs_;
+  std::condition_variable pending_cv_;
+  std::mutex pending_mutex_;
 
   // Client tracking
-  std::map<int, std::string> connected_clients_;
-  int next_client_id_;
-  mutable std::mutex clients_mutex_;
+  ClientRegistry clients_;
+  std::atomic<size_t> max_peers_{kDefaultMaxPeers};
+
+  // Runs work too slow for a poller thread, last so its jobs never outlive
+  // the members they use
+  WorkQueue workers_;
 };
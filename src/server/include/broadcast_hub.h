@@ -0,0 +1,208 @@
+#pragma once
+
+#include <grpcpp/support/byte_buffer.h>
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+#include "audio_server.h"
+#include "broadcast_ring.h"
+#include "wav_format.h"
+
+/**
+ * @brief Pacing and buffering of live broadcasts
+ */
+struct BroadcastOptions {
+  /** @brief Playback time of the audio in one chunk */
+  std::chrono::milliseconds chunk_duration{100};
+
+  /**
+   * @brief How far ahead of its play time a chunk is published, which is
+   * also what a joining listener is sent right away to fill its buffer
+   */
+  std::chrono::milliseconds lead{2000};
+
+  /**
+   * @brief Chunks kept for listeners that fall behind, at least twice the
+   * chunks within the lead
+   */
+  size_t ring_chunks = 128;
+};
+
+/**
+ * @brief One chunk of a broadcast, serialized once for every listener
+ */
+struct BroadcastFrame {
+  grpc::ByteBuffer message; /**< Wire-format BroadcastChunk */
+  size_t bytes = 0;         /**< Audio bytes in the chunk */
+};
+
+/**
+ * @brief Counters of the broadcasts of a hub
+ */
+struct BroadcastStats {
+  size_t channels = 0;          /**< Broadcasts currently live */
+  size_t listeners = 0;         /**< Listeners of all live broadcasts */
+  uint64_t chunks = 0;          /**< Chunks published, each read once */
+  uint64_t bytes = 0;           /**< Audio bytes published */
+  uint64_t skipped_chunks = 0;  /**< Chunks listeners fell behind on */
+};
+
+/**
+ * @brief A live broadcast of the playlist starting at one song
+ *
+ * A producer thread slices the songs into chunks in real time and publishes
+ * each chunk into a BroadcastRing once, a lead ahead of its play time.
+ * Listeners read the ring at their own pace, so a broadcast costs one read
+ * of every song however many clients listen.
+ */
+class BroadcastChannel {
+ public:
+  using Ring = BroadcastRing<BroadcastFrame>;
+
+  /**
+   * @brief Construct a channel and start its producer
+   *
+   * @param server Server to get the songs from
+   * @param song_num Song the broadcast starts with
+   * @param options Pacing and buffering of the broadcast
+   */
+  BroadcastChannel(AudioServer* server, int song_num,
+                   const BroadcastOptions& options);
+
+  /**
+   * @brief Stop the producer
+   */
+  ~BroadcastChannel();
+
+  /**
+   * @brief Get the ring the chunks are published to
+   */
+  const Ring& ring() const { return ring_; }
+
+  /**
+   * @brief Get the song the broadcast started with
+   */
+  int song_num() const { return song_num_; }
+
+  /**
+   * @brief Get the sequence number a new listener starts at, the oldest
+   * chunk still ahead of its play time
+   */
+  uint64_t JoinSequence() const;
+
+  /**
+   * @brief Get the time the next chunk is due to be published
+   */
+  std::chrono::system_clock::time_point NextPublishTime() const;
+
+  /**
+   * @brief Check whether the producer stopped, because no song of the
+   * playlist could be read or the channel is being destroyed
+   */
+  bool finished() const { return finished_.load(); }
+
+  /**
+   * @brief Get the number of chunks published
+   */
+  uint64_t chunks() const { return ring_.head(); }
+
+  /**
+   * @brief Get the number of audio bytes published
+   */
+  uint64_t bytes() const { return bytes_.load(); }
+
+ private:
+  // Producer thread loop
+  void Run();
+
+  // Map the next readable song of the playlist after song_num, wrapping
+  // around, nullptr if there is none
+  std::shared_ptr<const MappedSong> NextSong(int* song_num,
+                                             WavFormat* format);
+
+  AudioServer* server_;
+  int song_num_;
+  BroadcastOptions options_;
+  Ring ring_;
+  std::atomic<int64_t> next_publish_ns_{0};  // system_clock since epoch
+  std::atomic<uint64_t> bytes_{0};
+  std::atomic<bool> finished_{false};
+  bool stop_ = false;
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  std::thread producer_;
+};
+
+/**
+ * @brief Starts broadcasts as their first listener joins and stops them
+ * once the last one leaves
+ */
+class BroadcastHub {
+ public:
+  /**
+   * @brief Construct a new Broadcast Hub object
+   *
+   * @param server Server to get the songs from
+   * @param options Pacing and buffering of every broadcast
+   */
+  BroadcastHub(AudioServer* server, const BroadcastOptions& options);
+
+  /**
+   * @brief Join the broadcast starting at a song, starting it if needed
+   *
+   * @param song_num Song the broadcast starts with
+   * @return std::shared_ptr<BroadcastChannel> The broadcast, nullptr if the
+   * song does not exist or the hub is shut down
+   */
+  std::shared_ptr<BroadcastChannel> Join(int song_num);
+
+  /**
+   * @brief Leave a broadcast, stopping it if it was the last listener
+   *
+   * @param channel Broadcast returned by Join
+   */
+  void Leave(const std::shared_ptr<BroadcastChannel>& channel);
+
+  /**
+   * @brief Count chunks a listener fell behind on and did not get
+   */
+  void ChunksSkipped(uint64_t chunks) { skipped_chunks_ += chunks; }
+
+  /**
+   * @brief Stop every broadcast and refuse new listeners
+   */
+  void Shutdown();
+
+  /**
+   * @brief Get a snapshot of the broadcast counters
+   */
+  BroadcastStats GetStats() const;
+
+  /**
+   * @brief Get the options broadcasts are started with
+   */
+  const BroadcastOptions& options() const { return options_; }
+
+ private:
+  struct Listened {
+    std::shared_ptr<BroadcastChannel> channel;
+    size_t listeners = 0;
+  };
+
+  AudioServer* server_;
+  BroadcastOptions options_;
+  std::map<int, Listened> channels_;  // By the song they started with
+  bool shut_down_ = false;
+  uint64_t stopped_chunks_ = 0;  // Chunks of broadcasts already stopped
+  uint64_t stopped_bytes_ = 0;
+  std::atomic<uint64_t> skipped_chunks_{0};
+  mutable std::mutex mutex_;
+};
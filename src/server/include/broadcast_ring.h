@@ -0,0 +1,135 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+/**
+ * @brief Ring of the latest items of a broadcast, written by one producer
+ * and read by any number of readers at their own cursor without locks
+ *
+ * The producer publishes items with consecutive sequence numbers starting
+ * at 0, and slot sequence % capacity holds an item until it is overwritten
+ * capacity items later. A reader that falls further behind than that finds
+ * its item overwritten and has to skip forward, the producer never waits
+ * for a slow reader.
+ *
+ * Items are immutable and shared, so a reader takes a reference rather than
+ * a copy. Each slot counts the readers taking a reference from it. Before
+ * replacing an item the producer marks the slot busy and waits for that
+ * count to drop to zero, which takes no longer than a reference count
+ * increment: readers that see the busy mark back off without touching the
+ * item.
+ *
+ * @tparam T Type of the items
+ */
+template <class T>
+class BroadcastRing {
+ public:
+  /**
+   * @brief Outcome of reading an item
+   */
+  enum class ReadResult {
+    kOk,          /**< The item was read */
+    kNotYet,      /**< The item has not been published yet */
+    kOverwritten, /**< The reader fell behind and the item is gone */
+  };
+
+  /**
+   * @brief Construct a new Broadcast Ring object
+   *
+   * @param capacity Number of items kept, rounded up to a power of two
+   */
+  explicit BroadcastRing(size_t capacity)
+      : slots_(RoundUp(capacity)), mask_(slots_.size() - 1) {}
+
+  BroadcastRing(const BroadcastRing&) = delete;
+  BroadcastRing& operator=(const BroadcastRing&) = delete;
+
+  /**
+   * @brief Publish the next item, only ever called by the producer
+   *
+   * @param item Item to publish
+   * @return uint64_t Sequence number of the item
+   */
+  uint64_t Publish(std::shared_ptr<const T> item) {
+    uint64_t sequence = head_.load(std::memory_order_relaxed);
+    Slot& slot = slots_[sequence & mask_];
+
+    // Sequentially consistent, so either a reader sees the busy mark or the
+    // producer sees the reader's pin
+    slot.published.store(kBusy);
+    while (slot.pins.load() != 0) {
+      // Readers only hold a pin while copying the item's shared_ptr
+    }
+    slot.item = std::move(item);
+    slot.published.store(sequence + 1, std::memory_order_release);
+    head_.store(sequence + 1, std::memory_order_release);
+    return sequence;
+  }
+
+  /**
+   * @brief Take a reference to a published item
+   *
+   * @param sequence Sequence number of the item
+   * @param item Receives the item on success
+   * @return ReadResult Whether the item was read
+   */
+  ReadResult Read(uint64_t sequence, std::shared_ptr<const T>* item) const {
+    if (sequence >= head_.load(std::memory_order_acquire)) {
+      return ReadResult::kNotYet;
+    }
+    const Slot& slot = slots_[sequence & mask_];
+    ReadResult result = ReadResult::kOverwritten;
+    slot.pins.fetch_add(1);
+    if (slot.published.load() == sequence + 1) {
+      *item = slot.item;
+      result = ReadResult::kOk;
+    }
+    slot.pins.fetch_sub(1, std::memory_order_release);
+    return result;
+  }
+
+  /**
+   * @brief Get the sequence number the next item will be published with
+   */
+  uint64_t head() const { return head_.load(std::memory_order_acquire); }
+
+  /**
+   * @brief Get the sequence number of the oldest item still held
+   */
+  uint64_t oldest() const {
+    uint64_t head = this->head();
+    return head > slots_.size() ? head - slots_.size() : 0;
+  }
+
+  /**
+   * @brief Get the number of items kept
+   */
+  size_t capacity() const { return slots_.size(); }
+
+ private:
+  // Slots are kept on their own cache lines, readers of neighboring items
+  // do not contend on their pins
+  struct alignas(64) Slot {
+    std::atomic<uint64_t> published{0};  // Sequence + 1 of the item, 0 if none
+    mutable std::atomic<uint32_t> pins{0};  // Readers taking a reference
+    std::shared_ptr<const T> item;
+  };
+
+  static constexpr uint64_t kBusy = ~uint64_t{0};
+
+  static size_t RoundUp(size_t capacity) {
+    size_t size = 1;
+    while (size < capacity) {
+      size <<= 1;
+    }
+    return size;
+  }
+
+  std::vector<Slot> slots_;
+  size_t mask_;
+  std::atomic<uint64_t> head_{0};
+};
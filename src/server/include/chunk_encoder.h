@@ -0,0 +1,61 @@
+#pragma once
+
+#include <grpcpp/support/byte_buffer.h>
+
+#include <cstddef>
+#include <memory>
+
+#include <vector>
+
+#include "audio_service.pb.h"
+#include "client_registry.h"
+#include "song_store.h"
+
+/**
+ * @brief Encode part of a mapped song as a serialized AudioChunk message
+ *
+ * The returned buffer holds a small copied protobuf header followed by a
+ * slice that points directly into the song mapping. The slice keeps the
+ * mapping alive until gRPC has finished sending it, so the audio bytes are
+ * never copied in user space.
+ *
+ * @param song Mapped song to send from
+ * @param offset Byte offset of the chunk within the song
+ * @param length Number of bytes in the chunk
+ * @return grpc::ByteBuffer Wire-format AudioChunk
+ */
+grpc::ByteBuffer EncodeAudioChunk(const std::shared_ptr<const MappedSong>& song,
+                                  size_t offset, size_t length);
+
+/**
+ * @brief Encode part of a mapped song as a serialized BroadcastChunk message
+ *
+ * The fields of metadata other than data are serialized into a copied
+ * header and the audio bytes are sliced from the song mapping, as in
+ * EncodeAudioChunk.
+ *
+ * @param metadata Chunk without its data
+ * @param song Mapped song to send from
+ * @param offset Byte offset of the chunk within the song
+ * @param length Number of bytes in the chunk
+ * @return grpc::ByteBuffer Wire-format BroadcastChunk
+ */
+grpc::ByteBuffer EncodeBroadcastChunk(
+    const audio_service::BroadcastChunk& metadata,
+    const std::shared_ptr<const MappedSong>& song, size_t offset,
+    size_t length);
+
+/**
+ * @brief Encode peers of a client list as a serialized PeerListResponse
+ *
+ * The response is made of slices of the list's cached encoding, which they
+ * keep alive until gRPC has sent them, so nothing is serialized or copied
+ * per call.
+ *
+ * @param clients Published client list
+ * @param peers Indexes into clients->peers to list, in order
+ * @return grpc::ByteBuffer Wire-format PeerListResponse
+ */
+grpc::ByteBuffer EncodePeerList(
+    const std::shared_ptr<const ClientListSnapshot>& clients,
+    const std::vector<size_t>& peers);
@@ -0,0 +1,57 @@
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+
+/**
+ * @brief Picks the chunk size of one LoadAudio stream from its backpressure
+ *
+ * A write completes once the transport has accepted the chunk, so the time a
+ * write takes reflects both the link speed and how long the stream waited for
+ * gRPC flow-control window. The sizer keeps a smoothed estimate of the
+ * stream's drain rate and sizes chunks so each write takes about the target
+ * latency: fast, idle links get large chunks with little per-message
+ * overhead, while slow or contended streams fall back to small chunks so no
+ * stream holds the transport for long.
+ */
+class ChunkSizer {
+ public:
+  /**
+   * @brief Construct a new Chunk Sizer object
+   *
+   * @param min_bytes Smallest chunk size
+   * @param max_bytes Largest chunk size, equal to min_bytes for a fixed size
+   * @param target_latency Time a single write should take
+   */
+  ChunkSizer(size_t min_bytes, size_t max_bytes,
+             std::chrono::microseconds target_latency);
+
+  /**
+   * @brief Get the size of the next chunk to write
+   */
+  size_t NextChunkSize() const { return chunk_size_; }
+
+  /**
+   * @brief Record a completed write and adapt the chunk size
+   *
+   * The size changes by at most a factor of two per write so that a single
+   * outlier does not swing it between the bounds.
+   *
+   * @param bytes Size of the chunk that was written
+   * @param latency Time from issuing the write until it completed
+   */
+  void OnWriteComplete(size_t bytes, std::chrono::microseconds latency);
+
+  /** @brief Chunk size used before any write has been observed */
+  static constexpr size_t kInitialChunkSize = 64 * 1024;
+
+  /** @brief Chunk sizes are multiples of this many bytes */
+  static constexpr size_t kGranularity = 4 * 1024;
+
+ private:
+  size_t min_bytes_;
+  size_t max_bytes_;
+  double target_us_;
+  double bytes_per_us_ = 0;  // Smoothed drain rate, 0 until the first sample
+  size_t chunk_size_;
+};
@@ -0,0 +1,364 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+/**
+ * @brief What a client tells the server about itself as a peer
+ */
+struct ClientAdvertisement {
+  int p2p_port = 0;         /**< Port of its peer service, 0 if none */
+  int64_t uplink_kbps = 0;  /**< Upload bandwidth, 0 if unknown */
+  std::vector<int> cached_songs; /**< Songs it holds, sorted */
+
+  bool operator==(const ClientAdvertisement& other) const {
+    return p2p_port == other.p2p_port && uplink_kbps == other.uplink_kbps &&
+           cached_songs == other.cached_songs;
+  }
+};
+
+/**
+ * @brief A client the server has heard from within its lease
+ */
+struct ClientLease {
+  int id = 0;          /**< Id assigned when the client registered */
+  std::string address; /**< "ip:port" the client connects from */
+  std::chrono::steady_clock::time_point last_seen; /**< Last call or beat */
+  ClientAdvertisement advertisement; /**< Last advertisement of the client */
+};
+
+/**
+ * @brief A client that can be offered to other clients as a peer
+ */
+struct PeerEntry {
+  std::string address;      /**< "ip:port" the client connects from */
+  std::string peer_address; /**< "ip:p2p_port" its peers connect to */
+  std::string subnet;       /**< /24 for IPv4, /64 for IPv6 */
+  int64_t uplink_kbps = 0;  /**< Advertised upload bandwidth */
+  std::vector<int> cached_songs; /**< Songs it holds, sorted */
+
+  /**
+   * @brief Byte range [first, second) of the peer's field in
+   * ClientListSnapshot::encoded
+   */
+  std::pair<size_t, size_t> range;
+
+  /**
+   * @brief Check whether the peer advertised holding a song
+   */
+  bool HasSong(int song_num) const;
+};
+
+/**
+ * @brief A client starting or stopping to offer its peer service
+ */
+struct PeerEvent {
+  uint64_t sequence = 0;    /**< Position in the registry's change log */
+  bool joined = false;      /**< Whether the peer joined or left */
+  std::string address;      /**< "ip:port" the client connects from */
+  std::string peer_address; /**< "ip:p2p_port" its peers connect to */
+};
+
+/**
+ * @brief The peers that joined or left after a sequence number
+ */
+struct PeerChanges {
+  uint64_t epoch = 0;    /**< Identifies the registry, and so the server run */
+  uint64_t sequence = 0; /**< Sequence number of the latest change */
+
+  /**
+   * @brief The changes asked for are no longer kept; events then lists every
+   * current peer as joined and the caller starts over from them
+   */
+  bool reset = false;
+
+  std::vector<PeerEvent> events; /**< Oldest first */
+};
+
+/**
+ * @brief Immutable list of the clients whose lease had not expired
+ */
+struct ClientListSnapshot {
+  uint64_t version = 0; /**< Incremented by every published list */
+  std::vector<std::string> addresses; /**< Most recently seen first */
+
+  /**
+   * @brief Clients that advertised a peer service, most recently seen first
+   */
+  std::vector<PeerEntry> peers;
+
+  /**
+   * @brief Indexes into peers, best provisioned first
+   */
+  std::vector<size_t> ranked;
+
+  /**
+   * @brief Indexes into peers by subnet, best provisioned first
+   */
+  std::unordered_map<std::string, std::vector<size_t>> by_subnet;
+
+  /**
+   * @brief Index into peers by connection address
+   */
+  std::unordered_map<std::string, size_t> by_address;
+
+  /**
+   * @brief The peer addresses as repeated field 1, the wire format of a
+   * PeerListResponse listing every peer
+   */
+  std::string encoded;
+
+  /**
+   * @brief Time the first listed lease runs out, the list is stale from
+   * then on
+   */
+  std::chrono::steady_clock::time_point expires =
+      std::chrono::steady_clock::time_point::max();
+
+  /**
+   * @brief Time the list was published
+   */
+  std::chrono::steady_clock::time_point published;
+};
+
+/**
+ * @brief Get the subnet of a client address
+ *
+ * @param address "ip:port" or "[ipv6]:port"
+ * @return std::string The /24 of an IPv4 or the /64 of an IPv6 address, the
+ * address without its port if it cannot be parsed
+ */
+std::string SubnetOf(const std::string& address);
+
+/**
+ * @brief Clients that called the server recently, indexed by address
+ *
+ * Every call from a client renews its lease. Clients that stay silent for
+ * longer than the lease are dropped, so peer lists only name clients that
+ * are still around. Leases are kept in a list ordered by last_seen next to a
+ * hash index on the address: registering or renewing a client moves its
+ * lease to the back of the list in O(1) and expired leases are taken off the
+ * front.
+ *
+ * Peer lists are read from an immutable ClientListSnapshot that is swapped
+ * atomically, so readers never lock the registry. A client joining, leaving
+ * or changing its advertisement marks the snapshot stale, and the writer
+ * publishes a new one from the live leases in O(k). While the expiry thread
+ * runs, writers publish at most once per kMaxStaleness: changes arriving
+ * sooner are left to the expiry thread, which publishes them together once
+ * the interval has passed, so a join storm does not rebuild the list on
+ * every join. Renewals do not change the list and publish nothing.
+ *
+ * Peers joining and leaving are also kept in a log of the last
+ * kMaxPeerEvents changes, numbered by a sequence number, so watchers can
+ * follow them without listing all clients again. While the expiry thread
+ * runs, leases are dropped as soon as they run out rather than on the next
+ * registration, so leaves are logged on time.
+ */
+class ClientRegistry {
+ public:
+  using Clock = std::chrono::steady_clock;
+
+  /**
+   * @brief Default time a client stays registered without calling
+   */
+  static constexpr std::chrono::milliseconds kDefaultLease{30000};
+
+  /**
+   * @brief Shortest time between two published lists while the expiry
+   * thread runs, and so the longest a change waits to be listed
+   */
+  static constexpr std::chrono::milliseconds kMaxStaleness{100};
+
+  /**
+   * @brief Number of peer changes kept for watchers catching up
+   */
+  static constexpr size_t kMaxPeerEvents = 4096;
+
+  /**
+   * @brief Function told that peers joined or left
+   */
+  using ChangeListener = std::function<void()>;
+
+  /**
+   * @brief Construct an empty registry
+   *
+   * @param lease Time a client stays registered without calling
+   */
+  explicit ClientRegistry(std::chrono::milliseconds lease = kDefaultLease);
+  ~ClientRegistry();
+
+  /**
+   * @brief Register a client or renew its lease
+   *
+   * @param address "ip:port" of the client
+   * @param now Time of the call
+   * @return int Id of the client, kept while its lease is renewed
+   */
+  int Register(const std::string& address,
+               Clock::time_point now = Clock::now());
+
+  /**
+   * @brief Register a client or renew its lease, updating what it
+   * advertises
+   *
+   * @param address "ip:port" of the client
+   * @param advertisement Peer service of the client
+   * @param now Time of the call
+   * @return int Id of the client
+   */
+  int Advertise(const std::string& address,
+                const ClientAdvertisement& advertisement,
+                Clock::time_point now = Clock::now());
+
+  /**
+   * @brief Get the last published list of clients, without locking
+   *
+   * @return std::shared_ptr<const ClientListSnapshot> Clients whose lease
+   * had not expired when the list was published
+   */
+  std::shared_ptr<const ClientListSnapshot> Snapshot() const;
+
+  /**
+   * @brief Get the clients whose lease has not expired
+   *
+   * @param exclude Address to leave out, usually the caller's
+   * @param now Time to check the leases at
+   * @return std::vector<std::string> Addresses, most recently seen first
+   */
+  std::vector<std::string> List(const std::string& exclude = "",
+                                Clock::time_point now = Clock::now()) const;
+
+  /**
+   * @brief Get the leases that have not expired
+   *
+   * @param now Time to check the leases at
+   * @return std::vector<ClientLease> Leases, most recently seen first
+   */
+  std::vector<ClientLease> Leases(Clock::time_point now = Clock::now()) const;
+
+  /**
+   * @brief Drop the clients whose lease has expired
+   *
+   * @param now Time to check the leases at
+   * @return size_t Number of clients dropped
+   */
+  size_t Expire(Clock::time_point now = Clock::now());
+
+  /**
+   * @brief Get the peers that joined or left after a change
+   *
+   * @param epoch Epoch of the changes the caller has seen, 0 for none
+   * @param since Sequence number of the last change the caller has seen
+   * @param now Time to check the leases at when listing every peer
+   * @return PeerChanges The changes after since, or every current peer if
+   * those changes are no longer kept or belong to another epoch
+   */
+  PeerChanges Changes(uint64_t epoch, uint64_t since,
+                      Clock::time_point now = Clock::now()) const;
+
+  /**
+   * @brief Get the sequence number of the latest peer change, without
+   * waiting for registrations
+   */
+  uint64_t sequence() const { return latest_sequence_.load(); }
+
+  /**
+   * @brief Set the function told when peers join or leave
+   *
+   * The listener is called on the thread that made the change, after the
+   * registry is unlocked. Once this returns, the previous listener is no
+   * longer being called.
+   *
+   * @param listener Function to call, nullptr to stop notifications
+   */
+  void SetChangeListener(ChangeListener listener);
+
+  /**
+   * @brief Start a thread dropping leases as soon as they run out and
+   * publishing the changes writers deferred
+   */
+  void StartExpiring();
+
+  /**
+   * @brief Stop the expiry thread, leases are then dropped on registration
+   * and every change is published right away
+   */
+  void StopExpiring();
+
+  /**
+   * @brief Get the lease granted to clients
+   */
+  std::chrono::milliseconds lease() const;
+
+  /**
+   * @brief Change the lease, also for clients already registered
+   */
+  void set_lease(std::chrono::milliseconds lease);
+
+ private:
+  using LeaseList = std::list<ClientLease>;
+
+  bool expired(const ClientLease& client, Clock::time_point now) const {
+    return now - client.last_seen >= lease_;
+  }
+
+  // Register or renew a client, mutex_ must be held
+  LeaseList::iterator RegisterLocked(const std::string& address,
+                                     Clock::time_point now);
+
+  // Drop expired leases from the front of leases_, mutex_ must be held
+  size_t ExpireLocked(Clock::time_point now);
+
+  // Log a peer joining or leaving, mutex_ must be held
+  void LogPeerLocked(bool joined, const std::string& address, int p2p_port);
+
+  // Tell the listener about changes made after the sequence number
+  void NotifyChanges(uint64_t since);
+
+  // Publish a stale list unless the expiry thread will, because the last
+  // one was published less than kMaxStaleness ago; mutex_ must be held
+  void PublishIfDueLocked(Clock::time_point now);
+
+  // Build and swap in a snapshot of the live leases, mutex_ must be held
+  void PublishLocked(Clock::time_point now);
+
+  mutable std::mutex mutex_;
+  std::chrono::milliseconds lease_;
+  LeaseList leases_;  // Least recently seen first
+  std::unordered_map<std::string, LeaseList::iterator> by_address_;
+  int next_id_ = 1;
+
+  // Published list, atomically swapped and only read without mutex_. Set
+  // stale_ when clients join, leave or advertise something new.
+  std::shared_ptr<const ClientListSnapshot> snapshot_;
+  bool stale_ = false;
+
+  // Log of peer changes, oldest first, numbered from 1
+  uint64_t epoch_;
+  uint64_t sequence_ = 0;
+  std::atomic<uint64_t> latest_sequence_{0};
+  std::deque<PeerEvent> events_;
+
+  ChangeListener listener_;
+  std::mutex listener_mutex_;
+
+  // Wakes when the oldest lease runs out, or when the first client joins
+  std::thread expiry_thread_;
+  std::condition_variable expiry_cv_;
+  bool expiring_ = false;  // Whether the expiry thread runs
+  bool stop_expiry_ = false;
+};
@@ -0,0 +1,209 @@
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+/**
+ * @brief Limits of the egress scheduler
+ */
+struct EgressOptions {
+  /**
+   * @brief Bytes all streams may have written but not yet completed, 0
+   * sends every chunk right away and only applies the rate caps
+   */
+  size_t window_bytes = 2 * 1024 * 1024;
+
+  /** @brief Egress of the whole server in bytes per second, 0 for no cap */
+  uint64_t rate_bytes_per_sec = 0;
+
+  /** @brief Egress to one client host in bytes per second, 0 for no cap */
+  uint64_t client_rate_bytes_per_sec = 0;
+
+  /**
+   * @brief Bytes at the start of every stream that playback is waiting for,
+   * sent ahead of the rest unless the client is prefetching
+   */
+  size_t urgent_bytes = 256 * 1024;
+};
+
+/**
+ * @brief Orders the chunk writes of concurrent streams so they share egress
+ * fairly
+ *
+ * Every stream asks before writing a chunk. While the bytes in flight fit
+ * the window and the rate caps allow it, the chunk is granted right away.
+ * Otherwise the stream is queued and its wake function is called once its
+ * turn comes: urgent chunks, the first seconds of a song somebody is about
+ * to play, go first in arrival order, and the others are granted by start
+ * time fair queuing, so every stream gets the same share of bytes whatever
+ * its chunk size. Streams of a client host over its rate are skipped until
+ * its bucket refills.
+ *
+ * Each queued chunk is tagged with the bytes its stream was sent before it,
+ * counted from when the stream last caught up with the others, and the
+ * lowest tag goes next. Unlike deficit round robin this stays fair when a
+ * stream has only one chunk queued or in flight at a time, which is how
+ * every stream writes.
+ *
+ * Rates are token buckets holding a tenth of a second of bytes. A chunk is
+ * granted while its buckets are not empty and may take them below zero, so
+ * chunks larger than a bucket still pass at the configured rate.
+ */
+class EgressScheduler {
+ public:
+  using Clock = std::chrono::steady_clock;
+
+  /**
+   * @brief Identifies a stream registered with the scheduler
+   */
+  using FlowId = uint64_t;
+
+  /**
+   * @brief Function called when a queued chunk is granted, on the thread
+   * completing a write or on the scheduler's rate thread
+   */
+  using Wake = std::function<void()>;
+
+  /**
+   * @brief Construct a new Egress Scheduler object
+   *
+   * A thread granting chunks as the buckets refill runs while a rate cap is
+   * set.
+   */
+  explicit EgressScheduler(const EgressOptions& options = EgressOptions());
+  ~EgressScheduler();
+
+  /**
+   * @brief Register a stream
+   *
+   * @param client Host the stream sends to, rate caps are per host
+   * @return FlowId Id of the stream
+   */
+  FlowId AddFlow(const std::string& client);
+
+  /**
+   * @brief Unregister a stream, dropping its queued chunk if any
+   *
+   * Chunks of the stream still in flight must have completed first.
+   */
+  void RemoveFlow(FlowId flow);
+
+  /**
+   * @brief Ask to write a chunk
+   *
+   * A stream has at most one chunk queued or in flight at a time.
+   *
+   * @param flow Stream writing the chunk
+   * @param bytes Size of the chunk
+   * @param urgent Whether playback is waiting for the chunk
+   * @param wake Called once the chunk is granted, unless it is granted
+   * right away
+   * @return bool Whether the chunk may be written right away
+   */
+  bool Request(FlowId flow, size_t bytes, bool urgent, Wake wake);
+
+  /**
+   * @brief Tell that a granted chunk was written, freeing its window
+   */
+  void Complete(size_t bytes);
+
+  /**
+   * @brief Wake every queued stream and grant all chunks from now on
+   */
+  void Shutdown();
+
+  /**
+   * @brief Get the bytes granted and not yet completed
+   */
+  size_t inflight_bytes() const;
+
+  /**
+   * @brief Get the number of streams waiting for a grant
+   */
+  size_t queued() const;
+
+  /**
+   * @brief Get the options the scheduler was created with
+   */
+  const EgressOptions& options() const { return options_; }
+
+ private:
+  struct Bucket {
+    uint64_t rate = 0;  // Bytes per second, 0 for no cap
+    double tokens = 0;
+    Clock::time_point refilled;
+  };
+
+  struct ClientState {
+    Bucket bucket;
+    size_t flows = 0;
+  };
+
+  struct Flow {
+    ClientState* client = nullptr;
+    std::string client_name;
+    size_t pending = 0;  // Size of the queued chunk, 0 if none
+    bool urgent = false;
+    uint64_t start = 0;   // Virtual time the queued chunk starts at
+    uint64_t finish = 0;  // Virtual time the last chunk ended at
+    Wake wake;
+  };
+
+  // Refill a bucket and check whether it may send
+  static bool HasTokens(Bucket* bucket, Clock::time_point now);
+
+  // Time the bucket may send again
+  static Clock::time_point RefillTime(const Bucket& bucket);
+
+  // Whether the window and the global cap let a chunk through, mutex_ held
+  bool CanSendLocked(size_t bytes, Clock::time_point now);
+
+  // Count a granted chunk, mutex_ held
+  void GrantLocked(Flow* flow, size_t bytes);
+
+  // Grant queued chunks while the limits allow, mutex_ held. Adds the wake
+  // functions to call once unlocked, and sets self_granted instead if the
+  // flow self is granted.
+  void PumpLocked(Clock::time_point now, FlowId self, bool* self_granted,
+                  std::vector<Wake>* wakes);
+
+  // Pick the next queued flow whose client may send, or 0
+  FlowId PickLocked(Clock::time_point now);
+
+  // Call fn with every queued flow
+  template <class Fn>
+  void ForEachQueuedLocked(Fn fn);
+
+  // Grant chunks as the buckets refill
+  void RunRateThread();
+
+  EgressOptions options_;
+
+  mutable std::mutex mutex_;
+  std::unordered_map<FlowId, Flow> flows_;
+  std::unordered_map<std::string, ClientState> clients_;
+  std::deque<FlowId> urgent_;                    // Arrival order
+  std::set<std::pair<uint64_t, FlowId>> fair_;  // By start time
+  uint64_t virtual_time_ = 0;  // Start time of the last fair grant
+  FlowId next_id_ = 1;
+  size_t inflight_ = 0;
+  Bucket global_;
+  bool shut_down_ = false;
+
+  // Wakes when a bucket that held back queued chunks has refilled
+  std::thread rate_thread_;
+  std::condition_variable rate_cv_;
+  Clock::time_point next_refill_ = Clock::time_point::max();
+  bool stop_rate_thread_ = false;
+};
@@ -0,0 +1,42 @@
+#pragma once
+
+#include <cstddef>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "client_registry.h"
+
+/**
+ * @brief What a client asks for when it requests peers
+ */
+struct PeerQuery {
+  std::string address;  /**< "ip:port" of the requester, never selected */
+  size_t max_peers = 8; /**< Most peers to select */
+  int song_num = 0;     /**< Prefer peers holding this song, 0 for none */
+};
+
+/**
+ * @brief Peers picked for a client, with the client list they index into
+ */
+struct PeerSelection {
+  std::shared_ptr<const ClientListSnapshot> clients; /**< List picked from */
+  std::vector<size_t> peers; /**< Indexes into clients->peers, best first */
+};
+
+/**
+ * @brief Pick the peers a client should connect to
+ *
+ * Peers on the requester's subnet come first, then the others; within both
+ * groups peers holding the requested song come first, and among those the
+ * ones with the most uplink bandwidth. Every client then keeps at most
+ * max_peers connections however many clients share the server, and prefers
+ * nearby, well-provisioned peers. Without a song the cost is O(max_peers),
+ * with one it is at most the number of peers scanned for the song.
+ *
+ * @param clients Published client list
+ * @param query Requester and limits
+ * @return std::vector<size_t> Indexes into clients.peers, best first
+ */
+std::vector<size_t> SelectPeers(const ClientListSnapshot& clients,
+                                const PeerQuery& query);
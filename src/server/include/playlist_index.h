@@ -0,0 +1,119 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "song_catalog.h"
+
+/**
+ * @brief One song of the playlist as it is listed to clients
+ */
+struct PlaylistEntry {
+  SongMetadata song;         /**< Name is empty if the id is unused */
+  uint64_t content_hash = 0; /**< XXH64 of the song file, 0 until hashed */
+  uint64_t version = 0;      /**< Playlist version that last changed it */
+};
+
+/**
+ * @brief Immutable version of the playlist
+ */
+struct PlaylistSnapshot {
+  uint64_t epoch = 0;   /**< Random number identifying the server run */
+  uint64_t version = 0; /**< Increases with every published change */
+  std::vector<PlaylistEntry> entries; /**< entries[i] is song id i + 1 */
+
+  /**
+   * @brief Get the tag identifying this version of the playlist
+   *
+   * @return std::string "<epoch>-<version>" in hex
+   */
+  std::string etag() const;
+
+  /**
+   * @brief Get the version of a tag from the same server run
+   *
+   * @param etag Tag returned by etag()
+   * @param version Receives the version the tag names
+   * @return true if the tag is well formed and from this run, false
+   * otherwise
+   */
+  bool ParseEtag(const std::string& etag, uint64_t* version) const;
+};
+
+/**
+ * @brief Versioned playlist that lets clients fetch only what changed
+ *
+ * Every entry records the version that last changed it, so the changes
+ * since any earlier version are the entries with a newer version. Removed
+ * songs stay as entries without a name. Changes are collected and published
+ * as one new version when a snapshot is next requested, so a burst of
+ * changes such as hashing the whole catalog costs one copy per request
+ * rather than one per song. The last kHistory versions are kept so clients
+ * can page through a consistent version.
+ */
+class PlaylistIndex {
+ public:
+  /**
+   * @brief Number of published versions kept for paging
+   */
+  static constexpr size_t kHistory = 8;
+
+  /**
+   * @brief Construct an empty playlist with a random epoch
+   */
+  PlaylistIndex();
+
+  /**
+   * @brief Apply songs the catalog reports as added, changed or removed
+   *
+   * Changed songs lose their content hash until SetDigest is called again.
+   *
+   * @param catalog Catalog snapshot after the change
+   * @param changed Songs that changed, looked up in the catalog by id
+   */
+  void UpdateSongs(const CatalogSnapshot& catalog,
+                   const std::vector<SongMetadata>& changed);
+
+  /**
+   * @brief Record the content hash of a song
+   *
+   * Ignored if the song changed since the hashed version was mapped.
+   *
+   * @param id Id of the song
+   * @param size Size of the hashed file
+   * @param mtime_ns Modification time of the hashed file
+   * @param content_hash XXH64 of the file
+   * @return true if the hash was recorded, false otherwise
+   */
+  bool SetDigest(int id, size_t size, int64_t mtime_ns,
+                 uint64_t content_hash);
+
+  /**
+   * @brief Get the current playlist, publishing pending changes
+   */
+  std::shared_ptr<const PlaylistSnapshot> Snapshot();
+
+  /**
+   * @brief Get a recently published version of the playlist
+   *
+   * @param version Version to look up
+   * @return std::shared_ptr<const PlaylistSnapshot> The version, nullptr if
+   * it is no longer kept
+   */
+  std::shared_ptr<const PlaylistSnapshot> Snapshot(uint64_t version) const;
+
+ private:
+  mutable std::mutex mutex_;
+  uint64_t epoch_;
+  std::vector<PlaylistEntry> entries_;
+  bool dirty_ = true;
+  std::deque<std::shared_ptr<const PlaylistSnapshot>> history_;  // Oldest first
+
+  // Version the pending changes will be published as
+  uint64_t next_version() const;
+};
@@ -0,0 +1,53 @@
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "song_store.h"
+
+/**
+ * @brief A contiguous byte range of a song covering whole sample frames
+ */
+struct SongSegment {
+  int id = 0;               /**< Position of the segment in the song */
+  size_t offset = 0;        /**< First byte of the segment in the file */
+  size_t size = 0;          /**< Number of bytes in the segment */
+  uint64_t first_frame = 0; /**< First sample frame in the segment */
+  uint64_t frame_count = 0; /**< Number of sample frames in the segment */
+  uint32_t crc32 = 0;       /**< CRC-32 of the segment bytes */
+};
+
+/**
+ * @brief Splits a song into fixed-duration segments that can be fetched on
+ * their own
+ *
+ * Segments are aligned to sample frames and together cover every byte of
+ * the file: the first segment also carries the WAV header and the last one
+ * any chunks after the sample data. A client can therefore fetch segments in
+ * parallel or out of order, verify each one against its checksum and start
+ * playback as soon as the first segment has arrived.
+ */
+struct SegmentIndex {
+  std::string resume_token; /**< Version of the song the index describes */
+  size_t song_size = 0;     /**< Size of the song file in bytes */
+  uint32_t sample_rate = 0; /**< Sample frames per second */
+  uint16_t channels = 0;    /**< Channels per sample frame */
+  uint16_t bytes_per_frame = 0;      /**< Size of one sample frame */
+  uint64_t frames_per_segment = 0;   /**< Frames in every full segment */
+  std::vector<SongSegment> segments; /**< Segments in file order */
+
+  /**
+   * @brief Build the index of a PCM WAV song
+   *
+   * @param song Mapping of the song
+   * @param segment_duration Playback time covered by each segment
+   * @return std::shared_ptr<const SegmentIndex> The index, nullptr if the
+   * song is not a PCM WAV file
+   */
+  static std::shared_ptr<const SegmentIndex> Build(
+      const MappedSong& song, std::chrono::milliseconds segment_duration);
+};
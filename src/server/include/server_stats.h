@@ -0,0 +1,284 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+/**
+ * @brief RPCs of the audio service counted by ServerStats
+ */
+enum class RpcMethod {
+  kGetPlaylist,
+  kLoadAudio,
+  kGetPeerClientIPs,
+  kGetSegmentIndex,
+  kLoadSegment,
+  kHeartbeat,
+  kWatchPeers,
+  kGetServerStats,
+  kJoinBroadcast,
+  kHintNextSongs,
+  kCount
+};
+
+/**
+ * @brief Steps of serving a song whose latency is recorded, to tell where
+ * the time of a slow song start goes
+ */
+enum class StreamStage {
+  kSongOpen,    /**< Getting the song's mapping, from the cache or disk */
+  kFirstChunk,  /**< From the request to the first chunk being written */
+  kChunkEncode, /**< Building one chunk message */
+  kChunkWrite,  /**< Writing one chunk, until the transport took it */
+  kCount
+};
+
+/**
+ * @brief Get the name of an RPC as in audio_service.proto
+ */
+const char* RpcMethodName(RpcMethod method);
+
+/**
+ * @brief Get the name of a stream stage, as used in metric labels
+ */
+const char* StreamStageName(StreamStage stage);
+
+/**
+ * @brief Percentiles of the latencies recorded by a LatencyHistogram
+ */
+struct LatencySummary {
+  uint64_t count = 0;
+  std::chrono::nanoseconds sum{0};
+  std::chrono::nanoseconds p50{0};
+  std::chrono::nanoseconds p99{0};
+  std::chrono::nanoseconds p999{0};
+  std::chrono::nanoseconds max{0};
+};
+
+/**
+ * @brief Lock-free histogram of latencies
+ *
+ * Latencies are counted in log-linear buckets: every power of two of
+ * nanoseconds is split into kSubBuckets buckets, so percentiles are within
+ * 6.25% of the recorded values from a nanosecond up to several hours.
+ * Recording is a few relaxed atomic increments, so any number of threads
+ * can record without waiting for each other.
+ */
+class LatencyHistogram {
+ public:
+  /** @brief Buckets per power of two */
+  static constexpr int kSubBuckets = 8;
+
+  /** @brief Latencies are counted up to 2^kMaxExponent ns, about 9 hours */
+  static constexpr int kMaxExponent = 45;
+
+  /** @brief Total number of buckets */
+  static constexpr int kBuckets = kSubBuckets * (kMaxExponent - 2);
+
+  /**
+   * @brief Count one latency
+   */
+  void Record(std::chrono::nanoseconds latency);
+
+  /**
+   * @brief Get the count, sum and percentiles of the recorded latencies
+   *
+   * Percentiles are the midpoints of their buckets. The summary is taken
+   * while other threads may record, so it can miss their latest latencies.
+   */
+  LatencySummary Summarize() const;
+
+  /**
+   * @brief Get the bucket a latency in nanoseconds is counted in
+   */
+  static int BucketOf(uint64_t nanos);
+
+  /**
+   * @brief Get the smallest latency in nanoseconds counted in a bucket
+   */
+  static uint64_t BucketStart(int bucket);
+
+ private:
+  std::array<std::atomic<uint64_t>, kBuckets> buckets_{};
+  std::atomic<uint64_t> count_{0};
+  std::atomic<uint64_t> sum_{0};
+  std::atomic<uint64_t> max_{0};
+};
+
+/**
+ * @brief Lock-free count of bytes per second over the last few seconds
+ *
+ * Each slot holds the bytes of one second, tagged with the second it
+ * belongs to in a single atomic word, so a slot reused for a new second
+ * starts over without a lock.
+ */
+class RateWindow {
+ public:
+  /** @brief Seconds the rate is averaged over */
+  static constexpr int kWindowSeconds = 10;
+
+  /**
+   * @brief Count bytes in a second
+   *
+   * @param bytes Bytes to count
+   * @param second Seconds since some fixed start
+   */
+  void Add(uint64_t bytes, int64_t second);
+
+  /**
+   * @brief Get the average bytes per second over the kWindowSeconds
+   * complete seconds before a second, or over all of them early on
+   *
+   * @param second Current second, counted from the same start as Add
+   */
+  double PerSecond(int64_t second) const;
+
+ private:
+  static constexpr int kSlots = 16;
+  static constexpr int kTagBits = 20;
+  static constexpr int kCountBits = 64 - kTagBits;
+
+  std::array<std::atomic<uint64_t>, kSlots> slots_{};
+};
+
+/**
+ * @brief Counters of one RPC at the time of a snapshot
+ */
+struct RpcStatsSnapshot {
+  RpcMethod method = RpcMethod::kCount;
+  uint64_t calls = 0;        /**< Calls finished */
+  uint64_t errors = 0;       /**< Calls finished with an error status */
+  int64_t active = 0;        /**< Calls in progress */
+  LatencySummary latency;    /**< Duration of finished calls */
+  uint64_t bytes_sent = 0;   /**< Payload bytes streamed */
+  double bytes_per_sec = 0;  /**< Payload bytes over the last seconds */
+};
+
+/**
+ * @brief Latencies of one stream stage at the time of a snapshot
+ */
+struct StageStatsSnapshot {
+  StreamStage stage = StreamStage::kCount;
+  LatencySummary latency;
+};
+
+/**
+ * @brief All counters of the server at one time
+ */
+struct ServerStatsSnapshot {
+  std::chrono::milliseconds uptime{0};
+  std::vector<RpcStatsSnapshot> rpcs;     /**< In RpcMethod order */
+  std::vector<StageStatsSnapshot> stages; /**< In StreamStage order */
+};
+
+/**
+ * @brief Per-RPC counters, latency histograms and stream gauges
+ *
+ * Every counter is a relaxed atomic, so recording never takes a lock and
+ * calls on different poller threads do not contend beyond sharing cache
+ * lines. Snapshots are formatted for the CLI and as Prometheus text, which
+ * can be written to a file periodically for a node exporter to pick up.
+ */
+class ServerStats {
+ public:
+  using Clock = std::chrono::steady_clock;
+
+  ServerStats();
+  ~ServerStats();
+
+  /**
+   * @brief Count a call that started
+   */
+  void CallStarted(RpcMethod method);
+
+  /**
+   * @brief Count a call that finished
+   *
+   * @param method RPC of the call
+   * @param duration Time from the request to the call finishing
+   * @param ok Whether the call finished with an OK status
+   */
+  void CallFinished(RpcMethod method, std::chrono::nanoseconds duration,
+                    bool ok);
+
+  /**
+   * @brief Count payload bytes a call sent
+   */
+  void BytesSent(RpcMethod method, size_t bytes);
+
+  /**
+   * @brief Record the latency of a stream stage
+   */
+  void RecordStage(StreamStage stage, std::chrono::nanoseconds latency);
+
+  /**
+   * @brief Take a snapshot of all counters
+   */
+  ServerStatsSnapshot Snapshot() const;
+
+  /**
+   * @brief Print a snapshot as a table for the CLI
+   */
+  static void Print(const ServerStatsSnapshot& snapshot, std::ostream& out);
+
+  /**
+   * @brief Format a snapshot in the Prometheus text exposition format
+   */
+  static std::string FormatPrometheus(const ServerStatsSnapshot& snapshot);
+
+  /**
+   * @brief Write the current counters to a Prometheus text file
+   *
+   * The file is written next to its destination and renamed over it, so
+   * readers never see a partial file.
+   *
+   * @param path File to write
+   * @return bool Whether the file was written
+   */
+  bool WritePrometheusFile(const std::string& path) const;
+
+  /**
+   * @brief Start a thread writing the Prometheus file periodically
+   *
+   * @param path File to write
+   * @param interval Time between writes
+   */
+  void StartWritingFile(const std::string& path,
+                        std::chrono::milliseconds interval);
+
+  /**
+   * @brief Stop the writer thread, after writing the file a last time
+   */
+  void StopWritingFile();
+
+ private:
+  struct RpcCounters {
+    std::atomic<uint64_t> calls{0};
+    std::atomic<uint64_t> errors{0};
+    std::atomic<int64_t> active{0};
+    std::atomic<uint64_t> bytes_sent{0};
+    LatencyHistogram latency;
+    RateWindow sent_rate;
+  };
+
+  int64_t SecondsSinceStart() const;
+
+  Clock::time_point start_;
+  std::array<RpcCounters, static_cast<size_t>(RpcMethod::kCount)> rpcs_;
+  std::array<LatencyHistogram, static_cast<size_t>(StreamStage::kCount)>
+      stages_;
+
+  // Writes the Prometheus file every interval until stopped
+  std::thread writer_thread_;
+  std::mutex writer_mutex_;
+  std::condition_variable writer_cv_;
+  bool stop_writer_ = false;
+};
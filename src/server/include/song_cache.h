@@ -0,0 +1,115 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <unordered_map>
+
+#include "song_store.h"
+
+/**
+ * @brief Counters describing how well the song cache is doing
+ */
+struct SongCacheStats {
+  uint64_t hits = 0;       /**< Requests served from the cache */
+  uint64_t misses = 0;     /**< Requests that had to load the song */
+  uint64_t evictions = 0;  /**< Songs dropped to stay within the budget */
+  size_t entries = 0;      /**< Songs currently cached */
+  size_t pinned = 0;       /**< Cached songs that cannot be evicted */
+  size_t bytes_used = 0;   /**< Bytes held by cached songs */
+  size_t budget_bytes = 0; /**< Maximum bytes the cache may hold */
+};
+
+/**
+ * @brief Byte-budgeted LRU cache of mapped songs
+ *
+ * Keeps recently streamed songs resident so repeated requests skip the file
+ * lookup and are served from memory. When the budget is exceeded the least
+ * recently used unpinned songs are evicted. Evicted songs stay mapped until
+ * the streams still using them finish.
+ */
+class SongCache {
+ public:
+  using Loader = std::function<std::shared_ptr<const MappedSong>()>;
+
+  /**
+   * @brief Construct a new Song Cache object
+   *
+   * @param budget_bytes Maximum number of bytes to keep cached, 0 disables
+   * caching
+   */
+  explicit SongCache(size_t budget_bytes);
+
+  /**
+   * @brief Get a song from the cache, loading it on a miss
+   *
+   * @param song_num Index of the song in the playlist (1-based)
+   * @param loader Called to load the song when it is not cached
+   * @return std::shared_ptr<const MappedSong> The song, nullptr if loading
+   * failed
+   */
+  std::shared_ptr<const MappedSong> Get(int song_num, const Loader& loader);
+
+  /**
+   * @brief Drop a song whose file changed, so the next Get loads it again
+   *
+   * Streams still using the old version keep their mapping.
+   *
+   * @param song_num Index of the song in the playlist (1-based)
+   */
+  void Invalidate(int song_num);
+
+  /**
+   * @brief Pin a song so that it is never evicted once cached
+   *
+   * @param song_num Index of the song in the playlist (1-based)
+   */
+  void Pin(int song_num);
+
+  /**
+   * @brief Check whether a song is currently cached
+   *
+   * @param song_num Index of the song in the playlist (1-based)
+   * @return true if the song is cached, false otherwise
+   */
+  bool Contains(int song_num) const;
+
+  /**
+   * @brief Check whether another song of the given size fits in the budget
+   * without evicting anything
+   *
+   * @param size Size of the song in bytes
+   * @return true if the song fits, false otherwise
+   */
+  bool HasRoomFor(size_t size) const;
+
+  /**
+   * @brief Get a snapshot of the cache counters
+   *
+   * @return SongCacheStats Current counters
+   */
+  SongCacheStats GetStats() const;
+
+ private:
+  struct Entry {
+    std::shared_ptr<const MappedSong> song;
+    std::list<int>::iterator lru_position;
+  };
+
+  // Insert a loaded song and evict until the cache fits its budget
+  void Insert(int song_num, std::shared_ptr<const MappedSong> song);
+
+  size_t budget_bytes_;
+  size_t bytes_used_;
+  std::unordered_map<int, Entry> entries_;
+  std::list<int> lru_;  // Most recently used first
+  std::set<int> pinned_;
+  uint64_t hits_;
+  uint64_t misses_;
+  uint64_t evictions_;
+  mutable std::mutex mutex_;
+};
@@ -0,0 +1,234 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+/**
+ * @brief Format and file information of one song, read once from its header
+ */
+struct SongMetadata {
+  int id = 0;                   /**< Stable song number, starting at 1 */
+  std::string name;             /**< Path relative to the audio directory */
+  size_t size = 0;              /**< Size of the file in bytes */
+  int64_t mtime_ns = 0;         /**< Modification time of the file */
+  uint32_t sample_rate = 0;     /**< Frames per second, 0 if unknown */
+  uint16_t channels = 0;        /**< Samples per frame, 0 if unknown */
+  uint16_t bits_per_sample = 0; /**< Bits per sample, 0 if unknown */
+  uint64_t duration_ms = 0;     /**< Playback time, 0 if unknown */
+};
+
+/**
+ * @brief Immutable view of the catalog at one point in time
+ */
+struct CatalogSnapshot {
+  uint64_t version = 0;            /**< Incremented by every change */
+  std::vector<SongMetadata> songs; /**< Songs sorted by id */
+
+  /**
+   * @brief Find a song by its id
+   *
+   * @param id Song number (1-based)
+   * @return const SongMetadata* The song, nullptr if there is no such song
+   */
+  const SongMetadata* Find(int id) const;
+
+  /**
+   * @brief Get the highest song id, 0 if the catalog is empty
+   */
+  int max_id() const { return songs.empty() ? 0 : songs.back().id; }
+};
+
+/**
+ * @brief Options of a SongCatalog
+ */
+struct SongCatalogOptions {
+  /**
+   * @brief File the catalog is persisted to, empty to keep it in memory
+   *
+   * When set, the catalog starts from this file instead of scanning the
+   * directory, and the first scan happens in the background.
+   */
+  std::string catalog_file;
+
+  /**
+   * @brief Threads walking directories and parsing headers during a scan
+   *
+   * Scans are dominated by metadata latency on network storage, so this may
+   * well exceed the number of cores.
+   */
+  int scan_threads = 16;
+};
+
+/**
+ * @brief Live index of the songs in the audio directory tree
+ *
+ * Every WAV file is parsed once when it appears or changes, and readers get
+ * the result as an immutable snapshot that is swapped atomically, so
+ * lookups never block on a rescan. Songs are named by their path relative
+ * to the directory; hidden files and directories are skipped.
+ *
+ * Songs keep their id: new files get the next free id, and a removed song's
+ * id is not reused by other files. The files found by the first scan are
+ * numbered in name order. With a catalog file, ids also survive restarts.
+ */
+class SongCatalog {
+ public:
+  /**
+   * @brief Called with the songs that were added, changed or removed
+   *
+   * Removed songs are passed with their last known metadata.
+   */
+  using ChangeListener =
+      std::function<void(const std::vector<SongMetadata>& changed)>;
+
+  /**
+   * @brief Build the first snapshot
+   *
+   * Loads the catalog file if one is configured and valid. Otherwise the
+   * directory is scanned right away, unless a catalog file is configured,
+   * in which case the catalog starts empty until the first Rescan.
+   *
+   * @param directory Directory containing the songs
+   * @param options Persistence and scan parallelism
+   */
+  explicit SongCatalog(
+      const std::string& directory,
+      const SongCatalogOptions& options = SongCatalogOptions());
+
+  /**
+   * @brief Destroy the catalog, stopping the watcher
+   */
+  ~SongCatalog();
+
+  SongCatalog(const SongCatalog&) = delete;
+  SongCatalog& operator=(const SongCatalog&) = delete;
+
+  /**
+   * @brief Get the current snapshot of the catalog
+   *
+   * @return std::shared_ptr<const CatalogSnapshot> The snapshot, never
+   * nullptr
+   */
+  std::shared_ptr<const CatalogSnapshot> Snapshot() const;
+
+  /**
+   * @brief Get the directory the catalog indexes
+   */
+  const std::string& directory() const { return directory_; }
+
+  /**
+   * @brief Set the function told about every change of the catalog
+   *
+   * The listener is called on the thread that applied the change, with
+   * further updates held off until it returns.
+   *
+   * @param listener Function to call, nullptr to stop notifications
+   */
+  void SetChangeListener(ChangeListener listener);
+
+  /**
+   * @brief Compare the whole directory tree with the catalog and apply the
+   * differences
+   *
+   * Directories are walked and files are checked in parallel. Only files
+   * whose size or modification time changed have their header read again.
+   *
+   * @return size_t Number of songs added, changed or removed
+   */
+  size_t Rescan();
+
+  /**
+   * @brief Re-read the given files and apply the differences
+   *
+   * @param names Paths relative to the directory, missing files are removed
+   * @return size_t Number of songs added, changed or removed
+   */
+  size_t Refresh(const std::vector<std::string>& names);
+
+  /**
+   * @brief Reconcile the catalog with the directory in the background, then
+   * apply changes as they happen
+   *
+   * Uses inotify on Linux and falls back to rescanning every
+   * kPollInterval elsewhere or when the tree has too many directories to
+   * watch.
+   *
+   * @return true if the watcher is running, false otherwise
+   */
+  bool StartWatching();
+
+  /**
+   * @brief Check whether the first snapshot was loaded from the catalog file
+   */
+  bool loaded_from_file() const { return loaded_from_file_; }
+
+  /**
+   * @brief Stop the watcher, if running
+   */
+  void StopWatching();
+
+  /**
+   * @brief Interval of the rescans where inotify is not available
+   */
+  static constexpr std::chrono::milliseconds kPollInterval{2000};
+
+ private:
+  // Called with the path of each directory relative to the root ("" for the
+  // root itself) before the directory is listed, possibly concurrently
+  using DirectoryVisitor = std::function<void(const std::string&)>;
+
+  // Walk the tree, filling in the size and modification time of every song.
+  // False if the root cannot be listed.
+  bool Walk(std::vector<SongMetadata>* songs,
+            const DirectoryVisitor& visit) const;
+
+  // Read the format of a song from its header
+  void ReadFormat(SongMetadata* song) const;
+
+  // Rescan, visiting every directory
+  size_t Rescan(const DirectoryVisitor& visit);
+
+  // Apply the songs found on disk. Songs in `gone`, and with remove_others
+  // every song not in `present`, are removed.
+  size_t Apply(std::vector<SongMetadata> present,
+               const std::vector<std::string>& gone, bool remove_others);
+
+  // Load and save the catalog file
+  bool Load();
+  bool Save(const CatalogSnapshot& snapshot) const;
+
+  void WatchLoop();
+
+  // Rescan, watching each directory before it is listed so no file created
+  // during the scan is missed, Linux only
+  void RescanAndWatch();
+
+  // Watch a directory, returning the watch or -1, Linux only
+  int AddWatch(const std::string& directory) const;
+
+  std::string directory_;
+  SongCatalogOptions options_;
+  bool loaded_from_file_ = false;
+  std::shared_ptr<const CatalogSnapshot> snapshot_;  // atomically swapped
+
+  // Serializes updates, readers only load snapshot_
+  std::mutex update_mutex_;
+  std::map<std::string, int> ids_;  // Every name ever seen, to keep its id
+  int next_id_ = 1;
+  ChangeListener listener_;
+
+  std::thread watch_thread_;
+  std::atomic<bool> stop_watching_{false};
+  int inotify_fd_ = -1;
+  std::map<int, std::string> watches_;  // Relative directory by watch
+  int wake_fds_[2] = {-1, -1};          // Pipe that interrupts the watcher
+};
@@ -0,0 +1,161 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <vector>
+
+/**
+ * @brief A read-only memory mapping of a single song file
+ *
+ * The file is mapped once and unmapped when the last reference is dropped,
+ * so every stream holding a reference can safely send straight out of the
+ * mapping without copying the bytes into user-space buffers.
+ */
+class MappedSong {
+ public:
+  ~MappedSong();
+
+  MappedSong(const MappedSong&) = delete;
+  MappedSong& operator=(const MappedSong&) = delete;
+
+  /**
+   * @brief Map a file into memory
+   *
+   * @param path Path to the file to map
+   * @param copy Read the file into private memory instead of mapping it, so
+   * rewriting the file in place cannot change or truncate the song
+   * @return std::shared_ptr<const MappedSong> The mapping, nullptr on failure
+   */
+  static std::shared_ptr<const MappedSong> Open(const std::string& path,
+                                                bool copy = false);
+
+  /**
+   * @brief Serve a song built in memory, such as a converted one, like a
+   * mapped file
+   *
+   * @param name Name the song is known by, part of its resume token
+   * @param bytes Contents of the song, kept until the last reference drops
+   * @param mtime_ns Modification time of the file the song was built from
+   * @return std::shared_ptr<const MappedSong> The song
+   */
+  static std::shared_ptr<const MappedSong> Adopt(const std::string& name,
+                                                 std::vector<char> bytes,
+                                                 int64_t mtime_ns);
+
+  /**
+   * @brief Get a pointer to the first byte of the file
+   */
+  const char* data() const { return data_; }
+
+  /**
+   * @brief Get the size of the file in bytes
+   */
+  size_t size() const { return size_; }
+
+  /**
+   * @brief Get the path the file was mapped from
+   */
+  const std::string& path() const { return path_; }
+
+  /**
+   * @brief Get a token identifying this version of the file
+   *
+   * The token changes whenever the file is replaced or modified, so a client
+   * resuming a download can check that it is still reading the same bytes.
+   */
+  const std::string& resume_token() const { return resume_token_; }
+
+  /**
+   * @brief Get the modification time of the file when it was mapped
+   */
+  int64_t mtime_ns() const { return mtime_ns_; }
+
+  /**
+   * @brief Check whether the song was read into memory instead of mapped
+   */
+  bool copied() const { return !owned_.empty(); }
+
+  /**
+   * @brief Get the device and inode of the file when it was mapped
+   */
+  uint64_t device() const { return device_; }
+  uint64_t inode() const { return inode_; }
+
+  /**
+   * @brief Ask the kernel to read the whole song into the page cache
+   */
+  void Prefetch() const;
+
+ private:
+  MappedSong(const std::string& path, const char* data, size_t size,
+             int64_t mtime_ns);
+
+  std::string path_;
+  std::string resume_token_;
+  std::vector<char> owned_;  // Contents of adopted songs, which are not mapped
+  const char* data_;
+  size_t size_;
+  int64_t mtime_ns_;
+  uint64_t device_ = 0;
+  uint64_t inode_ = 0;
+};
+
+/**
+ * @brief Shares one mapping per song file across all concurrent streams
+ *
+ * The store only keeps weak references, so a song is mapped while at least
+ * one stream is using it and released as soon as the last stream finishes.
+ * When many clients pull the same track, they all read from the same pages
+ * of the page cache.
+ *
+ * Mappings are shared with the file, so songs must be replaced by renaming a
+ * new file over the old one. A file rewritten in place changes under the
+ * streams reading it, and truncating it makes them fault. The store warns
+ * when it sees that happen and reads that file into memory from then on.
+ */
+class SongStore {
+ public:
+  /**
+   * @brief Get the mapping for a file, mapping it if needed
+   *
+   * @param path Path to the song file
+   * @return std::shared_ptr<const MappedSong> The mapping, nullptr on failure
+   */
+  std::shared_ptr<const MappedSong> Get(const std::string& path);
+
+  /**
+   * @brief Stop sharing the current mapping of a file that changed
+   *
+   * The next Get maps the file again. If the file was replaced by a rename,
+   * streams still using the old mapping keep reading the old version. If it
+   * was rewritten in place, they already read the new bytes (or fault, if it
+   * was truncated); the store logs a warning and copies the file into memory
+   * on every later Get, so further rewrites cannot reach those streams.
+   *
+   * @param path Path to the song file
+   */
+  void Forget(const std::string& path);
+
+  /**
+   * @brief Get the number of songs that are currently mapped
+   *
+   * @return size_t Number of live mappings
+   */
+  size_t MappedCount() const;
+
+ private:
+  struct Entry {
+    std::weak_ptr<const MappedSong> song;
+    uint64_t device = 0;  // Identity of the file last mapped from the path
+    uint64_t inode = 0;
+  };
+
+  std::map<std::string, Entry> songs_;
+  std::set<std::string> rewritten_;  // Paths rewritten in place, copied
+  mutable std::mutex mutex_;
+};
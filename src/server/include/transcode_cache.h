@@ -0,0 +1,166 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <tuple>
+#include <utility>
+#include <vector>
+
+#include "../../codec/include/pcm_convert.h"
+#include "song_store.h"
+#include "work_queue.h"
+
+/**
+ * @brief Counters describing how well the transcode cache is doing
+ */
+struct TranscodeCacheStats {
+  uint64_t hits = 0;        /**< Requests served from the cache */
+  uint64_t conversions = 0; /**< Songs converted on a miss */
+  uint64_t failures = 0;    /**< Conversions that were not supported */
+  uint64_t evictions = 0;   /**< Songs dropped to stay within the budget */
+  size_t entries = 0;       /**< Converted songs currently cached */
+  size_t bytes_used = 0;    /**< Bytes held by converted songs */
+  size_t budget_bytes = 0;  /**< Maximum bytes the cache may hold */
+};
+
+/**
+ * @brief Byte-budgeted LRU cache of songs converted to device formats
+ *
+ * Clients can ask for a song in the sample format, rate and channel layout
+ * of their output device. Each song is converted once per format and the
+ * result is served to every client asking for the same one. Requests for a
+ * conversion already running are told its result rather than converting
+ * again. Converting a whole song takes long, so the server converts on a
+ * WorkQueue and callers are called back instead of waiting.
+ *
+ * Entries remember the version of the song they were converted from, so a
+ * song that changed on disk is converted again even before Invalidate is
+ * called.
+ */
+class TranscodeCache {
+ public:
+  /**
+   * @brief Default byte budget of the cache
+   */
+  static constexpr size_t kDefaultBudgetBytes = 256 * 1024 * 1024;
+
+  /**
+   * @brief Construct a new Transcode Cache object
+   *
+   * @param budget_bytes Maximum number of bytes to keep cached, 0 converts
+   * every request again
+   */
+  explicit TranscodeCache(size_t budget_bytes = kDefaultBudgetBytes);
+
+  /**
+   * @brief Function told the converted song, nullptr if the song cannot be
+   * converted to the format
+   */
+  using Done = std::function<void(std::shared_ptr<const MappedSong>)>;
+
+  /**
+   * @brief Get a song in a format without converting it on the calling
+   * thread
+   *
+   * @param song_num Index of the song in the playlist (1-based)
+   * @param song Current version of the song
+   * @param format Format to convert to
+   * @param workers Threads to convert on a miss, nullptr or shut down to
+   * convert on the calling thread
+   * @param converted Receives the converted song on a hit
+   * @param done Called with the converted song on the thread that converted
+   * it, unless it is returned right away. It may be called before this
+   * returns, and may be nullptr to only fill the cache.
+   * @return true if converted was set right away, false if done will be
+   * called instead
+   */
+  bool Get(int song_num, const std::shared_ptr<const MappedSong>& song,
+           const music262::PcmFormat& format, WorkQueue* workers,
+           std::shared_ptr<const MappedSong>* converted, Done done);
+
+  /**
+   * @brief Get a song in a format, converting it on the calling thread on a
+   * miss
+   *
+   * Waits for a conversion of the same song and format already running, so
+   * it must not be called on a poller thread.
+   *
+   * @param song_num Index of the song in the playlist (1-based)
+   * @param song Current version of the song
+   * @param format Format to convert to
+   * @return std::shared_ptr<const MappedSong> The converted song, nullptr if
+   * the song cannot be converted to the format
+   */
+  std::shared_ptr<const MappedSong> Get(
+      int song_num, const std::shared_ptr<const MappedSong>& song,
+      const music262::PcmFormat& format);
+
+  /**
+   * @brief Drop every format of a song whose file changed
+   *
+   * @param song_num Index of the song in the playlist (1-based)
+   */
+  void Invalidate(int song_num);
+
+  /**
+   * @brief Change the byte budget, evicting songs if it shrank
+   */
+  void SetBudget(size_t budget_bytes);
+
+  /**
+   * @brief Get a snapshot of the cache counters
+   *
+   * @return TranscodeCacheStats Current counters
+   */
+  TranscodeCacheStats GetStats() const;
+
+ private:
+  // Song number, sample format, rate and channels
+  using Key = std::tuple<int, int, uint32_t, uint16_t>;
+
+  struct Entry {
+    std::shared_ptr<const MappedSong> song;
+    std::string source_token;  // Version of the song it was converted from
+    std::list<Key>::iterator lru_position;
+  };
+
+  static Key MakeKey(int song_num, const music262::PcmFormat& format);
+
+  // Convert a song into a song served under its own resume token
+  static std::shared_ptr<const MappedSong> Convert(
+      const MappedSong& song, const music262::PcmFormat& format);
+
+  // Convert one version of a song, cache the result and tell the callers
+  // waiting for it
+  void RunConversion(const Key& key, std::shared_ptr<const MappedSong> song,
+                     const music262::PcmFormat& format);
+
+  // Insert a converted song and evict until the cache fits its budget,
+  // mutex_ held
+  void InsertLocked(const Key& key, const std::string& source_token,
+                    std::shared_ptr<const MappedSong> song);
+
+  // Evict least recently used songs until bytes_used_ + incoming fits the
+  // budget, mutex_ held
+  void EvictLocked(size_t incoming);
+
+  void EraseLocked(std::map<Key, Entry>::iterator it);
+
+  size_t budget_bytes_;
+  size_t bytes_used_ = 0;
+  std::map<Key, Entry> entries_;
+  std::list<Key> lru_;  // Most recently used first
+  // Conversions running by key and source version, with their callers
+  std::map<std::pair<Key, std::string>, std::vector<Done>> converting_;
+  uint64_t hits_ = 0;
+  uint64_t conversions_ = 0;
+  uint64_t failures_ = 0;
+  uint64_t evictions_ = 0;
+  mutable std::mutex mutex_;
+};
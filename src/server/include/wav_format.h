@@ -0,0 +1,90 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+/**
+ * @brief Sample format and location of the sample data of a WAV file
+ */
+struct WavFormat {
+  uint32_t sample_rate = 0;     /**< Frames per second */
+  uint16_t channels = 0;        /**< Samples per frame */
+  uint16_t block_align = 0;     /**< Bytes per frame */
+  uint16_t bits_per_sample = 0; /**< Bits per sample */
+  size_t data_offset = 0;       /**< First byte of the sample data */
+  size_t data_size = 0;         /**< Bytes of sample data in the file */
+
+  /**
+   * @brief Get the playback time of the sample data in milliseconds
+   */
+  uint64_t duration_ms() const {
+    return block_align > 0 && sample_rate > 0
+               ? data_size / block_align * 1000 / sample_rate
+               : 0;
+  }
+};
+
+namespace wav_format_detail {
+
+inline uint64_t ReadLE(const char* in, int bytes) {
+  uint64_t value = 0;
+  for (int i = 0; i < bytes; i++) {
+    value |= static_cast<uint64_t>(static_cast<uint8_t>(in[i])) << (8 * i);
+  }
+  return value;
+}
+
+}  // namespace wav_format_detail
+
+/**
+ * @brief Walk the RIFF chunks of a WAV file up to the "data" chunk
+ *
+ * Only the beginning of the file is needed, so the format can be read
+ * without loading the samples.
+ *
+ * @param wav The first bytes of the file
+ * @param size Number of bytes at wav
+ * @param file_size Size of the whole file, used to clamp the sample data
+ * @param format Receives the sample format
+ * @return true if the file is a WAV file with a usable format, false otherwise
+ */
+inline bool ParseWavFormat(const char* wav, size_t size, size_t file_size,
+                           WavFormat* format) {
+  using wav_format_detail::ReadLE;
+  if (size < 12 || std::memcmp(wav, "RIFF", 4) != 0 ||
+      std::memcmp(wav + 8, "WAVE", 4) != 0) {
+    return false;
+  }
+
+  bool have_format = false;
+  size_t position = 12;
+  while (position + 8 <= size) {
+    const char* id = wav + position;
+    uint64_t chunk_size = ReadLE(wav + position + 4, 4);
+    size_t body = position + 8;
+
+    if (std::memcmp(id, "fmt ", 4) == 0 && chunk_size >= 16 &&
+        body + 16 <= size) {
+      format->channels = static_cast<uint16_t>(ReadLE(wav + body + 2, 2));
+      format->sample_rate = static_cast<uint32_t>(ReadLE(wav + body + 4, 4));
+      format->block_align = static_cast<uint16_t>(ReadLE(wav + body + 12, 2));
+      format->bits_per_sample =
+          static_cast<uint16_t>(ReadLE(wav + body + 14, 2));
+      have_format = true;
+    } else if (std::memcmp(id, "data", 4) == 0) {
+      if (!have_format || format->sample_rate == 0 ||
+          format->channels == 0 || format->block_align == 0 ||
+          body > file_size) {
+        return false;
+      }
+      // Streaming writers leave the size at its maximum, clamp to the file
+      format->data_offset = body;
+      format->data_size = std::min<uint64_t>(chunk_size, file_size - body);
+      return true;
+    }
+    position = body + chunk_size + (chunk_size & 1);
+  }
+  return false;
+}
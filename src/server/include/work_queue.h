@@ -0,0 +1,74 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/**
+ * @brief Fixed pool of threads running jobs too slow for a poller thread
+ *
+ * Converting or checksumming a whole song takes far longer than handling a
+ * completion, so calls hand that work to the queue and are resumed once it
+ * is done instead of holding one of the few poller threads. Jobs run in the
+ * order they were submitted.
+ */
+class WorkQueue {
+ public:
+  using Job = std::function<void()>;
+
+  /**
+   * @brief Default number of worker threads
+   */
+  static constexpr int kDefaultThreads = 2;
+
+  /**
+   * @brief Construct a new Work Queue object and start its threads
+   *
+   * @param threads Number of worker threads, at least one is started
+   */
+  explicit WorkQueue(int threads = kDefaultThreads);
+
+  /**
+   * @brief Destroy the Work Queue object, see Shutdown
+   */
+  ~WorkQueue();
+
+  WorkQueue(const WorkQueue&) = delete;
+  WorkQueue& operator=(const WorkQueue&) = delete;
+
+  /**
+   * @brief Queue a job to run on a worker thread
+   *
+   * @param job Function to run
+   * @return true if the job was queued, false once shut down, the caller
+   * then has to run it or give up on it itself
+   */
+  bool Submit(Job job);
+
+  /**
+   * @brief Stop accepting jobs, run the ones already queued and join the
+   * threads
+   *
+   * Jobs still queued are run rather than dropped, as calls may be waiting
+   * for them to finish.
+   */
+  void Shutdown();
+
+  /**
+   * @brief Get the number of jobs waiting for a worker
+   */
+  size_t queued() const;
+
+ private:
+  void Run();
+
+  mutable std::mutex mutex_;
+  std::condition_variable cv_;
+  std::deque<Job> jobs_;
+  bool shut_down_ = false;
+  std::vector<std::thread> threads_;
+};
@@ -6,16 +6,18 @@
 #include <netinet/in.h>
 #include <sys/socket.h>
 
+#include <algorithm>
+#include <chrono>
 #include <filesystem>
-#include <fstream>
 #include <iostream>
 #include <memory>
+#include <sstream>
 #include <string>
-#include <thread>
 #include <vector>
 
+#include "../common/include/grpc_server_config.h"
 #include "../common/include/logger.h"
-#include "audio_service.grpc.pb.h"
+#include "include/async_audio_service.h"
 #include "include/audio_server.h"
 
 // Helper: get first non-loopback IPv4 address
@@ -37,149 +39,41 @@ std::string GetLocalIPAddress() {
   return "";
 }
 
-// AudioServiceImpl class that implements the gRPC service
-// This class now delegates to the AudioServer class for business logic
-class AudioServiceImpl final : public audio_service::audio_service::Service {
- public:
-  AudioServiceImpl(std::shared_ptr<AudioServer> server) : server_(server) {
-    LOG_INFO("AudioServiceImpl initialized");
-  }
-
-  grpc::Status GetPlaylist(grpc::ServerContext* context,
-                           const audio_service::PlaylistRequest* request,
-                           audio_service::PlaylistResponse* response) override {
-    LOG_INFO("Received playlist request from client");
-
-    // Register client in the connected clients list
-    std::string client_ip = context->peer();
-    server_->RegisterClient(client_ip);
-
-    // Add each song filename to the response
-    for (const auto& song : server_->GetPlaylist()) {
-      response->add_song_names(song);
-    }
-
-    return grpc::Status::OK;
-  }
-
-  grpc::Status LoadAudio(
-      grpc::ServerContext* context,
-      const audio_service::LoadAudioRequest* request,
-      grpc::ServerWriter<audio_service::AudioChunk>* writer) override {
-    int song_num = request->song_num();
-    LOG_INFO("Received request to load song: {}", song_num);
-
-    // Get the file path from the server
-    std::string file_path = server_->GetAudioFilePath(song_num);
-    if (file_path.empty()) {
-      return grpc::Status(grpc::StatusCode::NOT_FOUND, "Song not found");
-    }
-
-    // Open the audio file
-    std::ifstream file(file_path, std::ios::binary);
-    if (!file) {
-      LOG_ERROR("Failed to open song file: {}", file_path);
-      return grpc::Status(grpc::StatusCode::INTERNAL,
-                          "Failed to open song file");
-    }
-
-    // Register client in the connected clients list
-    std::string client_ip = context->peer();
-    server_->RegisterClient(client_ip);
-
-    // Read and send the file in chunks
-    constexpr size_t CHUNK_SIZE = 64 * 1024;  // 64 KB chunks
-    std::vector<char> buffer(CHUNK_SIZE);
-    size_t total_bytes_sent = 0;
-
-    while (file) {
-      file.read(buffer.data(), CHUNK_SIZE);
-      std::streamsize bytes_read = file.gcount();
-
-      if (bytes_read > 0) {
-        audio_service::AudioChunk chunk;
-        chunk.set_data(buffer.data(), bytes_read);
-
-        if (!writer->Write(chunk)) {
-          LOG_ERROR("Failed to write audio chunk to client");
-          break;
-        }
-
-        total_bytes_sent += bytes_read;
-      }
-    }
-
-    LOG_INFO("Sent {} bytes of audio data", total_bytes_sent);
-    return grpc::Status::OK;
-  }
-
-  grpc::Status GetPeerClientIPs(
-      grpc::ServerContext* context,
-      const audio_service::PeerListRequest* request,
-      audio_service::PeerListResponse* response) override {
-    LOG_INFO("Received peer list request");
-
-    // Register the requesting client
-    std::string requester_ip = context->peer();
-    server_->RegisterClient(requester_ip);
-
-    // Get connected clients excluding the requester
-    std::vector<std::string> clients =
-        server_->GetConnectedClients(requester_ip);
-
-    // Add all clients to the response
-    for (const auto& client : clients) {
-      response->add_client_ips(client);
-    }
-
-    return grpc::Status::OK;
-  }
-
-  // Helper function to extract clean IP:port from gRPC peer string
-  std::string ExtractIPFromPeer(const std::string& peer) {
-    // gRPC peer strings are typically in format "ipv4:127.0.0.1:12345" or
-    // "ipv6:[::1]:12345"
-    size_t colon_pos = peer.find(':');
-    if (colon_pos != std::string::npos) {
-      // Skip the prefix (e.g., "ipv4:" or "ipv6:")
-      std::string address = peer.substr(colon_pos + 1);
-      return address;
-    }
-    return peer;  // Return original if format is unexpected
-  }
-
-  // Get current server stats for the CLI
-  void PrintStatus(int port) const {
-    std::string local_ip = GetLocalIPAddress();
-    if (local_ip.empty()) local_ip = "127.0.0.1";
-
-    server_->PrintStatus(local_ip, port);
-  }
-
- private:
-  std::shared_ptr<AudioServer> server_;
-};
-
 void displayHelp() {
   std::cout << "\nCommands:" << std::endl;
   std::cout << "  status            - Show server status (IP Address and port, "
-               "active clients, etc.)"
+               "active clients, song cache, etc.)"
+            << std::endl;
+  std::cout << "  rescan            - Re-read the audio directory now"
+            << std::endl;
+  std::cout << "  stats             - Show call counts, latencies and "
+               "throughput per RPC"
             << std::endl;
   std::cout << "  help              - Show this help message" << std::endl;
   std::cout << "  exit              - Shutdown the server" << std::endl;
 }
 
-void RunServer(AudioServiceImpl* service, int port) {
+std::unique_ptr<grpc::Server> StartServer(
+    AsyncAudioService* service, int port,
+    const music262::GrpcServerConfig& grpc_config) {
   std::string server_address = "0.0.0.0:" + std::to_string(port);
 
   grpc::ServerBuilder builder;
   builder.AddListeningPort(server_address, grpc::InsecureServerCredentials());
-  builder.RegisterService(service);
+  grpc_config.Apply(&builder);
+  service->RegisterWith(builder);
 
   std::unique_ptr<grpc::Server> server(builder.BuildAndStart());
+  if (!server) {
+    LOG_ERROR("Failed to start server on {}", server_address);
+    return nullptr;
+  }
+
+  // Calls are served by the service's poller threads from here on
+  service->Start();
   LOG_INFO("Server listening on {}", server_address);
 
-  server->Wait();
+  return server;
 }
 
 int main(int argc, char* argv[]) {
@@ -189,14 +83,119 @@ int main(int argc, char* argv[]) {
   // Default values
   int port = 50051;
   std::string audio_directory = "../sample_music";
-
-  // Parse command line arguments
-  for (int i = 1; i < argc; i++) {
-    std::string arg = argv[i];
-    if (arg == "--port" && i + 1 < argc) {
-      port = std::stoi(argv[++i]);
-    } else if (arg == "--audio_dir" && i + 1 < argc) {
-      audio_directory = argv[++i];
+  size_t cache_mb = AudioServer::kDefaultCacheBytes / (1024 * 1024);
+  size_t transcode_cache_mb =
+      TranscodeCache::kDefaultBudgetBytes / (1024 * 1024);
+  bool preload = false;
+  std::string codec_directory;
+  bool encode = true;
+  bool watch = true;
+  std::string catalog_file;
+  bool persist_catalog = true;
+  SongCatalogOptions catalog_options;
+  std::vector<int> pinned_songs;
+  std::chrono::milliseconds segment_duration =
+      AudioServer::kDefaultSegmentDuration;
+  std::chrono::milliseconds client_lease = ClientRegistry::kDefaultLease;
+  size_t max_peers = AudioServer::kDefaultMaxPeers;
+  AsyncServiceOptions service_options;
+  music262::GrpcServerConfig grpc_config;
+  std::string metrics_file;
+  std::chrono::seconds metrics_interval(10);
+
+  // Parse command line arguments, a config file's flags are read in its
+  // place so later flags override them
+  std::vector<std::string> args(argv + 1, argv + argc);
+  for (size_t i = 0; i < args.size(); i++) {
+    std::string arg = args[i];
+    if (arg == "--config" && i + 1 < args.size()) {
+      std::string config_file = args[++i];
+      std::vector<std::string> file_args;
+      std::string error;
+      if (!music262::ReadConfigFile(config_file, &file_args, &error)) {
+        LOG_ERROR("Cannot read config file: {}", error);
+        return 1;
+      }
+      args.insert(args.begin() + i + 1, file_args.begin(), file_args.end());
+    } else if (arg.rfind("--grpc_", 0) == 0 && i + 1 < args.size()) {
+      if (!grpc_config.Set(arg.substr(2), args[i + 1])) {
+        LOG_ERROR("Invalid gRPC setting {} {}", arg, args[i + 1]);
+        return 1;
+      }
+      i++;
+    } else if (arg == "--port" && i + 1 < args.size()) {
+      port = std::stoi(args[++i]);
+    } else if (arg == "--audio_dir" && i + 1 < args.size()) {
+      audio_directory = args[++i];
+    } else if (arg == "--cache_mb" && i + 1 < args.size()) {
+      cache_mb = std::stoul(args[++i]);
+    } else if (arg == "--transcode_cache_mb" && i + 1 < args.size()) {
+      transcode_cache_mb = std::stoul(args[++i]);
+    } else if (arg == "--num_cqs" && i + 1 < args.size()) {
+      service_options.num_cqs = std::stoi(args[++i]);
+    } else if (arg == "--pollers_per_cq" && i + 1 < args.size()) {
+      service_options.pollers_per_cq = std::stoi(args[++i]);
+    } else if (arg == "--min_chunk_kb" && i + 1 < args.size()) {
+      service_options.min_chunk_bytes = std::stoul(args[++i]) * 1024;
+    } else if (arg == "--max_chunk_kb" && i + 1 < args.size()) {
+      service_options.max_chunk_bytes = std::stoul(args[++i]) * 1024;
+    } else if (arg == "--target_write_ms" && i + 1 < args.size()) {
+      service_options.target_write_latency =
+          std::chrono::microseconds(std::stoul(args[++i]) * 1000);
+    } else if (arg == "--egress_window_kb" && i + 1 < args.size()) {
+      service_options.egress.window_bytes = std::stoul(args[++i]) * 1024;
+    } else if (arg == "--egress_rate_mbit" && i + 1 < args.size()) {
+      service_options.egress.rate_bytes_per_sec =
+          std::stoull(args[++i]) * 1000 * 1000 / 8;
+    } else if (arg == "--client_rate_mbit" && i + 1 < args.size()) {
+      service_options.egress.client_rate_bytes_per_sec =
+          std::stoull(args[++i]) * 1000 * 1000 / 8;
+    } else if (arg == "--urgent_kb" && i + 1 < args.size()) {
+      service_options.egress.urgent_bytes = std::stoul(args[++i]) * 1024;
+    } else if (arg == "--broadcast_chunk_ms" && i + 1 < args.size()) {
+      service_options.broadcast.chunk_duration =
+          std::chrono::milliseconds(std::stoul(args[++i]));
+    } else if (arg == "--broadcast_lead_ms" && i + 1 < args.size()) {
+      service_options.broadcast.lead =
+          std::chrono::milliseconds(std::stoul(args[++i]));
+    } else if (arg == "--broadcast_ring_chunks" && i + 1 < args.size()) {
+      service_options.broadcast.ring_chunks = std::stoul(args[++i]);
+    } else if (arg == "--segment_ms" && i + 1 < args.size()) {
+      segment_duration = std::chrono::milliseconds(std::stoul(args[++i]));
+      if (segment_duration < AudioServer::kMinSegmentDuration) {
+        LOG_ERROR("--segment_ms must be at least {}",
+                  AudioServer::kMinSegmentDuration.count());
+        return 1;
+      }
+    } else if (arg == "--client_lease_s" && i + 1 < args.size()) {
+      client_lease = std::chrono::seconds(std::stoul(args[++i]));
+    } else if (arg == "--max_peers" && i + 1 < args.size()) {
+      max_peers = std::stoul(args[++i]);
+    } else if (arg == "--metrics_file" && i + 1 < args.size()) {
+      metrics_file = args[++i];
+    } else if (arg == "--metrics_interval_s" && i + 1 < args.size()) {
+      metrics_interval = std::chrono::seconds(std::stoul(args[++i]));
+    } else if (arg == "--codec_dir" && i + 1 < args.size()) {
+      codec_directory = args[++i];
+    } else if (arg == "--no_encode") {
+      encode = false;
+    } else if (arg == "--no_watch") {
+      watch = false;
+    } else if (arg == "--catalog_file" && i + 1 < args.size()) {
+      catalog_file = args[++i];
+    } else if (arg == "--no_catalog_file") {
+      persist_catalog = false;
+    } else if (arg == "--scan_threads" && i + 1 < args.size()) {
+      catalog_options.scan_threads = std::stoi(args[++i]);
+    } else if (arg == "--preload") {
+      preload = true;
+    } else if (arg == "--pin" && i + 1 < args.size()) {
+      // Comma-separated list of song numbers, e.g. "1,4,7"
+      std::stringstream songs(args[++i]);
+      std::string song;
+      while (std::getline(songs, song, ',')) {
+        if (!song.empty()) pinned_songs.push_back(std::stoi(song));
+      }
     }
   }
 
@@ -204,18 +203,94 @@ int main(int argc, char* argv[]) {
   grpc::EnableDefaultHealthCheckService(true);
   grpc::reflection::InitProtoReflectionServerBuilderPlugin();
 
+  // Start from the catalog saved by the previous run, so large libraries
+  // are served right away while the directory is reconciled
+  if (persist_catalog) {
+    catalog_options.catalog_file = catalog_file.empty()
+                                       ? audio_directory + "/.m262catalog"
+                                       : catalog_file;
+  }
+
   // Create the AudioServer instance (business logic)
-  auto audio_server = std::make_shared<AudioServer>(audio_directory);
+  auto audio_server = std::make_shared<AudioServer>(
+      audio_directory, cache_mb * 1024 * 1024, segment_duration,
+      catalog_options);
+  audio_server->SetClientLease(client_lease);
+  audio_server->SetMaxPeers(max_peers);
+  audio_server->SetTranscodeCacheBytes(transcode_cache_mb * 1024 * 1024);
+  for (int song_num : pinned_songs) {
+    audio_server->PinSong(song_num);
+  }
+  if (preload) {
+    audio_server->Preload();
+  }
+
+  // Hash and losslessly encode the catalog in the background, songs are
+  // served as PCM until their encoded version is ready
+  if (codec_directory.empty()) {
+    codec_directory = audio_directory + "/.m2lc";
+  }
+  audio_server->StartCatalogIndexing(encode ? codec_directory : "");
+
+  // Pick up songs added, changed or removed while the server was down, in
+  // the background when watching, and then as they change
+  if (watch) {
+    audio_server->WatchCatalog();
+  } else if (persist_catalog) {
+    audio_server->RescanCatalog();
+  }
 
   // Create the service implementation (networking layer)
-  AudioServiceImpl service(audio_server);
+  AsyncAudioService service(audio_server, service_options);
 
-  // Start the gRPC server in a separate thread
-  std::thread server_thread(RunServer, &service, port);
+  // Start the gRPC server, calls are handled on the service's poller threads
+  std::unique_ptr<grpc::Server> server =
+      StartServer(&service, port, grpc_config);
+  if (!server) {
+    return 1;
+  }
+
+  // Export the counters for a node exporter's textfile collector
+  if (!metrics_file.empty()) {
+    service.stats()->StartWritingFile(
+        metrics_file, std::max(metrics_interval, std::chrono::seconds(1)));
+  }
 
   std::cout << "Music Streaming Server - Starting up..." << std::endl;
   std::cout << "Configured to use port: " << port << std::endl;
   std::cout << "Audio directory: " << audio_directory << std::endl;
+  std::cout << "Song cache: " << cache_mb << " MB" << std::endl;
+  std::cout << "Transcode cache: " << transcode_cache_mb << " MB"
+            << std::endl;
+  std::cout << "Completion queues: " << service.options().num_cqs << " ("
+            << service.options().pollers_per_cq << " pollers each)"
+            << std::endl;
+  std::cout << "gRPC transport: " << grpc_config.Summary() << std::endl;
+  std::cout << "Chunk size: " << service.options().min_chunk_bytes / 1024
+            << "-" << service.options().max_chunk_bytes / 1024 << " KB"
+            << std::endl;
+  const EgressOptions& egress = service.options().egress;
+  std::cout << "Egress window: " << egress.window_bytes / 1024 << " KB, first "
+            << egress.urgent_bytes / 1024 << " KB of every stream urgent"
+            << std::endl;
+  if (egress.rate_bytes_per_sec > 0 || egress.client_rate_bytes_per_sec > 0) {
+    std::cout << "Egress cap: " << egress.rate_bytes_per_sec * 8 / 1000000
+              << " Mbit/s, " << egress.client_rate_bytes_per_sec * 8 / 1000000
+              << " Mbit/s per client (0 for none)" << std::endl;
+  }
+  const BroadcastOptions& broadcast = service.options().broadcast;
+  std::cout << "Broadcast: " << broadcast.chunk_duration.count()
+            << " ms chunks, " << broadcast.lead.count() << " ms lead"
+            << std::endl;
+  std::cout << "Segment duration: " << segment_duration.count() << " ms"
+            << std::endl;
+  std::cout << "Client lease: " << client_lease.count() / 1000 << " s"
+            << std::endl;
+  std::cout << "Peers per list: " << max_peers << std::endl;
+  if (!metrics_file.empty()) {
+    std::cout << "Metrics file: " << metrics_file << " (every "
+              << metrics_interval.count() << " s)" << std::endl;
+  }
 
   // Determine and log actual network IP and port
   std::string local_ip = GetLocalIPAddress();
@@ -234,12 +309,28 @@ int main(int argc, char* argv[]) {
     std::getline(std::cin, command);
 
     if (command == "status") {
-      service.PrintStatus(port);
+      audio_server->PrintStatus(local_ip, port);
+    } else if (command == "rescan") {
+      std::cout << audio_server->RescanCatalog() << " songs changed"
+                << std::endl;
+    } else if (command == "stats") {
+      ServerStats::Print(service.stats()->Snapshot(), std::cout);
+      std::cout << "Egress: " << service.egress()->inflight_bytes() / 1024
+                << " KB in flight, " << service.egress()->queued()
+                << " streams queued" << std::endl;
+      BroadcastStats broadcasts = service.broadcasts()->GetStats();
+      std::cout << "Broadcasts: " << broadcasts.channels << " live, "
+                << broadcasts.listeners << " listeners, "
+                << broadcasts.chunks << " chunks read once, "
+                << broadcasts.skipped_chunks << " chunks skipped by slow "
+                << "listeners" << std::endl;
     } else if (command == "help") {
       displayHelp();
     } else if (command == "exit") {
       std::cout << "Shutting down server..." << std::endl;
       running = false;
+      service.Shutdown(server.get());
+      service.stats()->StopWritingFile();
     } else if (!command.empty()) {
       LOG_WARN("Unknown command: {}. Type 'help' for available commands.",
                command);
@@ -0,0 +1,37 @@
+#include "include/peer_selector.h"
+
+#include <algorithm>
+
+std::vector<size_t> SelectPeers(const ClientListSnapshot& clients,
+                                const PeerQuery& query) {
+  std::vector<size_t> selected;
+  auto take = [&](const std::vector<size_t>& candidates, bool need_song) {
+    for (size_t i : candidates) {
+      if (selected.size() >= query.max_peers) {
+        return;
+      }
+      const PeerEntry& peer = clients.peers[i];
+      if (peer.address == query.address ||
+          (need_song && !peer.HasSong(query.song_num)) ||
+          std::find(selected.begin(), selected.end(), i) != selected.end()) {
+        continue;
+      }
+      selected.push_back(i);
+    }
+  };
+
+  static const std::vector<size_t> kNone;
+  auto subnet = clients.by_subnet.find(SubnetOf(query.address));
+  const std::vector<size_t>& nearby =
+      subnet != clients.by_subnet.end() ? subnet->second : kNone;
+
+  if (query.song_num > 0) {
+    take(nearby, true);
+  }
+  take(nearby, false);
+  if (query.song_num > 0) {
+    take(clients.ranked, true);
+  }
+  take(clients.ranked, false);
+  return selected;
+}
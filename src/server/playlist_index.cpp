@@ -0,0 +1,113 @@
+#include "include/playlist_index.h"
+
+#include <chrono>
+#include <cinttypes>
+#include <cstdio>
+#include <random>
+
+std::string PlaylistSnapshot::etag() const {
+  char tag[34];
+  snprintf(tag, sizeof(tag), "%016" PRIx64 "-%" PRIx64, epoch, version);
+  return tag;
+}
+
+bool PlaylistSnapshot::ParseEtag(const std::string& etag,
+                                 uint64_t* version) const {
+  uint64_t tag_epoch = 0;
+  int consumed = 0;
+  if (sscanf(etag.c_str(), "%16" SCNx64 "-%" SCNx64 "%n", &tag_epoch, version,
+             &consumed) != 2 ||
+      static_cast<size_t>(consumed) != etag.size()) {
+    return false;
+  }
+  return tag_epoch == epoch;
+}
+
+PlaylistIndex::PlaylistIndex() {
+  // Versions restart with every run, the epoch keeps tags of an earlier run
+  // from matching
+  std::random_device random;
+  epoch_ = (static_cast<uint64_t>(random()) << 32) ^ random() ^
+           static_cast<uint64_t>(
+               std::chrono::steady_clock::now().time_since_epoch().count());
+}
+
+uint64_t PlaylistIndex::next_version() const {
+  return history_.empty() ? 1 : history_.back()->version + 1;
+}
+
+void PlaylistIndex::UpdateSongs(const CatalogSnapshot& catalog,
+                                const std::vector<SongMetadata>& changed) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  uint64_t version = next_version();
+  for (const auto& song : changed) {
+    if (song.id <= 0) {
+      continue;
+    }
+    if (entries_.size() < static_cast<size_t>(song.id)) {
+      // Ids skipped by the catalog are listed as unused
+      size_t first_new = entries_.size();
+      entries_.resize(song.id);
+      for (size_t i = first_new; i < entries_.size(); i++) {
+        entries_[i].song.id = static_cast<int>(i + 1);
+        entries_[i].version = version;
+      }
+    }
+
+    PlaylistEntry& entry = entries_[song.id - 1];
+    const SongMetadata* current = catalog.Find(song.id);
+    entry.song = current ? *current : SongMetadata();
+    entry.song.id = song.id;
+    entry.content_hash = 0;
+    entry.version = version;
+  }
+  dirty_ = true;
+}
+
+bool PlaylistIndex::SetDigest(int id, size_t size, int64_t mtime_ns,
+                              uint64_t content_hash) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (id <= 0 || static_cast<size_t>(id) > entries_.size()) {
+    return false;
+  }
+  PlaylistEntry& entry = entries_[id - 1];
+  if (entry.song.name.empty() || entry.song.size != size ||
+      entry.song.mtime_ns != mtime_ns) {
+    return false;
+  }
+  if (entry.content_hash != content_hash) {
+    entry.content_hash = content_hash;
+    entry.version = next_version();
+    dirty_ = true;
+  }
+  return true;
+}
+
+std::shared_ptr<const PlaylistSnapshot> PlaylistIndex::Snapshot() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (!dirty_) {
+    return history_.back();
+  }
+
+  auto snapshot = std::make_shared<PlaylistSnapshot>();
+  snapshot->epoch = epoch_;
+  snapshot->version = next_version();
+  snapshot->entries = entries_;
+  history_.push_back(std::move(snapshot));
+  if (history_.size() > kHistory) {
+    history_.pop_front();
+  }
+  dirty_ = false;
+  return history_.back();
+}
+
+std::shared_ptr<const PlaylistSnapshot> PlaylistIndex::Snapshot(
+    uint64_t version) const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  for (const auto& snapshot : history_) {
+    if (snapshot->version == version) {
+      return snapshot;
+    }
+  }
+  return nullptr;
+}
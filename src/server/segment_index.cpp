@@ -0,0 +1,56 @@
+#include "include/segment_index.h"
+
+#include <algorithm>
+#include <cstring>
+
+#include "../common/include/crc32.h"
+#include "../common/include/logger.h"
+#include "include/wav_format.h"
+
+std::shared_ptr<const SegmentIndex> SegmentIndex::Build(
+    const MappedSong& song, std::chrono::milliseconds segment_duration) {
+  WavFormat format;
+  if (!ParseWavFormat(song.data(), song.size(), song.size(), &format)) {
+    LOG_WARN("Cannot segment {}: not a PCM WAV file", song.path());
+    return nullptr;
+  }
+
+  auto index = std::make_shared<SegmentIndex>();
+  index->resume_token = song.resume_token();
+  index->song_size = song.size();
+  index->sample_rate = format.sample_rate;
+  index->channels = format.channels;
+  index->bytes_per_frame = format.block_align;
+  index->frames_per_segment = std::max<uint64_t>(
+      1, static_cast<uint64_t>(format.sample_rate) *
+             std::max<int64_t>(0, segment_duration.count()) / 1000);
+
+  uint64_t total_frames = format.data_size / format.block_align;
+
+  // Segments start on frame boundaries of the sample data, except that the
+  // first one begins at the header and the last one runs to the end of file
+  uint64_t frame = 0;
+  size_t offset = 0;
+  do {
+    SongSegment segment;
+    segment.id = static_cast<int>(index->segments.size());
+    segment.offset = offset;
+    segment.first_frame = frame;
+    segment.frame_count =
+        std::min<uint64_t>(index->frames_per_segment, total_frames - frame);
+    frame += segment.frame_count;
+
+    size_t end = frame < total_frames
+                     ? format.data_offset + frame * format.block_align
+                     : song.size();
+    segment.size = end - offset;
+    segment.crc32 = music262::Crc32(song.data() + offset, segment.size);
+    index->segments.push_back(segment);
+    offset = end;
+  } while (frame < total_frames);
+
+  LOG_DEBUG("Indexed {} into {} segments of {} bytes", song.path(),
+            index->segments.size(),
+            index->frames_per_segment * format.block_align);
+  return index;
+}
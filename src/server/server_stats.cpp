@@ -0,0 +1,393 @@
+#include "include/server_stats.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <fstream>
+#include <iomanip>
+#include <sstream>
+
+#include "logger.h"
+
+namespace {
+
+constexpr size_t kMethods = static_cast<size_t>(RpcMethod::kCount);
+constexpr size_t kStages = static_cast<size_t>(StreamStage::kCount);
+
+// Quantiles reported by every summary
+constexpr double kQuantiles[] = {0.5, 0.99, 0.999};
+
+double Seconds(std::chrono::nanoseconds duration) {
+  return std::chrono::duration<double>(duration).count();
+}
+
+double Millis(std::chrono::nanoseconds duration) {
+  return std::chrono::duration<double, std::milli>(duration).count();
+}
+
+void WriteHeader(std::ostream& out, const char* name, const char* type,
+                 const char* help) {
+  out << "# HELP " << name << " " << help << "\n";
+  out << "# TYPE " << name << " " << type << "\n";
+}
+
+// Quantiles, sum and count of a summary metric, labels include the trailing
+// comma if not empty
+void WriteSummary(std::ostream& out, const char* name,
+                  const std::string& labels, const LatencySummary& summary) {
+  const std::chrono::nanoseconds values[] = {summary.p50, summary.p99,
+                                             summary.p999};
+  for (size_t i = 0; i < 3; i++) {
+    out << name << "{" << labels << "quantile=\"" << kQuantiles[i] << "\"} "
+        << Seconds(values[i]) << "\n";
+  }
+  std::string plain = labels.empty() ? "" : labels.substr(0, labels.size() - 1);
+  out << name << "_sum{" << plain << "} " << Seconds(summary.sum) << "\n";
+  out << name << "_count{" << plain << "} " << summary.count << "\n";
+}
+
+}  // namespace
+
+const char* RpcMethodName(RpcMethod method) {
+  switch (method) {
+    case RpcMethod::kGetPlaylist:
+      return "GetPlaylist";
+    case RpcMethod::kLoadAudio:
+      return "LoadAudio";
+    case RpcMethod::kGetPeerClientIPs:
+      return "GetPeerClientIPs";
+    case RpcMethod::kGetSegmentIndex:
+      return "GetSegmentIndex";
+    case RpcMethod::kLoadSegment:
+      return "LoadSegment";
+    case RpcMethod::kHeartbeat:
+      return "Heartbeat";
+    case RpcMethod::kWatchPeers:
+      return "WatchPeers";
+    case RpcMethod::kGetServerStats:
+      return "GetServerStats";
+    case RpcMethod::kJoinBroadcast:
+      return "JoinBroadcast";
+    case RpcMethod::kHintNextSongs:
+      return "HintNextSongs";
+    case RpcMethod::kCount:
+      break;
+  }
+  return "Unknown";
+}
+
+const char* StreamStageName(StreamStage stage) {
+  switch (stage) {
+    case StreamStage::kSongOpen:
+      return "song_open";
+    case StreamStage::kFirstChunk:
+      return "first_chunk";
+    case StreamStage::kChunkEncode:
+      return "chunk_encode";
+    case StreamStage::kChunkWrite:
+      return "chunk_write";
+    case StreamStage::kCount:
+      break;
+  }
+  return "unknown";
+}
+
+int LatencyHistogram::BucketOf(uint64_t nanos) {
+  if (nanos < kSubBuckets) {
+    return static_cast<int>(nanos);
+  }
+  nanos = std::min(nanos, (uint64_t{1} << kMaxExponent) - 1);
+  // Power of two of the latency, and which of its sub-buckets it falls in
+  int exponent = 63 - __builtin_clzll(nanos);
+  int sub = static_cast<int>(nanos >> (exponent - 3)) & (kSubBuckets - 1);
+  return kSubBuckets + (exponent - 3) * kSubBuckets + sub;
+}
+
+uint64_t LatencyHistogram::BucketStart(int bucket) {
+  if (bucket < kSubBuckets) {
+    return bucket;
+  }
+  int exponent = (bucket - kSubBuckets) / kSubBuckets + 3;
+  uint64_t sub = (bucket - kSubBuckets) % kSubBuckets;
+  return (kSubBuckets + sub) << (exponent - 3);
+}
+
+void LatencyHistogram::Record(std::chrono::nanoseconds latency) {
+  uint64_t nanos = latency.count() > 0 ? latency.count() : 0;
+  buckets_[BucketOf(nanos)].fetch_add(1, std::memory_order_relaxed);
+  count_.fetch_add(1, std::memory_order_relaxed);
+  sum_.fetch_add(nanos, std::memory_order_relaxed);
+  uint64_t max = max_.load(std::memory_order_relaxed);
+  while (nanos > max && !max_.compare_exchange_weak(
+                            max, nanos, std::memory_order_relaxed)) {
+  }
+}
+
+LatencySummary LatencyHistogram::Summarize() const {
+  // Copy the buckets first so the percentiles agree with one total
+  std::array<uint64_t, kBuckets> counts;
+  uint64_t total = 0;
+  for (int i = 0; i < kBuckets; i++) {
+    counts[i] = buckets_[i].load(std::memory_order_relaxed);
+    total += counts[i];
+  }
+
+  LatencySummary summary;
+  summary.count = total;
+  summary.sum =
+      std::chrono::nanoseconds(sum_.load(std::memory_order_relaxed));
+  summary.max =
+      std::chrono::nanoseconds(max_.load(std::memory_order_relaxed));
+  if (total == 0) {
+    return summary;
+  }
+
+  std::chrono::nanoseconds* targets[] = {&summary.p50, &summary.p99,
+                                         &summary.p999};
+  uint64_t seen = 0;
+  size_t next = 0;
+  for (int i = 0; i < kBuckets && next < 3; i++) {
+    seen += counts[i];
+    while (next < 3 &&
+           seen >= std::max<uint64_t>(
+                       1, static_cast<uint64_t>(
+                              std::ceil(kQuantiles[next] * total)))) {
+      uint64_t start = BucketStart(i);
+      uint64_t width = i + 1 < kBuckets ? BucketStart(i + 1) - start : 1;
+      uint64_t mid = std::min<uint64_t>(start + width / 2, summary.max.count());
+      *targets[next++] = std::chrono::nanoseconds(mid);
+    }
+  }
+  return summary;
+}
+
+void RateWindow::Add(uint64_t bytes, int64_t second) {
+  constexpr uint64_t kCountMask = (uint64_t{1} << kCountBits) - 1;
+  uint64_t tag = static_cast<uint64_t>(second) & ((1u << kTagBits) - 1);
+  auto& slot = slots_[second % kSlots];
+  uint64_t old = slot.load(std::memory_order_relaxed);
+  uint64_t updated;
+  do {
+    uint64_t count = (old >> kCountBits) == tag ? old & kCountMask : 0;
+    updated = tag << kCountBits | ((count + bytes) & kCountMask);
+  } while (!slot.compare_exchange_weak(old, updated,
+                                       std::memory_order_relaxed));
+}
+
+double RateWindow::PerSecond(int64_t second) const {
+  constexpr uint64_t kCountMask = (uint64_t{1} << kCountBits) - 1;
+  int64_t window = std::min<int64_t>(kWindowSeconds, second);
+  if (window <= 0) {
+    return 0;
+  }
+  uint64_t bytes = 0;
+  for (int64_t s = second - window; s < second; s++) {
+    uint64_t tag = static_cast<uint64_t>(s) & ((1u << kTagBits) - 1);
+    uint64_t value = slots_[s % kSlots].load(std::memory_order_relaxed);
+    if ((value >> kCountBits) == tag) {
+      bytes += value & kCountMask;
+    }
+  }
+  return static_cast<double>(bytes) / window;
+}
+
+ServerStats::ServerStats() : start_(Clock::now()) {}
+
+ServerStats::~ServerStats() { StopWritingFile(); }
+
+int64_t ServerStats::SecondsSinceStart() const {
+  return std::chrono::duration_cast<std::chrono::seconds>(Clock::now() -
+                                                          start_)
+      .count();
+}
+
+void ServerStats::CallStarted(RpcMethod method) {
+  rpcs_[static_cast<size_t>(method)].active.fetch_add(
+      1, std::memory_order_relaxed);
+}
+
+void ServerStats::CallFinished(RpcMethod method,
+                               std::chrono::nanoseconds duration, bool ok) {
+  auto& rpc = rpcs_[static_cast<size_t>(method)];
+  rpc.active.fetch_sub(1, std::memory_order_relaxed);
+  rpc.calls.fetch_add(1, std::memory_order_relaxed);
+  if (!ok) {
+    rpc.errors.fetch_add(1, std::memory_order_relaxed);
+  }
+  rpc.latency.Record(duration);
+}
+
+void ServerStats::BytesSent(RpcMethod method, size_t bytes) {
+  auto& rpc = rpcs_[static_cast<size_t>(method)];
+  rpc.bytes_sent.fetch_add(bytes, std::memory_order_relaxed);
+  rpc.sent_rate.Add(bytes, SecondsSinceStart());
+}
+
+void ServerStats::RecordStage(StreamStage stage,
+                              std::chrono::nanoseconds latency) {
+  stages_[static_cast<size_t>(stage)].Record(latency);
+}
+
+ServerStatsSnapshot ServerStats::Snapshot() const {
+  ServerStatsSnapshot snapshot;
+  snapshot.uptime = std::chrono::duration_cast<std::chrono::milliseconds>(
+      Clock::now() - start_);
+  int64_t second = SecondsSinceStart();
+  for (size_t i = 0; i < kMethods; i++) {
+    const auto& rpc = rpcs_[i];
+    RpcStatsSnapshot stats;
+    stats.method = static_cast<RpcMethod>(i);
+    stats.calls = rpc.calls.load(std::memory_order_relaxed);
+    stats.errors = rpc.errors.load(std::memory_order_relaxed);
+    stats.active = rpc.active.load(std::memory_order_relaxed);
+    stats.latency = rpc.latency.Summarize();
+    stats.bytes_sent = rpc.bytes_sent.load(std::memory_order_relaxed);
+    stats.bytes_per_sec = rpc.sent_rate.PerSecond(second);
+    snapshot.rpcs.push_back(stats);
+  }
+  for (size_t i = 0; i < kStages; i++) {
+    snapshot.stages.push_back(
+        {static_cast<StreamStage>(i), stages_[i].Summarize()});
+  }
+  return snapshot;
+}
+
+void ServerStats::Print(const ServerStatsSnapshot& snapshot,
+                        std::ostream& out) {
+  out << "Uptime: " << snapshot.uptime.count() / 1000 << " s" << std::endl;
+  out << std::left << std::setw(18) << "RPC" << std::right << std::setw(9)
+      << "calls" << std::setw(8) << "errors" << std::setw(8) << "active"
+      << std::setw(10) << "p50 ms" << std::setw(10) << "p99 ms"
+      << std::setw(10) << "p999 ms" << std::setw(10) << "max ms"
+      << std::setw(10) << "MB/s" << std::endl;
+  for (const auto& rpc : snapshot.rpcs) {
+    out << std::left << std::setw(18) << RpcMethodName(rpc.method)
+        << std::right << std::setw(9) << rpc.calls << std::setw(8)
+        << rpc.errors << std::setw(8) << rpc.active << std::fixed
+        << std::setprecision(3) << std::setw(10) << Millis(rpc.latency.p50)
+        << std::setw(10) << Millis(rpc.latency.p99) << std::setw(10)
+        << Millis(rpc.latency.p999) << std::setw(10)
+        << Millis(rpc.latency.max) << std::setprecision(2) << std::setw(10)
+        << rpc.bytes_per_sec / (1024 * 1024) << std::endl;
+  }
+  out << std::left << std::setw(18) << "Stream stage" << std::right
+      << std::setw(9) << "count" << std::setw(16) << "" << std::setw(10)
+      << "p50 ms" << std::setw(10) << "p99 ms" << std::setw(10) << "p999 ms"
+      << std::setw(10) << "max ms" << std::endl;
+  for (const auto& stage : snapshot.stages) {
+    out << std::left << std::setw(18) << StreamStageName(stage.stage)
+        << std::right << std::setw(9) << stage.latency.count << std::setw(16)
+        << "" << std::fixed << std::setprecision(3) << std::setw(10)
+        << Millis(stage.latency.p50) << std::setw(10)
+        << Millis(stage.latency.p99) << std::setw(10)
+        << Millis(stage.latency.p999) << std::setw(10)
+        << Millis(stage.latency.max) << std::endl;
+  }
+  out.unsetf(std::ios::floatfield);
+}
+
+std::string ServerStats::FormatPrometheus(
+    const ServerStatsSnapshot& snapshot) {
+  std::ostringstream out;
+  out << std::setprecision(9);
+
+  WriteHeader(out, "music262_uptime_seconds", "gauge",
+              "Time since the server started.");
+  out << "music262_uptime_seconds "
+      << std::chrono::duration<double>(snapshot.uptime).count() << "\n";
+
+  auto method_label = [](const RpcStatsSnapshot& rpc) {
+    return std::string("method=\"") + RpcMethodName(rpc.method) + "\"";
+  };
+
+  WriteHeader(out, "music262_rpc_calls_total", "counter",
+              "Calls finished, by RPC.");
+  for (const auto& rpc : snapshot.rpcs) {
+    out << "music262_rpc_calls_total{" << method_label(rpc) << "} "
+        << rpc.calls << "\n";
+  }
+  WriteHeader(out, "music262_rpc_errors_total", "counter",
+              "Calls finished with an error status, by RPC.");
+  for (const auto& rpc : snapshot.rpcs) {
+    out << "music262_rpc_errors_total{" << method_label(rpc) << "} "
+        << rpc.errors << "\n";
+  }
+  WriteHeader(out, "music262_rpc_active", "gauge",
+              "Calls in progress, by RPC.");
+  for (const auto& rpc : snapshot.rpcs) {
+    out << "music262_rpc_active{" << method_label(rpc) << "} " << rpc.active
+        << "\n";
+  }
+  WriteHeader(out, "music262_rpc_latency_seconds", "summary",
+              "Time from the request to the call finishing, by RPC.");
+  for (const auto& rpc : snapshot.rpcs) {
+    WriteSummary(out, "music262_rpc_latency_seconds", method_label(rpc) + ",",
+                 rpc.latency);
+  }
+  WriteHeader(out, "music262_rpc_sent_bytes_total", "counter",
+              "Payload bytes streamed, by RPC.");
+  for (const auto& rpc : snapshot.rpcs) {
+    out << "music262_rpc_sent_bytes_total{" << method_label(rpc) << "} "
+        << rpc.bytes_sent << "\n";
+  }
+  WriteHeader(out, "music262_rpc_sent_bytes_per_second", "gauge",
+              "Payload bytes streamed per second over the last seconds.");
+  for (const auto& rpc : snapshot.rpcs) {
+    out << "music262_rpc_sent_bytes_per_second{" << method_label(rpc) << "} "
+        << rpc.bytes_per_sec << "\n";
+  }
+  WriteHeader(out, "music262_stream_stage_latency_seconds", "summary",
+              "Time taken by each step of streaming a song.");
+  for (const auto& stage : snapshot.stages) {
+    WriteSummary(out, "music262_stream_stage_latency_seconds",
+                 std::string("stage=\"") + StreamStageName(stage.stage) +
+                     "\",",
+                 stage.latency);
+  }
+  return out.str();
+}
+
+bool ServerStats::WritePrometheusFile(const std::string& path) const {
+  std::string temporary = path + ".tmp";
+  {
+    std::ofstream file(temporary, std::ios::trunc);
+    file << FormatPrometheus(Snapshot());
+    if (!file) {
+      LOG_WARN("Could not write metrics to {}", temporary);
+      return false;
+    }
+  }
+  if (std::rename(temporary.c_str(), path.c_str()) != 0) {
+    LOG_WARN("Could not replace metrics file {}", path);
+    std::remove(temporary.c_str());
+    return false;
+  }
+  return true;
+}
+
+void ServerStats::StartWritingFile(const std::string& path,
+                                   std::chrono::milliseconds interval) {
+  StopWritingFile();
+  stop_writer_ = false;
+  writer_thread_ = std::thread([this, path, interval]() {
+    std::unique_lock<std::mutex> lock(writer_mutex_);
+    while (!stop_writer_) {
+      writer_cv_.wait_for(lock, interval, [this] { return stop_writer_; });
+      lock.unlock();
+      WritePrometheusFile(path);
+      lock.lock();
+    }
+  });
+  LOG_INFO("Writing metrics to {} every {} ms", path, interval.count());
+}
+
+void ServerStats::StopWritingFile() {
+  {
+    std::lock_guard<std::mutex> lock(writer_mutex_);
+    stop_writer_ = true;
+  }
+  writer_cv_.notify_all();
+  if (writer_thread_.joinable()) {
+    writer_thread_.join();
+  }
+}
@@ -0,0 +1,118 @@
+#include "include/song_cache.h"
+
+#include "../common/include/logger.h"
+
+SongCache::SongCache(size_t budget_bytes)
+    : budget_bytes_(budget_bytes),
+      bytes_used_(0),
+      hits_(0),
+      misses_(0),
+      evictions_(0) {}
+
+std::shared_ptr<const MappedSong> SongCache::Get(int song_num,
+                                                 const Loader& loader) {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = entries_.find(song_num);
+    if (it != entries_.end()) {
+      // Move the song to the front of the LRU list
+      lru_.splice(lru_.begin(), lru_, it->second.lru_position);
+      hits_++;
+      return it->second.song;
+    }
+    misses_++;
+  }
+
+  // Load outside the lock so a slow miss does not block cache hits
+  std::shared_ptr<const MappedSong> song = loader();
+  if (song) {
+    Insert(song_num, song);
+  }
+  return song;
+}
+
+void SongCache::Insert(int song_num, std::shared_ptr<const MappedSong> song) {
+  std::lock_guard<std::mutex> lock(mutex_);
+
+  // Another request may have loaded the same song in the meantime
+  if (entries_.count(song_num) > 0) {
+    return;
+  }
+
+  size_t size = song->size();
+  if (size > budget_bytes_) {
+    LOG_DEBUG("Song {} ({} bytes) exceeds the cache budget, not caching",
+              song_num, size);
+    return;
+  }
+
+  // Evict least recently used songs, skipping pinned ones
+  auto victim = lru_.end();
+  while (bytes_used_ + size > budget_bytes_ && victim != lru_.begin()) {
+    --victim;
+    if (pinned_.count(*victim) > 0) {
+      continue;
+    }
+
+    auto entry = entries_.find(*victim);
+    bytes_used_ -= entry->second.song->size();
+    LOG_DEBUG("Evicting song {} from cache", *victim);
+    entries_.erase(entry);
+    victim = lru_.erase(victim);
+    evictions_++;
+  }
+
+  if (bytes_used_ + size > budget_bytes_) {
+    LOG_DEBUG("Cache is full of pinned songs, not caching song {}", song_num);
+    return;
+  }
+
+  // Ask the kernel to bring the whole song into memory ahead of the stream
+  song->Prefetch();
+
+  lru_.push_front(song_num);
+  entries_[song_num] = Entry{std::move(song), lru_.begin()};
+  bytes_used_ += size;
+}
+
+void SongCache::Invalidate(int song_num) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto it = entries_.find(song_num);
+  if (it == entries_.end()) {
+    return;
+  }
+  bytes_used_ -= it->second.song->size();
+  lru_.erase(it->second.lru_position);
+  entries_.erase(it);
+}
+
+void SongCache::Pin(int song_num) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  pinned_.insert(song_num);
+}
+
+bool SongCache::Contains(int song_num) const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return entries_.count(song_num) > 0;
+}
+
+bool SongCache::HasRoomFor(size_t size) const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return bytes_used_ + size <= budget_bytes_;
+}
+
+SongCacheStats SongCache::GetStats() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+
+  SongCacheStats stats;
+  stats.hits = hits_;
+  stats.misses = misses_;
+  stats.evictions = evictions_;
+  stats.entries = entries_.size();
+  for (int song_num : pinned_) {
+    stats.pinned += entries_.count(song_num);
+  }
+  stats.bytes_used = bytes_used_;
+  stats.budget_bytes = budget_bytes_;
+  return stats;
+}
@@ -0,0 +1,721 @@
+#include "include/song_catalog.h"
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/inotify.h>
+#endif
+
+#include <algorithm>
+#include <cerrno>
+#include <condition_variable>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <set>
+#include <unordered_map>
+#include <unordered_set>
+
+#include "../common/include/logger.h"
+#include "include/wav_format.h"
+
+namespace fs = std::filesystem;
+
+namespace {
+
+// Enough for the format chunk and the usual metadata chunks before "data"
+constexpr size_t kHeaderBytes = 64 * 1024;
+
+// The catalog file is a header, one fixed-size record per song in id order
+// and the song names. It is a local cache, so it uses host byte order.
+constexpr char kCatalogMagic[8] = {'M', '2', '6', '2', 'C', 'A', 'T', '1'};
+
+struct CatalogFileHeader {
+  char magic[8];
+  uint32_t count;         // Number of records
+  int32_t next_id;        // Id the next new song gets
+  uint64_t strings_size;  // Bytes of names after the records
+  uint64_t reserved;
+};
+
+struct CatalogRecord {
+  int32_t id;
+  uint32_t name_offset;  // Offset of the name in the names
+  uint32_t name_size;
+  uint16_t channels;
+  uint16_t bits_per_sample;
+  uint64_t size;
+  int64_t mtime_ns;
+  uint32_t sample_rate;
+  uint32_t reserved;
+  uint64_t duration_ms;
+};
+
+static_assert(sizeof(CatalogFileHeader) == 32, "unexpected header layout");
+static_assert(sizeof(CatalogRecord) == 48, "unexpected record layout");
+
+#ifdef __linux__
+constexpr uint32_t kWatchMask = IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM |
+                                IN_CREATE | IN_DELETE | IN_ATTRIB |
+                                IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR;
+#endif
+
+bool IsSongName(const std::string& name) {
+  fs::path path(name);
+  std::string file = path.filename().string();
+  return !file.empty() && file[0] != '.' && path.extension() == ".wav";
+}
+
+int64_t MtimeNs(const struct stat& st) {
+#ifdef __APPLE__
+  return static_cast<int64_t>(st.st_mtimespec.tv_sec) * 1000000000 +
+         st.st_mtimespec.tv_nsec;
+#else
+  return static_cast<int64_t>(st.st_mtim.tv_sec) * 1000000000 +
+         st.st_mtim.tv_nsec;
+#endif
+}
+
+std::string JoinPath(const std::string& directory, const std::string& name) {
+  return directory.empty() ? name : directory + "/" + name;
+}
+
+// Fill in the size and modification time of a song, false if it is missing
+// or not a song
+bool StatSong(const std::string& root, const std::string& name,
+              SongMetadata* song) {
+  struct stat st;
+  if (!IsSongName(name) || stat((root + "/" + name).c_str(), &st) != 0 ||
+      !S_ISREG(st.st_mode)) {
+    return false;
+  }
+  song->name = name;
+  song->size = static_cast<size_t>(st.st_size);
+  song->mtime_ns = MtimeNs(st);
+  return true;
+}
+
+// List one directory of the tree. Hidden entries are skipped and symbolic
+// links to directories are not followed.
+bool ListDirectory(const std::string& root, const std::string& relative,
+                   std::vector<SongMetadata>* songs,
+                   std::vector<std::string>* directories) {
+  std::string path = relative.empty() ? root : root + "/" + relative;
+  DIR* dir = opendir(path.c_str());
+  if (dir == nullptr) {
+    return false;
+  }
+
+  int fd = dirfd(dir);
+  while (dirent* entry = readdir(dir)) {
+    const char* name = entry->d_name;
+    if (name[0] == '.') {
+      continue;
+    }
+    std::string child = JoinPath(relative, name);
+
+    struct stat st;
+    bool is_directory = entry->d_type == DT_DIR;
+    if (entry->d_type == DT_UNKNOWN) {
+      is_directory = fstatat(fd, name, &st, AT_SYMLINK_NOFOLLOW) == 0 &&
+                     S_ISDIR(st.st_mode);
+    }
+    if (is_directory) {
+      directories->push_back(std::move(child));
+      continue;
+    }
+
+    if (!IsSongName(child) || fstatat(fd, name, &st, 0) != 0 ||
+        !S_ISREG(st.st_mode)) {
+      continue;
+    }
+    SongMetadata song;
+    song.name = std::move(child);
+    song.size = static_cast<size_t>(st.st_size);
+    song.mtime_ns = MtimeNs(st);
+    songs->push_back(std::move(song));
+  }
+  closedir(dir);
+  return true;
+}
+
+// Run fn(0) ... fn(count - 1) on up to `threads` threads
+void ParallelFor(size_t count, int threads,
+                 const std::function<void(size_t)>& fn) {
+  std::atomic<size_t> next{0};
+  auto worker = [&]() {
+    size_t i;
+    while ((i = next.fetch_add(1)) < count) {
+      fn(i);
+    }
+  };
+
+  size_t num_threads =
+      std::min(count, static_cast<size_t>(std::max(1, threads)));
+  std::vector<std::thread> workers;
+  for (size_t t = 1; t < num_threads; t++) {
+    workers.emplace_back(worker);
+  }
+  worker();
+  for (auto& thread : workers) {
+    thread.join();
+  }
+}
+
+}  // namespace
+
+const SongMetadata* CatalogSnapshot::Find(int id) const {
+  auto it = std::lower_bound(
+      songs.begin(), songs.end(), id,
+      [](const SongMetadata& song, int id) { return song.id < id; });
+  return it != songs.end() && it->id == id ? &*it : nullptr;
+}
+
+SongCatalog::SongCatalog(const std::string& directory,
+                         const SongCatalogOptions& options)
+    : directory_(directory),
+      options_(options),
+      snapshot_(std::make_shared<const CatalogSnapshot>()) {
+  if (!fs::is_directory(directory_)) {
+    LOG_ERROR("Directory does not exist: {}", directory_);
+    return;
+  }
+  if (!options_.catalog_file.empty()) {
+    // The directory is reconciled with the file later, off the startup path
+    loaded_from_file_ = Load();
+    return;
+  }
+  Rescan();
+}
+
+SongCatalog::~SongCatalog() { StopWatching(); }
+
+std::shared_ptr<const CatalogSnapshot> SongCatalog::Snapshot() const {
+  return std::atomic_load(&snapshot_);
+}
+
+void SongCatalog::SetChangeListener(ChangeListener listener) {
+  std::lock_guard<std::mutex> lock(update_mutex_);
+  listener_ = std::move(listener);
+}
+
+size_t SongCatalog::Rescan() { return Rescan(nullptr); }
+
+size_t SongCatalog::Rescan(const DirectoryVisitor& visit) {
+  std::vector<SongMetadata> songs;
+  if (!Walk(&songs, visit)) {
+    LOG_ERROR("Cannot list {}", directory_);
+    return 0;
+  }
+
+  // New songs are numbered in name order
+  std::sort(songs.begin(), songs.end(),
+            [](const SongMetadata& a, const SongMetadata& b) {
+              return a.name < b.name;
+            });
+  return Apply(std::move(songs), {}, true);
+}
+
+size_t SongCatalog::Refresh(const std::vector<std::string>& names) {
+  std::vector<SongMetadata> present;
+  std::vector<std::string> gone;
+  std::set<std::string> seen;
+  for (const auto& name : names) {
+    if (!seen.insert(name).second) {
+      continue;
+    }
+    SongMetadata song;
+    if (StatSong(directory_, name, &song)) {
+      present.push_back(std::move(song));
+    } else {
+      gone.push_back(name);
+    }
+  }
+  return Apply(std::move(present), gone, false);
+}
+
+bool SongCatalog::Walk(std::vector<SongMetadata>* songs,
+                       const DirectoryVisitor& visit) const {
+  // Directories are listed by a pool of threads sharing a stack of
+  // directories still to list. The walk ends when the stack is empty and no
+  // thread is listing a directory that could add to it.
+  std::mutex mutex;
+  std::condition_variable cv;
+  std::vector<std::string> pending = {""};
+  size_t listing = 0;
+  bool root_listed = false;
+
+  auto worker = [&]() {
+    std::vector<SongMetadata> found;
+    std::unique_lock<std::mutex> lock(mutex);
+    while (true) {
+      cv.wait(lock, [&] { return !pending.empty() || listing == 0; });
+      if (pending.empty()) {
+        break;
+      }
+      std::string relative = std::move(pending.back());
+      pending.pop_back();
+      listing++;
+      lock.unlock();
+
+      if (visit) {
+        visit(relative);
+      }
+      std::vector<std::string> subdirectories;
+      bool listed =
+          ListDirectory(directory_, relative, &found, &subdirectories);
+      if (!listed && !relative.empty()) {
+        LOG_WARN("Cannot list {}/{}", directory_, relative);
+      }
+
+      lock.lock();
+      listing--;
+      if (relative.empty()) {
+        root_listed = listed;
+      }
+      for (auto& subdirectory : subdirectories) {
+        pending.push_back(std::move(subdirectory));
+      }
+      cv.notify_all();
+    }
+    songs->insert(songs->end(), std::make_move_iterator(found.begin()),
+                  std::make_move_iterator(found.end()));
+  };
+
+  std::vector<std::thread> workers;
+  for (int t = 1; t < options_.scan_threads; t++) {
+    workers.emplace_back(worker);
+  }
+  worker();
+  for (auto& thread : workers) {
+    thread.join();
+  }
+  return root_listed;
+}
+
+void SongCatalog::ReadFormat(SongMetadata* song) const {
+  // Only the header is read, the samples stay on disk until streamed.
+  // Files without a usable format are still listed and served as they are.
+  std::string path = directory_ + "/" + song->name;
+  std::vector<char> header(std::min(kHeaderBytes, song->size));
+  ssize_t bytes = -1;
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd >= 0) {
+    bytes = header.empty() ? 0 : pread(fd, header.data(), header.size(), 0);
+    close(fd);
+  }
+
+  WavFormat format;
+  if (bytes > 0 && ParseWavFormat(header.data(), static_cast<size_t>(bytes),
+                                  song->size, &format)) {
+    song->sample_rate = format.sample_rate;
+    song->channels = format.channels;
+    song->bits_per_sample = format.bits_per_sample;
+    song->duration_ms = format.duration_ms();
+  } else {
+    LOG_WARN("Cannot read the format of {}", path);
+  }
+}
+
+size_t SongCatalog::Apply(std::vector<SongMetadata> present,
+                          const std::vector<std::string>& gone,
+                          bool remove_others) {
+  std::lock_guard<std::mutex> lock(update_mutex_);
+  std::shared_ptr<const CatalogSnapshot> current = Snapshot();
+
+  std::map<int, SongMetadata> songs;
+  std::unordered_map<std::string, int> live_ids;
+  live_ids.reserve(current->songs.size());
+  for (const auto& song : current->songs) {
+    songs[song.id] = song;
+    live_ids[song.name] = song.id;
+  }
+
+  std::unordered_set<std::string> names;
+  if (remove_others) {
+    names.reserve(present.size());
+    for (const auto& song : present) {
+      names.insert(song.name);
+    }
+  }
+
+  // Only new files and files whose size or modification time changed have
+  // their header read, in parallel since each read waits on storage
+  std::vector<SongMetadata*> stale;
+  for (auto& song : present) {
+    auto live = live_ids.find(song.name);
+    if (live != live_ids.end()) {
+      const SongMetadata& known = songs[live->second];
+      if (known.size == song.size && known.mtime_ns == song.mtime_ns) {
+        continue;
+      }
+    }
+    stale.push_back(&song);
+  }
+  ParallelFor(stale.size(), options_.scan_threads,
+              [this, &stale](size_t i) { ReadFormat(stale[i]); });
+
+  std::vector<SongMetadata> changed;
+  for (SongMetadata* song : stale) {
+    auto live = live_ids.find(song->name);
+    if (live != live_ids.end()) {
+      song->id = live->second;
+    } else {
+      auto id = ids_.find(song->name);
+      song->id = id != ids_.end() ? id->second : next_id_++;
+      ids_[song->name] = song->id;
+    }
+    changed.push_back(*song);
+    songs[song->id] = std::move(*song);
+  }
+
+  auto remove = [&](int id) {
+    changed.push_back(std::move(songs[id]));
+    songs.erase(id);
+  };
+  for (const auto& name : gone) {
+    auto live = live_ids.find(name);
+    if (live != live_ids.end()) {
+      remove(live->second);
+    }
+  }
+  if (remove_others) {
+    for (const auto& [name, id] : live_ids) {
+      if (names.count(name) == 0) {
+        remove(id);
+      }
+    }
+  }
+
+  if (changed.empty()) {
+    return 0;
+  }
+
+  auto snapshot = std::make_shared<CatalogSnapshot>();
+  snapshot->version = current->version + 1;
+  snapshot->songs.reserve(songs.size());
+  for (auto& [id, song] : songs) {
+    snapshot->songs.push_back(std::move(song));
+  }
+  if (!options_.catalog_file.empty()) {
+    Save(*snapshot);
+  }
+  std::atomic_store(
+      &snapshot_, std::shared_ptr<const CatalogSnapshot>(std::move(snapshot)));
+  LOG_INFO("Catalog of {} updated: {} songs changed, {} songs available",
+           directory_, changed.size(), songs.size());
+
+  if (listener_) {
+    listener_(changed);
+  }
+  return changed.size();
+}
+
+bool SongCatalog::Load() {
+  const std::string& path = options_.catalog_file;
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0) {
+    LOG_INFO("No catalog file at {}, scanning {} in the background", path,
+             directory_);
+    return false;
+  }
+  struct stat st;
+  void* map = MAP_FAILED;
+  if (fstat(fd, &st) == 0 &&
+      static_cast<size_t>(st.st_size) >= sizeof(CatalogFileHeader)) {
+    map = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  }
+  close(fd);
+  if (map == MAP_FAILED) {
+    LOG_WARN("Ignoring unreadable catalog file {}", path);
+    return false;
+  }
+
+  const char* data = static_cast<const char*>(map);
+  size_t size = static_cast<size_t>(st.st_size);
+  CatalogFileHeader header;
+  std::memcpy(&header, data, sizeof(header));
+  size_t strings_offset =
+      sizeof(header) + size_t{header.count} * sizeof(CatalogRecord);
+  bool valid =
+      std::memcmp(header.magic, kCatalogMagic, sizeof(kCatalogMagic)) == 0 &&
+      strings_offset <= size && header.strings_size == size - strings_offset;
+
+  auto snapshot = std::make_shared<CatalogSnapshot>();
+  snapshot->version = 1;
+  snapshot->songs.reserve(valid ? header.count : 0);
+  for (uint32_t i = 0; valid && i < header.count; i++) {
+    CatalogRecord record;
+    std::memcpy(&record, data + sizeof(header) + i * sizeof(record),
+                sizeof(record));
+    int previous_id = snapshot->songs.empty() ? 0 : snapshot->songs.back().id;
+    valid = record.id > previous_id && record.id < header.next_id &&
+            uint64_t{record.name_offset} + record.name_size <=
+                header.strings_size;
+    if (!valid) {
+      break;
+    }
+    SongMetadata song;
+    song.id = record.id;
+    song.name.assign(data + strings_offset + record.name_offset,
+                     record.name_size);
+    song.size = record.size;
+    song.mtime_ns = record.mtime_ns;
+    song.sample_rate = record.sample_rate;
+    song.channels = record.channels;
+    song.bits_per_sample = record.bits_per_sample;
+    song.duration_ms = record.duration_ms;
+    snapshot->songs.push_back(std::move(song));
+  }
+  munmap(map, size);
+  if (!valid) {
+    LOG_WARN("Ignoring invalid catalog file {}", path);
+    return false;
+  }
+
+  std::lock_guard<std::mutex> lock(update_mutex_);
+  for (const auto& song : snapshot->songs) {
+    ids_[song.name] = song.id;
+  }
+  next_id_ = header.next_id;
+  LOG_INFO("Loaded {} songs from {}", snapshot->songs.size(), path);
+  std::atomic_store(
+      &snapshot_, std::shared_ptr<const CatalogSnapshot>(std::move(snapshot)));
+  return true;
+}
+
+bool SongCatalog::Save(const CatalogSnapshot& snapshot) const {
+  CatalogFileHeader header = {};
+  std::memcpy(header.magic, kCatalogMagic, sizeof(kCatalogMagic));
+  header.count = static_cast<uint32_t>(snapshot.songs.size());
+  header.next_id = next_id_;
+
+  std::vector<CatalogRecord> records;
+  records.reserve(snapshot.songs.size());
+  std::string names;
+  for (const auto& song : snapshot.songs) {
+    CatalogRecord record = {};
+    record.id = song.id;
+    record.name_offset = static_cast<uint32_t>(names.size());
+    record.name_size = static_cast<uint32_t>(song.name.size());
+    record.channels = song.channels;
+    record.bits_per_sample = song.bits_per_sample;
+    record.size = song.size;
+    record.mtime_ns = song.mtime_ns;
+    record.sample_rate = song.sample_rate;
+    record.duration_ms = song.duration_ms;
+    records.push_back(record);
+    names += song.name;
+  }
+  header.strings_size = names.size();
+
+  // Readers never see a partial file, a crash leaves the previous catalog
+  std::string temp = options_.catalog_file + ".tmp";
+  {
+    std::ofstream file(temp, std::ios::binary | std::ios::trunc);
+    file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    file.write(reinterpret_cast<const char*>(records.data()),
+               records.size() * sizeof(CatalogRecord));
+    file.write(names.data(), names.size());
+    if (!file) {
+      LOG_WARN("Cannot write the catalog file {}", temp);
+      return false;
+    }
+  }
+  std::error_code ec;
+  fs::rename(temp, options_.catalog_file, ec);
+  if (ec) {
+    LOG_WARN("Cannot replace the catalog file {}: {}", options_.catalog_file,
+             ec.message());
+    fs::remove(temp, ec);
+    return false;
+  }
+  return true;
+}
+
+bool SongCatalog::StartWatching() {
+  if (watch_thread_.joinable()) {
+    return true;
+  }
+  if (pipe(wake_fds_) != 0) {
+    LOG_ERROR("Cannot create the catalog watcher's wake-up pipe");
+    return false;
+  }
+
+  // The root is watched right away so no change is missed while the
+  // watcher reconciles the catalog and watches the subdirectories
+#ifdef __linux__
+  inotify_fd_ = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  int wd = inotify_fd_ >= 0 ? AddWatch("") : -1;
+  if (wd >= 0) {
+    watches_[wd] = "";
+  } else if (inotify_fd_ >= 0) {
+    close(inotify_fd_);
+    inotify_fd_ = -1;
+  }
+#endif
+  if (inotify_fd_ < 0) {
+    LOG_WARN("Cannot watch {}, rescanning it every {} ms", directory_,
+             kPollInterval.count());
+  }
+
+  stop_watching_ = false;
+  watch_thread_ = std::thread(&SongCatalog::WatchLoop, this);
+  LOG_INFO("Watching {} for new and changed songs", directory_);
+  return true;
+}
+
+void SongCatalog::StopWatching() {
+  if (!watch_thread_.joinable()) {
+    return;
+  }
+  stop_watching_ = true;
+  char wake = 0;
+  if (write(wake_fds_[1], &wake, 1) < 0) {
+    LOG_WARN("Cannot wake up the catalog watcher");
+  }
+  watch_thread_.join();
+
+  for (int* fd : {&inotify_fd_, &wake_fds_[0], &wake_fds_[1]}) {
+    if (*fd >= 0) {
+      close(*fd);
+      *fd = -1;
+    }
+  }
+  watches_.clear();
+}
+
+int SongCatalog::AddWatch(const std::string& directory) const {
+#ifdef __linux__
+  std::string path = directory.empty() ? directory_ : directory_ + "/" +
+                                                          directory;
+  return inotify_add_watch(inotify_fd_, path.c_str(), kWatchMask);
+#else
+  (void)directory;
+  return -1;
+#endif
+}
+
+void SongCatalog::RescanAndWatch() {
+#ifdef __linux__
+  if (inotify_fd_ < 0) {
+    Rescan();
+    return;
+  }
+
+  // Watching a directory again returns its existing watch, which then
+  // points at the directory's current path if it was moved
+  std::mutex mutex;
+  std::map<int, std::string> watches;
+  int error = 0;
+  Rescan([&](const std::string& directory) {
+    int wd = AddWatch(directory);
+    std::lock_guard<std::mutex> lock(mutex);
+    if (wd >= 0) {
+      watches[wd] = directory;
+    } else if (error == 0) {
+      error = errno;
+    }
+  });
+  if (watches.empty()) {
+    return;  // The root is gone, which its own events report
+  }
+
+  if (error != 0) {
+    // Usually the limit of watches per user, see max_user_watches
+    LOG_WARN("Cannot watch every directory of {}: {}, rescanning every {} ms",
+             directory_, std::strerror(error), kPollInterval.count());
+    close(inotify_fd_);
+    inotify_fd_ = -1;
+    watches_.clear();
+    return;
+  }
+  for (const auto& [wd, directory] : watches_) {
+    if (watches.count(wd) == 0) {
+      inotify_rm_watch(inotify_fd_, wd);
+    }
+  }
+  watches_.swap(watches);
+#else
+  Rescan();
+#endif
+}
+
+void SongCatalog::WatchLoop() {
+  // Pick up whatever changed since the catalog was built or saved
+  RescanAndWatch();
+
+  while (!stop_watching_) {
+    pollfd fds[2] = {{wake_fds_[0], POLLIN, 0}, {inotify_fd_, POLLIN, 0}};
+    int count = inotify_fd_ >= 0 ? 2 : 1;
+    int timeout =
+        inotify_fd_ >= 0 ? -1 : static_cast<int>(kPollInterval.count());
+    if (poll(fds, count, timeout) < 0 || stop_watching_) {
+      continue;
+    }
+    if (inotify_fd_ < 0) {
+      Rescan();
+      continue;
+    }
+    if (!(fds[1].revents & POLLIN)) {
+      continue;
+    }
+
+#ifdef __linux__
+    // Drain all pending events so a batch of files becomes one snapshot
+    std::vector<std::string> names;
+    bool rescan = false;
+    alignas(inotify_event) char buffer[16 * 1024];
+    ssize_t bytes;
+    while ((bytes = read(inotify_fd_, buffer, sizeof(buffer))) > 0) {
+      for (char* p = buffer; p < buffer + bytes;) {
+        auto* event = reinterpret_cast<inotify_event*>(p);
+        p += sizeof(inotify_event) + event->len;
+
+        auto watch = watches_.find(event->wd);
+        if (event->mask & IN_Q_OVERFLOW) {
+          rescan = true;
+        } else if (watch == watches_.end() ||
+                   (event->len > 0 && event->name[0] == '.')) {
+          continue;
+        } else if (event->mask & IN_IGNORED) {
+          watches_.erase(watch);
+        } else if (event->mask & (IN_DELETE_SELF | IN_MOVE_SELF)) {
+          // Subdirectories are handled through the events of their parent
+          if (!watch->second.empty()) {
+            continue;
+          }
+          LOG_WARN("Audio directory {} was removed, rescanning every {} ms",
+                   directory_, kPollInterval.count());
+          close(inotify_fd_);
+          inotify_fd_ = -1;
+          watches_.clear();
+          rescan = true;
+          break;
+        } else if (event->mask & IN_ISDIR) {
+          // New, moved and removed directories change which songs exist and
+          // which directories need a watch
+          rescan = rescan || (event->mask & (IN_CREATE | IN_MOVED_TO |
+                                             IN_MOVED_FROM | IN_DELETE));
+        } else if (event->len > 0 && !(event->mask & IN_CREATE)) {
+          // Files are picked up once written, not when created
+          names.push_back(JoinPath(watch->second, event->name));
+        }
+      }
+      if (inotify_fd_ < 0) {
+        break;
+      }
+    }
+
+    if (rescan) {
+      RescanAndWatch();
+    } else if (!names.empty()) {
+      Refresh(names);
+    }
+#endif
+  }
+}
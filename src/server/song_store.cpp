@@ -0,0 +1,177 @@
+#include "include/song_store.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstdio>
+
+#include "../common/include/logger.h"
+
+MappedSong::MappedSong(const std::string& path, const char* data, size_t size,
+                       int64_t mtime_ns)
+    : path_(path), data_(data), size_(size), mtime_ns_(mtime_ns) {
+  // FNV-1a over the path, size and modification time
+  uint64_t hash = 14695981039346656037ull;
+  auto mix = [&hash](const void* bytes, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+      hash ^= static_cast<const uint8_t*>(bytes)[i];
+      hash *= 1099511628211ull;
+    }
+  };
+  mix(path.data(), path.size());
+  mix(&size, sizeof(size));
+  mix(&mtime_ns, sizeof(mtime_ns));
+
+  char token[17];
+  snprintf(token, sizeof(token), "%016llx",
+           static_cast<unsigned long long>(hash));
+  resume_token_ = token;
+}
+
+MappedSong::~MappedSong() {
+  if (data_ && size_ > 0 && owned_.empty()) {
+    munmap(const_cast<char*>(data_), size_);
+  }
+  LOG_DEBUG("Unmapped song file: {}", path_);
+}
+
+void MappedSong::Prefetch() const {
+  if (data_ && size_ > 0 && owned_.empty()) {
+    madvise(const_cast<char*>(data_), size_, MADV_WILLNEED);
+  }
+}
+
+std::shared_ptr<const MappedSong> MappedSong::Open(const std::string& path,
+                                                 bool copy) {
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0) {
+    LOG_ERROR("Failed to open song file: {}", path);
+    return nullptr;
+  }
+
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    LOG_ERROR("Failed to stat song file: {}", path);
+    close(fd);
+    return nullptr;
+  }
+
+  size_t size = static_cast<size_t>(st.st_size);
+  const char* data = nullptr;
+  std::vector<char> bytes;
+  if (copy) {
+    // Stop early if the file shrinks while it is being read
+    bytes.resize(size);
+    size_t done = 0;
+    while (done < size) {
+      ssize_t n = pread(fd, bytes.data() + done, size - done, done);
+      if (n < 0 && errno == EINTR) {
+        continue;
+      }
+      if (n <= 0) {
+        break;
+      }
+      done += static_cast<size_t>(n);
+    }
+    bytes.resize(done);
+    size = done;
+  } else if (size > 0) {
+    void* addr = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+    if (addr == MAP_FAILED) {
+      LOG_ERROR("Failed to map song file: {}", path);
+      close(fd);
+      return nullptr;
+    }
+    // Songs are streamed front to back, let the kernel read ahead
+    madvise(addr, size, MADV_SEQUENTIAL);
+    data = static_cast<const char*>(addr);
+  }
+
+  // The mapping stays valid after the descriptor is closed
+  close(fd);
+
+  LOG_DEBUG("{} song file: {} ({} bytes)", copy ? "Copied" : "Mapped", path,
+            size);
+
+#ifdef __APPLE__
+  int64_t mtime_ns =
+      static_cast<int64_t>(st.st_mtimespec.tv_sec) * 1000000000 +
+      st.st_mtimespec.tv_nsec;
+#else
+  int64_t mtime_ns =
+      static_cast<int64_t>(st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec;
+#endif
+
+  auto song = std::shared_ptr<MappedSong>(
+      new MappedSong(path, copy ? bytes.data() : data, size, mtime_ns));
+  song->owned_ = std::move(bytes);
+  song->device_ = static_cast<uint64_t>(st.st_dev);
+  song->inode_ = static_cast<uint64_t>(st.st_ino);
+  return song;
+}
+
+std::shared_ptr<const MappedSong> MappedSong::Adopt(const std::string& name,
+                                                  std::vector<char> bytes,
+                                                  int64_t mtime_ns) {
+  auto song = std::shared_ptr<MappedSong>(
+      new MappedSong(name, bytes.data(), bytes.size(), mtime_ns));
+  song->owned_ = std::move(bytes);
+  return song;
+}
+
+std::shared_ptr<const MappedSong> SongStore::Get(const std::string& path) {
+  std::lock_guard<std::mutex> lock(mutex_);
+
+  auto it = songs_.find(path);
+  if (it != songs_.end()) {
+    if (auto song = it->second.song.lock()) {
+      return song;  // Already mapped by another stream
+    }
+  }
+
+  auto song = MappedSong::Open(path, rewritten_.count(path) > 0);
+  if (!song) {
+    songs_.erase(path);
+    return nullptr;
+  }
+
+  songs_[path] = {song, song->device(), song->inode()};
+  return song;
+}
+
+void SongStore::Forget(const std::string& path) {
+  std::lock_guard<std::mutex> lock(mutex_);
+
+  auto it = songs_.find(path);
+  if (it == songs_.end()) {
+    return;
+  }
+
+  // A rename gives the path a new inode, a rewrite in place keeps the old one
+  struct stat st;
+  if (stat(path.c_str(), &st) == 0 &&
+      static_cast<uint64_t>(st.st_dev) == it->second.device &&
+      static_cast<uint64_t>(st.st_ino) == it->second.inode &&
+      rewritten_.insert(path).second) {
+    LOG_WARN(
+        "Song file was rewritten in place, replace songs by renaming a new "
+        "file over them; copying it from now on: {}",
+        path);
+  }
+  songs_.erase(it);
+}
+
+size_t SongStore::MappedCount() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+
+  size_t count = 0;
+  for (const auto& [path, entry] : songs_) {
+    if (!entry.song.expired()) {
+      count++;
+    }
+  }
+  return count;
+}
@@ -0,0 +1,183 @@
+#include "include/transcode_cache.h"
+
+#include <chrono>
+#include <future>
+#include <string>
+#include <vector>
+
+#include "../common/include/logger.h"
+
+TranscodeCache::TranscodeCache(size_t budget_bytes)
+    : budget_bytes_(budget_bytes) {}
+
+bool TranscodeCache::Get(int song_num,
+                         const std::shared_ptr<const MappedSong>& song,
+                         const music262::PcmFormat& format, WorkQueue* workers,
+                         std::shared_ptr<const MappedSong>* converted,
+                         Done done) {
+  Key key = MakeKey(song_num, format);
+  const std::string& token = song->resume_token();
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = entries_.find(key);
+    if (it != entries_.end() && it->second.source_token == token) {
+      lru_.splice(lru_.begin(), lru_, it->second.lru_position);
+      hits_++;
+      *converted = it->second.song;
+      return true;
+    }
+    if (it != entries_.end()) {
+      EraseLocked(it);  // Converted from an older version of the song
+    }
+
+    // Join the same conversion rather than running it twice
+    auto& waiters = converting_[std::make_pair(key, token)];
+    waiters.push_back(std::move(done));
+    if (waiters.size() > 1) {
+      hits_++;
+      return false;
+    }
+  }
+
+  // Convert outside the lock so other songs and formats are still served
+  auto convert = [this, key, song, format]() {
+    RunConversion(key, song, format);
+  };
+  if (!workers || !workers->Submit(convert)) {
+    convert();
+  }
+  return false;
+}
+
+std::shared_ptr<const MappedSong> TranscodeCache::Get(
+    int song_num, const std::shared_ptr<const MappedSong>& song,
+    const music262::PcmFormat& format) {
+  // Shared, as the converting thread may still be in set_value when the
+  // result is read
+  auto promise =
+      std::make_shared<std::promise<std::shared_ptr<const MappedSong>>>();
+  auto result = promise->get_future();
+  std::shared_ptr<const MappedSong> converted;
+  if (Get(song_num, song, format, nullptr, &converted,
+          [promise](std::shared_ptr<const MappedSong> song) {
+            promise->set_value(std::move(song));
+          })) {
+    return converted;
+  }
+  return result.get();
+}
+
+void TranscodeCache::RunConversion(const Key& key,
+                                   std::shared_ptr<const MappedSong> song,
+                                   const music262::PcmFormat& format) {
+  std::shared_ptr<const MappedSong> converted = Convert(*song, format);
+
+  std::vector<Done> waiters;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto running = converting_.find(std::make_pair(key, song->resume_token()));
+    if (running != converting_.end()) {
+      waiters.swap(running->second);
+      converting_.erase(running);
+    }
+    if (converted) {
+      conversions_++;
+      InsertLocked(key, song->resume_token(), converted);
+    } else {
+      failures_++;
+    }
+  }
+  for (auto& done : waiters) {
+    if (done) {
+      done(converted);
+    }
+  }
+}
+
+void TranscodeCache::Invalidate(int song_num) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto it = entries_.lower_bound(Key(song_num, 0, 0, 0));
+  while (it != entries_.end() && std::get<0>(it->first) == song_num) {
+    EraseLocked(it++);
+  }
+}
+
+void TranscodeCache::SetBudget(size_t budget_bytes) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  budget_bytes_ = budget_bytes;
+  EvictLocked(0);
+}
+
+TranscodeCacheStats TranscodeCache::GetStats() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+
+  TranscodeCacheStats stats;
+  stats.hits = hits_;
+  stats.conversions = conversions_;
+  stats.failures = failures_;
+  stats.evictions = evictions_;
+  stats.entries = entries_.size();
+  stats.bytes_used = bytes_used_;
+  stats.budget_bytes = budget_bytes_;
+  return stats;
+}
+
+TranscodeCache::Key TranscodeCache::MakeKey(
+    int song_num, const music262::PcmFormat& format) {
+  return Key(song_num, static_cast<int>(format.sample_format),
+             format.sample_rate, format.channels);
+}
+
+std::shared_ptr<const MappedSong> TranscodeCache::Convert(
+    const MappedSong& song, const music262::PcmFormat& format) {
+  auto start = std::chrono::steady_clock::now();
+  std::vector<char> converted;
+  if (!music262::ConvertPcm(song.data(), song.size(), format, &converted)) {
+    LOG_WARN("Cannot convert {} to {} Hz, {} channels", song.path(),
+             format.sample_rate, format.channels);
+    return nullptr;
+  }
+  auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(
+      std::chrono::steady_clock::now() - start);
+
+  // Every format gets its own resume token, the same one each time the
+  // same version of the song is converted
+  std::string name =
+      song.path() + "#" +
+      (format.sample_format == music262::PcmSampleFormat::kFloat32 ? "f32"
+                                                                  : "s16") +
+      "-" + std::to_string(format.sample_rate) + "-" +
+      std::to_string(format.channels);
+  LOG_INFO("Converted {} ({} bytes) in {} ms", name, converted.size(),
+           elapsed.count());
+  return MappedSong::Adopt(name, std::move(converted), song.mtime_ns());
+}
+
+void TranscodeCache::InsertLocked(const Key& key,
+                                  const std::string& source_token,
+                                  std::shared_ptr<const MappedSong> song) {
+  // Another version converted in the meantime, the next Get sorts it out
+  if (entries_.count(key) > 0 || song->size() > budget_bytes_) {
+    return;
+  }
+  EvictLocked(song->size());
+  lru_.push_front(key);
+  bytes_used_ += song->size();
+  entries_[key] = Entry{std::move(song), source_token, lru_.begin()};
+}
+
+void TranscodeCache::EvictLocked(size_t incoming) {
+  while (bytes_used_ + incoming > budget_bytes_ && !lru_.empty()) {
+    auto victim = entries_.find(lru_.back());
+    LOG_DEBUG("Evicting converted song {} from the transcode cache",
+              victim->second.song->path());
+    EraseLocked(victim);
+    evictions_++;
+  }
+}
+
+void TranscodeCache::EraseLocked(std::map<Key, Entry>::iterator it) {
+  bytes_used_ -= it->second.song->size();
+  lru_.erase(it->second.lru_position);
+  entries_.erase(it);
+}
@@ -0,0 +1,58 @@
+#include "include/work_queue.h"
+
+#include <algorithm>
+
+WorkQueue::WorkQueue(int threads) {
+  for (int i = 0; i < std::max(1, threads); i++) {
+    threads_.emplace_back(&WorkQueue::Run, this);
+  }
+}
+
+WorkQueue::~WorkQueue() { Shutdown(); }
+
+bool WorkQueue::Submit(Job job) {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (shut_down_) {
+      return false;
+    }
+    jobs_.push_back(std::move(job));
+  }
+  cv_.notify_one();
+  return true;
+}
+
+void WorkQueue::Shutdown() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    shut_down_ = true;
+  }
+  cv_.notify_all();
+  for (auto& thread : threads_) {
+    if (thread.joinable()) {
+      thread.join();
+    }
+  }
+  threads_.clear();
+}
+
+size_t WorkQueue::queued() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return jobs_.size();
+}
+
+void WorkQueue::Run() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  while (true) {
+    cv_.wait(lock, [this]() { return shut_down_ || !jobs_.empty(); });
+    if (jobs_.empty()) {
+      break;  // Shut down and drained
+    }
+    Job job = std::move(jobs_.front());
+    jobs_.pop_front();
+    lock.unlock();
+    job();
+    job = nullptr;  // Release what the job holds before locking again
+    lock.lock();
+  }
+}
@@ -1,6 +1,8 @@
 #include "../testlib/include/test_utils.h"
 #include <thread>
 #include <chrono>
+#include <cstring>
+#include <vector>
 
 // Use the base test fixture for AudioPlayer tests
 class AudioPlayerCallbackTest : public AudioPlayerTestBase {};
@@ -86,6 +88,51 @@ TEST_F(AudioPlayerCallbackTest, SimulatePlaybackUntilEnd) {
     std::remove(testFilePath.c_str());
 }
 
+TEST_F(AudioPlayerCallbackTest, SimulateFloatPlayback) {
+    // A float song, as converted by the server to the device's format
+    const int frames = 64;
+    WavHeader header = {};
+    std::memcpy(header.riff, "RIFF", 4);
+    std::memcpy(header.wave, "WAVE", 4);
+    std::memcpy(header.fmt, "fmt ", 4);
+    std::memcpy(header.data, "data", 4);
+    header.fileSize = sizeof(WavHeader) - 8 + frames * 2 * sizeof(float);
+    header.fmtSize = 16;
+    header.audioFormat = kWavFormatFloat;
+    header.numChannels = 2;
+    header.sampleRate = 48000;
+    header.byteRate = 48000 * 2 * sizeof(float);
+    header.blockAlign = 2 * sizeof(float);
+    header.bitsPerSample = 32;
+    header.dataSize = frames * 2 * sizeof(float);
+
+    std::vector<float> samples(frames * 2);
+    for (size_t i = 0; i < samples.size(); ++i) {
+        samples[i] = (static_cast<float>(i) - frames) / (2 * frames);
+    }
+    std::vector<char> song(sizeof(WavHeader) + header.dataSize);
+    std::memcpy(song.data(), &header, sizeof(WavHeader));
+    std::memcpy(song.data() + sizeof(WavHeader), samples.data(), header.dataSize);
+    ASSERT_TRUE(player->loadFromMemory(song.data(), song.size()));
+    player->play();
+
+    AudioUnitRenderActionFlags flags = 0;
+    AudioTimeStamp timestamp = {};
+    std::vector<float> output(frames * 2, 1.0f);
+    AudioBufferList bufferList = {};
+    bufferList.mNumberBuffers = 1;
+    bufferList.mBuffers[0].mNumberChannels = 2;
+    bufferList.mBuffers[0].mDataByteSize = output.size() * sizeof(float);
+    bufferList.mBuffers[0].mData = output.data();
+
+    OSStatus status = MockRenderCallback(player.get(), &flags, &timestamp, 0, frames, &bufferList);
+    EXPECT_EQ(status, noErr);
+
+    // The samples reach the device unchanged
+    EXPECT_EQ(output, samples);
+    EXPECT_EQ(player->get_position(), sizeof(WavHeader) + header.dataSize);
+}
+
 int main(int argc, char **argv) {
     testing::InitGoogleTest(&argc, argv);
     return RUN_ALL_TESTS();
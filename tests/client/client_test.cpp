@@ -2,20 +2,36 @@
 #include "client/include/audio_service_interface.h"
 #include "client/include/peer_service_interface.h"
 #include "../testlib/include/test_utils.h"
+#include "client/include/wavheader.h"
+#include "common/include/content_hash.h"
 
 #include <gtest/gtest.h>
 #include <gmock/gmock.h>
 
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <filesystem>
 #include <memory>
 #include <string>
+#include <thread>
 #include <vector>
 
 // Mock implementation of the AudioServiceInterface for testing
 class MockAudioService : public music262::AudioServiceInterface {
 public:
     MOCK_METHOD(std::vector<std::string>, GetPlaylist, (), (override));
+    MOCK_METHOD(std::vector<music262::SongInfo>, GetPlaylistInfo, (), (override));
     MOCK_METHOD(bool, LoadAudio, (int song_num, music262::AudioChunkCallback callback), (override));
+    MOCK_METHOD(bool, PrefetchAudio, (int song_num, std::vector<char>* data, const std::atomic<bool>& cancel), (override));
+    MOCK_METHOD(void, HintNextSongs, (const std::vector<int>& song_nums), (override));
+    MOCK_METHOD(bool, LoadAudioRange, (int song_num, int64_t offset, int64_t length, music262::AudioChunkCallback callback), (override));
+    MOCK_METHOD(bool, GetSegmentIndex, (int song_num, music262::AudioSegmentIndex* index), (override));
+    MOCK_METHOD(bool, LoadSegment, (int song_num, const music262::AudioSegment& segment, const std::string& resume_token, std::vector<char>* data), (override));
     MOCK_METHOD(std::vector<std::string>, GetPeerClientIPs, (), (override));
+    MOCK_METHOD(void, Advertise, (const music262::PeerAdvertisement& advertisement), (override));
+    MOCK_METHOD(bool, WatchPeers, (uint64_t epoch, uint64_t sequence, music262::PeerUpdateCallback callback), (override));
+    MOCK_METHOD(void, StopWatchingPeers, (), (override));
     MOCK_METHOD(bool, IsServerConnected, (), (override));
 };
 
@@ -128,6 +144,130 @@ TEST_F(AudioClientTest, LoadAudioFailure) {
     EXPECT_TRUE(client->GetAudioData().empty());
 }
 
+// Test that a song whose content hash matches the loaded buffer is not
+// downloaded again
+TEST_F(AudioClientTest, SkipsDownloadWhenHashMatches) {
+    SetupLoadAudioTest(true);
+    std::vector<char> test_data(1024, 'A');
+    music262::SongInfo song{"song1.wav", 1024,
+                            music262::ContentHash(test_data.data(), test_data.size())};
+    ON_CALL(*mock_audio_service_ptr, GetPlaylistInfo())
+        .WillByDefault(testing::Return(std::vector<music262::SongInfo>{song}));
+
+    // Only the first load transfers the song
+    EXPECT_CALL(*mock_audio_service_ptr, LoadAudio(1, testing::_)).Times(1);
+    client->LoadAudio(1);
+    client->LoadAudio(1);
+    EXPECT_EQ(client->GetAudioData(), test_data);
+}
+
+// Test that a song is downloaded again when its content hash changed or is
+// unknown
+TEST_F(AudioClientTest, DownloadsWhenHashDiffers) {
+    SetupLoadAudioTest(true);
+    music262::SongInfo song{"song1.wav", 1024, 0x1234};
+    music262::SongInfo unhashed{"song1.wav", 0, 0};
+    EXPECT_CALL(*mock_audio_service_ptr, GetPlaylistInfo())
+        .WillOnce(testing::Return(std::vector<music262::SongInfo>{song}))
+        .WillOnce(testing::Return(std::vector<music262::SongInfo>{song}))
+        .WillOnce(testing::Return(std::vector<music262::SongInfo>{unhashed}));
+
+    EXPECT_CALL(*mock_audio_service_ptr, LoadAudio(1, testing::_)).Times(3);
+    client->LoadAudio(1);
+    client->LoadAudio(1);
+    client->LoadAudio(1);
+}
+
+// Test that downloaded songs are stored in the disk cache and that cached
+// songs are played without contacting the server
+TEST_F(AudioClientTest, PlaysSongsFromDiskCache) {
+    auto cache_dir = std::filesystem::temp_directory_path() / "music262_client_cache_test";
+    std::filesystem::remove_all(cache_dir);
+    auto disk_cache = std::make_shared<SongDiskCache>(cache_dir.string(), 1 << 20);
+    client->SetDiskCache(disk_cache);
+
+    // A downloaded song is cached under its content hash
+    SetupLoadAudioTest(true);
+    std::vector<char> downloaded(1024, 'A');
+    music262::SongInfo song1{"song1.wav", 1024,
+                             music262::ContentHash(downloaded.data(), downloaded.size())};
+
+    // A valid WAV file that is already cached
+    WavHeader header = {};
+    std::memcpy(header.riff, "RIFF", 4);
+    std::memcpy(header.wave, "WAVE", 4);
+    std::vector<char> cached(sizeof(WavHeader) + 4096, 'B');
+    std::memcpy(cached.data(), &header, sizeof(header));
+    uint64_t cached_hash = music262::ContentHash(cached.data(), cached.size());
+    ASSERT_TRUE(disk_cache->Put(cached_hash, cached.data(), cached.size()));
+    music262::SongInfo song2{"song2.wav", static_cast<int64_t>(cached.size()), cached_hash};
+
+    ON_CALL(*mock_audio_service_ptr, GetPlaylistInfo())
+        .WillByDefault(testing::Return(std::vector<music262::SongInfo>{song1, song2}));
+    EXPECT_CALL(*mock_audio_service_ptr, LoadAudio(1, testing::_)).Times(1);
+    EXPECT_CALL(*mock_audio_service_ptr, LoadAudio(2, testing::_)).Times(0);
+
+    client->LoadAudio(1);
+    EXPECT_NE(disk_cache->Get(song1.content_hash, 1024), nullptr);
+
+    // The cached song is played in place, without a copy
+    client->LoadAudio(2);
+    EXPECT_TRUE(client->GetAudioData().empty());
+    EXPECT_TRUE(client->GetPlayer().get_audio_data().empty());
+    EXPECT_EQ(client->GetPlayer().get_sample_size(), 4096u);
+    EXPECT_EQ(client->GetPlayer().get_sample_data()[0], 'B');
+
+    client.reset();
+    std::filesystem::remove_all(cache_dir);
+}
+
+// Test that the song after the one playing is prefetched and then played
+// without being downloaded again
+TEST_F(AudioClientTest, PlaysPrefetchedSong) {
+    WavHeader header = {};
+    std::memcpy(header.riff, "RIFF", 4);
+    std::memcpy(header.wave, "WAVE", 4);
+    std::vector<char> downloaded(sizeof(WavHeader) + 4096, 'A');
+    std::memcpy(downloaded.data(), &header, sizeof(header));
+    std::vector<char> prefetched(sizeof(WavHeader) + 4096, 'C');
+    std::memcpy(prefetched.data(), &header, sizeof(header));
+    music262::SongInfo song1{"song1.wav", static_cast<int64_t>(downloaded.size()),
+                             music262::ContentHash(downloaded.data(), downloaded.size())};
+    music262::SongInfo song2{"song2.wav", static_cast<int64_t>(prefetched.size()),
+                             music262::ContentHash(prefetched.data(), prefetched.size())};
+
+    ON_CALL(*mock_audio_service_ptr, GetPlaylistInfo())
+        .WillByDefault(testing::Return(std::vector<music262::SongInfo>{song1, song2}));
+    ON_CALL(*mock_audio_service_ptr, LoadAudio(1, testing::_))
+        .WillByDefault([&downloaded](int, music262::AudioChunkCallback callback) {
+            callback(downloaded);
+            return true;
+        });
+    ON_CALL(*mock_audio_service_ptr, PrefetchAudio(2, testing::_, testing::_))
+        .WillByDefault([&prefetched](int, std::vector<char>* data,
+                                     const std::atomic<bool>&) {
+            *data = prefetched;
+            return true;
+        });
+    // Playing song 2 goes on to hint song 1
+    EXPECT_CALL(*mock_audio_service_ptr, HintNextSongs(testing::_)).Times(testing::AnyNumber());
+    EXPECT_CALL(*mock_audio_service_ptr, HintNextSongs(std::vector<int>{2}));
+    EXPECT_CALL(*mock_audio_service_ptr, LoadAudio(1, testing::_)).Times(1);
+    EXPECT_CALL(*mock_audio_service_ptr, LoadAudio(2, testing::_)).Times(0);
+
+    client->EnablePrefetch(1, 1 << 20);
+    ASSERT_TRUE(client->LoadAudio(1));
+    for (int i = 0; i < 500 && client->GetPrefetchStats().fetched == 0; i++) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    ASSERT_EQ(client->GetPrefetchStats().fetched, 1u);
+
+    ASSERT_TRUE(client->LoadAudio(2));
+    EXPECT_EQ(client->GetAudioData(), prefetched);
+    EXPECT_EQ(client->GetPrefetchStats().hits, 1u);
+    EXPECT_EQ(client->GetPrefetchStats().bytes_used, 0u);
+}
+
 // Test peer sync flag functionality
 TEST_F(AudioClientTest, PeerSyncFlagControl) {
     // Default should be disabled
@@ -26,8 +26,17 @@ public:
 class MockAudioService : public music262::AudioServiceInterface {
 public:
     MOCK_METHOD(std::vector<std::string>, GetPlaylist, (), (override));
+    MOCK_METHOD(std::vector<music262::SongInfo>, GetPlaylistInfo, (), (override));
     MOCK_METHOD(bool, LoadAudio, (int song_num, music262::AudioChunkCallback callback), (override));
+    MOCK_METHOD(bool, PrefetchAudio, (int song_num, std::vector<char>* data, const std::atomic<bool>& cancel), (override));
+    MOCK_METHOD(void, HintNextSongs, (const std::vector<int>& song_nums), (override));
+    MOCK_METHOD(bool, LoadAudioRange, (int song_num, int64_t offset, int64_t length, music262::AudioChunkCallback callback), (override));
+    MOCK_METHOD(bool, GetSegmentIndex, (int song_num, music262::AudioSegmentIndex* index), (override));
+    MOCK_METHOD(bool, LoadSegment, (int song_num, const music262::AudioSegment& segment, const std::string& resume_token, std::vector<char>* data), (override));
     MOCK_METHOD(std::vector<std::string>, GetPeerClientIPs, (), (override));
+    MOCK_METHOD(void, Advertise, (const music262::PeerAdvertisement& advertisement), (override));
+    MOCK_METHOD(bool, WatchPeers, (uint64_t epoch, uint64_t sequence, music262::PeerUpdateCallback callback), (override));
+    MOCK_METHOD(void, StopWatchingPeers, (), (override));
     MOCK_METHOD(bool, IsServerConnected, (), (override));
 };
 
@@ -391,6 +400,49 @@ TEST_F(PeerNetworkTest, StartAndStopServer) {
     peer_network->StopServer();
 }
 
+// Test that server peer updates connect to joined peers, up to the limit,
+// and drop peers that left
+TEST_F(PeerNetworkTest, ApplyPeerUpdate) {
+    EXPECT_CALL(*mock_peer_service_ptr, Ping(testing::_, testing::_, testing::_))
+        .WillRepeatedly(testing::Return(true));
+    EXPECT_CALL(*mock_peer_service_ptr, Exit(testing::_))
+        .WillRepeatedly(testing::Return(true));
+
+    // The first update lists every peer on the server
+    music262::PeerUpdate update;
+    update.sequence = 10;
+    update.reset = true;
+    for (int i = 1; i <= 10; i++) {
+        update.joined.push_back("10.0.0." + std::to_string(i) + ":50052");
+    }
+    peer_network->ApplyPeerUpdate(update);
+    EXPECT_EQ(peer_network->GetKnownPeers().size(), 10u);
+    EXPECT_EQ(peer_network->GetConnectedPeers().size(), PeerNetwork::kDefaultMaxPeers);
+
+    // A connected peer leaving frees a slot for a known one
+    music262::PeerUpdate leave;
+    leave.sequence = 11;
+    leave.left = {"10.0.0.1:50052"};
+    peer_network->ApplyPeerUpdate(leave);
+    auto connected = peer_network->GetConnectedPeers();
+    EXPECT_EQ(connected.size(), PeerNetwork::kDefaultMaxPeers);
+    EXPECT_THAT(connected, testing::Not(testing::Contains("10.0.0.1:50052")));
+    EXPECT_THAT(connected, testing::Contains("10.0.0.9:50052"));
+    EXPECT_EQ(peer_network->GetKnownPeers().size(), 9u);
+
+    // A reset, e.g. after the server restarted, drops connected peers it
+    // no longer lists and fills their slots
+    music262::PeerUpdate reset;
+    reset.sequence = 1;
+    reset.reset = true;
+    reset.joined = {"10.0.0.2:50052", "10.0.0.20:50052"};
+    peer_network->ApplyPeerUpdate(reset);
+    EXPECT_THAT(peer_network->GetConnectedPeers(),
+                testing::UnorderedElementsAre("10.0.0.2:50052",
+                                              "10.0.0.20:50052"));
+    EXPECT_EQ(peer_network->GetKnownPeers().size(), 2u);
+}
+
 int main(int argc, char** argv) {
     ::testing::InitGoogleTest(&argc, argv);
     return RUN_ALL_TESTS();
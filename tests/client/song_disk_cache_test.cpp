@@ -0,0 +1,147 @@
+#include "client/include/song_disk_cache.h"
+
+#include <gtest/gtest.h>
+
+#include <filesystem>
+#include <fstream>
+#include <string>
+#include <vector>
+
+namespace fs = std::filesystem;
+
+class SongDiskCacheTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    test_dir_ = fs::temp_directory_path() / "music262_song_disk_cache_test";
+    fs::remove_all(test_dir_);
+  }
+
+  void TearDown() override { fs::remove_all(test_dir_); }
+
+  static std::vector<char> song(size_t size, char fill) {
+    return std::vector<char>(size, fill);
+  }
+
+  bool contains(SongDiskCache& cache, uint64_t hash, size_t size) {
+    return cache.Get(hash, size) != nullptr;
+  }
+
+  fs::path test_dir_;
+};
+
+TEST_F(SongDiskCacheTest, PutThenGetMapsTheSong) {
+  SongDiskCache cache(test_dir_.string(), 1 << 20);
+  auto data = song(1000, 'a');
+  ASSERT_TRUE(cache.Put(0x1234, data.data(), data.size()));
+
+  auto cached = cache.Get(0x1234, data.size());
+  ASSERT_NE(cached, nullptr);
+  ASSERT_EQ(cached->size(), data.size());
+  EXPECT_EQ(std::vector<char>(cached->data(), cached->data() + cached->size()),
+            data);
+  EXPECT_TRUE(fs::exists(test_dir_ / "0000000000001234.wav"));
+  EXPECT_EQ(cache.entries(), 1u);
+  EXPECT_EQ(cache.bytes_used(), data.size());
+}
+
+TEST_F(SongDiskCacheTest, MissesUnknownSongs) {
+  SongDiskCache cache(test_dir_.string(), 1 << 20);
+  EXPECT_EQ(cache.Get(0x1234, 1000), nullptr);
+}
+
+TEST_F(SongDiskCacheTest, DropsSongsWithTheWrongSize) {
+  SongDiskCache cache(test_dir_.string(), 1 << 20);
+  auto data = song(1000, 'a');
+  ASSERT_TRUE(cache.Put(0x1234, data.data(), data.size()));
+
+  EXPECT_EQ(cache.Get(0x1234, 999), nullptr);
+  EXPECT_EQ(cache.entries(), 0u);
+  EXPECT_FALSE(fs::exists(test_dir_ / "0000000000001234.wav"));
+}
+
+TEST_F(SongDiskCacheTest, EvictsLeastRecentlyUsedSongs) {
+  SongDiskCache cache(test_dir_.string(), 3000);
+  auto data = song(1000, 'a');
+  cache.Put(1, data.data(), data.size());
+  cache.Put(2, data.data(), data.size());
+  cache.Put(3, data.data(), data.size());
+
+  // Song 1 becomes the most recently used, so song 2 is evicted
+  ASSERT_TRUE(contains(cache, 1, data.size()));
+  cache.Put(4, data.data(), data.size());
+
+  EXPECT_TRUE(contains(cache, 1, data.size()));
+  EXPECT_FALSE(contains(cache, 2, data.size()));
+  EXPECT_TRUE(contains(cache, 3, data.size()));
+  EXPECT_TRUE(contains(cache, 4, data.size()));
+  EXPECT_EQ(cache.bytes_used(), 3000u);
+}
+
+TEST_F(SongDiskCacheTest, ContainsLeavesTheRecencyOrderAlone) {
+  SongDiskCache cache(test_dir_.string(), 2000);
+  auto data = song(1000, 'a');
+  cache.Put(1, data.data(), data.size());
+  cache.Put(2, data.data(), data.size());
+  auto path = test_dir_ / "0000000000000001.wav";
+  auto written = fs::last_write_time(path);
+
+  EXPECT_TRUE(cache.Contains(1, data.size()));
+  EXPECT_FALSE(cache.Contains(1, data.size() - 1));
+  EXPECT_FALSE(cache.Contains(3, data.size()));
+  EXPECT_EQ(fs::last_write_time(path), written);
+
+  // Song 1 is still the least recently used, so it is evicted
+  cache.Put(3, data.data(), data.size());
+  EXPECT_FALSE(cache.Contains(1, data.size()));
+  EXPECT_TRUE(cache.Contains(2, data.size()));
+  EXPECT_EQ(cache.entries(), 2u);
+}
+
+TEST_F(SongDiskCacheTest, RejectsSongsLargerThanTheBudget) {
+  SongDiskCache cache(test_dir_.string(), 1000);
+  auto data = song(1001, 'a');
+  EXPECT_FALSE(cache.Put(1, data.data(), data.size()));
+  EXPECT_EQ(cache.entries(), 0u);
+}
+
+TEST_F(SongDiskCacheTest, MappingOutlivesEviction) {
+  SongDiskCache cache(test_dir_.string(), 1000);
+  auto first = song(1000, 'a');
+  auto second = song(1000, 'b');
+  cache.Put(1, first.data(), first.size());
+  auto cached = cache.Get(1, first.size());
+  ASSERT_NE(cached, nullptr);
+
+  cache.Put(2, second.data(), second.size());
+  EXPECT_FALSE(contains(cache, 1, first.size()));
+  EXPECT_EQ(cached->data()[999], 'a');
+}
+
+TEST_F(SongDiskCacheTest, PersistsAcrossInstances) {
+  auto data = song(1000, 'a');
+  {
+    SongDiskCache cache(test_dir_.string(), 1 << 20);
+    cache.Put(0xabcdef, data.data(), data.size());
+  }
+  // Leftovers of an interrupted write are removed
+  std::ofstream(test_dir_ / "0000000000000001.wav.tmp") << "partial";
+
+  SongDiskCache cache(test_dir_.string(), 1 << 20);
+  EXPECT_EQ(cache.entries(), 1u);
+  EXPECT_EQ(cache.bytes_used(), data.size());
+  EXPECT_TRUE(contains(cache, 0xabcdef, data.size()));
+  EXPECT_FALSE(fs::exists(test_dir_ / "0000000000000001.wav.tmp"));
+}
+
+TEST_F(SongDiskCacheTest, ShrinksToASmallerBudgetOnOpen) {
+  auto data = song(1000, 'a');
+  {
+    SongDiskCache cache(test_dir_.string(), 1 << 20);
+    cache.Put(1, data.data(), data.size());
+    cache.Put(2, data.data(), data.size());
+  }
+
+  SongDiskCache cache(test_dir_.string(), 1500);
+  EXPECT_EQ(cache.entries(), 1u);
+  EXPECT_LE(cache.bytes_used(), 1500u);
+}
@@ -0,0 +1,168 @@
+#include "client/include/song_prefetcher.h"
+
+#include <gmock/gmock.h>
+#include <gtest/gtest.h>
+
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <string>
+#include <thread>
+#include <vector>
+
+using music262::AudioChunkCallback;
+using music262::SongInfo;
+using ::testing::_;
+
+namespace {
+
+class MockAudioService : public music262::AudioServiceInterface {
+ public:
+  MOCK_METHOD(std::vector<std::string>, GetPlaylist, (), (override));
+  MOCK_METHOD(std::vector<SongInfo>, GetPlaylistInfo, (), (override));
+  MOCK_METHOD(bool, LoadAudio, (int song_num, AudioChunkCallback callback),
+              (override));
+  MOCK_METHOD(bool, PrefetchAudio,
+              (int song_num, std::vector<char>* data,
+               const std::atomic<bool>& cancel),
+              (override));
+  MOCK_METHOD(void, HintNextSongs, (const std::vector<int>& song_nums),
+              (override));
+  MOCK_METHOD(bool, LoadAudioRange,
+              (int song_num, int64_t offset, int64_t length,
+               AudioChunkCallback callback),
+              (override));
+  MOCK_METHOD(bool, GetSegmentIndex,
+              (int song_num, music262::AudioSegmentIndex* index), (override));
+  MOCK_METHOD(bool, LoadSegment,
+              (int song_num, const music262::AudioSegment& segment,
+               const std::string& resume_token, std::vector<char>* data),
+              (override));
+  MOCK_METHOD(std::vector<std::string>, GetPeerClientIPs, (), (override));
+  MOCK_METHOD(void, Advertise,
+              (const music262::PeerAdvertisement& advertisement), (override));
+  MOCK_METHOD(bool, WatchPeers,
+              (uint64_t epoch, uint64_t sequence,
+               music262::PeerUpdateCallback callback),
+              (override));
+  MOCK_METHOD(void, StopWatchingPeers, (), (override));
+  MOCK_METHOD(bool, IsServerConnected, (), (override));
+};
+
+// Wait up to five seconds for a condition
+bool WaitFor(const std::function<bool()>& condition) {
+  for (int i = 0; i < 500 && !condition(); i++) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  }
+  return condition();
+}
+
+// Song n of the test playlists holds its size in bytes of 'a' + n
+std::vector<char> SongData(int song_num, int64_t size) {
+  return std::vector<char>(static_cast<size_t>(size),
+                           static_cast<char>('a' + song_num));
+}
+
+}  // namespace
+
+class SongPrefetcherTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    ON_CALL(service_, GetPlaylistInfo()).WillByDefault([this]() {
+      return playlist_;
+    });
+    ON_CALL(service_, PrefetchAudio(_, _, _))
+        .WillByDefault([this](int song_num, std::vector<char>* data,
+                              const std::atomic<bool>&) {
+          *data = SongData(song_num, playlist_[song_num - 1].size);
+          return true;
+        });
+  }
+
+  std::vector<SongInfo> playlist_ = {
+      {"song1.wav", 100, 0}, {"song2.wav", 100, 0}, {"song3.wav", 100, 0}};
+  ::testing::NiceMock<MockAudioService> service_;
+};
+
+// Test that songs played after a song before are predicted first, followed
+// by the playlist order, skipping removed songs
+TEST_F(SongPrefetcherTest, PredictsLearnedThenPlaylistOrder) {
+  std::vector<SongInfo> playlist = {{"song1.wav", 1, 0},
+                                    {"song2.wav", 1, 0},
+                                    {"song3.wav", 1, 0},
+                                    {"", 0, 0},
+                                    {"song5.wav", 1, 0}};
+  playlist_.clear();
+  SongPrefetcher prefetcher(&service_, 3, 0);
+  EXPECT_EQ(prefetcher.Predict(3, playlist), (std::vector<int>{5, 1, 2}));
+
+  for (int song_num : {3, 1, 3, 2, 3, 2}) {
+    prefetcher.SongPlayed(song_num);
+  }
+  EXPECT_EQ(prefetcher.Predict(3, playlist), (std::vector<int>{2, 1, 5}));
+  EXPECT_EQ(prefetcher.Predict(5, playlist), (std::vector<int>{1, 2, 3}));
+}
+
+// Test that the predicted songs are hinted, downloaded and taken once
+TEST_F(SongPrefetcherTest, PrefetchesPredictedSongs) {
+  EXPECT_CALL(service_, HintNextSongs(std::vector<int>{2, 3}));
+  SongPrefetcher prefetcher(&service_, 2);
+  prefetcher.SongPlayed(1);
+  ASSERT_TRUE(WaitFor([&]() { return prefetcher.GetStats().fetched == 2; }));
+  EXPECT_EQ(prefetcher.GetStats().bytes_used, 200u);
+
+  std::vector<char> data;
+  ASSERT_TRUE(prefetcher.Take(2, &data));
+  EXPECT_EQ(data, SongData(2, 100));
+  EXPECT_FALSE(prefetcher.Take(2, &data));
+
+  PrefetchStats stats = prefetcher.GetStats();
+  EXPECT_EQ(stats.hits, 1u);
+  EXPECT_EQ(stats.misses, 1u);
+  EXPECT_EQ(stats.entries, 1u);
+  EXPECT_EQ(stats.bytes_used, 100u);
+}
+
+// Test that songs that do not fit the budget or are available locally are
+// not downloaded
+TEST_F(SongPrefetcherTest, SkipsSongsOverBudgetOrLocal) {
+  playlist_.push_back({"song4.wav", 100, 0});
+  playlist_[1].size = 400;
+  EXPECT_CALL(service_, PrefetchAudio(2, _, _)).Times(0);
+  EXPECT_CALL(service_, PrefetchAudio(3, _, _)).Times(0);
+  EXPECT_CALL(service_, PrefetchAudio(4, _, _));
+  SongPrefetcher prefetcher(&service_, 3, 300, [](const SongInfo& song) {
+    return song.name == "song3.wav";
+  });
+  prefetcher.SongPlayed(1);
+  ASSERT_TRUE(WaitFor([&]() { return prefetcher.GetStats().fetched == 1; }));
+
+  std::vector<char> data;
+  EXPECT_TRUE(prefetcher.Take(4, &data));
+  EXPECT_FALSE(prefetcher.Take(2, &data));
+}
+
+// Test that playing a song that was not predicted cancels the running
+// download
+TEST_F(SongPrefetcherTest, CancelsWhenAnotherSongIsPlayed) {
+  std::atomic<bool> started{false};
+  EXPECT_CALL(service_, PrefetchAudio(2, _, _))
+      .WillOnce([&started](int, std::vector<char>*,
+                           const std::atomic<bool>& cancel) {
+        started = true;
+        while (!cancel) {
+          std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+        return false;
+      });
+  SongPrefetcher prefetcher(&service_, 1);
+  prefetcher.SongPlayed(1);
+  ASSERT_TRUE(WaitFor([&]() { return started.load(); }));
+
+  std::vector<char> data;
+  EXPECT_FALSE(prefetcher.Take(3, &data));
+  ASSERT_TRUE(
+      WaitFor([&]() { return prefetcher.GetStats().cancelled == 1; }));
+  EXPECT_EQ(prefetcher.GetStats().misses, 1u);
+  EXPECT_EQ(prefetcher.GetStats().entries, 0u);
+}
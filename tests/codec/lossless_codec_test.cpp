@@ -0,0 +1,210 @@
+#include "codec/include/lossless_codec.h"
+
+#include <gtest/gtest.h>
+
+#include <cmath>
+#include <cstring>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "codec/include/lossless_format.h"
+#include "codec/include/lpc.h"
+
+using namespace music262;
+
+namespace {
+
+// Build a 16-bit PCM WAV file from interleaved samples
+std::vector<char> MakeWav(const std::vector<int16_t>& samples, int channels,
+                          const std::string& trailer = "") {
+  auto put32 = [](std::vector<char>& out, uint32_t v) {
+    for (int i = 0; i < 4; i++) out.push_back(static_cast<char>(v >> (8 * i)));
+  };
+  auto put16 = [](std::vector<char>& out, uint16_t v) {
+    out.push_back(static_cast<char>(v));
+    out.push_back(static_cast<char>(v >> 8));
+  };
+
+  uint32_t data_size = samples.size() * 2;
+  std::vector<char> wav;
+  wav.insert(wav.end(), {'R', 'I', 'F', 'F'});
+  put32(wav, 36 + data_size + trailer.size());
+  wav.insert(wav.end(), {'W', 'A', 'V', 'E', 'f', 'm', 't', ' '});
+  put32(wav, 16);
+  put16(wav, 1);
+  put16(wav, channels);
+  put32(wav, 44100);
+  put32(wav, 44100 * channels * 2);
+  put16(wav, channels * 2);
+  put16(wav, 16);
+  wav.insert(wav.end(), {'d', 'a', 't', 'a'});
+  put32(wav, data_size);
+  for (int16_t s : samples) put16(wav, static_cast<uint16_t>(s));
+  wav.insert(wav.end(), trailer.begin(), trailer.end());
+  return wav;
+}
+
+// A tonal stereo signal with a little noise, like typical music
+std::vector<int16_t> MakeMusic(size_t frames, int channels) {
+  std::mt19937 rng(42);
+  std::normal_distribution<double> noise(0, 30);
+  std::vector<int16_t> samples;
+  for (size_t i = 0; i < frames; i++) {
+    double t = i / 44100.0;
+    double tone = 8000 * std::sin(2 * M_PI * 220 * t) +
+                  3000 * std::sin(2 * M_PI * 330 * t + 0.5);
+    for (int ch = 0; ch < channels; ch++) {
+      double value = tone * (ch == 0 ? 1.0 : 0.8) + noise(rng);
+      samples.push_back(static_cast<int16_t>(std::lround(value)));
+    }
+  }
+  return samples;
+}
+
+std::vector<char> RoundTrip(const std::vector<char>& wav,
+                            unsigned threads = 0) {
+  std::vector<char> encoded;
+  EXPECT_TRUE(EncodeLossless(wav.data(), wav.size(), &encoded));
+  EXPECT_TRUE(IsLosslessStream(encoded.data(), encoded.size()));
+
+  std::vector<char> decoded;
+  EXPECT_TRUE(
+      DecodeLossless(encoded.data(), encoded.size(), &decoded, threads));
+  return decoded;
+}
+
+}  // namespace
+
+// Test that stereo music round-trips and compresses well
+TEST(LosslessCodecTest, StereoRoundTrip) {
+  std::vector<char> wav = MakeWav(MakeMusic(100000, 2), 2);
+  EXPECT_EQ(RoundTrip(wav), wav);
+
+  std::vector<char> encoded;
+  ASSERT_TRUE(EncodeLossless(wav.data(), wav.size(), &encoded));
+  EXPECT_LT(encoded.size(), wav.size() * 6 / 10);
+}
+
+// Test mono files and a partial last frame
+TEST(LosslessCodecTest, MonoRoundTrip) {
+  std::vector<char> wav = MakeWav(MakeMusic(12345, 1), 1);
+  EXPECT_EQ(RoundTrip(wav), wav);
+}
+
+// Test that worst-case signals survive: silence, full-scale noise and
+// full-scale square waves with opposite channels
+TEST(LosslessCodecTest, ExtremeSignals) {
+  std::vector<int16_t> silence(20000, 0);
+  EXPECT_EQ(RoundTrip(MakeWav(silence, 2)), MakeWav(silence, 2));
+
+  std::mt19937 rng(7);
+  std::uniform_int_distribution<int> full(-32768, 32767);
+  std::vector<int16_t> noise(40000);
+  for (auto& s : noise) s = static_cast<int16_t>(full(rng));
+  EXPECT_EQ(RoundTrip(MakeWav(noise, 2)), MakeWav(noise, 2));
+
+  std::vector<int16_t> square;
+  for (int i = 0; i < 20000; i++) {
+    int16_t high = (i / 50) % 2 ? 32767 : -32768;
+    square.push_back(high);
+    square.push_back(static_cast<int16_t>(-1 - high));
+  }
+  EXPECT_EQ(RoundTrip(MakeWav(square, 2)), MakeWav(square, 2));
+}
+
+// Test that bytes after the PCM data and empty files are preserved
+TEST(LosslessCodecTest, PreservesContainer) {
+  std::vector<char> wav = MakeWav(MakeMusic(5000, 2), 2, "LIST\4\0\0\0abcd");
+  EXPECT_EQ(RoundTrip(wav), wav);
+
+  std::vector<char> empty = MakeWav({}, 2);
+  EXPECT_EQ(RoundTrip(empty), empty);
+}
+
+// Test that the number of decoder threads does not change the output
+TEST(LosslessCodecTest, ParallelDecodeMatchesSerial) {
+  std::vector<char> wav = MakeWav(MakeMusic(300000, 2), 2);
+  std::vector<char> serial = RoundTrip(wav, 1);
+  EXPECT_EQ(serial, wav);
+  EXPECT_EQ(RoundTrip(wav, 8), serial);
+}
+
+// Test that unsupported and corrupt inputs are rejected
+TEST(LosslessCodecTest, RejectsBadInput) {
+  std::vector<char> wav = MakeWav(MakeMusic(1000, 1), 1);
+  wav[34] = 8;  // 8 bits per sample
+  std::vector<char> encoded;
+  EXPECT_FALSE(CanEncodeLossless(wav.data(), wav.size()));
+  EXPECT_FALSE(EncodeLossless(wav.data(), wav.size(), &encoded));
+
+  wav = MakeWav(MakeMusic(50000, 2), 2);
+  ASSERT_TRUE(EncodeLossless(wav.data(), wav.size(), &encoded));
+  std::vector<char> decoded;
+  EXPECT_FALSE(IsLosslessStream(wav.data(), wav.size()));
+  EXPECT_FALSE(DecodeLossless(wav.data(), wav.size(), &decoded));
+
+  // Truncated stream
+  EXPECT_FALSE(DecodeLossless(encoded.data(), encoded.size() / 2, &decoded));
+  EXPECT_TRUE(decoded.empty());
+}
+
+// Test that a flipped bit anywhere in the stream fails the decode
+TEST(LosslessCodecTest, DetectsCorruption) {
+  std::vector<char> wav = MakeWav(MakeMusic(50000, 2), 2, "LIST\4\0\0\0abcd");
+  std::vector<char> encoded;
+  ASSERT_TRUE(EncodeLossless(wav.data(), wav.size(), &encoded));
+
+  // In the copied WAV header, the frame table and the middle of a frame
+  for (size_t position : {size_t{60}, size_t{kStreamHeaderSize + 60},
+                          encoded.size() / 2, encoded.size() - 1}) {
+    std::vector<char> corrupt = encoded;
+    corrupt[position] ^= 0x10;
+    std::vector<char> decoded;
+    EXPECT_FALSE(DecodeLossless(corrupt.data(), corrupt.size(), &decoded))
+        << "flipped byte " << position;
+    EXPECT_TRUE(decoded.empty());
+  }
+}
+
+// Test that the identity of the source file is kept in the header
+TEST(LosslessCodecTest, StoresSource) {
+  std::vector<char> wav = MakeWav(MakeMusic(10000, 1), 1);
+  LosslessEncodeOptions options;
+  options.source = {wav.size(), 1234567890123, 0xfeedfacecafebeefull};
+  std::vector<char> encoded;
+  ASSERT_TRUE(EncodeLossless(wav.data(), wav.size(), &encoded, options));
+
+  LosslessSource source;
+  ASSERT_TRUE(ReadLosslessSource(encoded.data(), encoded.size(), &source));
+  EXPECT_EQ(source, options.source);
+  EXPECT_FALSE(ReadLosslessSource(wav.data(), wav.size(), &source));
+
+  std::vector<char> decoded;
+  ASSERT_TRUE(DecodeLossless(encoded.data(), encoded.size(), &decoded));
+  EXPECT_EQ(decoded, wav);
+}
+
+// Test that the vectorized reconstruction inverts the residual exactly
+TEST(LosslessCodecTest, RestoreSignalInvertsResidual) {
+  std::vector<int16_t> music = MakeMusic(4096, 1);
+  std::vector<int32_t> samples(music.begin(), music.end());
+
+  for (int order = 1; order <= kMaxLpcOrder; order++) {
+    int32_t coefs[kMaxLpcOrder];
+    int shift;
+    ASSERT_TRUE(
+        ComputeLpc(samples.data(), samples.size(), order, coefs, &shift));
+
+    std::vector<int32_t> residual(samples.size() - order);
+    ComputeResidual(samples.data(), samples.size(), order, coefs, shift,
+                    residual.data());
+
+    std::vector<int32_t> restored(samples.begin(), samples.begin() + order);
+    restored.resize(samples.size());
+    RestoreSignal(residual.data(), samples.size(), order, coefs, shift,
+                  restored.data());
+    EXPECT_EQ(restored, samples) << "order " << order << " using "
+                                 << CodecSimdPath();
+  }
+}
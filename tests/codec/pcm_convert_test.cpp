@@ -0,0 +1,236 @@
+#include "codec/include/pcm_convert.h"
+
+#include <gtest/gtest.h>
+
+#include <cmath>
+#include <cstring>
+#include <vector>
+
+using namespace music262;
+
+namespace {
+
+void Put(std::vector<char>& out, uint32_t value, int bytes) {
+  for (int i = 0; i < bytes; i++) {
+    out.push_back(static_cast<char>(value >> (8 * i)));
+  }
+}
+
+// Build a WAV file from interleaved samples in [-1, 1], stored as 16-bit or
+// 24-bit integers, or 32-bit floats
+std::vector<char> MakeWav(const std::vector<float>& samples, int channels,
+                          uint32_t rate, int bits, bool is_float = false) {
+  uint32_t data_size = samples.size() * bits / 8;
+  std::vector<char> wav;
+  wav.insert(wav.end(), {'R', 'I', 'F', 'F'});
+  Put(wav, 36 + data_size, 4);
+  wav.insert(wav.end(), {'W', 'A', 'V', 'E', 'f', 'm', 't', ' '});
+  Put(wav, 16, 4);
+  Put(wav, is_float ? 3 : 1, 2);
+  Put(wav, channels, 2);
+  Put(wav, rate, 4);
+  Put(wav, rate * channels * bits / 8, 4);
+  Put(wav, channels * bits / 8, 2);
+  Put(wav, bits, 2);
+  wav.insert(wav.end(), {'d', 'a', 't', 'a'});
+  Put(wav, data_size, 4);
+  for (float s : samples) {
+    if (is_float) {
+      uint32_t raw;
+      std::memcpy(&raw, &s, 4);
+      Put(wav, raw, 4);
+    } else {
+      double scale = bits == 16 ? 32767 : 8388607;
+      Put(wav, static_cast<uint32_t>(std::lround(s * scale)), bits / 8);
+    }
+  }
+  return wav;
+}
+
+std::vector<float> Sine(double frequency, uint32_t rate, size_t frames,
+                        int channels, double amplitude = 0.5) {
+  std::vector<float> samples;
+  for (size_t i = 0; i < frames; i++) {
+    float value = amplitude * std::sin(2 * M_PI * frequency * i / rate);
+    for (int ch = 0; ch < channels; ch++) {
+      samples.push_back(ch == 0 ? value : -value);
+    }
+  }
+  return samples;
+}
+
+uint32_t Get(const std::vector<char>& wav, size_t offset, int bytes) {
+  uint32_t value = 0;
+  for (int i = 0; i < bytes; i++) {
+    value |= static_cast<uint32_t>(static_cast<uint8_t>(wav[offset + i]))
+             << (8 * i);
+  }
+  return value;
+}
+
+// Samples of a converted float file
+std::vector<float> FloatSamples(const std::vector<char>& wav) {
+  std::vector<float> samples((wav.size() - 44) / 4);
+  std::memcpy(samples.data(), wav.data() + 44, samples.size() * 4);
+  return samples;
+}
+
+}  // namespace
+
+// Test that 16-bit samples become the floats a device plays
+TEST(PcmConvertTest, Int16ToFloat) {
+  std::vector<float> source = Sine(440, 44100, 1001, 2);
+  std::vector<char> wav = MakeWav(source, 2, 44100, 16);
+
+  PcmFormat target;
+  target.sample_format = PcmSampleFormat::kFloat32;
+  ASSERT_TRUE(CanConvertPcm(wav.data(), wav.size(), target));
+  std::vector<char> converted;
+  ASSERT_TRUE(ConvertPcm(wav.data(), wav.size(), target, &converted));
+
+  ASSERT_EQ(converted.size(), 44u + source.size() * 4);
+  EXPECT_EQ(std::memcmp(converted.data(), "RIFF", 4), 0);
+  EXPECT_EQ(Get(converted, 20, 2), 3u);  // IEEE float
+  EXPECT_EQ(Get(converted, 22, 2), 2u);
+  EXPECT_EQ(Get(converted, 24, 4), 44100u);
+  EXPECT_EQ(Get(converted, 32, 2), 8u);
+  EXPECT_EQ(Get(converted, 34, 2), 32u);
+  EXPECT_EQ(Get(converted, 40, 4), source.size() * 4);
+
+  std::vector<float> samples = FloatSamples(converted);
+  for (size_t i = 0; i < source.size(); i++) {
+    ASSERT_NEAR(samples[i], source[i], 1.0 / 16384) << i;
+  }
+}
+
+// Test that float and 24-bit sources come back as the same 16-bit samples
+TEST(PcmConvertTest, WiderSourcesToInt16) {
+  std::vector<float> source = Sine(1000, 48000, 999, 1, 0.9);
+  PcmFormat target;  // 16-bit, rate and channels kept
+
+  for (auto [bits, is_float] : {std::pair{24, false}, std::pair{32, true}}) {
+    std::vector<char> wav = MakeWav(source, 1, 48000, bits, is_float);
+    std::vector<char> converted;
+    ASSERT_TRUE(ConvertPcm(wav.data(), wav.size(), target, &converted));
+    ASSERT_EQ(converted.size(), 44u + source.size() * 2);
+    EXPECT_EQ(Get(converted, 20, 2), 1u);
+    EXPECT_EQ(Get(converted, 34, 2), 16u);
+    for (size_t i = 0; i < source.size(); i++) {
+      int16_t sample = static_cast<int16_t>(Get(converted, 44 + i * 2, 2));
+      ASSERT_NEAR(sample, source[i] * 32767, 1.0) << i;
+    }
+  }
+}
+
+// Test that out of range floats are clamped rather than wrapped
+TEST(PcmConvertTest, ClampsOnQuantizing) {
+  std::vector<float> source = {1.5f, -1.5f, 0.25f, -2.0f, 3.0f, 0.0f, 1.0f};
+  std::vector<char> wav = MakeWav(source, 1, 44100, 32, true);
+  std::vector<char> converted;
+  ASSERT_TRUE(ConvertPcm(wav.data(), wav.size(), PcmFormat(), &converted));
+
+  std::vector<int16_t> expected = {32767, -32768, 8192, -32768,
+                                   32767, 0,      32767};
+  for (size_t i = 0; i < expected.size(); i++) {
+    EXPECT_EQ(static_cast<int16_t>(Get(converted, 44 + i * 2, 2)),
+              expected[i]);
+  }
+}
+
+// Test that stereo is mixed down to mono and mono played on both channels
+TEST(PcmConvertTest, MixesChannels) {
+  std::vector<float> stereo;
+  for (int i = 0; i < 100; i++) {
+    stereo.push_back(0.5f);
+    stereo.push_back(-0.25f);
+  }
+  std::vector<char> wav = MakeWav(stereo, 2, 44100, 32, true);
+  PcmFormat mono;
+  mono.sample_format = PcmSampleFormat::kFloat32;
+  mono.channels = 1;
+  std::vector<char> converted;
+  ASSERT_TRUE(ConvertPcm(wav.data(), wav.size(), mono, &converted));
+  for (float sample : FloatSamples(converted)) {
+    ASSERT_FLOAT_EQ(sample, 0.125f);
+  }
+
+  std::vector<float> single = Sine(440, 44100, 100, 1);
+  wav = MakeWav(single, 1, 44100, 32, true);
+  PcmFormat stereo_format = mono;
+  stereo_format.channels = 2;
+  ASSERT_TRUE(ConvertPcm(wav.data(), wav.size(), stereo_format, &converted));
+  std::vector<float> samples = FloatSamples(converted);
+  ASSERT_EQ(samples.size(), 200u);
+  for (size_t i = 0; i < single.size(); i++) {
+    ASSERT_FLOAT_EQ(samples[i * 2], single[i]);
+    ASSERT_FLOAT_EQ(samples[i * 2 + 1], single[i]);
+  }
+}
+
+// Test that 44.1 kHz audio played by a 48 kHz device keeps its pitch and
+// level
+TEST(PcmConvertTest, Resamples44To48) {
+  std::vector<float> source = Sine(1000, 44100, 44100, 2);
+  std::vector<char> wav = MakeWav(source, 2, 44100, 16);
+  PcmFormat target;
+  target.sample_format = PcmSampleFormat::kFloat32;
+  target.sample_rate = 48000;
+  std::vector<char> converted;
+  ASSERT_TRUE(ConvertPcm(wav.data(), wav.size(), target, &converted));
+  EXPECT_EQ(Get(converted, 24, 4), 48000u);
+
+  std::vector<float> samples = FloatSamples(converted);
+  ASSERT_EQ(samples.size(), 48000u * 2);
+
+  // Away from the edges, the output is the same sine sampled at 48 kHz
+  std::vector<float> expected = Sine(1000, 48000, 48000, 2);
+  double worst = 0;
+  for (size_t i = 2000; i < samples.size() - 2000; i++) {
+    worst = std::max(worst, std::abs(double{samples[i]} - expected[i]));
+  }
+  EXPECT_LT(worst, 1e-3);
+}
+
+// Test that content above the new Nyquist frequency is filtered out when
+// downsampling, not folded back into the audible band
+TEST(PcmConvertTest, DownsamplingRemovesAliases) {
+  std::vector<float> source = Sine(23000, 48000, 48000, 1, 0.9);
+  std::vector<char> wav = MakeWav(source, 1, 48000, 32, true);
+  PcmFormat target;
+  target.sample_format = PcmSampleFormat::kFloat32;
+  target.sample_rate = 44100;
+  std::vector<char> converted;
+  ASSERT_TRUE(ConvertPcm(wav.data(), wav.size(), target, &converted));
+
+  std::vector<float> samples = FloatSamples(converted);
+  ASSERT_EQ(samples.size(), 44100u);
+  double peak = 0;
+  for (size_t i = 2000; i < samples.size() - 2000; i++) {
+    peak = std::max(peak, std::abs(double{samples[i]}));
+  }
+  EXPECT_LT(peak, 0.9 * 1e-3);  // At least 60 dB down
+}
+
+// Test that unsupported sources and targets are rejected
+TEST(PcmConvertTest, RejectsUnsupported) {
+  std::vector<float> source = Sine(440, 44100, 100, 2);
+  std::vector<char> wav = MakeWav(source, 2, 44100, 16);
+  std::vector<char> converted;
+
+  PcmFormat surround;
+  surround.channels = 6;
+  EXPECT_FALSE(CanConvertPcm(wav.data(), wav.size(), surround));
+  EXPECT_FALSE(ConvertPcm(wav.data(), wav.size(), surround, &converted));
+
+  // 44100 to 47999 Hz would need 47999 filter phases
+  PcmFormat odd_rate;
+  odd_rate.sample_rate = 47999;
+  EXPECT_FALSE(CanConvertPcm(wav.data(), wav.size(), odd_rate));
+
+  // 8-bit sources and files that are not WAV
+  std::vector<char> eight_bit = MakeWav(source, 2, 44100, 16);
+  eight_bit[34] = 8;
+  EXPECT_FALSE(CanConvertPcm(eight_bit.data(), eight_bit.size(), {}));
+  std::string text = "not a wav file";
+  EXPECT_FALSE(CanConvertPcm(text.data(), text.size(), {}));
+}
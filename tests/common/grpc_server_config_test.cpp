@@ -0,0 +1,165 @@
+#include "common/include/grpc_server_config.h"
+
+#include <grpcpp/generic/async_generic_service.h>
+#include <grpcpp/generic/generic_stub.h>
+#include <grpcpp/grpcpp.h>
+#include <gtest/gtest.h>
+#include <unistd.h>
+
+#include <filesystem>
+#include <fstream>
+#include <future>
+#include <string>
+#include <vector>
+
+using music262::GrpcServerConfig;
+
+namespace {
+
+// Answers every call with its request
+class EchoService : public grpc::CallbackGenericService {
+ public:
+  grpc::ServerGenericBidiReactor* CreateReactor(
+      grpc::GenericCallbackServerContext*) override {
+    return new Reactor();
+  }
+
+ private:
+  class Reactor : public grpc::ServerGenericBidiReactor {
+   public:
+    Reactor() { StartRead(&message_); }
+
+    void OnReadDone(bool ok) override {
+      if (ok) {
+        StartWriteAndFinish(&message_, grpc::WriteOptions(),
+                            grpc::Status::OK);
+      } else {
+        Finish(grpc::Status::OK);
+      }
+    }
+
+    void OnDone() override { delete this; }
+
+   private:
+    grpc::ByteBuffer message_;
+  };
+};
+
+}  // namespace
+
+// Test that settings are set by their flag names, with either separator
+TEST(GrpcServerConfigTest, SetsByFlagName) {
+  GrpcServerConfig config;
+  EXPECT_EQ(config.Summary(), "defaults");
+
+  EXPECT_TRUE(config.Set("grpc_max_streams", "256"));
+  EXPECT_TRUE(config.Set("grpc-stream-window-kb", "1024"));
+  EXPECT_EQ(config.max_streams, 256);
+  EXPECT_EQ(config.stream_window_kb, 1024);
+  EXPECT_EQ(config.Summary(),
+            "grpc_max_streams=256 grpc_stream_window_kb=1024");
+
+  EXPECT_FALSE(config.Set("grpc_max_stream", "1"));
+  EXPECT_FALSE(config.Set("grpc_max_streams", "many"));
+  EXPECT_FALSE(config.Set("grpc_max_streams", "-1"));
+  EXPECT_FALSE(config.Set("grpc_max_streams", ""));
+  EXPECT_EQ(config.max_streams, 256);
+}
+
+// Test that each setting is capped so its size in bytes fits an int
+TEST(GrpcServerConfigTest, RejectsValuesOverflowingBytes) {
+  GrpcServerConfig config;
+  EXPECT_TRUE(config.Set("grpc_max_message_mb", "2047"));
+  EXPECT_FALSE(config.Set("grpc_max_message_mb", "2048"));
+  EXPECT_TRUE(config.Set("grpc_stream_window_kb", "2097151"));
+  EXPECT_FALSE(config.Set("grpc_stream_window_kb", "2097152"));
+  EXPECT_FALSE(config.Set("grpc_write_buffer_kb", "1073741824"));
+  EXPECT_FALSE(config.Set("grpc_max_frame_kb", "16385"));
+  EXPECT_TRUE(config.Set("grpc_keepalive_ms", "1073741824"));
+  EXPECT_FALSE(config.Set("grpc_keepalive_ms", "1073741825"));
+  EXPECT_EQ(config.max_message_mb, 2047);
+  EXPECT_EQ(config.stream_window_kb, 2097151);
+  EXPECT_EQ(config.write_buffer_kb, 0);
+}
+
+// Test that a config file becomes the arguments it stands for
+TEST(GrpcServerConfigTest, ReadsConfigFile) {
+  auto path = std::filesystem::temp_directory_path() /
+              ("grpc_server_config_test_" + std::to_string(getpid()));
+  {
+    std::ofstream file(path);
+    file << "# Tuned for the LAN\n"
+         << "\n"
+         << "num_cqs = 4\n"
+         << "  grpc_max_streams 256\r\n"
+         << "no_watch\n"
+         << "audio_dir=/srv/music \n";
+  }
+
+  std::vector<std::string> args;
+  ASSERT_TRUE(music262::ReadConfigFile(path.string(), &args));
+  std::filesystem::remove(path);
+  EXPECT_EQ(args, (std::vector<std::string>{
+                      "--num_cqs", "4", "--grpc_max_streams", "256",
+                      "--no_watch", "--audio_dir", "/srv/music"}));
+
+  EXPECT_FALSE(music262::ReadConfigFile(path.string(), &args));
+}
+
+// Test that a config file naming a config file is rejected, since it could
+// name itself
+TEST(GrpcServerConfigTest, RejectsNestedConfigFile) {
+  auto path = std::filesystem::temp_directory_path() /
+              ("grpc_server_config_nested_" + std::to_string(getpid()));
+  {
+    std::ofstream file(path);
+    file << "num_cqs = 4\n"
+         << "config = " << path.string() << "\n";
+  }
+
+  std::vector<std::string> args;
+  std::string error;
+  EXPECT_FALSE(music262::ReadConfigFile(path.string(), &args, &error));
+  std::filesystem::remove(path);
+  EXPECT_TRUE(args.empty());
+  EXPECT_NE(error.find("another config file"), std::string::npos);
+}
+
+// Test that the settings reach the server, here its message size limit
+TEST(GrpcServerConfigTest, AppliesToServer) {
+  GrpcServerConfig config;
+  ASSERT_TRUE(config.Set("grpc_max_message_mb", "1"));
+  ASSERT_TRUE(config.Set("grpc_max_streams", "16"));
+  ASSERT_TRUE(config.Set("grpc_stream_window_kb", "512"));
+  ASSERT_TRUE(config.Set("grpc_memory_mb", "64"));
+
+  EchoService service;
+  grpc::ServerBuilder builder;
+  int port = 0;
+  builder.AddListeningPort("127.0.0.1:0", grpc::InsecureServerCredentials(),
+                           &port);
+  config.Apply(&builder);
+  builder.RegisterCallbackGenericService(&service);
+  std::unique_ptr<grpc::Server> server = builder.BuildAndStart();
+  ASSERT_NE(server, nullptr);
+
+  auto channel = grpc::CreateChannel("127.0.0.1:" + std::to_string(port),
+                                     grpc::InsecureChannelCredentials());
+  grpc::GenericStub stub(channel);
+  auto check = [&](size_t request_bytes) {
+    std::string payload(request_bytes, 'x');
+    grpc::Slice slice(payload);
+    grpc::ByteBuffer request(&slice, 1);
+    grpc::ByteBuffer response;
+    grpc::ClientContext context;
+    std::promise<grpc::Status> done;
+    stub.UnaryCall(&context, "/test.Echo/Call", grpc::StubOptions(), &request,
+                   &response,
+                   [&](grpc::Status status) { done.set_value(status); });
+    return done.get_future().get().error_code();
+  };
+
+  EXPECT_EQ(check(16), grpc::StatusCode::OK);
+  EXPECT_EQ(check(2 * 1024 * 1024), grpc::StatusCode::RESOURCE_EXHAUSTED);
+  server->Shutdown();
+}
@@ -0,0 +1,1016 @@
+#include "server/include/async_audio_service.h"
+
+#include <grpcpp/grpcpp.h>
+#include <gtest/gtest.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <map>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "codec/include/lossless_codec.h"
+#include "common/include/content_hash.h"
+#include "common/include/crc32.h"
+
+namespace fs = std::filesystem;
+
+// Test fixture that runs the async service on a loopback port
+class AsyncAudioServiceTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    test_dir_ = fs::temp_directory_path() / "music262_async_service_test";
+    fs::create_directories(test_dir_);
+
+    // A song spanning several chunks with a recognizable byte pattern
+    song_.resize(300 * 1024);
+    for (size_t i = 0; i < song_.size(); i++) {
+      song_[i] = static_cast<char>(i % 253);
+    }
+    std::ofstream file(test_dir_ / "song.wav", std::ios::binary);
+    file.write(song_.data(), song_.size());
+    file.close();
+    if (with_wav_song_) {
+      writeWavSong(test_dir_ / "tone.wav");
+    }
+
+    // A single queue with a single poller must still serve many streams
+    AsyncServiceOptions options;
+    options.num_cqs = 1;
+    options.pollers_per_cq = 1;
+    options.egress = egress_;
+    options.broadcast = broadcast_;
+
+    audio_server_ = std::make_shared<AudioServer>(
+        test_dir_.string(), AudioServer::kDefaultCacheBytes, segment_duration_);
+    service_ = std::make_unique<AsyncAudioService>(audio_server_, options);
+
+    grpc::ServerBuilder builder;
+    int port = 0;
+    builder.AddListeningPort("127.0.0.1:0", grpc::InsecureServerCredentials(),
+                             &port);
+    service_->RegisterWith(builder);
+    server_ = builder.BuildAndStart();
+    ASSERT_NE(server_, nullptr);
+    service_->Start();
+
+    auto channel = grpc::CreateChannel("127.0.0.1:" + std::to_string(port),
+                                       grpc::InsecureChannelCredentials());
+    stub_ = audio_service::audio_service::NewStub(channel);
+  }
+
+  void TearDown() override {
+    service_->Shutdown(server_.get());
+    fs::remove_all(test_dir_);
+  }
+
+  // Download a song and return the status of the stream
+  grpc::Status loadSong(int song_num, std::string* data) {
+    audio_service::LoadAudioRequest request;
+    request.set_song_num(song_num);
+    return load(request, data);
+  }
+
+  // A valid 16-bit stereo WAV file the lossless codec can encode
+  void writeWavSong(const fs::path& path) {
+    std::vector<int16_t> samples;
+    for (int i = 0; i < 50000; i++) {
+      int16_t value = static_cast<int16_t>(8000 * std::sin(i * 0.05));
+      samples.push_back(value);
+      samples.push_back(value / 2);
+    }
+    uint32_t data_size = samples.size() * 2;
+    uint32_t header[] = {0x46464952, 36 + data_size, 0x45564157, 0x20746d66,
+                         16,         0x00020001,     44100,      44100 * 4,
+                         0x00100004, 0x61746164,     data_size};
+    std::ofstream file(path, std::ios::binary);
+    file.write(reinterpret_cast<const char*>(header), sizeof(header));
+    file.write(reinterpret_cast<const char*>(samples.data()), data_size);
+  }
+
+  // Issue a LoadAudio request, optionally capturing the resume token and
+  // the codec the server picked
+  grpc::Status load(const audio_service::LoadAudioRequest& request,
+                    std::string* data, std::string* resume_token = nullptr,
+                    std::string* codec = nullptr) {
+    grpc::ClientContext context;
+    auto reader = stub_->LoadAudio(&context, request);
+    audio_service::AudioChunk chunk;
+    while (reader->Read(&chunk)) {
+      data->append(chunk.data());
+    }
+    grpc::Status status = reader->Finish();
+
+    if (resume_token) {
+      const auto& metadata = context.GetServerInitialMetadata();
+      auto it = metadata.find("resume-token");
+      if (it != metadata.end()) {
+        resume_token->assign(it->second.data(), it->second.size());
+      }
+    }
+    if (codec) {
+      const auto& metadata = context.GetServerInitialMetadata();
+      auto it = metadata.find("audio-codec");
+      if (it != metadata.end()) {
+        codec->assign(it->second.data(), it->second.size());
+      }
+    }
+    return status;
+  }
+
+  bool with_wav_song_ = false;
+  EgressOptions egress_;
+  BroadcastOptions broadcast_;
+  std::chrono::milliseconds segment_duration_ =
+      AudioServer::kDefaultSegmentDuration;
+  fs::path test_dir_;
+  std::string song_;
+  std::shared_ptr<AudioServer> audio_server_;
+  std::unique_ptr<AsyncAudioService> service_;
+  std::unique_ptr<grpc::Server> server_;
+  std::unique_ptr<audio_service::audio_service::Stub> stub_;
+};
+
+// Test the unary playlist call
+TEST_F(AsyncAudioServiceTest, GetPlaylist) {
+  audio_service::PlaylistRequest request;
+  audio_service::PlaylistResponse response;
+  grpc::ClientContext context;
+
+  ASSERT_TRUE(stub_->GetPlaylist(&context, request, &response).ok());
+  ASSERT_EQ(response.song_names_size(), 1);
+  EXPECT_EQ(response.song_names(0), "song.wav");
+  ASSERT_EQ(response.songs_size(), 1);
+  EXPECT_EQ(response.songs(0).name(), "song.wav");
+}
+
+// Test that hashed songs are listed with their size and content hash
+TEST_F(AsyncAudioServiceTest, GetPlaylistWithDigests) {
+  audio_server_->HashCatalog();
+
+  audio_service::PlaylistRequest request;
+  audio_service::PlaylistResponse response;
+  grpc::ClientContext context;
+  ASSERT_TRUE(stub_->GetPlaylist(&context, request, &response).ok());
+  ASSERT_EQ(response.songs_size(), 1);
+  EXPECT_EQ(response.songs(0).size(), song_.size());
+  EXPECT_EQ(response.songs(0).content_hash(),
+            music262::ContentHash(song_.data(), song_.size()));
+}
+
+// Test that a client holding the current playlist gets "not modified" and
+// only the changes once the playlist changes
+TEST_F(AsyncAudioServiceTest, RevalidatesPlaylist) {
+  audio_service::PlaylistRequest request;
+  audio_service::PlaylistResponse full;
+  {
+    grpc::ClientContext context;
+    ASSERT_TRUE(stub_->GetPlaylist(&context, request, &full).ok());
+  }
+  ASSERT_FALSE(full.etag().empty());
+  EXPECT_FALSE(full.delta());
+
+  request.set_if_none_match(full.etag());
+  request.set_delta(true);
+  {
+    audio_service::PlaylistResponse response;
+    grpc::ClientContext context;
+    ASSERT_TRUE(stub_->GetPlaylist(&context, request, &response).ok());
+    EXPECT_TRUE(response.not_modified());
+    EXPECT_EQ(response.songs_size(), 0);
+    EXPECT_EQ(response.etag(), full.etag());
+  }
+
+  // Hashing changes the listed song, a new song is added
+  audio_server_->HashCatalog();
+  std::ofstream(test_dir_ / "new.wav") << "new song";
+  audio_server_->RescanCatalog();
+
+  audio_service::PlaylistResponse delta;
+  {
+    grpc::ClientContext context;
+    ASSERT_TRUE(stub_->GetPlaylist(&context, request, &delta).ok());
+  }
+  EXPECT_FALSE(delta.not_modified());
+  EXPECT_TRUE(delta.delta());
+  EXPECT_NE(delta.etag(), full.etag());
+  EXPECT_EQ(delta.song_count(), 2);
+  EXPECT_EQ(delta.song_names_size(), 0);
+  ASSERT_EQ(delta.songs_size(), 2);
+  EXPECT_NE(delta.songs(0).content_hash(), 0u);
+  EXPECT_EQ(delta.songs(1).id(), 2);
+  EXPECT_EQ(delta.songs(1).name(), "new.wav");
+
+  // Removing a song lists it without a name
+  fs::remove(test_dir_ / "new.wav");
+  audio_server_->RescanCatalog();
+  request.set_if_none_match(delta.etag());
+  {
+    audio_service::PlaylistResponse response;
+    grpc::ClientContext context;
+    ASSERT_TRUE(stub_->GetPlaylist(&context, request, &response).ok());
+    ASSERT_EQ(response.songs_size(), 1);
+    EXPECT_EQ(response.songs(0).id(), 2);
+    EXPECT_TRUE(response.songs(0).name().empty());
+  }
+
+  // Tags from another server run get the whole playlist
+  request.set_if_none_match("0123456789abcdef-1");
+  {
+    audio_service::PlaylistResponse response;
+    grpc::ClientContext context;
+    ASSERT_TRUE(stub_->GetPlaylist(&context, request, &response).ok());
+    EXPECT_FALSE(response.delta());
+    EXPECT_EQ(response.songs_size(), 2);
+  }
+}
+
+// Test paging through the playlist, pages come from one version
+TEST_F(AsyncAudioServiceTest, PagesThroughPlaylist) {
+  for (int i = 0; i < 4; i++) {
+    std::ofstream(test_dir_ / ("page" + std::to_string(i) + ".wav")) << i;
+  }
+  audio_server_->RescanCatalog();
+
+  audio_service::PlaylistRequest request;
+  request.set_page_size(2);
+  std::vector<std::string> names;
+  std::string etag;
+  int pages = 0;
+  while (true) {
+    audio_service::PlaylistResponse response;
+    grpc::ClientContext context;
+    ASSERT_TRUE(stub_->GetPlaylist(&context, request, &response).ok());
+    EXPECT_EQ(response.song_count(), 5);
+    EXPECT_EQ(response.song_names_size(), 0);
+    EXPECT_LE(response.songs_size(), 2);
+    if (pages == 0) {
+      etag = response.etag();
+      // Changes made while paging show up in the next revalidation
+      std::ofstream(test_dir_ / "late.wav") << "late";
+      audio_server_->RescanCatalog();
+    }
+    EXPECT_EQ(response.etag(), etag);
+    for (const auto& song : response.songs()) {
+      EXPECT_EQ(song.id(), static_cast<int>(names.size()) + 1);
+      names.push_back(song.name());
+    }
+    pages++;
+    if (response.next_page_token().empty()) {
+      break;
+    }
+    request.set_page_token(response.next_page_token());
+  }
+  EXPECT_EQ(pages, 3);
+  EXPECT_EQ(names, (std::vector<std::string>{"song.wav", "page0.wav",
+                                             "page1.wav", "page2.wav",
+                                             "page3.wav"}));
+
+  audio_service::PlaylistResponse response;
+  grpc::ClientContext context;
+  request.Clear();
+  request.set_page_token("not a token");
+  EXPECT_EQ(stub_->GetPlaylist(&context, request, &response).error_code(),
+            grpc::StatusCode::INVALID_ARGUMENT);
+}
+
+// Test that the peer list names advertised peers, best first and bounded
+TEST_F(AsyncAudioServiceTest, ListsOtherPeers) {
+  auto advertise = [this](const std::string& client, int64_t uplink_kbps,
+                          std::vector<int> cached_songs) {
+    ClientAdvertisement advertisement;
+    advertisement.p2p_port = 50052;
+    advertisement.uplink_kbps = uplink_kbps;
+    advertisement.cached_songs = std::move(cached_songs);
+    audio_server_->AdvertiseClient(client, advertisement);
+  };
+  // Joins this close together are listed by the registry's expiry thread
+  auto wait_for_list = []() {
+    std::this_thread::sleep_for(2 * ClientRegistry::kMaxStaleness);
+  };
+  advertise("ipv4:10.0.0.1:5000", 1000, {});
+  advertise("ipv6:[::1]:6000", 5000, {});
+  audio_server_->RegisterClient("ipv4:10.0.0.9:5000");  // No peer service
+  wait_for_list();
+
+  auto list_peers = [this](int max_peers, int song_num) {
+    audio_service::PeerListRequest request;
+    request.set_max_peers(max_peers);
+    request.set_song_num(song_num);
+    audio_service::PeerListResponse response;
+    grpc::ClientContext context;
+    EXPECT_TRUE(stub_->GetPeerClientIPs(&context, request, &response).ok());
+    return std::vector<std::string>(response.client_ips().begin(),
+                                    response.client_ips().end());
+  };
+  EXPECT_EQ(list_peers(0, 0),
+            (std::vector<std::string>{"[::1]:50052", "10.0.0.1:50052"}));
+
+  // Peers holding the song come first, and the server's limit applies
+  advertise("ipv4:10.0.0.2:5000", 2000, {3});
+  wait_for_list();
+  EXPECT_EQ(list_peers(0, 3),
+            (std::vector<std::string>{"10.0.0.2:50052", "[::1]:50052",
+                                      "10.0.0.1:50052"}));
+  EXPECT_EQ(list_peers(1, 0), (std::vector<std::string>{"[::1]:50052"}));
+  audio_server_->SetMaxPeers(2);
+  EXPECT_EQ(list_peers(0, 0).size(), 2u);
+}
+
+// Test that heartbeats keep a client listed and silent clients drop out
+TEST_F(AsyncAudioServiceTest, HeartbeatRenewsLease) {
+  audio_server_->SetClientLease(std::chrono::milliseconds(300));
+  audio_server_->RegisterClient("ipv4:10.0.0.1:5000");
+
+  audio_service::HeartbeatRequest request;
+  audio_service::HeartbeatResponse response;
+  for (int i = 0; i < 4; i++) {
+    grpc::ClientContext context;
+    ASSERT_TRUE(stub_->Heartbeat(&context, request, &response).ok());
+    EXPECT_EQ(response.lease_ms(), 300);
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+  }
+
+  // Only the client sending heartbeats is still connected
+  auto clients = audio_server_->GetConnectedClients();
+  ASSERT_EQ(clients.size(), 1u);
+  EXPECT_EQ(clients[0].rfind("127.0.0.1:", 0), 0u);
+  EXPECT_GT(response.client_id(), 0);
+
+  audio_service::PeerListRequest peer_request;
+  audio_service::PeerListResponse peer_response;
+  grpc::ClientContext context;
+  ASSERT_TRUE(
+      stub_->GetPeerClientIPs(&context, peer_request, &peer_response).ok());
+  EXPECT_EQ(peer_response.client_ips_size(), 0);
+}
+
+// Test that peer watchers are told about joins and leaves as they happen
+TEST_F(AsyncAudioServiceTest, WatchPeersPushesChanges) {
+  audio_server_->SetClientLease(std::chrono::milliseconds(500));
+  ClientAdvertisement advertisement;
+  advertisement.p2p_port = 50052;
+  audio_server_->AdvertiseClient("ipv4:10.0.0.1:5000", advertisement);
+
+  grpc::ClientContext context;
+  context.set_deadline(std::chrono::system_clock::now() +
+                       std::chrono::seconds(10));
+  auto reader =
+      stub_->WatchPeers(&context, audio_service::WatchPeersRequest());
+  audio_service::PeerUpdate update;
+
+  // The first update lists the current peers
+  ASSERT_TRUE(reader->Read(&update));
+  EXPECT_TRUE(update.reset());
+  ASSERT_EQ(update.joined_size(), 1);
+  EXPECT_EQ(update.joined(0), "10.0.0.1:50052");
+
+  // Joins are pushed without asking
+  audio_server_->AdvertiseClient("ipv4:10.0.0.2:5000", advertisement);
+  ASSERT_TRUE(reader->Read(&update));
+  EXPECT_FALSE(update.reset());
+  ASSERT_EQ(update.joined_size(), 1);
+  EXPECT_EQ(update.joined(0), "10.0.0.2:50052");
+  EXPECT_EQ(update.left_size(), 0);
+
+  // So are leaves, once the silent peers' leases run out
+  std::vector<std::string> left;
+  while (left.size() < 2 && reader->Read(&update)) {
+    left.insert(left.end(), update.left().begin(), update.left().end());
+  }
+  std::sort(left.begin(), left.end());
+  EXPECT_EQ(left,
+            (std::vector<std::string>{"10.0.0.1:50052", "10.0.0.2:50052"}));
+  context.TryCancel();
+  reader->Finish();
+
+  // A watch resuming after the last update only gets what changed since
+  audio_server_->AdvertiseClient("ipv4:10.0.0.3:5000", advertisement);
+  audio_service::WatchPeersRequest request;
+  request.set_epoch(update.epoch());
+  request.set_sequence(update.sequence());
+  grpc::ClientContext resumed_context;
+  resumed_context.set_deadline(std::chrono::system_clock::now() +
+                               std::chrono::seconds(10));
+  auto resumed = stub_->WatchPeers(&resumed_context, request);
+  ASSERT_TRUE(resumed->Read(&update));
+  EXPECT_FALSE(update.reset());
+  ASSERT_EQ(update.joined_size(), 1);
+  EXPECT_EQ(update.joined(0), "10.0.0.3:50052");
+
+  // The server still shuts down with the watcher waiting
+  resumed_context.TryCancel();
+  resumed->Finish();
+}
+
+// Test streaming a whole song
+TEST_F(AsyncAudioServiceTest, LoadAudio) {
+  std::string data;
+  ASSERT_TRUE(loadSong(1, &data).ok());
+  EXPECT_EQ(data, song_);
+}
+
+// Test that streams announce the size of the whole file, also for ranges,
+// before the first chunk
+TEST_F(AsyncAudioServiceTest, SendsSongSize) {
+  audio_service::LoadAudioRequest request;
+  request.set_song_num(1);
+  request.set_offset(1000);
+  request.set_length(5000);
+  grpc::ClientContext context;
+  auto reader = stub_->LoadAudio(&context, request);
+  reader->WaitForInitialMetadata();
+  const auto& metadata = context.GetServerInitialMetadata();
+  auto it = metadata.find("song-size");
+  ASSERT_NE(it, metadata.end());
+  EXPECT_EQ(std::string(it->second.data(), it->second.size()),
+            std::to_string(song_.size()));
+
+  audio_service::AudioChunk chunk;
+  size_t received = 0;
+  while (reader->Read(&chunk)) {
+    received += chunk.data().size();
+  }
+  ASSERT_TRUE(reader->Finish().ok());
+  EXPECT_EQ(received, 5000u);
+}
+
+// Test that calls and streamed bytes show up in the server stats
+TEST_F(AsyncAudioServiceTest, ReportsServerStats) {
+  std::string data;
+  ASSERT_TRUE(loadSong(1, &data).ok());
+  EXPECT_EQ(loadSong(42, &data).error_code(), grpc::StatusCode::NOT_FOUND);
+
+  // A call is counted once the server sees its status sent, which can be
+  // after the client got it
+  audio_service::ServerStatsResponse response;
+  const audio_service::RpcStats* load = nullptr;
+  auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+  do {
+    grpc::ClientContext context;
+    ASSERT_TRUE(stub_->GetServerStats(&context, {}, &response).ok());
+    for (const auto& rpc : response.rpcs()) {
+      if (rpc.method() == "LoadAudio") load = &rpc;
+    }
+    ASSERT_NE(load, nullptr);
+  } while (load->calls() < 2 && std::chrono::steady_clock::now() < deadline);
+  EXPECT_EQ(load->calls(), 2u);
+  EXPECT_EQ(load->errors(), 1u);
+  EXPECT_EQ(load->active(), 0);
+  EXPECT_EQ(load->bytes_sent(), song_.size());
+  EXPECT_EQ(load->latency().count(), 2u);
+  EXPECT_GT(load->latency().max_us(), 0);
+
+  // Both requests opened a song, the one found was written in chunks
+  ASSERT_EQ(response.stages_size(), 4);
+  EXPECT_EQ(response.stages(0).stage(), "song_open");
+  EXPECT_EQ(response.stages(0).latency().count(), 2u);
+  EXPECT_EQ(response.stages(1).latency().count(), 1u);
+  EXPECT_GT(response.stages(3).latency().count(), 1u);
+}
+
+// Test that hinted songs are loaded ahead of time and unknown ones skipped
+TEST_F(AsyncAudioServiceTest, WarmsHintedSongs) {
+  audio_service::SongHintRequest request;
+  request.add_song_nums(42);
+  request.add_song_nums(1);
+  audio_service::SongHintResponse response;
+  grpc::ClientContext context;
+  ASSERT_TRUE(stub_->HintNextSongs(&context, request, &response).ok());
+  EXPECT_EQ(response.warmed(), 1);
+
+  std::string data;
+  ASSERT_TRUE(loadSong(1, &data).ok());
+  EXPECT_EQ(data, song_);
+}
+
+// Test that unknown songs are reported as not found
+TEST_F(AsyncAudioServiceTest, LoadMissingSong) {
+  std::string data;
+  grpc::Status status = loadSong(42, &data);
+  EXPECT_EQ(status.error_code(), grpc::StatusCode::NOT_FOUND);
+  EXPECT_TRUE(data.empty());
+}
+
+// Test streaming a byte range of a song
+TEST_F(AsyncAudioServiceTest, LoadAudioRange) {
+  audio_service::LoadAudioRequest request;
+  request.set_song_num(1);
+  request.set_offset(100000);
+  request.set_length(70000);
+
+  std::string data;
+  ASSERT_TRUE(load(request, &data).ok());
+  EXPECT_EQ(data, song_.substr(100000, 70000));
+
+  // A length of zero reads to the end, and overlong lengths are clipped
+  for (int64_t length : {int64_t{0}, int64_t{1} << 30, INT64_MAX}) {
+    request.set_length(length);
+    data.clear();
+    ASSERT_TRUE(load(request, &data).ok());
+    EXPECT_EQ(data, song_.substr(100000));
+  }
+}
+
+// Test resuming a download with the token from the first response
+TEST_F(AsyncAudioServiceTest, ResumeWithToken) {
+  audio_service::LoadAudioRequest request;
+  request.set_song_num(1);
+  request.set_length(123456);
+
+  std::string data;
+  std::string token;
+  ASSERT_TRUE(load(request, &data, &token).ok());
+  ASSERT_FALSE(token.empty());
+
+  request.set_offset(data.size());
+  request.set_length(0);
+  request.set_resume_token(token);
+  ASSERT_TRUE(load(request, &data).ok());
+  EXPECT_EQ(data, song_);
+}
+
+// Test that a token for a different version of the song is rejected
+TEST_F(AsyncAudioServiceTest, StaleResumeToken) {
+  audio_service::LoadAudioRequest request;
+  request.set_song_num(1);
+  request.set_offset(1000);
+  request.set_resume_token("0000000000000000");
+
+  std::string data;
+  EXPECT_EQ(load(request, &data).error_code(),
+            grpc::StatusCode::FAILED_PRECONDITION);
+  EXPECT_TRUE(data.empty());
+}
+
+// Test that ranges starting past the end of the song are rejected
+TEST_F(AsyncAudioServiceTest, RangeOutOfBounds) {
+  audio_service::LoadAudioRequest request;
+  request.set_song_num(1);
+  request.set_offset(song_.size() + 1);
+
+  std::string data;
+  EXPECT_EQ(load(request, &data).error_code(),
+            grpc::StatusCode::OUT_OF_RANGE);
+
+  request.set_offset(-1);
+  EXPECT_EQ(load(request, &data).error_code(),
+            grpc::StatusCode::OUT_OF_RANGE);
+  EXPECT_TRUE(data.empty());
+}
+
+// Test many concurrent streams multiplexed over one poller thread
+TEST_F(AsyncAudioServiceTest, ConcurrentStreams) {
+  constexpr int kStreams = 32;
+  std::vector<std::string> results(kStreams);
+  std::vector<char> ok(kStreams, false);
+
+  std::vector<std::thread> clients;
+  for (int i = 0; i < kStreams; i++) {
+    clients.emplace_back(
+        [this, i, &results, &ok]() { ok[i] = loadSong(1, &results[i]).ok(); });
+  }
+  for (auto& client : clients) {
+    client.join();
+  }
+
+  for (int i = 0; i < kStreams; i++) {
+    EXPECT_TRUE(ok[i]);
+    EXPECT_EQ(results[i], song_);
+  }
+
+  // Every stream was registered as the same loopback client
+  EXPECT_FALSE(audio_server_->GetConnectedClients().empty());
+}
+
+// Fixture whose egress window holds a single chunk, so streams take turns
+class AsyncAudioServiceEgressTest : public AsyncAudioServiceTest {
+ protected:
+  AsyncAudioServiceEgressTest() {
+    egress_.window_bytes = 1;
+    egress_.urgent_bytes = 64 * 1024;
+  }
+};
+
+// Test that queued streams, prefetching or not, arrive complete
+TEST_F(AsyncAudioServiceEgressTest, StreamsTakeTurns) {
+  constexpr int kStreams = 8;
+  std::vector<std::string> results(kStreams);
+  std::vector<char> ok(kStreams, false);
+
+  std::vector<std::thread> clients;
+  for (int i = 0; i < kStreams; i++) {
+    clients.emplace_back([this, i, &results, &ok]() {
+      audio_service::LoadAudioRequest request;
+      request.set_song_num(1);
+      request.set_prefetch(i % 2 == 1);
+      ok[i] = load(request, &results[i]).ok();
+    });
+  }
+  for (auto& client : clients) {
+    client.join();
+  }
+
+  for (int i = 0; i < kStreams; i++) {
+    EXPECT_TRUE(ok[i]);
+    EXPECT_EQ(results[i], song_);
+  }
+  EXPECT_EQ(service_->egress()->inflight_bytes(), 0u);
+  EXPECT_EQ(service_->egress()->queued(), 0u);
+}
+
+// Fixture whose catalog also holds a WAV song the codec can encode
+class AsyncAudioServiceCodecTest : public AsyncAudioServiceTest {
+ protected:
+  AsyncAudioServiceCodecTest() { with_wav_song_ = true; }
+
+  void SetUp() override {
+    AsyncAudioServiceTest::SetUp();
+    audio_server_->EncodeCatalog((test_dir_ / ".m2lc").string());
+
+    auto playlist = audio_server_->GetPlaylist();
+    for (size_t i = 0; i < playlist.size(); i++) {
+      if (playlist[i] == "tone.wav") tone_num_ = i + 1;
+      if (playlist[i] == "song.wav") song_num_ = i + 1;
+    }
+    ASSERT_NE(audio_server_->GetEncodedSong(tone_num_), nullptr);
+  }
+
+  int tone_num_ = 0;
+  int song_num_ = 0;
+};
+
+// Test that the playlist lists every song's id and format
+TEST_F(AsyncAudioServiceCodecTest, GetPlaylistWithFormats) {
+  audio_service::PlaylistRequest request;
+  audio_service::PlaylistResponse response;
+  grpc::ClientContext context;
+  ASSERT_TRUE(stub_->GetPlaylist(&context, request, &response).ok());
+  ASSERT_EQ(response.songs_size(), 2);
+
+  const auto& tone = response.songs(tone_num_ - 1);
+  EXPECT_EQ(tone.id(), tone_num_);
+  EXPECT_EQ(tone.name(), "tone.wav");
+  EXPECT_EQ(tone.sample_rate(), 44100);
+  EXPECT_EQ(tone.channels(), 2);
+  EXPECT_EQ(tone.bits_per_sample(), 16);
+  EXPECT_EQ(tone.duration_ms(), 50000 * 1000 / 44100);
+
+  // song.wav has no WAV header, so its format is unknown
+  const auto& song = response.songs(song_num_ - 1);
+  EXPECT_EQ(song.id(), song_num_);
+  EXPECT_EQ(song.size(), song_.size());
+  EXPECT_EQ(song.sample_rate(), 0);
+}
+
+// Test that clients accepting the codec get the encoded song
+TEST_F(AsyncAudioServiceCodecTest, NegotiatesLossless) {
+  audio_service::LoadAudioRequest request;
+  request.set_song_num(tone_num_);
+
+  std::string pcm;
+  std::string codec;
+  ASSERT_TRUE(load(request, &pcm, nullptr, &codec).ok());
+  EXPECT_EQ(codec, "pcm");
+
+  request.add_accepted_codecs(audio_service::CODEC_M262_LOSSLESS);
+  std::string encoded;
+  ASSERT_TRUE(load(request, &encoded, nullptr, &codec).ok());
+  EXPECT_EQ(codec, "m262-lossless");
+  EXPECT_LT(encoded.size(), pcm.size());
+
+  std::vector<char> decoded;
+  ASSERT_TRUE(
+      music262::DecodeLossless(encoded.data(), encoded.size(), &decoded));
+  EXPECT_EQ(std::string(decoded.begin(), decoded.end()), pcm);
+
+  // Songs that could not be encoded fall back to PCM
+  request.set_song_num(song_num_);
+  std::string data;
+  ASSERT_TRUE(load(request, &data, nullptr, &codec).ok());
+  EXPECT_EQ(codec, "pcm");
+  EXPECT_EQ(data, song_);
+}
+
+// Test that a resumed download stays on the encoding it started with
+TEST_F(AsyncAudioServiceCodecTest, ResumeKeepsCodec) {
+  audio_service::LoadAudioRequest request;
+  request.set_song_num(tone_num_);
+  request.set_length(1000);
+
+  std::string pcm;
+  std::string token;
+  std::string codec;
+  ASSERT_TRUE(load(request, &pcm, &token, &codec).ok());
+  ASSERT_EQ(codec, "pcm");
+
+  // The client now offers the codec, but the token pins the PCM stream
+  request.add_accepted_codecs(audio_service::CODEC_M262_LOSSLESS);
+  request.set_offset(pcm.size());
+  request.set_length(0);
+  request.set_resume_token(token);
+  ASSERT_TRUE(load(request, &pcm, nullptr, &codec).ok());
+  EXPECT_EQ(codec, "pcm");
+  EXPECT_EQ(pcm.size(), fs::file_size(test_dir_ / "tone.wav"));
+}
+
+// Test that clients get songs converted to their device's format, and that
+// ranges and resume tokens address the converted file
+TEST_F(AsyncAudioServiceCodecTest, ConvertsToOutputFormat) {
+  audio_service::LoadAudioRequest request;
+  request.set_song_num(tone_num_);
+  request.add_accepted_codecs(audio_service::CODEC_M262_LOSSLESS);
+  auto* format = request.mutable_output_format();
+  format->set_sample_format(audio_service::SAMPLE_FORMAT_F32);
+  format->set_sample_rate(48000);
+
+  std::string converted;
+  std::string token;
+  std::string codec;
+  ASSERT_TRUE(load(request, &converted, &token, &codec).ok());
+  EXPECT_EQ(codec, "pcm");  // Converted songs are never encoded
+
+  // 50000 frames at 44.1 kHz are 54422 frames of two floats at 48 kHz
+  uint32_t header[11];
+  ASSERT_GE(converted.size(), sizeof(header));
+  std::memcpy(header, converted.data(), sizeof(header));
+  EXPECT_EQ(header[5], 0x00020003u);  // IEEE float, stereo
+  EXPECT_EQ(header[6], 48000u);
+  EXPECT_EQ(header[8], 0x00200008u);  // 8 bytes per frame, 32 bits
+  EXPECT_EQ(header[10], 54422u * 8);
+  EXPECT_EQ(converted.size(), 44u + 54422 * 8);
+
+  // A range resumed with the token continues the converted file
+  request.set_offset(1000);
+  request.set_length(5000);
+  request.set_resume_token(token);
+  std::string range;
+  ASSERT_TRUE(load(request, &range).ok());
+  EXPECT_EQ(range, converted.substr(1000, 5000));
+
+  auto stats = audio_server_->GetTranscodeStats();
+  EXPECT_EQ(stats.conversions, 1u);
+  EXPECT_EQ(stats.hits, 1u);
+
+  // Asking for the format the song is stored in streams the song itself
+  request.Clear();
+  request.set_song_num(tone_num_);
+  request.mutable_output_format()->set_channels(2);
+  std::string pcm;
+  ASSERT_TRUE(load(request, &pcm).ok());
+  EXPECT_EQ(pcm.size(), fs::file_size(test_dir_ / "tone.wav"));
+  EXPECT_EQ(audio_server_->GetTranscodeStats().conversions, 1u);
+}
+
+// Test that songs that cannot be converted are rejected
+TEST_F(AsyncAudioServiceCodecTest, RejectsUnsupportedOutputFormat) {
+  audio_service::LoadAudioRequest request;
+  request.set_song_num(tone_num_);
+  request.mutable_output_format()->set_channels(6);
+  std::string data;
+  EXPECT_EQ(load(request, &data).error_code(),
+            grpc::StatusCode::INVALID_ARGUMENT);
+
+  // song.wav is not a WAV file at all
+  request.set_song_num(song_num_);
+  request.mutable_output_format()->set_channels(2);
+  EXPECT_EQ(load(request, &data).error_code(),
+            grpc::StatusCode::INVALID_ARGUMENT);
+
+  request.set_song_num(999);
+  EXPECT_EQ(load(request, &data).error_code(), grpc::StatusCode::NOT_FOUND);
+}
+
+// Fixture with short broadcast chunks, the tone is the only song that can
+// be broadcast and lasts 23 chunks
+class AsyncAudioServiceBroadcastTest : public AsyncAudioServiceTest {
+ protected:
+  AsyncAudioServiceBroadcastTest() {
+    with_wav_song_ = true;
+    broadcast_.chunk_duration = std::chrono::milliseconds(50);
+    broadcast_.lead = std::chrono::milliseconds(200);
+    broadcast_.ring_chunks = 16;
+  }
+
+  void SetUp() override {
+    AsyncAudioServiceTest::SetUp();
+    auto playlist = audio_server_->GetPlaylist();
+    for (size_t i = 0; i < playlist.size(); i++) {
+      if (playlist[i] == "tone.wav") tone_num_ = i + 1;
+      if (playlist[i] == "song.wav") song_num_ = i + 1;
+    }
+    std::ifstream file(test_dir_ / "tone.wav", std::ios::binary);
+    tone_.assign(std::istreambuf_iterator<char>(file), {});
+  }
+
+  struct Listener {
+    grpc::ClientContext context;
+    std::unique_ptr<grpc::ClientReader<audio_service::BroadcastChunk>> reader;
+  };
+
+  std::unique_ptr<Listener> join(int song_num) {
+    auto listener = std::make_unique<Listener>();
+    audio_service::JoinBroadcastRequest request;
+    request.set_song_num(song_num);
+    listener->reader = stub_->JoinBroadcast(&listener->context, request);
+    return listener;
+  }
+
+  // Wait until the hub has stopped every broadcast
+  bool waitForStop() {
+    for (int i = 0; i < 200; i++) {
+      if (service_->broadcasts()->GetStats().channels == 0) {
+        return true;
+      }
+      std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    return false;
+  }
+
+  int tone_num_ = 0;
+  int song_num_ = 0;
+  std::string tone_;
+};
+
+// Test that every listener gets the same timed chunks of the song, read
+// once for all of them, and that the broadcast moves on at the song's end
+TEST_F(AsyncAudioServiceBroadcastTest, BroadcastsToEveryListener) {
+  auto first = join(tone_num_);
+  audio_service::BroadcastChunk chunk;
+  ASSERT_TRUE(first->reader->Read(&chunk));
+  EXPECT_EQ(chunk.sequence(), 0u);
+
+  // The second listener starts with the chunks still ahead of their play
+  // time and reads along
+  auto second = join(tone_num_);
+  std::map<uint64_t, std::string> first_chunks, second_chunks;
+  std::thread second_reader([&second, &second_chunks]() {
+    audio_service::BroadcastChunk chunk;
+    while (second->reader->Read(&chunk)) {
+      second_chunks[chunk.sequence()] = chunk.data();
+      if (chunk.sequence() >= 22) {
+        break;
+      }
+    }
+  });
+
+  // Each chunk is 50 ms of audio from its place in the file, published
+  // 200 ms ahead of its play time
+  int64_t previous_play_time = 0;
+  do {
+    EXPECT_EQ(chunk.song_num(), tone_num_);
+    EXPECT_EQ(chunk.wav_header(), tone_.substr(0, 44));
+    ASSERT_LE(chunk.song_offset() + chunk.data().size(), tone_.size());
+    EXPECT_EQ(chunk.data(),
+              tone_.substr(chunk.song_offset(), chunk.data().size()));
+    if (previous_play_time != 0) {
+      EXPECT_EQ(chunk.play_time_us() - previous_play_time, 50000);
+    }
+    previous_play_time = chunk.play_time_us();
+    first_chunks[chunk.sequence()] = chunk.data();
+    ASSERT_TRUE(first->reader->Read(&chunk));
+  } while (chunk.song_offset() != 44);
+
+  // The song that is not a WAV file is skipped and the tone starts over
+  // after its last, shorter chunk
+  EXPECT_EQ(chunk.sequence(), 23u);
+  EXPECT_NEAR(chunk.play_time_us() - previous_play_time, 33787, 1);
+  second_reader.join();
+
+  ASSERT_FALSE(second_chunks.empty());
+  EXPECT_LE(second_chunks.begin()->first, 4u);
+  EXPECT_EQ(second_chunks.rbegin()->first, 22u);
+  for (const auto& [sequence, data] : second_chunks) {
+    ASSERT_EQ(first_chunks.count(sequence), 1u) << sequence;
+    EXPECT_EQ(first_chunks[sequence], data) << sequence;
+  }
+
+  BroadcastStats stats = service_->broadcasts()->GetStats();
+  EXPECT_EQ(stats.channels, 1u);
+  EXPECT_EQ(stats.listeners, 2u);
+  EXPECT_LT(stats.chunks, first_chunks.size() + second_chunks.size());
+  EXPECT_EQ(stats.skipped_chunks, 0u);
+
+  // The broadcast stops once its listeners are gone
+  first->context.TryCancel();
+  second->context.TryCancel();
+  first->reader->Finish();
+  second->reader->Finish();
+  EXPECT_TRUE(waitForStop());
+}
+
+// Test that only songs that can be played are broadcast
+TEST_F(AsyncAudioServiceBroadcastTest, JoinMissingBroadcast) {
+  audio_service::BroadcastChunk chunk;
+  for (int song_num : {999, song_num_}) {
+    auto listener = join(song_num);
+    EXPECT_FALSE(listener->reader->Read(&chunk));
+    EXPECT_EQ(listener->reader->Finish().error_code(),
+              grpc::StatusCode::NOT_FOUND);
+  }
+  EXPECT_EQ(service_->broadcasts()->GetStats().channels, 0u);
+}
+
+// Fixture for segment tests, the tone is a WAV song that can be segmented
+class AsyncAudioServiceSegmentTest : public AsyncAudioServiceTest {
+ protected:
+  AsyncAudioServiceSegmentTest() {
+    with_wav_song_ = true;
+    segment_duration_ = std::chrono::milliseconds(250);
+  }
+
+  void SetUp() override {
+    AsyncAudioServiceTest::SetUp();
+    auto playlist = audio_server_->GetPlaylist();
+    for (size_t i = 0; i < playlist.size(); i++) {
+      if (playlist[i] == "tone.wav") tone_num_ = i + 1;
+      if (playlist[i] == "song.wav") song_num_ = i + 1;
+    }
+  }
+
+  grpc::Status getIndex(int song_num,
+                        audio_service::SegmentIndexResponse* index) {
+    audio_service::SegmentIndexRequest request;
+    request.set_song_num(song_num);
+    grpc::ClientContext context;
+    return stub_->GetSegmentIndex(&context, request, index);
+  }
+
+  grpc::Status loadSegment(int song_num, int segment_id,
+                           const std::string& resume_token,
+                           std::string* data) {
+    audio_service::LoadSegmentRequest request;
+    request.set_song_num(song_num);
+    request.set_segment_id(segment_id);
+    request.set_resume_token(resume_token);
+
+    grpc::ClientContext context;
+    auto reader = stub_->LoadSegment(&context, request);
+    audio_service::AudioChunk chunk;
+    while (reader->Read(&chunk)) {
+      data->append(chunk.data());
+    }
+    return reader->Finish();
+  }
+
+  int tone_num_ = 0;
+  int song_num_ = 0;
+};
+
+// Test that segments fetched out of order reassemble the song
+TEST_F(AsyncAudioServiceSegmentTest, SegmentsReassembleSong) {
+  audio_service::SegmentIndexResponse index;
+  ASSERT_TRUE(getIndex(tone_num_, &index).ok());
+  EXPECT_EQ(index.sample_rate(), 44100);
+  EXPECT_EQ(index.channels(), 2);
+  EXPECT_EQ(index.bytes_per_frame(), 4);
+
+  // 50000 frames in segments of a quarter second
+  ASSERT_EQ(index.segments_size(), 5);
+  EXPECT_EQ(index.segments(0).frame_count(), 11025);
+  EXPECT_EQ(index.segments(4).frame_count(), 50000 - 4 * 11025);
+
+  std::string song(index.song_size(), '\0');
+  for (int id = index.segments_size() - 1; id >= 0; id--) {
+    const auto& segment = index.segments(id);
+    std::string data;
+    ASSERT_TRUE(loadSegment(tone_num_, id, index.resume_token(), &data).ok());
+    ASSERT_EQ(data.size(), segment.size());
+    EXPECT_EQ(music262::Crc32(data.data(), data.size()), segment.crc32());
+    song.replace(segment.offset(), segment.size(), data);
+  }
+
+  std::string whole;
+  ASSERT_TRUE(loadSong(tone_num_, &whole).ok());
+  EXPECT_EQ(song, whole);
+}
+
+// Test the errors of the segment RPCs
+TEST_F(AsyncAudioServiceSegmentTest, SegmentErrors) {
+  audio_service::SegmentIndexResponse index;
+  EXPECT_EQ(getIndex(song_num_, &index).error_code(),
+            grpc::StatusCode::NOT_FOUND);
+  EXPECT_EQ(getIndex(42, &index).error_code(), grpc::StatusCode::NOT_FOUND);
+
+  ASSERT_TRUE(getIndex(tone_num_, &index).ok());
+  std::string data;
+  EXPECT_EQ(loadSegment(tone_num_, index.segments_size(),
+                        index.resume_token(), &data)
+                .error_code(),
+            grpc::StatusCode::OUT_OF_RANGE);
+  EXPECT_EQ(loadSegment(tone_num_, 0, "0000000000000000", &data).error_code(),
+            grpc::StatusCode::FAILED_PRECONDITION);
+  EXPECT_TRUE(data.empty());
+}
+
+int main(int argc, char** argv) {
+  testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
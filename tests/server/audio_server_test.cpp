@@ -3,10 +3,18 @@
 #include <gmock/gmock.h>
 #include <gtest/gtest.h>
 
+#include <chrono>
+#include <condition_variable>
 #include <filesystem>
 #include <fstream>
+#include <mutex>
+#include <set>
+#include <thread>
+#include <vector>
 
 #include "../testlib/include/test_utils.h"
+#include "codec/include/lossless_codec.h"
+#include "common/include/content_hash.h"
 
 namespace fs = std::filesystem;
 
@@ -115,6 +123,257 @@ TEST_F(AudioServerTest, GetInvalidAudioFilePath) {
   EXPECT_TRUE(file_path.empty());
 }
 
+// Test mapping a song by its playlist index
+TEST_F(AudioServerTest, GetSong) {
+  auto song = server_->GetSong(1);
+  ASSERT_NE(song, nullptr);
+
+  // Header plus 1KB of audio data
+  EXPECT_EQ(song->size(), sizeof(WavHeader) + 1024);
+
+  // Repeated requests share the same mapping
+  EXPECT_EQ(server_->GetSong(1).get(), song.get());
+
+  // Invalid indices return no mapping
+  EXPECT_EQ(server_->GetSong(100), nullptr);
+}
+
+// Test that repeated song requests are served from the cache
+TEST_F(AudioServerTest, SongCache) {
+  server_->GetSong(1);
+  server_->GetSong(1);
+  server_->GetSong(2);
+
+  auto stats = server_->GetCacheStats();
+  EXPECT_EQ(stats.hits, 1);
+  EXPECT_EQ(stats.misses, 2);
+  EXPECT_EQ(stats.entries, 2);
+}
+
+// Test pinning and preloading songs into the cache
+TEST_F(AudioServerTest, PinAndPreload) {
+  EXPECT_TRUE(server_->PinSong(2));
+  EXPECT_FALSE(server_->PinSong(100));
+
+  EXPECT_EQ(server_->Preload(), 2);
+
+  auto stats = server_->GetCacheStats();
+  EXPECT_EQ(stats.entries, 2);
+  EXPECT_EQ(stats.pinned, 1);
+
+  // Preloaded songs are hits
+  server_->GetSong(1);
+  EXPECT_EQ(server_->GetCacheStats().hits, 1);
+}
+
+// Test that hashing and segmenting the catalog leave the song cache to
+// client requests
+TEST_F(AudioServerTest, CatalogIndexingBypassesSongCache) {
+  EXPECT_TRUE(server_->PinSong(2));
+  EXPECT_EQ(server_->Preload(), 2);
+  auto before = server_->GetCacheStats();
+
+  EXPECT_EQ(server_->HashCatalog(), 2);
+  EXPECT_NE(server_->GetSegmentIndex(1), nullptr);
+  auto after = server_->GetCacheStats();
+  EXPECT_EQ(after.hits, before.hits);
+  EXPECT_EQ(after.misses, before.misses);
+  EXPECT_EQ(after.evictions, before.evictions);
+  EXPECT_EQ(after.entries, 2);
+}
+
+// Test losslessly encoding the catalog and reusing it on the next run
+TEST_F(AudioServerTest, EncodeCatalog) {
+  EXPECT_EQ(server_->GetEncodedSong(1), nullptr);
+
+  fs::path codec_dir = test_dir_ / ".m2lc";
+  EXPECT_EQ(server_->EncodeCatalog(codec_dir.string()), 2);
+  EXPECT_TRUE(fs::exists(codec_dir / "test1.wav.m2lc"));
+
+  // The encoded song is smaller and decodes back to the original file
+  auto song = server_->GetSong(1);
+  auto encoded = server_->GetEncodedSong(1);
+  ASSERT_NE(encoded, nullptr);
+  EXPECT_LT(encoded->size(), song->size());
+
+  std::vector<char> decoded;
+  ASSERT_TRUE(
+      music262::DecodeLossless(encoded->data(), encoded->size(), &decoded));
+  EXPECT_EQ(std::string(decoded.begin(), decoded.end()),
+            std::string(song->data(), song->size()));
+
+  // A new server picks up the existing encodings
+  auto write_time = fs::last_write_time(codec_dir / "test1.wav.m2lc");
+  AudioServer restarted(test_dir_.string());
+  EXPECT_EQ(restarted.EncodeCatalog(codec_dir.string()), 2);
+  EXPECT_EQ(fs::last_write_time(codec_dir / "test1.wav.m2lc"), write_time);
+  EXPECT_NE(restarted.GetEncodedSong(2), nullptr);
+}
+
+// Test that a song replaced by an older file is encoded again
+TEST_F(AudioServerTest, EncodeCatalogReplacedSong) {
+  fs::path codec_dir = test_dir_ / ".m2lc";
+  ASSERT_EQ(server_->EncodeCatalog(codec_dir.string()), 2);
+  auto write_time = fs::last_write_time(codec_dir / "test1.wav.m2lc");
+
+  // Same size, different samples, and older than the existing encoding
+  fs::path replacement = test_dir_ / "replacement.tmp";
+  createTestWavFile(replacement);
+  {
+    std::fstream file(replacement,
+                      std::ios::binary | std::ios::in | std::ios::out);
+    file.seekp(sizeof(WavHeader));
+    for (int i = 0; i < 512; i++) {
+      int16_t sample = static_cast<int16_t>(i * 37);
+      file.write(reinterpret_cast<const char*>(&sample), sizeof(sample));
+    }
+  }
+  fs::last_write_time(replacement, write_time - std::chrono::hours(1));
+  fs::rename(replacement, test_dir_ / "test1.wav");
+  server_->RescanCatalog();
+
+  EXPECT_EQ(server_->EncodeCatalog(codec_dir.string()), 2);
+  auto song = server_->GetSong(1);
+  auto encoded = server_->GetEncodedSong(1);
+  ASSERT_NE(song, nullptr);
+  ASSERT_NE(encoded, nullptr);
+
+  music262::LosslessSource source;
+  ASSERT_TRUE(music262::ReadLosslessSource(encoded->data(), encoded->size(),
+                                           &source));
+  EXPECT_EQ(source.mtime_ns, song->mtime_ns());
+  EXPECT_EQ(source.content_hash,
+            music262::ContentHash(song->data(), song->size()));
+
+  std::vector<char> decoded;
+  ASSERT_TRUE(
+      music262::DecodeLossless(encoded->data(), encoded->size(), &decoded));
+  EXPECT_EQ(std::string(decoded.begin(), decoded.end()),
+            std::string(song->data(), song->size()));
+}
+
+// Test that changed and removed songs are picked up without renumbering
+TEST_F(AudioServerTest, RescanCatalog) {
+  auto before = server_->GetSong(1);
+  ASSERT_NE(before, nullptr);
+  std::string name = fs::path(server_->GetAudioFilePath(1)).filename();
+
+  // Grow song 1 and remove song 2
+  {
+    std::ofstream file(test_dir_ / name, std::ios::binary | std::ios::app);
+    file << std::string(1000, 'x');
+  }
+  std::string removed = fs::path(server_->GetAudioFilePath(2)).filename();
+  fs::remove(test_dir_ / removed);
+  createTestWavFile(test_dir_ / "test3.wav");
+  EXPECT_EQ(server_->RescanCatalog(), 3);
+
+  // The cached mapping of song 1 was dropped, the old one is still readable
+  auto after = server_->GetSong(1);
+  ASSERT_NE(after, nullptr);
+  EXPECT_EQ(after->size(), before->size() + 1000);
+  EXPECT_NE(after->resume_token(), before->resume_token());
+
+  // Song 2 is gone without renumbering, the new song is song 3
+  EXPECT_EQ(server_->GetSong(2), nullptr);
+  auto playlist = server_->GetPlaylist();
+  ASSERT_EQ(playlist.size(), 3);
+  EXPECT_EQ(playlist[0], name);
+  EXPECT_EQ(playlist[1], "");
+  EXPECT_EQ(playlist[2], "test3.wav");
+  EXPECT_EQ(server_->GetCatalog()->Find(3)->sample_rate, 44100u);
+}
+
+// Test that song digests are computed once and match the file contents
+TEST_F(AudioServerTest, SongDigest) {
+  SongDigest digest;
+  EXPECT_FALSE(server_->GetSongDigest(1, &digest, false));
+  EXPECT_FALSE(server_->GetSongDigest(42, &digest));
+
+  EXPECT_EQ(server_->HashCatalog(), 2);
+  ASSERT_TRUE(server_->GetSongDigest(1, &digest, false));
+
+  auto song = server_->GetSong(1);
+  EXPECT_EQ(digest.size, song->size());
+  EXPECT_EQ(digest.content_hash,
+            music262::ContentHash(song->data(), song->size()));
+  EXPECT_EQ(digest.resume_token, song->resume_token());
+}
+
+// Test that concurrent requests for a song without a segment index share
+// one build on a worker thread, and later requests get it right away
+TEST_F(AudioServerTest, SegmentIndexBuiltOffThread) {
+  constexpr int kRequests = 8;
+  std::mutex mutex;
+  std::condition_variable cv;
+  std::vector<std::shared_ptr<const SegmentIndex>> indexes;
+  std::set<std::thread::id> threads;
+
+  for (int i = 0; i < kRequests; i++) {
+    std::shared_ptr<const SegmentIndex> index;
+    std::shared_ptr<const MappedSong> song;
+    bool ready = server_->GetSegmentIndex(
+        1, &index, &song,
+        [&](std::shared_ptr<const SegmentIndex> built,
+            std::shared_ptr<const MappedSong>) {
+          std::lock_guard<std::mutex> lock(mutex);
+          indexes.push_back(built);
+          threads.insert(std::this_thread::get_id());
+          cv.notify_all();
+        });
+    if (ready) {
+      std::lock_guard<std::mutex> lock(mutex);
+      indexes.push_back(index);
+    }
+  }
+
+  {
+    std::unique_lock<std::mutex> lock(mutex);
+    ASSERT_TRUE(cv.wait_for(lock, std::chrono::seconds(5), [&]() {
+      return indexes.size() == kRequests;
+    }));
+    EXPECT_EQ(threads.count(std::this_thread::get_id()), 0u);
+  }
+  ASSERT_NE(indexes[0], nullptr);
+  for (const auto& index : indexes) {
+    EXPECT_EQ(index.get(), indexes[0].get());
+  }
+
+  std::shared_ptr<const SegmentIndex> index;
+  std::shared_ptr<const MappedSong> song;
+  EXPECT_TRUE(server_->GetSegmentIndex(1, &index, &song, nullptr));
+  EXPECT_EQ(index.get(), indexes[0].get());
+  EXPECT_EQ(index->resume_token, song->resume_token());
+
+  // Missing songs are answered right away
+  EXPECT_TRUE(server_->GetSegmentIndex(42, &index, &song, nullptr));
+  EXPECT_EQ(index, nullptr);
+}
+
+// Test that warming a song for a device format converts it ahead of the
+// LoadAudio call asking for it
+TEST_F(AudioServerTest, WarmSongConvertsToTheHintedFormat) {
+  music262::PcmFormat format;
+  format.sample_format = music262::PcmSampleFormat::kFloat32;
+  format.sample_rate = 48000;
+  format.channels = 2;
+
+  EXPECT_TRUE(server_->WarmSong(1, &format));
+  EXPECT_FALSE(server_->WarmSong(42, &format));
+  auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+  while (server_->GetTranscodeStats().conversions == 0 &&
+         std::chrono::steady_clock::now() < deadline) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+  EXPECT_EQ(server_->GetTranscodeStats().conversions, 1u);
+
+  std::shared_ptr<const MappedSong> converted;
+  EXPECT_TRUE(server_->GetConvertedSong(1, server_->GetSong(1), format,
+                                        &converted, nullptr));
+  ASSERT_NE(converted, nullptr);
+  EXPECT_EQ(server_->GetTranscodeStats().hits, 1u);
+}
+
 // Test client registration and retrieval
 TEST_F(AudioServerTest, RegisterAndGetClients) {
   // Register some clients
@@ -0,0 +1,109 @@
+#include "server/include/broadcast_ring.h"
+
+#include <gtest/gtest.h>
+
+#include <atomic>
+#include <memory>
+#include <thread>
+#include <vector>
+
+using Ring = BroadcastRing<uint64_t>;
+using ReadResult = Ring::ReadResult;
+
+// Test that published items are read back in order and later ones are not
+// there yet
+TEST(BroadcastRingTest, PublishesInOrder) {
+  Ring ring(8);
+  EXPECT_EQ(ring.Publish(std::make_shared<uint64_t>(10)), 0u);
+  EXPECT_EQ(ring.Publish(std::make_shared<uint64_t>(11)), 1u);
+  EXPECT_EQ(ring.head(), 2u);
+
+  std::shared_ptr<const uint64_t> item;
+  ASSERT_EQ(ring.Read(0, &item), ReadResult::kOk);
+  EXPECT_EQ(*item, 10u);
+  ASSERT_EQ(ring.Read(1, &item), ReadResult::kOk);
+  EXPECT_EQ(*item, 11u);
+  EXPECT_EQ(ring.Read(2, &item), ReadResult::kNotYet);
+}
+
+// Test that the capacity is rounded up and the oldest items are overwritten
+TEST(BroadcastRingTest, OverwritesOldest) {
+  Ring ring(3);
+  EXPECT_EQ(ring.capacity(), 4u);
+  for (uint64_t i = 0; i < 6; i++) {
+    ring.Publish(std::make_shared<uint64_t>(i));
+  }
+  EXPECT_EQ(ring.oldest(), 2u);
+
+  std::shared_ptr<const uint64_t> item;
+  EXPECT_EQ(ring.Read(0, &item), ReadResult::kOverwritten);
+  EXPECT_EQ(ring.Read(1, &item), ReadResult::kOverwritten);
+  for (uint64_t i = 2; i < 6; i++) {
+    ASSERT_EQ(ring.Read(i, &item), ReadResult::kOk);
+    EXPECT_EQ(*item, i);
+  }
+}
+
+// Test that a reader's reference outlives the item being overwritten
+TEST(BroadcastRingTest, ReadItemsStayValid) {
+  Ring ring(1);
+  ring.Publish(std::make_shared<uint64_t>(1));
+  std::shared_ptr<const uint64_t> item;
+  ASSERT_EQ(ring.Read(0, &item), ReadResult::kOk);
+  ring.Publish(std::make_shared<uint64_t>(2));
+  EXPECT_EQ(*item, 1u);
+  EXPECT_EQ(item.use_count(), 1);
+}
+
+// Test that readers following a producer never see a wrong item, and only
+// lose items by being overwritten
+TEST(BroadcastRingTest, ConcurrentReaders) {
+  constexpr uint64_t kItems = 200000;
+  Ring ring(16);
+  std::atomic<bool> done{false};
+
+  std::vector<uint64_t> received(4, 0);
+  std::vector<uint64_t> skipped(4, 0);
+  std::vector<char> ordered(4, true);
+  std::vector<std::thread> readers;
+  for (size_t r = 0; r < received.size(); r++) {
+    readers.emplace_back([&, r]() {
+      uint64_t cursor = 0;
+      std::shared_ptr<const uint64_t> item;
+      while (cursor < kItems) {
+        switch (ring.Read(cursor, &item)) {
+          case ReadResult::kOk:
+            ordered[r] = ordered[r] && *item == cursor;
+            received[r]++;
+            cursor++;
+            break;
+          case ReadResult::kOverwritten: {
+            uint64_t oldest = ring.oldest();
+            skipped[r] += oldest - cursor;
+            cursor = oldest;
+            break;
+          }
+          case ReadResult::kNotYet:
+            if (done) {
+              return;
+            }
+            std::this_thread::yield();
+            break;
+        }
+      }
+    });
+  }
+
+  for (uint64_t i = 0; i < kItems; i++) {
+    ring.Publish(std::make_shared<uint64_t>(i));
+  }
+  done = true;
+  for (auto& reader : readers) {
+    reader.join();
+  }
+
+  for (size_t r = 0; r < received.size(); r++) {
+    EXPECT_TRUE(ordered[r]) << r;
+    EXPECT_EQ(received[r] + skipped[r], kItems) << r;
+  }
+}
@@ -0,0 +1,71 @@
+#include "server/include/chunk_sizer.h"
+
+#include <gtest/gtest.h>
+
+using std::chrono::microseconds;
+
+constexpr size_t kKB = 1024;
+
+// Test that the first chunk uses the initial size within the bounds
+TEST(ChunkSizerTest, InitialSize) {
+  ChunkSizer sizer(16 * kKB, 1024 * kKB, microseconds(5000));
+  EXPECT_EQ(sizer.NextChunkSize(), ChunkSizer::kInitialChunkSize);
+
+  ChunkSizer large(256 * kKB, 1024 * kKB, microseconds(5000));
+  EXPECT_EQ(large.NextChunkSize(), 256 * kKB);
+
+  ChunkSizer small(4 * kKB, 8 * kKB, microseconds(5000));
+  EXPECT_EQ(small.NextChunkSize(), 8 * kKB);
+}
+
+// Test that equal bounds pin the chunk size
+TEST(ChunkSizerTest, FixedSize) {
+  ChunkSizer sizer(32 * kKB, 32 * kKB, microseconds(5000));
+  for (int i = 0; i < 10; i++) {
+    sizer.OnWriteComplete(32 * kKB, microseconds(1));
+  }
+  EXPECT_EQ(sizer.NextChunkSize(), 32 * kKB);
+}
+
+// Test that fast writes grow the chunk size up to the maximum
+TEST(ChunkSizerTest, GrowsOnFastWrites) {
+  ChunkSizer sizer(16 * kKB, 1024 * kKB, microseconds(5000));
+
+  // Writes drain in 50us, far below the target
+  size_t previous = sizer.NextChunkSize();
+  sizer.OnWriteComplete(previous, microseconds(50));
+  EXPECT_EQ(sizer.NextChunkSize(), previous * 2);
+
+  for (int i = 0; i < 20; i++) {
+    sizer.OnWriteComplete(sizer.NextChunkSize(), microseconds(50));
+  }
+  EXPECT_EQ(sizer.NextChunkSize(), 1024 * kKB);
+}
+
+// Test that slow, backpressured writes shrink the chunk size to the minimum
+TEST(ChunkSizerTest, ShrinksOnSlowWrites) {
+  ChunkSizer sizer(16 * kKB, 1024 * kKB, microseconds(5000));
+
+  // A 64 KB write stalled for 100ms
+  sizer.OnWriteComplete(64 * kKB, microseconds(100000));
+  EXPECT_EQ(sizer.NextChunkSize(), 32 * kKB);
+
+  for (int i = 0; i < 20; i++) {
+    sizer.OnWriteComplete(sizer.NextChunkSize(), microseconds(100000));
+  }
+  EXPECT_EQ(sizer.NextChunkSize(), 16 * kKB);
+}
+
+// Test that the size settles where a write takes about the target latency
+TEST(ChunkSizerTest, ConvergesToTargetLatency) {
+  ChunkSizer sizer(4 * kKB, 4096 * kKB, microseconds(5000));
+
+  // A link draining 50 bytes per microsecond settles near 250 KB chunks
+  for (int i = 0; i < 50; i++) {
+    size_t bytes = sizer.NextChunkSize();
+    sizer.OnWriteComplete(bytes, microseconds(bytes / 50));
+  }
+  EXPECT_NEAR(static_cast<double>(sizer.NextChunkSize()), 250000.0,
+              2.0 * ChunkSizer::kGranularity);
+  EXPECT_EQ(sizer.NextChunkSize() % ChunkSizer::kGranularity, 0u);
+}
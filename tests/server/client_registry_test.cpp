@@ -0,0 +1,205 @@
+#include "server/include/client_registry.h"
+
+#include <gmock/gmock.h>
+#include <gtest/gtest.h>
+
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+
+using std::chrono::seconds;
+
+class ClientRegistryTest : public ::testing::Test {
+ protected:
+  ClientRegistry::Clock::time_point at(int second) {
+    return start_ + seconds(second);
+  }
+
+  ClientRegistry::Clock::time_point start_ = ClientRegistry::Clock::now();
+  ClientRegistry registry_{seconds(30)};
+};
+
+TEST_F(ClientRegistryTest, RenewingKeepsTheId) {
+  int id = registry_.Register("10.0.0.1:5000", at(0));
+  EXPECT_EQ(registry_.Register("10.0.0.2:5000", at(1)), id + 1);
+  EXPECT_EQ(registry_.Register("10.0.0.1:5000", at(20)), id);
+
+  // The renewed client is listed first, the caller is left out
+  EXPECT_EQ(registry_.List("", at(21)),
+            (std::vector<std::string>{"10.0.0.1:5000", "10.0.0.2:5000"}));
+  EXPECT_EQ(registry_.List("10.0.0.1:5000", at(21)),
+            (std::vector<std::string>{"10.0.0.2:5000"}));
+}
+
+TEST_F(ClientRegistryTest, SilentClientsExpire) {
+  registry_.Register("10.0.0.1:5000", at(0));
+  int id = registry_.Register("10.0.0.2:5000", at(10));
+  registry_.Register("10.0.0.1:5000", at(25));
+
+  // Client 2 was last seen at 10 s, its lease ran out at 40 s
+  EXPECT_THAT(registry_.List("", at(39)),
+              ::testing::ElementsAre("10.0.0.1:5000", "10.0.0.2:5000"));
+  EXPECT_THAT(registry_.List("", at(40)),
+              ::testing::ElementsAre("10.0.0.1:5000"));
+  EXPECT_TRUE(registry_.List("", at(55)).empty());
+
+  EXPECT_EQ(registry_.Expire(at(40)), 1u);
+  EXPECT_EQ(registry_.Expire(at(40)), 0u);
+
+  // A client that comes back is registered again under a new id
+  EXPECT_NE(registry_.Register("10.0.0.2:5000", at(60)), id);
+  EXPECT_EQ(registry_.Leases(at(60)).size(), 1u);
+}
+
+TEST_F(ClientRegistryTest, LeaseChangesApplyToRegisteredClients) {
+  registry_.Register("10.0.0.1:5000", at(0));
+  registry_.set_lease(seconds(5));
+  EXPECT_EQ(registry_.lease(), seconds(5));
+  EXPECT_TRUE(registry_.List("", at(5)).empty());
+}
+
+TEST_F(ClientRegistryTest, ScalesToThousandsOfClients) {
+  constexpr int kClients = 5000;
+  for (int i = 0; i < kClients; i++) {
+    registry_.Register("10.0.0.1:" + std::to_string(i), at(0));
+  }
+  for (int i = 0; i < kClients; i += 2) {
+    registry_.Register("10.0.0.1:" + std::to_string(i), at(20));
+  }
+
+  // Registering after the first lease ran out drops the odd clients
+  registry_.Register("10.0.0.2:1", at(31));
+  auto clients = registry_.Leases(at(31));
+  ASSERT_EQ(clients.size(), kClients / 2 + 1u);
+  EXPECT_EQ(clients.front().address, "10.0.0.2:1");
+  EXPECT_EQ(clients.back().address, "10.0.0.1:0");
+  EXPECT_EQ(clients.back().id, 1);
+}
+
+TEST_F(ClientRegistryTest, PublishesOnlyMembershipChanges) {
+  registry_.Register("10.0.0.1:5000", at(0));
+  auto first = registry_.Snapshot();
+  ASSERT_EQ(first->addresses.size(), 1u);
+
+  // Renewals keep the published list, a new client replaces it
+  registry_.Register("10.0.0.1:5000", at(2));
+  EXPECT_EQ(registry_.Snapshot(), first);
+  registry_.Register("10.0.0.2:5000", at(4));
+  auto second = registry_.Snapshot();
+  EXPECT_EQ(second->version, first->version + 1);
+  EXPECT_EQ(second->addresses,
+            (std::vector<std::string>{"10.0.0.2:5000", "10.0.0.1:5000"}));
+
+  // Changing an advertisement replaces it too, repeating it does not
+  ClientAdvertisement advertisement;
+  advertisement.p2p_port = 50052;
+  advertisement.cached_songs = {3, 1};
+  registry_.Advertise("10.0.0.1:5000", advertisement, at(5));
+  auto advertised = registry_.Snapshot();
+  EXPECT_NE(advertised, second);
+  registry_.Advertise("10.0.0.1:5000", advertisement, at(6));
+  EXPECT_EQ(registry_.Snapshot(), advertised);
+
+  // Only the advertised client is a peer, named by its peer service port,
+  // and is one length-delimited field of the encoding
+  ASSERT_EQ(advertised->peers.size(), 1u);
+  const PeerEntry& peer = advertised->peers[0];
+  EXPECT_EQ(peer.peer_address, "10.0.0.1:50052");
+  EXPECT_EQ(peer.cached_songs, (std::vector<int>{1, 3}));
+  EXPECT_TRUE(peer.HasSong(3));
+  EXPECT_FALSE(peer.HasSong(2));
+  auto [start, end] = peer.range;
+  EXPECT_EQ(end, advertised->encoded.size());
+  EXPECT_EQ(advertised->encoded.substr(start, 2), "\x0a\x0e");
+  EXPECT_EQ(advertised->encoded.substr(start + 2), "10.0.0.1:50052");
+
+  // Dropping a lease that ran out publishes the list without it
+  EXPECT_EQ(registry_.Expire(at(34)), 1u);
+  auto third = registry_.Snapshot();
+  EXPECT_NE(third, advertised);
+  EXPECT_EQ(third->addresses, (std::vector<std::string>{"10.0.0.1:5000"}));
+}
+
+TEST_F(ClientRegistryTest, ExpiryThreadPublishesDeferredChanges) {
+  registry_.StartExpiring();
+  registry_.Register("10.0.0.1:5000");
+  auto first = registry_.Snapshot();
+  ASSERT_EQ(first->addresses.size(), 1u);
+
+  // Joins right after a publish are listed together once the interval ends
+  registry_.Register("10.0.0.2:5000");
+  registry_.Register("10.0.0.3:5000");
+  auto deadline = ClientRegistry::Clock::now() + seconds(5);
+  while (registry_.Snapshot() == first &&
+         ClientRegistry::Clock::now() < deadline) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(5));
+  }
+  auto second = registry_.Snapshot();
+  EXPECT_GE(second->published - first->published,
+            ClientRegistry::kMaxStaleness);
+  EXPECT_EQ(second->version, first->version + 1);
+  EXPECT_EQ(second->addresses.size(), 3u);
+  registry_.StopExpiring();
+}
+
+TEST_F(ClientRegistryTest, LogsPeerJoinsAndLeaves) {
+  ClientAdvertisement advertisement;
+  advertisement.p2p_port = 7000;
+  registry_.Advertise("10.0.0.1:5000", advertisement, at(0));
+  registry_.Register("10.0.0.2:5000", at(1));  // Not a peer
+  advertisement.p2p_port = 7001;
+  registry_.Advertise("10.0.0.3:5000", advertisement, at(2));
+
+  // A first watch starts from every current peer
+  PeerChanges all = registry_.Changes(0, 0, at(3));
+  EXPECT_TRUE(all.reset);
+  EXPECT_EQ(all.sequence, 2u);
+  ASSERT_EQ(all.events.size(), 2u);
+  EXPECT_EQ(all.events[0].peer_address, "10.0.0.3:7001");
+  EXPECT_EQ(all.events[1].peer_address, "10.0.0.1:7000");
+  EXPECT_EQ(registry_.sequence(), 2u);
+
+  // Changing the port replaces the peer, expiring drops it
+  advertisement.p2p_port = 7002;
+  registry_.Advertise("10.0.0.3:5000", advertisement, at(20));
+  EXPECT_EQ(registry_.Expire(at(31)), 2u);
+  PeerChanges changes = registry_.Changes(all.epoch, all.sequence, at(31));
+  EXPECT_FALSE(changes.reset);
+  EXPECT_EQ(changes.sequence, 5u);
+  ASSERT_EQ(changes.events.size(), 3u);
+  EXPECT_FALSE(changes.events[0].joined);
+  EXPECT_EQ(changes.events[0].peer_address, "10.0.0.3:7001");
+  EXPECT_TRUE(changes.events[1].joined);
+  EXPECT_EQ(changes.events[1].peer_address, "10.0.0.3:7002");
+  EXPECT_FALSE(changes.events[2].joined);
+  EXPECT_EQ(changes.events[2].address, "10.0.0.1:5000");
+  EXPECT_TRUE(registry_.Changes(all.epoch, 5, at(31)).events.empty());
+
+  // Sequence numbers of another run start over
+  PeerChanges other = registry_.Changes(all.epoch + 1, 5, at(31));
+  EXPECT_TRUE(other.reset);
+  ASSERT_EQ(other.events.size(), 1u);
+  EXPECT_EQ(other.events[0].peer_address, "10.0.0.3:7002");
+}
+
+TEST_F(ClientRegistryTest, ExpiryThreadDropsSilentPeers) {
+  registry_.set_lease(std::chrono::milliseconds(100));
+  std::atomic<int> notified{0};
+  registry_.SetChangeListener([&notified]() { notified++; });
+  registry_.StartExpiring();
+
+  ClientAdvertisement advertisement;
+  advertisement.p2p_port = 7000;
+  registry_.Advertise("10.0.0.1:5000", advertisement);
+  EXPECT_EQ(notified, 1);
+
+  // Nobody calls, the lease runs out on its own
+  for (int i = 0; i < 100 && notified < 2; i++) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  }
+  EXPECT_EQ(notified, 2);
+  EXPECT_TRUE(registry_.Leases().empty());
+  registry_.StopExpiring();
+}
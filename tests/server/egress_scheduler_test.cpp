@@ -0,0 +1,208 @@
+#include "server/include/egress_scheduler.h"
+
+#include <gtest/gtest.h>
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+using FlowId = EgressScheduler::FlowId;
+
+namespace {
+
+// Drives a scheduler the way streams do: every flow keeps one chunk queued
+// or in flight, and the oldest chunk in flight completes first
+class StreamSimulation {
+ public:
+  explicit StreamSimulation(EgressScheduler* scheduler)
+      : scheduler_(scheduler) {}
+
+  void AddStream(FlowId flow, size_t chunk_bytes, bool urgent = false) {
+    chunks_[flow] = chunk_bytes;
+    urgent_[flow] = urgent;
+    RequestNext(flow);
+  }
+
+  // Complete one chunk and let its stream ask for the next
+  void Step() {
+    ASSERT_FALSE(inflight_.empty());
+    FlowId flow = inflight_.front();
+    inflight_.pop_front();
+    scheduler_->Complete(chunks_[flow]);
+    RequestNext(flow);
+  }
+
+  const std::map<FlowId, size_t>& sent() const { return sent_; }
+  const std::vector<FlowId>& grants() const { return grants_; }
+
+ private:
+  void RequestNext(FlowId flow) {
+    if (scheduler_->Request(flow, chunks_[flow], urgent_[flow],
+                            [this, flow]() { Granted(flow); })) {
+      Granted(flow);
+    }
+  }
+
+  void Granted(FlowId flow) {
+    sent_[flow] += chunks_[flow];
+    grants_.push_back(flow);
+    inflight_.push_back(flow);
+  }
+
+  EgressScheduler* scheduler_;
+  std::map<FlowId, size_t> chunks_;
+  std::map<FlowId, bool> urgent_;
+  std::map<FlowId, size_t> sent_;
+  std::vector<FlowId> grants_;
+  std::deque<FlowId> inflight_;
+};
+
+}  // namespace
+
+// Test that chunks fitting the window are granted right away
+TEST(EgressSchedulerTest, GrantsWithinWindow) {
+  EgressOptions options;
+  options.window_bytes = 100;
+  EgressScheduler scheduler(options);
+  FlowId first = scheduler.AddFlow("10.0.0.1");
+  FlowId second = scheduler.AddFlow("10.0.0.2");
+
+  bool woken = false;
+  auto wake = [&woken]() { woken = true; };
+  EXPECT_TRUE(scheduler.Request(first, 60, false, wake));
+  EXPECT_EQ(scheduler.inflight_bytes(), 60u);
+
+  // The second chunk has to wait for the first to complete
+  EXPECT_FALSE(scheduler.Request(second, 60, false, wake));
+  EXPECT_EQ(scheduler.queued(), 1u);
+  EXPECT_FALSE(woken);
+  scheduler.Complete(60);
+  EXPECT_TRUE(woken);
+  EXPECT_EQ(scheduler.queued(), 0u);
+  EXPECT_EQ(scheduler.inflight_bytes(), 60u);
+  scheduler.Complete(60);
+
+  // A chunk larger than the window goes out when nothing else is in flight
+  EXPECT_TRUE(scheduler.Request(first, 500, false, wake));
+  scheduler.Complete(500);
+  EXPECT_EQ(scheduler.inflight_bytes(), 0u);
+}
+
+// Test that streams get the same share of bytes whatever their chunk size
+TEST(EgressSchedulerTest, SharesBytesFairly) {
+  EgressOptions options;
+  options.window_bytes = 1;  // One chunk in flight at a time
+  EgressScheduler scheduler(options);
+  StreamSimulation simulation(&scheduler);
+
+  std::vector<FlowId> flows;
+  for (size_t chunk_kb : {32, 48, 64, 96}) {
+    flows.push_back(scheduler.AddFlow("10.0.0." + std::to_string(chunk_kb)));
+    simulation.AddStream(flows.back(), chunk_kb * 1024);
+  }
+  for (int i = 0; i < 2000; i++) {
+    simulation.Step();
+  }
+
+  // Within a couple of chunks of each other
+  size_t smallest = ~size_t{0};
+  size_t largest = 0;
+  for (FlowId flow : flows) {
+    smallest = std::min(smallest, simulation.sent().at(flow));
+    largest = std::max(largest, simulation.sent().at(flow));
+  }
+  EXPECT_LT(largest - smallest, 2u * 96 * 1024);
+  EXPECT_GT(smallest, 0u);
+}
+
+// Test that the first chunks of a new stream overtake bulk transfers
+TEST(EgressSchedulerTest, UrgentChunksGoFirst) {
+  EgressOptions options;
+  options.window_bytes = 1;
+  EgressScheduler scheduler(options);
+  StreamSimulation simulation(&scheduler);
+
+  std::vector<FlowId> bulk;
+  for (int i = 0; i < 8; i++) {
+    bulk.push_back(scheduler.AddFlow("10.0.0." + std::to_string(i)));
+    simulation.AddStream(bulk.back(), 64 * 1024);
+  }
+  for (int i = 0; i < 20; i++) {
+    simulation.Step();
+  }
+
+  // The new listener is next in line, ahead of the 7 queued bulk streams
+  FlowId listener = scheduler.AddFlow("10.0.1.1");
+  simulation.AddStream(listener, 64 * 1024, true);
+  EXPECT_EQ(scheduler.queued(), 8u);
+  simulation.Step();
+  ASSERT_FALSE(simulation.grants().empty());
+  EXPECT_EQ(simulation.grants().back(), listener);
+}
+
+// Test that a client over its rate is held back while others are not
+TEST(EgressSchedulerTest, CapsClientRate) {
+  EgressOptions options;
+  options.window_bytes = 0;
+  options.client_rate_bytes_per_sec = 1024 * 1024;
+  EgressScheduler scheduler(options);
+  FlowId capped = scheduler.AddFlow("10.0.0.1");
+  FlowId other = scheduler.AddFlow("10.0.0.2");
+
+  // The burst is a tenth of a second, a 200 KB chunk empties it
+  EXPECT_TRUE(scheduler.Request(capped, 200 * 1024, false, [] {}));
+  scheduler.Complete(200 * 1024);
+
+  std::mutex mutex;
+  std::condition_variable cv;
+  bool woken = false;
+  auto start = std::chrono::steady_clock::now();
+  EXPECT_FALSE(scheduler.Request(capped, 1024, false, [&]() {
+    std::lock_guard<std::mutex> lock(mutex);
+    woken = true;
+    cv.notify_all();
+  }));
+
+  // Another host is not affected
+  EXPECT_TRUE(scheduler.Request(other, 1024, false, [] {}));
+  scheduler.Complete(1024);
+
+  // 100 KB over the cap take about 100 ms to pay back
+  std::unique_lock<std::mutex> lock(mutex);
+  ASSERT_TRUE(
+      cv.wait_for(lock, std::chrono::seconds(5), [&woken] { return woken; }));
+  auto waited = std::chrono::steady_clock::now() - start;
+  EXPECT_GE(waited, std::chrono::milliseconds(80));
+  scheduler.Complete(1024);
+}
+
+// Test that shutting down releases every queued stream
+TEST(EgressSchedulerTest, ShutdownWakesQueuedFlows) {
+  EgressOptions options;
+  options.window_bytes = 1;
+  EgressScheduler scheduler(options);
+  FlowId first = scheduler.AddFlow("10.0.0.1");
+  FlowId second = scheduler.AddFlow("10.0.0.1");
+  FlowId third = scheduler.AddFlow("10.0.0.2");
+
+  int woken = 0;
+  auto wake = [&woken]() { woken++; };
+  EXPECT_TRUE(scheduler.Request(first, 10, false, wake));
+  EXPECT_FALSE(scheduler.Request(second, 10, true, wake));
+  EXPECT_FALSE(scheduler.Request(third, 10, false, wake));
+
+  scheduler.Shutdown();
+  EXPECT_EQ(woken, 2);
+  EXPECT_EQ(scheduler.queued(), 0u);
+
+  // Chunks asked for from now on are not held back
+  EXPECT_TRUE(scheduler.Request(first, 10, false, wake));
+  scheduler.RemoveFlow(first);
+  scheduler.RemoveFlow(second);
+  scheduler.RemoveFlow(third);
+}
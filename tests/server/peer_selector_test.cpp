@@ -0,0 +1,86 @@
+#include "server/include/peer_selector.h"
+
+#include <gmock/gmock.h>
+#include <gtest/gtest.h>
+
+#include <string>
+#include <vector>
+
+class PeerSelectorTest : public ::testing::Test {
+ protected:
+  void Advertise(const std::string& address, int64_t uplink_kbps,
+                 std::vector<int> cached_songs = {}) {
+    ClientAdvertisement advertisement;
+    advertisement.p2p_port = 7000;
+    advertisement.uplink_kbps = uplink_kbps;
+    advertisement.cached_songs = std::move(cached_songs);
+    registry_.Advertise(address, advertisement);
+  }
+
+  // Peer addresses selected for a requester
+  std::vector<std::string> Select(const std::string& address,
+                                  size_t max_peers, int song_num = 0) {
+    PeerQuery query;
+    query.address = address;
+    query.max_peers = max_peers;
+    query.song_num = song_num;
+    auto clients = registry_.Snapshot();
+    std::vector<std::string> peers;
+    for (size_t i : SelectPeers(*clients, query)) {
+      peers.push_back(clients->peers[i].peer_address);
+    }
+    return peers;
+  }
+
+  ClientRegistry registry_;
+};
+
+TEST_F(PeerSelectorTest, SubnetOfMasksTheHost) {
+  EXPECT_EQ(SubnetOf("192.168.1.77:5000"), "192.168.1.0/24");
+  EXPECT_EQ(SubnetOf("[2001:db8:1:2:3:4:5:6]:5000"), "2001:db8:1:2::/64");
+  EXPECT_EQ(SubnetOf("localhost:5000"), "localhost");
+}
+
+TEST_F(PeerSelectorTest, PrefersNearbyWellProvisionedPeers) {
+  Advertise("10.0.1.1:5000", 1000);
+  Advertise("10.0.2.1:5000", 9000);
+  Advertise("10.0.1.2:5000", 5000);
+  Advertise("10.0.2.2:5000", 2000);
+  registry_.Register("10.0.1.9:5000");  // No peer service, never offered
+
+  EXPECT_EQ(Select("10.0.1.3:5000", 8),
+            (std::vector<std::string>{"10.0.1.2:7000", "10.0.1.1:7000",
+                                      "10.0.2.1:7000", "10.0.2.2:7000"}));
+
+  // The requester is left out
+  EXPECT_EQ(Select("10.0.2.1:5000", 8),
+            (std::vector<std::string>{"10.0.2.2:7000", "10.0.1.2:7000",
+                                      "10.0.1.1:7000"}));
+}
+
+TEST_F(PeerSelectorTest, PrefersPeersHoldingTheSong) {
+  Advertise("10.0.1.1:5000", 1000, {4});
+  Advertise("10.0.1.2:5000", 5000);
+  Advertise("10.0.2.1:5000", 9000, {4, 7});
+  Advertise("10.0.2.2:5000", 2000);
+
+  EXPECT_EQ(Select("10.0.1.3:5000", 8, 4),
+            (std::vector<std::string>{"10.0.1.1:7000", "10.0.1.2:7000",
+                                      "10.0.2.1:7000", "10.0.2.2:7000"}));
+  EXPECT_EQ(Select("10.0.3.1:5000", 2, 4),
+            (std::vector<std::string>{"10.0.2.1:7000", "10.0.1.1:7000"}));
+}
+
+TEST_F(PeerSelectorTest, SelectsAtMostMaxPeers) {
+  for (int i = 0; i < 1000; i++) {
+    Advertise("10.0." + std::to_string(i / 250) + "." +
+                  std::to_string(i % 250) + ":5000",
+              i);
+  }
+
+  auto peers = Select("10.0.3.249:5000", 5);
+  EXPECT_EQ(peers, (std::vector<std::string>{
+                       "10.0.3.248:7000", "10.0.3.247:7000", "10.0.3.246:7000",
+                       "10.0.3.245:7000", "10.0.3.244:7000"}));
+  EXPECT_TRUE(Select("10.0.0.1:5000", 0).empty());
+}
@@ -0,0 +1,107 @@
+#include "server/include/playlist_index.h"
+
+#include <gtest/gtest.h>
+
+#include <string>
+#include <vector>
+
+class PlaylistIndexTest : public ::testing::Test {
+ protected:
+  SongMetadata song(int id, const std::string& name, size_t size = 100) {
+    SongMetadata metadata;
+    metadata.id = id;
+    metadata.name = name;
+    metadata.size = size;
+    metadata.mtime_ns = 1000 + id;
+    return metadata;
+  }
+
+  // Replace the catalog with the given songs and report them as changed
+  void update(std::vector<SongMetadata> songs,
+              const std::vector<SongMetadata>& changed) {
+    catalog_.songs = std::move(songs);
+    index_.UpdateSongs(catalog_, changed);
+  }
+
+  CatalogSnapshot catalog_;
+  PlaylistIndex index_;
+};
+
+TEST_F(PlaylistIndexTest, PublishesChangesAsOneVersion) {
+  update({song(1, "a.wav"), song(2, "b.wav")},
+         {song(1, "a.wav"), song(2, "b.wav")});
+  auto first = index_.Snapshot();
+  ASSERT_EQ(first->entries.size(), 2u);
+  EXPECT_EQ(first->entries[1].song.name, "b.wav");
+  EXPECT_EQ(index_.Snapshot(), first);
+
+  // Hashes are versioned like any other change, all pending changes are
+  // published together
+  EXPECT_TRUE(index_.SetDigest(1, 100, 1001, 0xabc));
+  EXPECT_TRUE(index_.SetDigest(2, 100, 1002, 0xdef));
+  auto second = index_.Snapshot();
+  EXPECT_EQ(second->version, first->version + 1);
+  EXPECT_EQ(second->entries[0].content_hash, 0xabcu);
+  EXPECT_EQ(second->entries[0].version, second->version);
+  EXPECT_EQ(first->entries[0].content_hash, 0u);
+}
+
+TEST_F(PlaylistIndexTest, IgnoresDigestsOfOldVersions) {
+  update({song(1, "a.wav")}, {song(1, "a.wav")});
+  update({song(1, "a.wav", 200)}, {song(1, "a.wav", 200)});
+
+  EXPECT_FALSE(index_.SetDigest(1, 100, 1001, 0xabc));
+  EXPECT_FALSE(index_.SetDigest(7, 100, 1001, 0xabc));
+  EXPECT_TRUE(index_.SetDigest(1, 200, 1001, 0xabc));
+}
+
+TEST_F(PlaylistIndexTest, KeepsRemovedSongsAsEntries) {
+  update({song(1, "a.wav"), song(2, "b.wav")},
+         {song(1, "a.wav"), song(2, "b.wav")});
+  uint64_t before = index_.Snapshot()->version;
+
+  update({song(2, "b.wav"), song(4, "d.wav")},
+         {song(1, "a.wav"), song(4, "d.wav")});
+  auto after = index_.Snapshot();
+  ASSERT_EQ(after->entries.size(), 4u);
+
+  // The changes since `before` are the removed song 1, the unused id 3 and
+  // the new song 4
+  std::vector<int> changed;
+  for (const auto& entry : after->entries) {
+    if (entry.version > before) {
+      changed.push_back(entry.song.id);
+    }
+  }
+  EXPECT_EQ(changed, (std::vector<int>{1, 3, 4}));
+  EXPECT_TRUE(after->entries[0].song.name.empty());
+  EXPECT_TRUE(after->entries[2].song.name.empty());
+  EXPECT_EQ(after->entries[3].song.name, "d.wav");
+}
+
+TEST_F(PlaylistIndexTest, EtagsIdentifyVersionAndRun) {
+  update({song(1, "a.wav")}, {song(1, "a.wav")});
+  auto snapshot = index_.Snapshot();
+
+  uint64_t version = 0;
+  EXPECT_TRUE(snapshot->ParseEtag(snapshot->etag(), &version));
+  EXPECT_EQ(version, snapshot->version);
+  EXPECT_FALSE(snapshot->ParseEtag("", &version));
+  EXPECT_FALSE(snapshot->ParseEtag(snapshot->etag() + "x", &version));
+
+  // Another run of the server uses another epoch
+  PlaylistIndex other;
+  EXPECT_FALSE(other.Snapshot()->ParseEtag(snapshot->etag(), &version));
+}
+
+TEST_F(PlaylistIndexTest, KeepsRecentVersions) {
+  update({song(1, "a.wav")}, {song(1, "a.wav")});
+  uint64_t first = index_.Snapshot()->version;
+  for (size_t i = 0; i < PlaylistIndex::kHistory; i++) {
+    update({song(1, "a.wav", 100 + i)}, {song(1, "a.wav", 100 + i)});
+    EXPECT_NE(index_.Snapshot(first + i), nullptr);
+    index_.Snapshot();
+  }
+  EXPECT_EQ(index_.Snapshot(first), nullptr);
+  EXPECT_NE(index_.Snapshot(first + 1), nullptr);
+}
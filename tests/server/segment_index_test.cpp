@@ -0,0 +1,132 @@
+#include "server/include/segment_index.h"
+
+#include <gtest/gtest.h>
+
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <string>
+
+#include "common/include/crc32.h"
+
+namespace fs = std::filesystem;
+
+// Create a test fixture for SegmentIndex tests
+class SegmentIndexTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    test_dir_ = fs::temp_directory_path() / "music262_segment_index_test";
+    fs::create_directories(test_dir_);
+  }
+
+  void TearDown() override { fs::remove_all(test_dir_); }
+
+  static void putLE(std::string* out, uint32_t value, int bytes) {
+    for (int i = 0; i < bytes; i++) {
+      out->push_back(static_cast<char>((value >> (8 * i)) & 0xFF));
+    }
+  }
+
+  // Write a 16-bit WAV file with the given number of frames and trailing
+  // bytes after the sample data
+  std::shared_ptr<const MappedSong> writeWav(uint32_t sample_rate,
+                                             uint16_t channels,
+                                             uint32_t frames,
+                                             const std::string& trailer = "") {
+    uint32_t data_size = frames * channels * 2;
+    std::string wav = "RIFF";
+    putLE(&wav, 36 + data_size + static_cast<uint32_t>(trailer.size()), 4);
+    wav += "WAVEfmt ";
+    putLE(&wav, 16, 4);
+    putLE(&wav, 1, 2);
+    putLE(&wav, channels, 2);
+    putLE(&wav, sample_rate, 4);
+    putLE(&wav, sample_rate * channels * 2, 4);
+    putLE(&wav, channels * 2, 2);
+    putLE(&wav, 16, 2);
+    wav += "data";
+    putLE(&wav, data_size, 4);
+    for (uint32_t i = 0; i < data_size; i++) {
+      wav.push_back(static_cast<char>(i * 7));
+    }
+    wav += trailer;
+
+    std::string path = (test_dir_ / "song.wav").string();
+    std::ofstream file(path, std::ios::binary | std::ios::trunc);
+    file.write(wav.data(), wav.size());
+    file.close();
+    return MappedSong::Open(path);
+  }
+
+  fs::path test_dir_;
+};
+
+// Test that segments are frame aligned and cover the whole file in order
+TEST_F(SegmentIndexTest, CoversWholeFile) {
+  // 2.5 seconds of stereo at 8 kHz, split into 1 second segments
+  auto song = writeWav(8000, 2, 20000, "LIST");
+  ASSERT_NE(song, nullptr);
+
+  auto index = SegmentIndex::Build(*song, std::chrono::milliseconds(1000));
+  ASSERT_NE(index, nullptr);
+  EXPECT_EQ(index->resume_token, song->resume_token());
+  EXPECT_EQ(index->song_size, song->size());
+  EXPECT_EQ(index->sample_rate, 8000);
+  EXPECT_EQ(index->channels, 2);
+  EXPECT_EQ(index->bytes_per_frame, 4);
+  EXPECT_EQ(index->frames_per_segment, 8000);
+  ASSERT_EQ(index->segments.size(), 3);
+
+  size_t offset = 0;
+  uint64_t frame = 0;
+  for (const auto& segment : index->segments) {
+    EXPECT_EQ(segment.offset, offset);
+    EXPECT_EQ(segment.first_frame, frame);
+    EXPECT_EQ(segment.crc32,
+              music262::Crc32(song->data() + segment.offset, segment.size));
+    offset += segment.size;
+    frame += segment.frame_count;
+  }
+  EXPECT_EQ(offset, song->size());
+  EXPECT_EQ(frame, 20000);
+
+  // The header rides with the first segment, the trailer with the last
+  EXPECT_EQ(index->segments[0].size, 44 + 8000 * 4);
+  EXPECT_EQ(index->segments[1].size, 8000 * 4);
+  EXPECT_EQ(index->segments[2].frame_count, 4000);
+  EXPECT_EQ(index->segments[2].size, 4000 * 4 + 4);
+}
+
+// Test that a song without samples still gets a single segment
+TEST_F(SegmentIndexTest, EmptySong) {
+  auto song = writeWav(44100, 1, 0);
+  ASSERT_NE(song, nullptr);
+
+  auto index = SegmentIndex::Build(*song, std::chrono::milliseconds(2000));
+  ASSERT_NE(index, nullptr);
+  ASSERT_EQ(index->segments.size(), 1);
+  EXPECT_EQ(index->segments[0].size, song->size());
+  EXPECT_EQ(index->segments[0].frame_count, 0);
+}
+
+// Test that files which are not WAV cannot be segmented
+TEST_F(SegmentIndexTest, RejectsNonWav) {
+  std::string path = (test_dir_ / "noise.wav").string();
+  std::ofstream file(path, std::ios::binary);
+  file << "not a riff file at all";
+  file.close();
+
+  auto song = MappedSong::Open(path);
+  ASSERT_NE(song, nullptr);
+  EXPECT_EQ(SegmentIndex::Build(*song, std::chrono::milliseconds(1000)),
+            nullptr);
+}
+
+// Test the checksum against the standard check value and piecewise updates
+TEST(Crc32Test, MatchesReferenceValue) {
+  const char* check = "123456789";
+  EXPECT_EQ(music262::Crc32(check, 9), 0xCBF43926u);
+  EXPECT_EQ(music262::Crc32(check + 5, 4, music262::Crc32(check, 5)),
+            0xCBF43926u);
+  EXPECT_EQ(music262::Crc32(nullptr, 0), 0u);
+}
@@ -0,0 +1,170 @@
+#include "server/include/server_stats.h"
+
+#include <gtest/gtest.h>
+
+#include <chrono>
+#include <filesystem>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+using std::chrono::microseconds;
+using std::chrono::milliseconds;
+using std::chrono::nanoseconds;
+
+// Test that buckets cover every latency in order without gaps
+TEST(LatencyHistogramTest, BucketsAreContiguous) {
+  EXPECT_EQ(LatencyHistogram::BucketOf(0), 0);
+  EXPECT_EQ(LatencyHistogram::BucketOf(15), 15);
+  for (int bucket = 1; bucket < LatencyHistogram::kBuckets; bucket++) {
+    uint64_t start = LatencyHistogram::BucketStart(bucket);
+    EXPECT_GT(start, LatencyHistogram::BucketStart(bucket - 1));
+    EXPECT_EQ(LatencyHistogram::BucketOf(start), bucket);
+    EXPECT_EQ(LatencyHistogram::BucketOf(start - 1), bucket - 1);
+  }
+
+  // Overlong latencies land in the last bucket
+  EXPECT_EQ(LatencyHistogram::BucketOf(~uint64_t{0}),
+            LatencyHistogram::kBuckets - 1);
+}
+
+// Test that percentiles are within a bucket of the recorded latencies
+TEST(LatencyHistogramTest, Percentiles) {
+  LatencyHistogram histogram;
+  EXPECT_EQ(histogram.Summarize().count, 0u);
+
+  // 1..1000 us, and one slow outlier
+  for (int i = 1; i <= 1000; i++) {
+    histogram.Record(microseconds(i));
+  }
+  histogram.Record(milliseconds(250));
+
+  LatencySummary summary = histogram.Summarize();
+  EXPECT_EQ(summary.count, 1001u);
+  EXPECT_EQ(summary.max, milliseconds(250));
+  EXPECT_EQ(summary.sum, microseconds(500500) + milliseconds(250));
+  auto near = [](nanoseconds actual, nanoseconds expected) {
+    return std::abs(actual.count() - expected.count()) <=
+           expected.count() / 16;
+  };
+  EXPECT_TRUE(near(summary.p50, microseconds(501))) << summary.p50.count();
+  EXPECT_TRUE(near(summary.p99, microseconds(991))) << summary.p99.count();
+  EXPECT_TRUE(near(summary.p999, microseconds(1000))) << summary.p999.count();
+}
+
+// Test recording from several threads at once
+TEST(LatencyHistogramTest, ConcurrentRecords) {
+  LatencyHistogram histogram;
+  std::vector<std::thread> threads;
+  for (int t = 0; t < 4; t++) {
+    threads.emplace_back([&histogram, t]() {
+      for (int i = 0; i < 10000; i++) {
+        histogram.Record(nanoseconds(1000 * (t + 1)));
+      }
+    });
+  }
+  for (auto& thread : threads) {
+    thread.join();
+  }
+
+  LatencySummary summary = histogram.Summarize();
+  EXPECT_EQ(summary.count, 40000u);
+  EXPECT_EQ(summary.sum, nanoseconds(10000 * (1000 + 2000 + 3000 + 4000)));
+  EXPECT_EQ(summary.max, nanoseconds(4000));
+}
+
+// Test that the rate only counts the complete seconds of the window
+TEST(RateWindowTest, AveragesCompleteSeconds) {
+  RateWindow rate;
+  EXPECT_EQ(rate.PerSecond(0), 0);
+
+  rate.Add(100, 0);
+  rate.Add(300, 1);
+  rate.Add(5000, 2);  // Still going, not counted yet
+  EXPECT_DOUBLE_EQ(rate.PerSecond(2), 200);
+
+  // Seconds that fell out of the window are dropped, even when their slot is
+  // reused by a later second
+  for (int64_t second = 3; second < 40; second++) {
+    rate.Add(1000, second);
+  }
+  EXPECT_DOUBLE_EQ(rate.PerSecond(40), 1000);
+  EXPECT_DOUBLE_EQ(rate.PerSecond(45), 500);
+  EXPECT_DOUBLE_EQ(rate.PerSecond(100), 0);
+}
+
+// Test the counters of finished calls
+TEST(ServerStatsTest, CountsCalls) {
+  ServerStats stats;
+  stats.CallStarted(RpcMethod::kLoadAudio);
+  stats.CallStarted(RpcMethod::kLoadAudio);
+  stats.BytesSent(RpcMethod::kLoadAudio, 4096);
+  stats.CallFinished(RpcMethod::kLoadAudio, milliseconds(3), true);
+  stats.CallStarted(RpcMethod::kHeartbeat);
+  stats.CallFinished(RpcMethod::kHeartbeat, microseconds(80), false);
+  stats.RecordStage(StreamStage::kSongOpen, microseconds(40));
+
+  ServerStatsSnapshot snapshot = stats.Snapshot();
+  ASSERT_EQ(snapshot.rpcs.size(), static_cast<size_t>(RpcMethod::kCount));
+  const auto& load = snapshot.rpcs[static_cast<size_t>(RpcMethod::kLoadAudio)];
+  EXPECT_EQ(load.method, RpcMethod::kLoadAudio);
+  EXPECT_EQ(load.calls, 1u);
+  EXPECT_EQ(load.errors, 0u);
+  EXPECT_EQ(load.active, 1);
+  EXPECT_EQ(load.bytes_sent, 4096u);
+  EXPECT_EQ(load.latency.max, milliseconds(3));
+
+  const auto& beat = snapshot.rpcs[static_cast<size_t>(RpcMethod::kHeartbeat)];
+  EXPECT_EQ(beat.calls, 1u);
+  EXPECT_EQ(beat.errors, 1u);
+  EXPECT_EQ(beat.active, 0);
+
+  const auto& open =
+      snapshot.stages[static_cast<size_t>(StreamStage::kSongOpen)];
+  EXPECT_EQ(open.latency.count, 1u);
+
+  std::ostringstream table;
+  ServerStats::Print(snapshot, table);
+  EXPECT_NE(table.str().find("LoadAudio"), std::string::npos);
+  EXPECT_NE(table.str().find("song_open"), std::string::npos);
+}
+
+// Test the Prometheus text format and the file it is written to
+TEST(ServerStatsTest, WritesPrometheusText) {
+  ServerStats stats;
+  stats.CallStarted(RpcMethod::kGetPlaylist);
+  stats.CallFinished(RpcMethod::kGetPlaylist, milliseconds(2), true);
+
+  std::string text = ServerStats::FormatPrometheus(stats.Snapshot());
+  EXPECT_NE(text.find("# TYPE music262_rpc_calls_total counter\n"),
+            std::string::npos);
+  EXPECT_NE(text.find("music262_rpc_calls_total{method=\"GetPlaylist\"} 1\n"),
+            std::string::npos);
+  EXPECT_NE(text.find("music262_rpc_latency_seconds{method=\"GetPlaylist\","
+                      "quantile=\"0.99\"} 0.00"),
+            std::string::npos);
+  EXPECT_NE(
+      text.find("music262_rpc_latency_seconds_count{method=\"GetPlaylist\"} "
+                "1\n"),
+      std::string::npos);
+  EXPECT_NE(text.find("music262_stream_stage_latency_seconds_count{stage="
+                      "\"chunk_write\"} 0\n"),
+            std::string::npos);
+
+  auto path = std::filesystem::temp_directory_path() / "music262_stats.prom";
+  ASSERT_TRUE(stats.WritePrometheusFile(path.string()));
+  std::ifstream file(path);
+  std::string written((std::istreambuf_iterator<char>(file)),
+                      std::istreambuf_iterator<char>());
+  EXPECT_NE(written.find("music262_uptime_seconds"), std::string::npos);
+  EXPECT_FALSE(std::filesystem::exists(path.string() + ".tmp"));
+  std::filesystem::remove(path);
+
+  // The writer thread writes the file once more when stopped
+  stats.StartWritingFile(path.string(), std::chrono::seconds(60));
+  stats.StopWritingFile();
+  EXPECT_TRUE(std::filesystem::exists(path));
+  std::filesystem::remove(path);
+}
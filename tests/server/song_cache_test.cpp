@@ -0,0 +1,146 @@
+#include "server/include/song_cache.h"
+
+#include <gtest/gtest.h>
+
+#include <filesystem>
+#include <fstream>
+#include <map>
+#include <string>
+
+namespace fs = std::filesystem;
+
+// Create a test fixture for SongCache tests
+class SongCacheTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    test_dir_ = fs::temp_directory_path() / "music262_song_cache_test";
+    fs::create_directories(test_dir_);
+
+    // Songs 1-4 are 1KB each, song 5 is 4KB
+    for (int song_num = 1; song_num <= 5; song_num++) {
+      createSong(song_num, song_num == 5 ? 4096 : 1024);
+    }
+  }
+
+  void TearDown() override { fs::remove_all(test_dir_); }
+
+  void createSong(int song_num, size_t size) {
+    std::string path =
+        (test_dir_ / ("song" + std::to_string(song_num) + ".wav")).string();
+    std::ofstream file(path, std::ios::binary);
+    std::string data(size, 'x');
+    file.write(data.data(), data.size());
+    paths_[song_num] = path;
+  }
+
+  // Loader that maps the song and counts how often it was called
+  SongCache::Loader loaderFor(int song_num) {
+    return [this, song_num]() {
+      loads_++;
+      return store_.Get(paths_[song_num]);
+    };
+  }
+
+  std::shared_ptr<const MappedSong> get(SongCache& cache, int song_num) {
+    return cache.Get(song_num, loaderFor(song_num));
+  }
+
+  fs::path test_dir_;
+  std::map<int, std::string> paths_;
+  SongStore store_;
+  int loads_ = 0;
+};
+
+// Test that repeated requests are served from the cache
+TEST_F(SongCacheTest, HitAfterMiss) {
+  SongCache cache(4096);
+
+  auto first = get(cache, 1);
+  auto second = get(cache, 1);
+
+  ASSERT_NE(first, nullptr);
+  EXPECT_EQ(first.get(), second.get());
+  EXPECT_EQ(loads_, 1);
+
+  auto stats = cache.GetStats();
+  EXPECT_EQ(stats.hits, 1);
+  EXPECT_EQ(stats.misses, 1);
+  EXPECT_EQ(stats.entries, 1);
+  EXPECT_EQ(stats.bytes_used, 1024);
+}
+
+// Test that the least recently used song is evicted first
+TEST_F(SongCacheTest, EvictsLeastRecentlyUsed) {
+  SongCache cache(3 * 1024);
+
+  get(cache, 1);
+  get(cache, 2);
+  get(cache, 3);
+  get(cache, 1);  // Song 2 is now the least recently used
+  get(cache, 4);
+
+  EXPECT_TRUE(cache.Contains(1));
+  EXPECT_FALSE(cache.Contains(2));
+  EXPECT_TRUE(cache.Contains(3));
+  EXPECT_TRUE(cache.Contains(4));
+
+  auto stats = cache.GetStats();
+  EXPECT_EQ(stats.evictions, 1);
+  EXPECT_EQ(stats.bytes_used, 3 * 1024);
+}
+
+// Test that pinned songs survive eviction
+TEST_F(SongCacheTest, PinnedSongsAreNotEvicted) {
+  SongCache cache(2 * 1024);
+  cache.Pin(1);
+
+  get(cache, 1);
+  get(cache, 2);
+  get(cache, 3);
+  get(cache, 4);
+
+  EXPECT_TRUE(cache.Contains(1));
+  EXPECT_TRUE(cache.Contains(4));
+  EXPECT_EQ(cache.GetStats().pinned, 1);
+}
+
+// Test that songs larger than the budget are served but not cached
+TEST_F(SongCacheTest, OversizedSongIsNotCached) {
+  SongCache cache(2 * 1024);
+
+  get(cache, 1);
+  auto song = get(cache, 5);
+
+  ASSERT_NE(song, nullptr);
+  EXPECT_EQ(song->size(), 4096);
+  EXPECT_FALSE(cache.Contains(5));
+  EXPECT_TRUE(cache.Contains(1));
+  EXPECT_EQ(cache.GetStats().evictions, 0);
+}
+
+// Test that a zero budget disables caching
+TEST_F(SongCacheTest, ZeroBudgetDisablesCaching) {
+  SongCache cache(0);
+
+  get(cache, 1);
+  get(cache, 1);
+
+  EXPECT_EQ(loads_, 2);
+  EXPECT_EQ(cache.GetStats().entries, 0);
+}
+
+// Test that failed loads are not cached
+TEST_F(SongCacheTest, FailedLoad) {
+  SongCache cache(4096);
+
+  auto song = cache.Get(9, []() { return nullptr; });
+
+  EXPECT_EQ(song, nullptr);
+  EXPECT_FALSE(cache.Contains(9));
+  EXPECT_EQ(cache.GetStats().misses, 1);
+}
+
+int main(int argc, char** argv) {
+  testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
@@ -0,0 +1,309 @@
+#include "server/include/song_catalog.h"
+
+#include <gtest/gtest.h>
+
+#include <chrono>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace fs = std::filesystem;
+
+class SongCatalogTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    test_dir_ = fs::temp_directory_path() / "music262_song_catalog_test";
+    fs::remove_all(test_dir_);
+    fs::create_directories(test_dir_);
+    fs::remove(test_dir_.string() + ".catalog");
+  }
+
+  void TearDown() override {
+    fs::remove_all(test_dir_);
+    fs::remove(test_dir_.string() + ".catalog");
+  }
+
+  // Write a PCM WAV file with the given format and sample bytes
+  void writeWav(const std::string& name, uint32_t sample_rate,
+                uint16_t channels, uint16_t bits, uint32_t data_size) {
+    uint16_t block_align = channels * bits / 8;
+    std::vector<char> wav(44 + data_size);
+    auto put = [&wav](size_t offset, uint32_t value, int bytes) {
+      for (int i = 0; i < bytes; i++) {
+        wav[offset + i] = static_cast<char>(value >> (8 * i));
+      }
+    };
+    std::memcpy(wav.data(), "RIFF", 4);
+    put(4, 36 + data_size, 4);
+    std::memcpy(wav.data() + 8, "WAVEfmt ", 8);
+    put(16, 16, 4);
+    put(20, 1, 2);
+    put(22, channels, 2);
+    put(24, sample_rate, 4);
+    put(28, sample_rate * block_align, 4);
+    put(32, block_align, 2);
+    put(34, bits, 2);
+    std::memcpy(wav.data() + 36, "data", 4);
+    put(40, data_size, 4);
+
+    fs::create_directories((test_dir_ / name).parent_path());
+    std::ofstream file(test_dir_ / name, std::ios::binary);
+    file.write(wav.data(), wav.size());
+  }
+
+  // Options persisting the catalog next to the test directory
+  SongCatalogOptions persistentOptions() const {
+    SongCatalogOptions options;
+    options.catalog_file = test_dir_.string() + ".catalog";
+    return options;
+  }
+
+  // Wait until the catalog reaches the given number of songs
+  bool waitForSongs(const SongCatalog& catalog, size_t count) {
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+    while (std::chrono::steady_clock::now() < deadline) {
+      if (catalog.Snapshot()->songs.size() == count) {
+        return true;
+      }
+      std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    return false;
+  }
+
+  fs::path test_dir_;
+};
+
+TEST_F(SongCatalogTest, ReadsFormatFromHeaders) {
+  writeWav("a.wav", 44100, 2, 16, 44100 * 4 * 3);
+  writeWav("b.wav", 8000, 1, 8, 4000);
+
+  SongCatalog catalog(test_dir_.string());
+  auto snapshot = catalog.Snapshot();
+  ASSERT_EQ(snapshot->songs.size(), 2u);
+
+  const SongMetadata* a = snapshot->Find(1);
+  ASSERT_NE(a, nullptr);
+  EXPECT_EQ(a->name, "a.wav");
+  EXPECT_EQ(a->size, 44u + 44100 * 4 * 3);
+  EXPECT_EQ(a->sample_rate, 44100u);
+  EXPECT_EQ(a->channels, 2);
+  EXPECT_EQ(a->bits_per_sample, 16);
+  EXPECT_EQ(a->duration_ms, 3000u);
+
+  const SongMetadata* b = snapshot->Find(2);
+  ASSERT_NE(b, nullptr);
+  EXPECT_EQ(b->channels, 1);
+  EXPECT_EQ(b->bits_per_sample, 8);
+  EXPECT_EQ(b->duration_ms, 500u);
+}
+
+TEST_F(SongCatalogTest, NumbersSongsInNameOrder) {
+  writeWav("c.wav", 8000, 1, 8, 100);
+  writeWav("a.wav", 8000, 1, 8, 100);
+  writeWav("b.wav", 8000, 1, 8, 100);
+  std::ofstream(test_dir_ / "notes.txt") << "not a song";
+
+  SongCatalog catalog(test_dir_.string());
+  auto snapshot = catalog.Snapshot();
+  ASSERT_EQ(snapshot->songs.size(), 3u);
+  EXPECT_EQ(snapshot->Find(1)->name, "a.wav");
+  EXPECT_EQ(snapshot->Find(2)->name, "b.wav");
+  EXPECT_EQ(snapshot->Find(3)->name, "c.wav");
+}
+
+TEST_F(SongCatalogTest, ListsUnreadableWavFiles) {
+  std::ofstream(test_dir_ / "broken.wav") << "not a wav header";
+
+  SongCatalog catalog(test_dir_.string());
+  auto snapshot = catalog.Snapshot();
+  ASSERT_EQ(snapshot->songs.size(), 1u);
+  EXPECT_EQ(snapshot->songs[0].sample_rate, 0u);
+  EXPECT_EQ(snapshot->songs[0].duration_ms, 0u);
+}
+
+TEST_F(SongCatalogTest, KeepsIdsStableAcrossChanges) {
+  writeWav("a.wav", 8000, 1, 8, 100);
+  writeWav("b.wav", 8000, 1, 8, 100);
+  SongCatalog catalog(test_dir_.string());
+
+  std::vector<SongMetadata> changes;
+  catalog.SetChangeListener([&changes](const std::vector<SongMetadata>& c) {
+    changes.insert(changes.end(), c.begin(), c.end());
+  });
+
+  // Removing a song leaves a gap, a new song gets the next id
+  fs::remove(test_dir_ / "a.wav");
+  writeWav("0.wav", 8000, 1, 8, 100);
+  EXPECT_EQ(catalog.Rescan(), 2u);
+  auto snapshot = catalog.Snapshot();
+  EXPECT_EQ(snapshot->Find(1), nullptr);
+  EXPECT_EQ(snapshot->Find(2)->name, "b.wav");
+  EXPECT_EQ(snapshot->Find(3)->name, "0.wav");
+  EXPECT_EQ(snapshot->max_id(), 3);
+  EXPECT_EQ(changes.size(), 2u);
+
+  // A song that comes back gets its old id
+  writeWav("a.wav", 8000, 1, 8, 100);
+  EXPECT_EQ(catalog.Refresh({"a.wav"}), 1u);
+  EXPECT_EQ(catalog.Snapshot()->Find(1)->name, "a.wav");
+
+  // Unchanged files are not reported
+  changes.clear();
+  EXPECT_EQ(catalog.Refresh({"a.wav", "b.wav"}), 0u);
+  EXPECT_EQ(catalog.Rescan(), 0u);
+  EXPECT_TRUE(changes.empty());
+}
+
+TEST_F(SongCatalogTest, SnapshotsAreImmutable) {
+  writeWav("a.wav", 8000, 1, 8, 100);
+  SongCatalog catalog(test_dir_.string());
+  auto before = catalog.Snapshot();
+
+  writeWav("a.wav", 16000, 2, 16, 64000);
+  EXPECT_EQ(catalog.Refresh({"a.wav"}), 1u);
+  auto after = catalog.Snapshot();
+
+  EXPECT_EQ(before->Find(1)->sample_rate, 8000u);
+  EXPECT_EQ(after->Find(1)->sample_rate, 16000u);
+  EXPECT_EQ(after->Find(1)->duration_ms, 1000u);
+  EXPECT_GT(after->version, before->version);
+}
+
+TEST_F(SongCatalogTest, WatcherAppliesChanges) {
+  writeWav("a.wav", 8000, 1, 8, 100);
+  SongCatalog catalog(test_dir_.string());
+  ASSERT_TRUE(catalog.StartWatching());
+
+  // Files are picked up once written, including those moved into place
+  writeWav("b.wav", 8000, 1, 8, 100);
+  writeWav("c.tmp", 8000, 1, 8, 100);
+  fs::rename(test_dir_ / "c.tmp", test_dir_ / "c.wav");
+  EXPECT_TRUE(waitForSongs(catalog, 3));
+  EXPECT_EQ(catalog.Snapshot()->Find(3)->name, "c.wav");
+
+  fs::remove(test_dir_ / "a.wav");
+  EXPECT_TRUE(waitForSongs(catalog, 2));
+  EXPECT_EQ(catalog.Snapshot()->Find(1), nullptr);
+
+  catalog.StopWatching();
+}
+
+TEST_F(SongCatalogTest, ScansSubdirectoriesInParallel) {
+  writeWav("b/2.wav", 8000, 1, 8, 100);
+  writeWav("a/x/1.wav", 8000, 1, 8, 100);
+  writeWav("a/3.wav", 16000, 2, 16, 64000);
+  writeWav("top.wav", 8000, 1, 8, 100);
+  writeWav(".m2lc/hidden.wav", 8000, 1, 8, 100);
+  writeWav("b/.hidden.wav", 8000, 1, 8, 100);
+
+  SongCatalogOptions options;
+  options.scan_threads = 4;
+  SongCatalog catalog(test_dir_.string(), options);
+  auto snapshot = catalog.Snapshot();
+  ASSERT_EQ(snapshot->songs.size(), 4u);
+  EXPECT_EQ(snapshot->Find(1)->name, "a/3.wav");
+  EXPECT_EQ(snapshot->Find(1)->duration_ms, 1000u);
+  EXPECT_EQ(snapshot->Find(2)->name, "a/x/1.wav");
+  EXPECT_EQ(snapshot->Find(3)->name, "b/2.wav");
+  EXPECT_EQ(snapshot->Find(4)->name, "top.wav");
+
+  // Songs in subdirectories are refreshed by their relative path
+  fs::remove(test_dir_ / "a/x/1.wav");
+  EXPECT_EQ(catalog.Refresh({"a/x/1.wav"}), 1u);
+  EXPECT_EQ(catalog.Snapshot()->Find(2), nullptr);
+}
+
+TEST_F(SongCatalogTest, PersistsCatalogAcrossRestarts) {
+  writeWav("a.wav", 8000, 1, 8, 100);
+  writeWav("b.wav", 44100, 2, 16, 44100 * 4);
+  {
+    // Without a catalog file the first scan is left to the caller
+    SongCatalog catalog(test_dir_.string(), persistentOptions());
+    EXPECT_FALSE(catalog.loaded_from_file());
+    EXPECT_TRUE(catalog.Snapshot()->songs.empty());
+    EXPECT_EQ(catalog.Rescan(), 2u);
+
+    fs::remove(test_dir_ / "a.wav");
+    EXPECT_EQ(catalog.Rescan(), 1u);
+  }
+
+  // The next start serves the saved catalog without reading the directory
+  SongCatalog catalog(test_dir_.string(), persistentOptions());
+  EXPECT_TRUE(catalog.loaded_from_file());
+  auto snapshot = catalog.Snapshot();
+  ASSERT_EQ(snapshot->songs.size(), 1u);
+  const SongMetadata* b = snapshot->Find(2);
+  ASSERT_NE(b, nullptr);
+  EXPECT_EQ(b->name, "b.wav");
+  EXPECT_EQ(b->sample_rate, 44100u);
+  EXPECT_EQ(b->channels, 2);
+  EXPECT_EQ(b->duration_ms, 1000u);
+  EXPECT_EQ(catalog.Rescan(), 0u);
+
+  // Ids are not reused after a restart either
+  writeWav("c.wav", 8000, 1, 8, 100);
+  EXPECT_EQ(catalog.Rescan(), 1u);
+  EXPECT_EQ(catalog.Snapshot()->Find(3)->name, "c.wav");
+}
+
+TEST_F(SongCatalogTest, RevalidatesStaleCatalogFile) {
+  writeWav("a.wav", 8000, 1, 8, 100);
+  writeWav("b.wav", 8000, 1, 8, 100);
+  {
+    SongCatalog catalog(test_dir_.string(), persistentOptions());
+    catalog.Rescan();
+  }
+
+  // Changes made while the server is down
+  fs::remove(test_dir_ / "a.wav");
+  writeWav("b.wav", 16000, 1, 16, 32000);
+  writeWav("c.wav", 8000, 1, 8, 100);
+
+  SongCatalog catalog(test_dir_.string(), persistentOptions());
+  std::vector<SongMetadata> changes;
+  catalog.SetChangeListener([&changes](const std::vector<SongMetadata>& c) {
+    changes.insert(changes.end(), c.begin(), c.end());
+  });
+  EXPECT_EQ(catalog.Snapshot()->Find(2)->sample_rate, 8000u);
+
+  EXPECT_EQ(catalog.Rescan(), 3u);
+  EXPECT_EQ(changes.size(), 3u);
+  auto snapshot = catalog.Snapshot();
+  EXPECT_EQ(snapshot->Find(1), nullptr);
+  EXPECT_EQ(snapshot->Find(2)->sample_rate, 16000u);
+  EXPECT_EQ(snapshot->Find(2)->duration_ms, 1000u);
+  EXPECT_EQ(snapshot->Find(3)->name, "c.wav");
+}
+
+TEST_F(SongCatalogTest, IgnoresInvalidCatalogFile) {
+  writeWav("a.wav", 8000, 1, 8, 100);
+  std::ofstream(test_dir_.string() + ".catalog") << "not a catalog";
+
+  SongCatalog catalog(test_dir_.string(), persistentOptions());
+  EXPECT_FALSE(catalog.loaded_from_file());
+  EXPECT_EQ(catalog.Rescan(), 1u);
+  EXPECT_EQ(catalog.Snapshot()->Find(1)->name, "a.wav");
+}
+
+TEST_F(SongCatalogTest, WatcherReconcilesAndFollowsSubdirectories) {
+  writeWav("a.wav", 8000, 1, 8, 100);
+  SongCatalog catalog(test_dir_.string(), persistentOptions());
+  ASSERT_TRUE(catalog.StartWatching());
+
+  // The first scan runs on the watcher
+  EXPECT_TRUE(waitForSongs(catalog, 1));
+
+  // Directories created later are watched as well, including files written
+  // to them before their watch was added
+  writeWav("new/album/b.wav", 8000, 1, 8, 100);
+  EXPECT_TRUE(waitForSongs(catalog, 2));
+  writeWav("new/album/c.wav", 8000, 1, 8, 100);
+  EXPECT_TRUE(waitForSongs(catalog, 3));
+
+  fs::remove_all(test_dir_ / "new");
+  EXPECT_TRUE(waitForSongs(catalog, 1));
+  catalog.StopWatching();
+}
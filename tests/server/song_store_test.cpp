@@ -0,0 +1,174 @@
+#include "server/include/song_store.h"
+
+#include <grpcpp/grpcpp.h>
+#include <gtest/gtest.h>
+
+#include <filesystem>
+#include <fstream>
+#include <string>
+
+#include "audio_service.grpc.pb.h"
+#include "server/include/chunk_encoder.h"
+
+namespace fs = std::filesystem;
+
+// Create a test fixture for SongStore tests
+class SongStoreTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    test_dir_ = fs::temp_directory_path() / "music262_song_store_test";
+    fs::create_directories(test_dir_);
+
+    // Fill a song with a repeating byte pattern so chunks can be verified
+    song_path_ = (test_dir_ / "song.wav").string();
+    contents_.resize(200 * 1024);
+    for (size_t i = 0; i < contents_.size(); i++) {
+      contents_[i] = static_cast<char>(i % 251);
+    }
+    std::ofstream file(song_path_, std::ios::binary);
+    file.write(contents_.data(), contents_.size());
+  }
+
+  void TearDown() override { fs::remove_all(test_dir_); }
+
+  // Helper to decode an encoded chunk back into an AudioChunk message
+  audio_service::AudioChunk Decode(grpc::ByteBuffer buffer) {
+    audio_service::AudioChunk chunk;
+    EXPECT_TRUE(
+        grpc::SerializationTraits<audio_service::AudioChunk>::Deserialize(
+            &buffer, &chunk)
+            .ok());
+    return chunk;
+  }
+
+  // Helper to write a file in place, truncating it like most editors do
+  void Rewrite(const std::string& path, const std::string& contents) {
+    std::ofstream file(path, std::ios::binary | std::ios::trunc);
+    file.write(contents.data(), contents.size());
+  }
+
+  fs::path test_dir_;
+  std::string song_path_;
+  std::string contents_;
+  SongStore store_;
+};
+
+// Test that a mapped song exposes the file contents
+TEST_F(SongStoreTest, MapsFileContents) {
+  auto song = store_.Get(song_path_);
+  ASSERT_NE(song, nullptr);
+
+  EXPECT_EQ(song->size(), contents_.size());
+  EXPECT_EQ(std::string(song->data(), song->size()), contents_);
+}
+
+// Test that concurrent users share a single mapping
+TEST_F(SongStoreTest, SharesMappingAcrossStreams) {
+  auto first = store_.Get(song_path_);
+  auto second = store_.Get(song_path_);
+
+  EXPECT_EQ(first.get(), second.get());
+  EXPECT_EQ(store_.MappedCount(), 1);
+
+  // The mapping is released once the last stream drops it
+  first.reset();
+  second.reset();
+  EXPECT_EQ(store_.MappedCount(), 0);
+}
+
+// Test that missing files are reported as failures
+TEST_F(SongStoreTest, MissingFile) {
+  EXPECT_EQ(store_.Get((test_dir_ / "missing.wav").string()), nullptr);
+  EXPECT_EQ(store_.MappedCount(), 0);
+}
+
+// Test that a stream keeps reading the old version of a song replaced by a
+// rename
+TEST_F(SongStoreTest, RenameKeepsOldVersionForStreams) {
+  auto old_song = store_.Get(song_path_);
+  ASSERT_NE(old_song, nullptr);
+
+  std::string replacement(1024, 'x');
+  std::string temp_path = (test_dir_ / "song.wav.tmp").string();
+  Rewrite(temp_path, replacement);
+  fs::rename(temp_path, song_path_);
+  store_.Forget(song_path_);
+
+  EXPECT_EQ(std::string(old_song->data(), old_song->size()), contents_);
+
+  auto new_song = store_.Get(song_path_);
+  ASSERT_NE(new_song, nullptr);
+  EXPECT_FALSE(new_song->copied());
+  EXPECT_EQ(std::string(new_song->data(), new_song->size()), replacement);
+}
+
+// Test that a song rewritten in place while a stream holds its mapping is
+// copied from then on, so a later truncating rewrite cannot reach streams
+TEST_F(SongStoreTest, RewriteInPlaceCopiesSongAfterward) {
+  auto mapped = store_.Get(song_path_);
+  ASSERT_NE(mapped, nullptr);
+  EXPECT_FALSE(mapped->copied());
+
+  std::string second(contents_.size(), 'y');
+  Rewrite(song_path_, second);
+  store_.Forget(song_path_);
+
+  auto copied = store_.Get(song_path_);
+  ASSERT_NE(copied, nullptr);
+  EXPECT_TRUE(copied->copied());
+  EXPECT_NE(copied.get(), mapped.get());
+  mapped.reset();
+
+  // Truncating a mapped file would fault the stream, the copy is unaffected
+  Rewrite(song_path_, "short");
+  store_.Forget(song_path_);
+  EXPECT_EQ(std::string(copied->data(), copied->size()), second);
+
+  auto third = store_.Get(song_path_);
+  ASSERT_NE(third, nullptr);
+  EXPECT_TRUE(third->copied());
+  EXPECT_EQ(std::string(third->data(), third->size()), "short");
+  EXPECT_NE(third->resume_token(), copied->resume_token());
+}
+
+// Test that encoded chunks decode to the expected bytes
+TEST_F(SongStoreTest, EncodeAudioChunk) {
+  auto song = store_.Get(song_path_);
+  ASSERT_NE(song, nullptr);
+
+  size_t offset = 64 * 1024;
+  size_t length = 64 * 1024;
+  auto chunk = Decode(EncodeAudioChunk(song, offset, length));
+
+  EXPECT_EQ(chunk.data(), contents_.substr(offset, length));
+}
+
+// Test that a chunk keeps the mapping alive after the store lets go of it
+TEST_F(SongStoreTest, ChunkOutlivesSongReference) {
+  auto song = store_.Get(song_path_);
+  ASSERT_NE(song, nullptr);
+
+  grpc::ByteBuffer buffer = EncodeAudioChunk(song, 0, 1024);
+  song.reset();
+  EXPECT_EQ(store_.MappedCount(), 1);
+
+  auto chunk = Decode(buffer);
+  EXPECT_EQ(chunk.data(), contents_.substr(0, 1024));
+
+  buffer.Clear();
+  EXPECT_EQ(store_.MappedCount(), 0);
+}
+
+// Test encoding of an empty chunk
+TEST_F(SongStoreTest, EncodeEmptyChunk) {
+  auto song = store_.Get(song_path_);
+  ASSERT_NE(song, nullptr);
+
+  auto chunk = Decode(EncodeAudioChunk(song, contents_.size(), 0));
+  EXPECT_TRUE(chunk.data().empty());
+}
+
+int main(int argc, char** argv) {
+  testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
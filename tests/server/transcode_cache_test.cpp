@@ -0,0 +1,215 @@
+#include "server/include/transcode_cache.h"
+
+#include <gtest/gtest.h>
+
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+
+using music262::PcmFormat;
+using music262::PcmSampleFormat;
+
+namespace {
+
+// A 16-bit stereo 44.1 kHz song of the given length, served from memory
+std::shared_ptr<const MappedSong> MakeSong(const std::string& name,
+                                           size_t frames,
+                                           int64_t mtime_ns = 1) {
+  uint32_t data_size = static_cast<uint32_t>(frames * 4);
+  uint32_t header[] = {0x46464952, 36 + data_size, 0x45564157, 0x20746d66,
+                       16,         0x00020001,     44100,      44100 * 4,
+                       0x00100004, 0x61746164,     data_size};
+  std::vector<char> wav(sizeof(header) + data_size);
+  std::memcpy(wav.data(), header, sizeof(header));
+  for (size_t i = sizeof(header); i < wav.size(); i++) {
+    wav[i] = static_cast<char>(i * 7);
+  }
+  return MappedSong::Adopt(name, std::move(wav), mtime_ns);
+}
+
+PcmFormat Float32(uint32_t sample_rate = 0) {
+  PcmFormat format;
+  format.sample_format = PcmSampleFormat::kFloat32;
+  format.sample_rate = sample_rate;
+  return format;
+}
+
+}  // namespace
+
+// Test that each format of a song is converted once and then shared
+TEST(TranscodeCacheTest, ConvertsOncePerFormat) {
+  TranscodeCache cache(1024 * 1024);
+  auto song = MakeSong("song1.wav", 1000);
+
+  auto first = cache.Get(1, song, Float32());
+  auto second = cache.Get(1, song, Float32());
+  ASSERT_NE(first, nullptr);
+  EXPECT_EQ(first.get(), second.get());
+  EXPECT_EQ(first->size(), 44u + 1000 * 8);
+
+  // Another format is another conversion, with its own resume token
+  auto resampled = cache.Get(1, song, Float32(48000));
+  ASSERT_NE(resampled, nullptr);
+  EXPECT_NE(resampled.get(), first.get());
+  EXPECT_NE(first->resume_token(), song->resume_token());
+  EXPECT_NE(first->resume_token(), resampled->resume_token());
+
+  auto stats = cache.GetStats();
+  EXPECT_EQ(stats.hits, 1u);
+  EXPECT_EQ(stats.conversions, 2u);
+  EXPECT_EQ(stats.entries, 2u);
+  EXPECT_EQ(stats.bytes_used, first->size() + resampled->size());
+}
+
+// Test that converting the same version again gives the same resume token,
+// so a client can resume a download after the song was evicted
+TEST(TranscodeCacheTest, ResumeTokenSurvivesEviction) {
+  TranscodeCache uncached(0);
+  auto song = MakeSong("song1.wav", 1000);
+
+  auto first = uncached.Get(1, song, Float32());
+  auto second = uncached.Get(1, song, Float32());
+  ASSERT_NE(first, nullptr);
+  ASSERT_NE(second, nullptr);
+  EXPECT_NE(first.get(), second.get());
+  EXPECT_EQ(first->resume_token(), second->resume_token());
+  EXPECT_EQ(uncached.GetStats().entries, 0u);
+}
+
+// Test that a new version of a song is converted again
+TEST(TranscodeCacheTest, ReconvertsChangedSong) {
+  TranscodeCache cache(1024 * 1024);
+  auto old_version = MakeSong("song1.wav", 1000, 1);
+  auto new_version = MakeSong("song1.wav", 1000, 2);
+
+  auto old_converted = cache.Get(1, old_version, Float32());
+  auto new_converted = cache.Get(1, new_version, Float32());
+  ASSERT_NE(new_converted, nullptr);
+  EXPECT_NE(old_converted->resume_token(), new_converted->resume_token());
+
+  auto stats = cache.GetStats();
+  EXPECT_EQ(stats.conversions, 2u);
+  EXPECT_EQ(stats.entries, 1u);
+}
+
+// Test that the least recently used conversion is evicted to fit the budget
+TEST(TranscodeCacheTest, EvictsLeastRecentlyUsed) {
+  size_t converted_size = 44 + 1000 * 8;
+  TranscodeCache cache(2 * converted_size);
+  auto song1 = MakeSong("song1.wav", 1000);
+  auto song2 = MakeSong("song2.wav", 1000);
+  auto song3 = MakeSong("song3.wav", 1000);
+
+  auto first = cache.Get(1, song1, Float32());
+  cache.Get(2, song2, Float32());
+  cache.Get(1, song1, Float32());  // Song 2 is now the oldest
+  cache.Get(3, song3, Float32());
+
+  EXPECT_EQ(cache.Get(1, song1, Float32()).get(), first.get());
+  auto stats = cache.GetStats();
+  EXPECT_EQ(stats.evictions, 1u);
+  EXPECT_EQ(stats.entries, 2u);
+  EXPECT_EQ(stats.bytes_used, 2 * converted_size);
+
+  // Shrinking the budget evicts right away
+  cache.SetBudget(converted_size);
+  EXPECT_EQ(cache.GetStats().entries, 1u);
+}
+
+// Test that invalidating a song drops all of its formats
+TEST(TranscodeCacheTest, InvalidateDropsEveryFormat) {
+  TranscodeCache cache(1024 * 1024);
+  auto song1 = MakeSong("song1.wav", 1000);
+  auto song2 = MakeSong("song2.wav", 1000);
+  cache.Get(1, song1, Float32());
+  cache.Get(1, song1, Float32(48000));
+  cache.Get(2, song2, Float32());
+
+  cache.Invalidate(1);
+  auto stats = cache.GetStats();
+  EXPECT_EQ(stats.entries, 1u);
+  EXPECT_EQ(stats.bytes_used, 44u + 1000 * 8);
+}
+
+// Test that clients asking for the same conversion at once share it
+TEST(TranscodeCacheTest, ConcurrentRequestsConvertOnce) {
+  TranscodeCache cache(64 * 1024 * 1024);
+  auto song = MakeSong("song1.wav", 200000);
+
+  std::vector<std::shared_ptr<const MappedSong>> results(4);
+  std::vector<std::thread> threads;
+  for (size_t i = 0; i < results.size(); i++) {
+    threads.emplace_back(
+        [&, i]() { results[i] = cache.Get(1, song, Float32(48000)); });
+  }
+  for (auto& thread : threads) {
+    thread.join();
+  }
+
+  for (const auto& result : results) {
+    ASSERT_NE(result, nullptr);
+    EXPECT_EQ(result.get(), results[0].get());
+  }
+  EXPECT_EQ(cache.GetStats().conversions, 1u);
+}
+
+// Test that callers on a poller are called back from the worker converting
+// the song instead of waiting for it
+TEST(TranscodeCacheTest, ConvertsOnWorkers) {
+  TranscodeCache cache(64 * 1024 * 1024);
+  WorkQueue workers(2);
+  auto song = MakeSong("song1.wav", 200000);
+
+  std::mutex mutex;
+  std::condition_variable cv;
+  std::vector<std::shared_ptr<const MappedSong>> results;
+  std::set<std::thread::id> threads;
+  for (int i = 0; i < 4; i++) {
+    std::shared_ptr<const MappedSong> converted;
+    EXPECT_FALSE(cache.Get(
+        1, song, Float32(48000), &workers, &converted,
+        [&](std::shared_ptr<const MappedSong> result) {
+          std::lock_guard<std::mutex> lock(mutex);
+          results.push_back(result);
+          threads.insert(std::this_thread::get_id());
+          cv.notify_all();
+        }));
+  }
+
+  {
+    std::unique_lock<std::mutex> lock(mutex);
+    ASSERT_TRUE(cv.wait_for(lock, std::chrono::seconds(10),
+                            [&]() { return results.size() == 4; }));
+    EXPECT_EQ(threads.size(), 1u);
+    EXPECT_EQ(threads.count(std::this_thread::get_id()), 0u);
+  }
+  for (const auto& result : results) {
+    ASSERT_NE(result, nullptr);
+    EXPECT_EQ(result.get(), results[0].get());
+  }
+  EXPECT_EQ(cache.GetStats().conversions, 1u);
+
+  // Once converted the song is returned right away
+  std::shared_ptr<const MappedSong> converted;
+  EXPECT_TRUE(cache.Get(1, song, Float32(48000), &workers, &converted,
+                        nullptr));
+  EXPECT_EQ(converted.get(), results[0].get());
+}
+
+// Test that formats the converter does not support are reported
+TEST(TranscodeCacheTest, UnsupportedFormat) {
+  TranscodeCache cache(1024 * 1024);
+  auto song = MakeSong("song1.wav", 1000);
+  PcmFormat surround = Float32();
+  surround.channels = 6;
+
+  EXPECT_EQ(cache.Get(1, song, surround), nullptr);
+  auto stats = cache.GetStats();
+  EXPECT_EQ(stats.failures, 1u);
+  EXPECT_EQ(stats.entries, 0u);
+}
@@ -0,0 +1,73 @@
+#include "server/include/work_queue.h"
+
+#include <gtest/gtest.h>
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Test that submitted jobs run on a worker thread
+TEST(WorkQueueTest, RunsJobsOffTheCallingThread) {
+  WorkQueue queue(2);
+  std::mutex mutex;
+  std::condition_variable cv;
+  std::thread::id worker;
+  bool done = false;
+
+  ASSERT_TRUE(queue.Submit([&]() {
+    std::lock_guard<std::mutex> lock(mutex);
+    worker = std::this_thread::get_id();
+    done = true;
+    cv.notify_all();
+  }));
+
+  std::unique_lock<std::mutex> lock(mutex);
+  ASSERT_TRUE(cv.wait_for(lock, std::chrono::seconds(5), [&]() { return done; }));
+  EXPECT_NE(worker, std::this_thread::get_id());
+}
+
+// Test that a slow job does not hold back jobs on the other workers
+TEST(WorkQueueTest, SlowJobDoesNotBlockOthers) {
+  WorkQueue queue(2);
+  std::mutex mutex;
+  std::condition_variable cv;
+  bool release = false;
+  bool fast_done = false;
+
+  queue.Submit([&]() {
+    std::unique_lock<std::mutex> lock(mutex);
+    cv.wait(lock, [&]() { return release; });
+  });
+  queue.Submit([&]() {
+    std::lock_guard<std::mutex> lock(mutex);
+    fast_done = true;
+    cv.notify_all();
+  });
+
+  std::unique_lock<std::mutex> lock(mutex);
+  EXPECT_TRUE(
+      cv.wait_for(lock, std::chrono::seconds(5), [&]() { return fast_done; }));
+  release = true;
+  cv.notify_all();
+}
+
+// Test that shutting down runs the queued jobs and then refuses new ones
+TEST(WorkQueueTest, ShutdownRunsQueuedJobs) {
+  WorkQueue queue(1);
+  std::atomic<int> ran{0};
+  for (int i = 0; i < 20; i++) {
+    ASSERT_TRUE(queue.Submit([&]() {
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+      ran++;
+    }));
+  }
+
+  queue.Shutdown();
+  EXPECT_EQ(ran.load(), 20);
+  EXPECT_EQ(queue.queued(), 0u);
+  EXPECT_FALSE(queue.Submit([&]() { ran++; }));
+  EXPECT_EQ(ran.load(), 20);
+}
@@ -70,8 +70,8 @@ extern "C" {
         unsigned int position = player->get_position();
         unsigned int dataPosition = position - sizeof(WavHeader);  // Adjust position to be relative to audio data
         
-        // Get the audio data
-        const std::vector<char>& audioData = player->get_audio_data();
+        // Get the audio data, which may live outside the player
+        const char* audioData = player->get_sample_data();
         
         // Calculate bytes per frame
         int channels = player->get_header().numChannels;
@@ -79,7 +79,7 @@ extern "C" {
         int bytesPerFrame = bytesPerSample * channels;
         
         // Calculate how many frames we can provide
-        unsigned int bytesAvailable = audioData.size() - dataPosition;
+        unsigned int bytesAvailable = player->get_sample_size() - dataPosition;
         unsigned int framesAvailable = bytesAvailable / bytesPerFrame;
         
         // Calculate how many frames to render
@@ -88,12 +88,17 @@ extern "C" {
         // Fill the output buffer with audio data
         float* outBuffer = reinterpret_cast<float*>(ioData->mBuffers[0].mData);
         
-        // Read audio to buffer
-        for (UInt32 i = 0; i < framesToRender; ++i) {
-            for (int ch = 0; ch < channels; ++ch) {
-                int idx = dataPosition + (i * bytesPerFrame) + (ch * bytesPerSample);
-                int16_t sample = *reinterpret_cast<const int16_t*>(&audioData[idx]);
-                outBuffer[i * channels + ch] = sample / 32768.0f;
+        // Read audio to buffer, float songs are copied as they are
+        if (player->get_header().audioFormat == kWavFormatFloat &&
+            player->get_header().bitsPerSample == 32) {
+            std::memcpy(outBuffer, audioData + dataPosition, framesToRender * bytesPerFrame);
+        } else {
+            for (UInt32 i = 0; i < framesToRender; ++i) {
+                for (int ch = 0; ch < channels; ++ch) {
+                    int idx = dataPosition + (i * bytesPerFrame) + (ch * bytesPerSample);
+                    int16_t sample = *reinterpret_cast<const int16_t*>(&audioData[idx]);
+                    outBuffer[i * channels + ch] = sample / 32768.0f;
+                }
             }
         }
         